@@ -18,6 +18,7 @@
 #include <windows.h>
 #include <shlobj.h>
 #include <shlwapi.h>
+#include <versionhelpers.h>
 
 #include "common1.h"
 
@@ -787,6 +788,47 @@ unsigned int get_mem_size(unsigned __int64 data_size)
 	return mem_size;
 }
 
+unsigned int cpu_flag = 0;	// 1=SSSE3, 16=AVX2, 128=SSE2
+int cpu_num = 1;
+
+void check_cpu(void)
+{
+	unsigned int CPUInfo[4];
+	DWORD_PTR ProcessAffinityMask, SystemAffinityMask;
+
+	// CPU の拡張機能を調べる
+	__cpuid(CPUInfo, 1);
+	cpu_flag |= (CPUInfo[3] & (1 << 26)) >> 19;	// SSE2 対応か
+	cpu_flag |= (CPUInfo[2] & (1 << 9)) >> 9;	// SSSE3 対応か
+	if ((CPUInfo[2] & (1 << 28)) != 0){	// AVX 対応なら
+		if (IsWindows7OrGreater()){	// Windows 7 以降なら AVX2 の判定をする
+			__cpuid(CPUInfo, 0);
+			if (CPUInfo[0] >= 7){	// AVX2 用の基本命令領域があるなら
+				__cpuidex(CPUInfo, 7, 0);
+				cpu_flag |= (CPUInfo[1] & (1 << 5)) >> 1;	// AVX2 対応か
+			}
+		}
+	}
+
+	// 使用可能なコア個数を調べる
+	cpu_num = 0;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &ProcessAffinityMask, &SystemAffinityMask) != 0){
+		while (ProcessAffinityMask != 0){
+			cpu_num++;
+			ProcessAffinityMask &= (ProcessAffinityMask - 1);
+		}
+	}
+	if (cpu_num <= 0){	// 取得に失敗したら総数を使う
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		cpu_num = si.dwNumberOfProcessors;
+	}
+	if (cpu_num > MAX_CPU)
+		cpu_num = MAX_CPU;
+	if (cpu_num < 1)
+		cpu_num = 1;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #define MAX_NAME_LEN	69	// 経過表示のタイトルの最大文字数 (末尾の null 文字を含む)
@@ -14,6 +14,12 @@ extern "C" {
 #define IO_SIZE			65536
 #define UPDATE_TIME		1024	// 更新間隔 ms
 
+#ifndef _WIN64	// 32-bit 版なら
+#define MAX_CPU			16		// 32-bit 版は少なくしておく
+#else
+#define MAX_CPU			32		// 最大 CPU/Core 個数 (スレッド本数)
+#endif
+
 
 // グローバル変数
 extern wchar_t recovery_file[MAX_LEN];	// リカバリ・ファイルのパス
@@ -108,6 +114,12 @@ extern unsigned int memory_use;	// メモリー使用量 0=auto, 1～7 -> 1/8 
 // 空きメモリー量と制限値から使用できるメモリー量を計算する
 unsigned int get_mem_size(unsigned __int64 data_size);
 
+extern unsigned int cpu_flag;	// 1=SSSE3, 16=AVX2, 128=SSE2
+extern int cpu_num;				// 利用するスレッドの数
+
+// CPU の拡張機能と、使用可能なコア個数を調べる
+void check_cpu(void);
+
 extern int prog_last;	// 前回と同じ進捗状況は出力しないので記録しておく
 
 // 経過のパーセント表示、キャンセルと一時停止ができる
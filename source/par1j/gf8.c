@@ -32,8 +32,26 @@ plank@cs.utk.edu
 
 #include <stdlib.h>
 
+#include <intrin.h>	// 組み込み関数(intrinsic)を使用する場合インクルード
+
 #include "gf8.h"
 
+extern unsigned int cpu_flag;	// declared in common1.h
+
+// CPU によって使う関数を変更する
+static void galois_region_xor1(unsigned char *r1, unsigned char *r2, int nbytes);
+static void galois_region_xor16(unsigned char *r1, unsigned char *r2, int nbytes);
+static void galois_region_xor32avx(unsigned char *r1, unsigned char *r2, int nbytes);
+static void galois_region_multiply1(unsigned char *r1, unsigned char *r2, int nbytes, int multby);
+static void galois_region_multiply16(unsigned char *r1, unsigned char *r2, int nbytes, int multby);
+static void galois_region_multiply32avx(unsigned char *r1, unsigned char *r2, int nbytes, int multby);
+static void galois_region_multiply16_2(unsigned char *r1, unsigned char *r1b, unsigned char *r2, int nbytes, int multby, int multby2);
+static void galois_region_multiply32avx_2(unsigned char *r1, unsigned char *r1b, unsigned char *r2, int nbytes, int multby, int multby2);
+
+void (*galois_region_xor)(unsigned char *r1, unsigned char *r2, int nbytes);
+void (*galois_region_multiply)(unsigned char *r1, unsigned char *r2, int nbytes, int multby);
+void (*galois_region_multiply2)(unsigned char *r1, unsigned char *r1b, unsigned char *r2, int nbytes, int multby, int multby2);
+
 #define NW   256
 #define NWM1 255
 #define PRIM_POLY 0x11D
@@ -109,6 +127,22 @@ int galois_create_mult_tables(void)
 			j++;
 		}
 	}
+
+	// CPU によって使う関数を変更する
+	galois_region_xor = galois_region_xor1;
+	galois_region_multiply = galois_region_multiply1;
+	galois_region_multiply2 = NULL;
+	if (cpu_flag & 16){	// AVX2 対応なら
+		galois_region_xor = galois_region_xor32avx;
+		galois_region_multiply = galois_region_multiply32avx;
+		galois_region_multiply2 = galois_region_multiply32avx_2;
+	} else if (cpu_flag & 1){	// SSSE3 対応なら
+		galois_region_xor = galois_region_xor16;
+		galois_region_multiply = galois_region_multiply16;
+		galois_region_multiply2 = galois_region_multiply16_2;
+	} else if (cpu_flag & 128){	// SSE2 対応なら XOR だけ速くする
+		galois_region_xor = galois_region_xor16;
+	}
 	return 0;
 }
 
@@ -148,7 +182,7 @@ void galois_free_tables(void) // テーブルを一括して解放するため
 	}
 }
 
-void galois_region_xor(
+static void galois_region_xor1(
 	unsigned char *r1,	// Region 1
 	unsigned char *r2,	// Sum region (r2 = r1 ^ r2)
 	int nbytes)			// Number of bytes in region
@@ -159,7 +193,7 @@ void galois_region_xor(
 		r2[i] ^= r1[i];
 }
 
-void galois_region_multiply(
+static void galois_region_multiply1(
 	unsigned char *r1,	// Region to multiply
 	unsigned char *r2,	// products go here.
 	int nbytes,			// Number of bytes in region
@@ -172,6 +206,172 @@ void galois_region_multiply(
 		r2[i] ^= table[ r1[i] ];
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// SSE2, SSSE3, AVX2 を使う場合
+// バッファーの位置は揃ってないので、unaligned load/store を使う
+
+static void galois_region_xor16(unsigned char *r1, unsigned char *r2, int nbytes)
+{
+	int i;
+	__m128i xmm0, xmm1;
+
+	for (i = 0; i + 16 <= nbytes; i += 16){
+		xmm0 = _mm_loadu_si128((__m128i *)(r1 + i));
+		xmm1 = _mm_loadu_si128((__m128i *)(r2 + i));
+		_mm_storeu_si128((__m128i *)(r2 + i), _mm_xor_si128(xmm0, xmm1));
+	}
+	for (; i < nbytes; i++)	// 16バイト未満の残り
+		r2[i] ^= r1[i];
+}
+
+static void galois_region_xor32avx(unsigned char *r1, unsigned char *r2, int nbytes)
+{
+	int i;
+	__m256i ymm0, ymm1;
+
+	for (i = 0; i + 32 <= nbytes; i += 32){
+		ymm0 = _mm256_loadu_si256((__m256i *)(r1 + i));
+		ymm1 = _mm256_loadu_si256((__m256i *)(r2 + i));
+		_mm256_storeu_si256((__m256i *)(r2 + i), _mm256_xor_si256(ymm0, ymm1));
+	}
+	_mm256_zeroupper();
+	for (; i < nbytes; i++)	// 32バイト未満の残り
+		r2[i] ^= r1[i];
+}
+
+// 乗算表から下位 4-bit と上位 4-bit 用の 16バイトずつの表を作る
+static void create_nibble_table(unsigned char *tbl, int multby)
+{
+	int i, *table;
+
+	table = galois_mult_table + (multby << 8);
+	for (i = 0; i < 16; i++){
+		tbl[i] = (unsigned char)table[i];
+		tbl[16 + i] = (unsigned char)table[i << 4];
+	}
+}
+
+static void galois_region_multiply16(unsigned char *r1, unsigned char *r2, int nbytes, int multby)
+{
+	__declspec(align(16)) unsigned char tbl[32];
+	int i, *table;
+	__m128i mask, tbl_l, tbl_h, xmm0, xmm1;
+
+	create_nibble_table(tbl, multby);
+	tbl_l = _mm_load_si128((__m128i *)tbl);
+	tbl_h = _mm_load_si128((__m128i *)(tbl + 16));
+	mask = _mm_set1_epi8(0x0F);
+
+	for (i = 0; i + 16 <= nbytes; i += 16){
+		xmm0 = _mm_loadu_si128((__m128i *)(r1 + i));
+		xmm1 = _mm_and_si128(_mm_srli_epi16(xmm0, 4), mask);
+		xmm0 = _mm_and_si128(xmm0, mask);
+		xmm0 = _mm_xor_si128(_mm_shuffle_epi8(tbl_l, xmm0), _mm_shuffle_epi8(tbl_h, xmm1));
+		xmm0 = _mm_xor_si128(xmm0, _mm_loadu_si128((__m128i *)(r2 + i)));
+		_mm_storeu_si128((__m128i *)(r2 + i), xmm0);
+	}
+
+	table = galois_mult_table + (multby << 8);
+	for (; i < nbytes; i++)	// 16バイト未満の残り
+		r2[i] ^= table[ r1[i] ];
+}
+
+// 二個のソースに別々の値を掛けて、一度に追加する
+static void galois_region_multiply16_2(unsigned char *r1, unsigned char *r1b, unsigned char *r2, int nbytes, int multby, int multby2)
+{
+	__declspec(align(16)) unsigned char tbl[64];
+	int i, *table, *table2;
+	__m128i mask, tbl_l, tbl_h, tbl_l2, tbl_h2, xmm0, xmm1, xmm2, xmm3;
+
+	create_nibble_table(tbl, multby);
+	create_nibble_table(tbl + 32, multby2);
+	tbl_l = _mm_load_si128((__m128i *)tbl);
+	tbl_h = _mm_load_si128((__m128i *)(tbl + 16));
+	tbl_l2 = _mm_load_si128((__m128i *)(tbl + 32));
+	tbl_h2 = _mm_load_si128((__m128i *)(tbl + 48));
+	mask = _mm_set1_epi8(0x0F);
+
+	for (i = 0; i + 16 <= nbytes; i += 16){
+		xmm0 = _mm_loadu_si128((__m128i *)(r1 + i));
+		xmm2 = _mm_loadu_si128((__m128i *)(r1b + i));
+		xmm1 = _mm_and_si128(_mm_srli_epi16(xmm0, 4), mask);
+		xmm0 = _mm_and_si128(xmm0, mask);
+		xmm3 = _mm_and_si128(_mm_srli_epi16(xmm2, 4), mask);
+		xmm2 = _mm_and_si128(xmm2, mask);
+		xmm0 = _mm_xor_si128(_mm_shuffle_epi8(tbl_l, xmm0), _mm_shuffle_epi8(tbl_h, xmm1));
+		xmm2 = _mm_xor_si128(_mm_shuffle_epi8(tbl_l2, xmm2), _mm_shuffle_epi8(tbl_h2, xmm3));
+		xmm0 = _mm_xor_si128(xmm0, xmm2);
+		xmm0 = _mm_xor_si128(xmm0, _mm_loadu_si128((__m128i *)(r2 + i)));
+		_mm_storeu_si128((__m128i *)(r2 + i), xmm0);
+	}
+
+	table = galois_mult_table + (multby << 8);
+	table2 = galois_mult_table + (multby2 << 8);
+	for (; i < nbytes; i++)	// 16バイト未満の残り
+		r2[i] ^= table[ r1[i] ] ^ table2[ r1b[i] ];
+}
+
+static void galois_region_multiply32avx(unsigned char *r1, unsigned char *r2, int nbytes, int multby)
+{
+	__declspec(align(16)) unsigned char tbl[32];
+	int i, *table;
+	__m256i mask, tbl_l, tbl_h, ymm0, ymm1;
+
+	create_nibble_table(tbl, multby);
+	tbl_l = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)tbl));
+	tbl_h = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(tbl + 16)));
+	mask = _mm256_set1_epi8(0x0F);
+
+	for (i = 0; i + 32 <= nbytes; i += 32){
+		ymm0 = _mm256_loadu_si256((__m256i *)(r1 + i));
+		ymm1 = _mm256_and_si256(_mm256_srli_epi16(ymm0, 4), mask);
+		ymm0 = _mm256_and_si256(ymm0, mask);
+		ymm0 = _mm256_xor_si256(_mm256_shuffle_epi8(tbl_l, ymm0), _mm256_shuffle_epi8(tbl_h, ymm1));
+		ymm0 = _mm256_xor_si256(ymm0, _mm256_loadu_si256((__m256i *)(r2 + i)));
+		_mm256_storeu_si256((__m256i *)(r2 + i), ymm0);
+	}
+	_mm256_zeroupper();
+
+	table = galois_mult_table + (multby << 8);
+	for (; i < nbytes; i++)	// 32バイト未満の残り
+		r2[i] ^= table[ r1[i] ];
+}
+
+static void galois_region_multiply32avx_2(unsigned char *r1, unsigned char *r1b, unsigned char *r2, int nbytes, int multby, int multby2)
+{
+	__declspec(align(16)) unsigned char tbl[64];
+	int i, *table, *table2;
+	__m256i mask, tbl_l, tbl_h, tbl_l2, tbl_h2, ymm0, ymm1, ymm2, ymm3;
+
+	create_nibble_table(tbl, multby);
+	create_nibble_table(tbl + 32, multby2);
+	tbl_l = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)tbl));
+	tbl_h = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(tbl + 16)));
+	tbl_l2 = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(tbl + 32)));
+	tbl_h2 = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(tbl + 48)));
+	mask = _mm256_set1_epi8(0x0F);
+
+	for (i = 0; i + 32 <= nbytes; i += 32){
+		ymm0 = _mm256_loadu_si256((__m256i *)(r1 + i));
+		ymm2 = _mm256_loadu_si256((__m256i *)(r1b + i));
+		ymm1 = _mm256_and_si256(_mm256_srli_epi16(ymm0, 4), mask);
+		ymm0 = _mm256_and_si256(ymm0, mask);
+		ymm3 = _mm256_and_si256(_mm256_srli_epi16(ymm2, 4), mask);
+		ymm2 = _mm256_and_si256(ymm2, mask);
+		ymm0 = _mm256_xor_si256(_mm256_shuffle_epi8(tbl_l, ymm0), _mm256_shuffle_epi8(tbl_h, ymm1));
+		ymm2 = _mm256_xor_si256(_mm256_shuffle_epi8(tbl_l2, ymm2), _mm256_shuffle_epi8(tbl_h2, ymm3));
+		ymm0 = _mm256_xor_si256(ymm0, ymm2);
+		ymm0 = _mm256_xor_si256(ymm0, _mm256_loadu_si256((__m256i *)(r2 + i)));
+		_mm256_storeu_si256((__m256i *)(r2 + i), ymm0);
+	}
+	_mm256_zeroupper();
+
+	table = galois_mult_table + (multby << 8);
+	table2 = galois_mult_table + (multby2 << 8);
+	for (; i < nbytes; i++)	// 32バイト未満の残り
+		r2[i] ^= table[ r1[i] ] ^ table2[ r1b[i] ];
+}
+
 // チェックサムを計算する
 void checksum4(unsigned char *data, unsigned char *hash, int byte_size)
 {
@@ -44,17 +44,27 @@ extern int galois_multtable_divide(int x, int y);
 extern int galois_power(int x, int y);	// 乗数計算用に追加
 extern void galois_free_tables(void);	// 解放用に追加
 
-void galois_region_xor(
+// CPU によって使う関数が変わる (galois_create_mult_tables で設定する)
+extern void (*galois_region_xor)(
 	unsigned char *r1,	// Region 1
 	unsigned char *r2,	// Sum region (r2 = r1 ^ r2)
 	int nbytes);		// Number of bytes in region
 
-void galois_region_multiply(
+extern void (*galois_region_multiply)(
 	unsigned char *r1,	// Region to multiply
 	unsigned char *r2,	// products go here.
 	int nbytes,			// Number of bytes in region
 	int multby);		// Number to multiply by
 
+// 二個のソースを一度に追加する (SSSE3 か AVX2 が使えない場合は NULL)
+extern void (*galois_region_multiply2)(
+	unsigned char *r1,	// Region to multiply
+	unsigned char *r1b,	// Second region to multiply
+	unsigned char *r2,	// products go here.
+	int nbytes,			// Number of bytes in region
+	int multby,			// Number to multiply r1 by
+	int multby2);		// Number to multiply r1b by
+
 #define HASH_SIZE 4
 #define HASH_RANGE 128
 void checksum4(unsigned char *data, unsigned char *hash, int byte_size);
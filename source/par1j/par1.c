@@ -12,6 +12,8 @@
 #define _WIN32_WINNT 0x0601	// Windows 7 or later
 #endif
 
+#include <limits.h>
+#include <process.h>
 #include <stdio.h>
 
 #include <windows.h>
@@ -208,6 +210,7 @@ int * make_decode_matrix(
 	int *exist,		// どのブロックが存在するか
 	int *id)		// 失われたソース・ブロックをどのパリティ・ブロックで代用したか
 {
+	unsigned char *mat8, *row_tmp;
 	int *mat_max, *mat_l, *mat_r;
 	int factor, row_start, row_start2, col_find, i, j, k;
 
@@ -291,13 +294,30 @@ int * make_decode_matrix(
 	//printf("\n");
 	//galois_print_matrix(mat_r, rows, cols);
 
+	// 行ごとの計算を galois_region_* で行えるように、左右を連結したバイト単位の行列にする
+	mat8 = malloc(rows * cols * 2 + cols * 2);
+	if (mat8 == NULL){
+		free(mat_l);
+		free(mat_r);
+		printf("malloc, %d\n", rows * cols * 2 + cols * 2);
+		return NULL;
+	}
+	row_tmp = mat8 + rows * cols * 2;	// 割り算用の作業領域
+	for (j = 0; j < rows; j++){
+		for (k = 0; k < cols; k++){
+			mat8[cols * 2 * j + k] = (unsigned char)mat_l[cols * j + k];
+			mat8[cols * 2 * j + cols + k] = (unsigned char)mat_r[cols * j + k];
+		}
+	}
+	free(mat_l);
+
 	// Gaussian Elimination
 	for (j = 0; j < rows; j++){
-		row_start = cols * j; // その行の開始位置
+		row_start = cols * 2 * j; // その行の開始位置
 
 		// mat_l の各行ごとに最初の 0でない値を探す
 		for (col_find = 0; col_find < cols; col_find++){
-			if (mat_l[row_start + col_find] != 0)
+			if (mat8[row_start + col_find] != 0)
 				break;
 		}
 		if (col_find == cols){ // 見つからなければ、その行列の逆行列を計算できない
@@ -312,16 +332,15 @@ int * make_decode_matrix(
 					k++;
 				}
 			}
-			free(mat_l);
+			free(mat8);
 			free(mat_r);
 			return NULL;
 		}
-		factor = mat_l[row_start + col_find]; // col_find 列に 0 ではない値を発見
-		if (factor != 1){ // factor が 1でなければ、1にする為に factor で割る
-			for (k = 0; k < cols; k++){
-				mat_l[row_start + k] = galois_multtable_divide(mat_l[row_start + k], factor);
-				mat_r[row_start + k] = galois_multtable_divide(mat_r[row_start + k], factor);
-			}
+		factor = mat8[row_start + col_find]; // col_find 列に 0 ではない値を発見
+		if (factor != 1){ // factor が 1でなければ、1にする為に factor の逆数を掛ける
+			memcpy(row_tmp, mat8 + row_start, cols * 2);
+			memset(mat8 + row_start, 0, cols * 2);
+			galois_region_multiply(row_tmp, mat8 + row_start, cols * 2, galois_multtable_divide(1, factor));
 		}
 
 		// 別の行の同じ col_find 列が 0以外なら、その値を 0にするために、
@@ -329,43 +348,180 @@ int * make_decode_matrix(
 		for (i = 0; i < rows; i++){
 			if (i == j)
 				continue; // 同じ行はとばす
-			row_start2 = cols * i; // その行の開始位置
-			factor = mat_l[row_start2 + col_find]; // i 行の col_find 列の値
+			row_start2 = cols * 2 * i; // その行の開始位置
+			factor = mat8[row_start2 + col_find]; // i 行の col_find 列の値
 			if (factor != 0){ // 0でなければ
 				// 先の計算により、j 行の col_find 列の値は必ず 1なので、この factor が倍率になる
 				if (factor == 1){ // 倍率が 1なら、単純に XOR するだけ
-					for (k = 0; k < cols; k++){
-						mat_l[row_start2 + k] ^= mat_l[row_start + k];
-						mat_r[row_start2 + k] ^= mat_r[row_start + k];
-					}
+					galois_region_xor(mat8 + row_start, mat8 + row_start2, cols * 2);
 				} else {
-					for (k = 0; k < cols; k++){
-						mat_l[row_start2 + k] ^= galois_multtable_multiply(mat_l[row_start + k], factor);
-						mat_r[row_start2 + k] ^= galois_multtable_multiply(mat_r[row_start + k], factor);
-					}
+					galois_region_multiply(mat8 + row_start, mat8 + row_start2, cols * 2, factor);
 				}
 			}
 		}
-
-		//printf("\nDivide & Eliminate :\n");
-		//galois_print_matrix(mat_l, rows, cols);
-		//printf("\n");
-		//galois_print_matrix(mat_r, rows, cols);
 	}
 
-	free(mat_l);
+	// 右側が復元用の行列になる
+	for (j = 0; j < rows; j++){
+		for (k = 0; k < cols; k++)
+			mat_r[cols * j + k] = mat8[cols * 2 * j + cols + k];
+	}
+	free(mat8);
 	return mat_r;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #define CHUNK_SIZE 65536
+#define STACK_SIZE 65536
 
 typedef struct {
 	HANDLE hFile;	// ファイル・ハンドル
 	__int64 size;	// ファイルの残りサイズ
 } file_ctx;
 
+typedef struct {	// RS threading control struct
+	unsigned char *buf;	// ソース・ブロックの断片
+	unsigned char *block;	// 計算結果を書き込む場所
+	int *factor;		// 各ソース・ブロックに掛ける値 (行列の一行)
+	int source_num;
+	unsigned int unit_size;
+	unsigned int chunk_size;
+	int chunk_count;
+	volatile long now;	// 次に計算する chunk の番号
+	HANDLE run;
+	HANDLE end;
+} RS_TH;
+
+// chunk 一個分の計算をする
+static void multiply_chunk(RS_TH *th, int k)
+{
+	unsigned char *block;
+	int j, j2, factor;
+	unsigned int offset, length;
+
+	offset = th->chunk_size * k;
+	length = th->chunk_size;
+	if (offset + length > th->unit_size)	// 最後の chunk だけサイズが異なるかも
+		length = th->unit_size - offset;
+	block = th->block + offset;
+
+	memset(block, 0, length);	// ブロックを 0で埋める
+	// ソース・ブロックごとに追加していく
+	j2 = -1;	// 二個ずつ計算するために保留しているソース・ブロック
+	for (j = 0; j < th->source_num; j++){
+		factor = th->factor[j];
+		if (factor == 1){
+			galois_region_xor(th->buf + (th->unit_size * j + offset), block, length);
+		} else if (factor != 0){
+			if (galois_region_multiply2 == NULL){
+				galois_region_multiply(th->buf + (th->unit_size * j + offset), block, length, factor);
+			} else if (j2 < 0){
+				j2 = j;
+			} else {
+				galois_region_multiply2(th->buf + (th->unit_size * j2 + offset), th->buf + (th->unit_size * j + offset),
+							block, length, th->factor[j2], factor);
+				j2 = -1;
+			}
+		}
+	}
+	if (j2 >= 0)	// 最後に一個残った場合
+		galois_region_multiply(th->buf + (th->unit_size * j2 + offset), block, length, th->factor[j2]);
+}
+
+// chunk ごとに計算するためのスレッド
+static DWORD WINAPI thread_multiply(LPVOID lpParameter)
+{
+	int k;
+	HANDLE hRun, hEnd;
+	RS_TH *th;
+
+	th = (RS_TH *)lpParameter;
+	hRun = th->run;
+	hEnd = th->end;
+	SetEvent(hEnd);	// 設定完了を通知する
+
+	WaitForSingleObject(hRun, INFINITE);	// 計算開始の合図を待つ
+	while (th->now < INT_MAX / 2){
+		while ((k = InterlockedIncrement(&(th->now))) < th->chunk_count)	// k = ++th_now
+			multiply_chunk(th, k);
+		SetEvent(hEnd);	// 計算終了を通知する
+		WaitForSingleObject(hRun, INFINITE);	// 計算開始の合図を待つ
+	}
+
+	// 終了処理
+	CloseHandle(hRun);
+	CloseHandle(hEnd);
+	return 0;
+}
+
+// 計算用のサブ・スレッドを起動する、戻り値はスレッドの数
+static int start_multiply(RS_TH *th, HANDLE *hSub, HANDLE *hRun, HANDLE *hEnd)
+{
+	int j, th_num;
+
+	// chunk を各スレッドに分配できるように、必要なら chunk を小さくする
+	th->chunk_size = CHUNK_SIZE;
+	while ((th->chunk_size > 4096) && ((th->unit_size + th->chunk_size - 1) / th->chunk_size < (unsigned int)cpu_num * 2))
+		th->chunk_size /= 2;
+	th->chunk_count = (th->unit_size + th->chunk_size - 1) / th->chunk_size;
+
+	// メイン・スレッドも計算するので、サブ・スレッドは一個少なくする
+	th_num = cpu_num - 1;
+	if (th_num > th->chunk_count - 1)
+		th_num = th->chunk_count - 1;
+	for (j = 0; j < th_num; j++){
+		hSub[j] = NULL;
+		hRun[j] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto Reset にする
+		if (hRun[j] == NULL)
+			break;
+		hEnd[j] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (hEnd[j] == NULL){
+			CloseHandle(hRun[j]);
+			break;
+		}
+		th->run = hRun[j];
+		th->end = hEnd[j];
+		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_multiply, (LPVOID)th, 0, NULL);
+		if (hSub[j] == NULL){
+			CloseHandle(hRun[j]);
+			CloseHandle(hEnd[j]);
+			break;
+		}
+		WaitForSingleObject(hEnd[j], INFINITE);	// 設定終了の合図を待つ
+	}
+	return j;	// 起動できなかった分はメイン・スレッドが計算する
+}
+
+// 一行分の計算をサブ・スレッドと分担する
+static void run_multiply(RS_TH *th, int *factor, unsigned char *block, HANDLE *hRun, HANDLE *hEnd, int th_num)
+{
+	int j, k;
+
+	th->factor = factor;
+	th->block = block;
+	th->now = -1;	// 初期値 - 1
+	for (j = 0; j < th_num; j++)
+		SetEvent(hRun[j]);	// サブ・スレッドに計算を開始させる
+	while ((k = InterlockedIncrement(&(th->now))) < th->chunk_count)	// k = ++th_now
+		multiply_chunk(th, k);
+	if (th_num > 0)
+		WaitForMultipleObjects(th_num, hEnd, TRUE, INFINITE);	// サブ・スレッドの計算終了の合図を待つ
+}
+
+// サブ・スレッドを終了させる
+static void stop_multiply(RS_TH *th, HANDLE *hSub, HANDLE *hRun, int th_num)
+{
+	int j;
+
+	InterlockedExchange(&(th->now), INT_MAX / 2);	// サブ・スレッドの計算を中断する
+	for (j = 0; j < th_num; j++){
+		SetEvent(hRun[j]);
+		WaitForSingleObject(hSub[j], INFINITE);
+		CloseHandle(hSub[j]);
+	}
+}
+
 // リード・ソロモン符号を使ってエンコードする
 int rs_encode(
 	int source_num,		// ソース・ブロックの数
@@ -377,12 +533,13 @@ int rs_encode(
 	PHMD5 *par_md5)
 {
 	unsigned char *buffer, *block = NULL;
-	int err = 0, i, j;
-	int *mat = NULL, factor;
+	int err = 0, i, th_num = 0;
+	int *mat = NULL;
 	unsigned int io_size, unit_size, len, rv;
-	unsigned int k, offset, length, chunk_count;
 	unsigned int time_last, prog_num = 0, prog_base;
 	__int64 block_left;
+	HANDLE hSub[MAX_CPU], hRun[MAX_CPU], hEnd[MAX_CPU];
+	RS_TH th;
 //unsigned int time1;
 
 	// 利用できるメモリー量を調べる
@@ -433,9 +590,12 @@ int rs_encode(
 
 	// chunk がキャッシュに収まるようにすれば速くなる！ (ストリップマイニングという最適化手法)
 	// CPU L2キャッシュ・サイズが 256KB として、1/4 なら 64KB
-	// chunk サイズが 2**16 なので分割数は 1～65536 の範囲になる
-	chunk_count = (unit_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
-	//printf("split count = %d, chunk size = %d\n", chunk_count, CHUNK_SIZE);
+	// chunk ごとにスレッドで分担して計算する
+	th.buf = buffer;
+	th.source_num = source_num;
+	th.unit_size = unit_size;
+	th_num = start_multiply(&th, hSub, hRun, hEnd);
+	//printf("split count = %d, chunk size = %d, thread = %d\n", th.chunk_count, th.chunk_size, th_num);
 
 //time1 = GetTickCount();
 	// バッファー・サイズごとにパリティ・ブロックを作成する
@@ -475,37 +635,8 @@ int rs_encode(
 
 		// パリティ・ブロックごとに
 		for (i = 0; i < parity_num; i++){
-			/*	without strip mining
-			memset(block, 0, unit_size);	// パリティ・ブロックを 0で埋める
 			// ソース・ブロックごとにパリティを追加していく
-			for (j = 0; j < source_num; j++){
-				factor = mat[i * source_num + j];
-				if (factor == 1){
-					galois_region_xor(buffer + (unit_size * j), block, unit_size);
-				} else if (factor != 0){
-					galois_region_multiply(buffer + (unit_size * j), block, unit_size, factor);
-				}
-			}
-			*/
-			length = CHUNK_SIZE;
-			for (k = 0; k < chunk_count; k++){	// chunk の番号
-				offset = k * CHUNK_SIZE;
-				if (offset + length >= unit_size){	// 最後の chunk なら
-					length = unit_size - offset;
-					k = chunk_count;
-				}
-
-				memset(block + offset, 0, length);	// パリティ・ブロックを 0で埋める
-				// ソース・ブロックごとにパリティを追加していく
-				for (j = 0; j < source_num; j++){
-					factor = mat[i * source_num + j];
-					if (factor == 1){
-						galois_region_xor(buffer + (unit_size * j + offset), block + offset, length);
-					} else if (factor != 0){
-						galois_region_multiply(buffer + (unit_size * j + offset), block + offset, length, factor);
-					}
-				}
-			}
+			run_multiply(&th, mat + (i * source_num), block, hRun, hEnd, th_num);
 
 			// 経過表示
 			prog_num++;
@@ -539,6 +670,7 @@ int rs_encode(
 //printf("encode %u.%03u sec\n", time1 / 1000, time1 % 1000);
 
 error_end:
+	stop_multiply(&th, hSub, hRun, th_num);
 	if (block)
 		free(block);
 	if (mat)
@@ -548,6 +680,76 @@ error_end:
 	return err;
 }
 
+typedef struct {	// 読み込み用スレッドに渡す内容
+	file_ctx *files;
+	int *id;
+	int source_num;
+	unsigned char * volatile buf;	// 読み込み先
+	unsigned int io_size;
+	unsigned int unit_size;
+	volatile int err;
+	volatile int stop;
+	HANDLE run;
+	HANDLE end;
+} READ_TH;
+
+// 復元に使うブロックの断片をバッファーに読み込む
+static int read_fragment(READ_TH *th)
+{
+	unsigned char *buf;
+	int i, *id;
+	unsigned int len, rv, io_size, unit_size;
+	file_ctx *files;
+
+	files = th->files;
+	id = th->id;
+	buf = th->buf;
+	io_size = th->io_size;
+	unit_size = th->unit_size;
+	for (i = 0; i < th->source_num; i++){
+		//printf("%d: id = %d, size = %I64u \n", i, id[i], files[id[i]].size);
+		if (files[id[i]].size > 0){
+			if (files[id[i]].size < io_size){
+				len = (unsigned int)(files[id[i]].size);
+			} else {
+				len = io_size;
+			}
+			files[id[i]].size -= len;
+			if (!ReadFile(files[id[i]].hFile, buf + (unit_size * i), len, &rv, NULL)){
+				print_win32_err();
+				printf("ReadFile, data file %d\n", id[i]);
+				return 1;
+			} else if (len != rv){
+				printf("ReadFile, data file %d, %d, %d\n", id[i], len, rv);
+				return 1;
+			}
+			if (len < io_size)
+				memset(buf + (unit_size * i + len), 0, io_size - len);
+			// ソース・ブロックのチェックサムを計算する
+			checksum4(buf + (unit_size * i), buf + (unit_size * i + io_size), io_size);
+		} else {
+			// ソース・ブロックの値が全て 0 なら、チェックサムも 0 になる。
+			memset(buf + (unit_size * i), 0, unit_size);
+		}
+	}
+	return 0;
+}
+
+// 計算中に次の断片を読み込むためのスレッド
+static DWORD WINAPI thread_read(LPVOID lpParameter)
+{
+	READ_TH *th;
+
+	th = (READ_TH *)lpParameter;
+	WaitForSingleObject(th->run, INFINITE);	// 読み込み開始の合図を待つ
+	while (th->stop == 0){
+		th->err = read_fragment(th);
+		SetEvent(th->end);	// 読み込み終了を通知する
+		WaitForSingleObject(th->run, INFINITE);
+	}
+	return 0;
+}
+
 // リード・ソロモン符号を使ってデコードする
 int rs_decode(
 	int source_num,		// 本来のソース・ブロックの数
@@ -557,14 +759,16 @@ int rs_decode(
 	int *exist,			// そのブロックが存在するか
 	file_ctx *files)
 {
-	unsigned char *buffer, *block = NULL;
-	int err = 0, i, j;
-	int *mat = NULL, *id = NULL, factor;
+	unsigned char *buffer[2], *block = NULL;
+	int err = 0, i, th_num = 0, buf_num, buf_now, reading = 0;
+	int *mat = NULL, *id = NULL;
 	int block_recover;
 	unsigned int io_size, unit_size, len, rv, len2;
-	unsigned int k, offset, length, chunk_count;
 	unsigned int time_last, prog_num = 0, prog_base;
 	__int64 block_left;
+	HANDLE hSub[MAX_CPU], hRun[MAX_CPU], hEnd[MAX_CPU], hRead = NULL;
+	RS_TH th;
+	READ_TH rth;
 
 	// 利用できるメモリー量を調べる
 	io_size = get_mem_size(block_size * (__int64)(source_num + block_lost));
@@ -572,11 +776,16 @@ int rs_decode(
 	io_size -= 1048576; // 行列に必要なメモリーとスタック用に 1MB
 	if (io_size < 1048576)
 		io_size = 1048576;
-	io_size /= source_num + 1;	// 何個分必要か
+	// 断片に分割する場合は、計算中に次の断片を読み込むためにバッファーを二組使う
+	buf_num = 1;
+	if (((__int64)(io_size / (source_num + 1)) < block_size) && (block_size > 4096))
+		buf_num = 2;
+	io_size /= source_num * buf_num + 1;	// 何個分必要か
 
 	// ブロック・サイズより大きい、またはブロック・サイズ自体が小さい場合は
 	if (((__int64)io_size >= block_size) || (block_size <= 4096)){
 		io_size = (unsigned int)block_size;	// ブロック・サイズと同じにする
+		buf_num = 1;
 	} else {	// ブロック・サイズを 2の乗数サイズの断片に分割する
 		// 断片化する場合でもブロック数が多いと 256 * 4096 = 1MB は使う
 		__int64 fragment_size = 4096;	// 最低サイズ
@@ -587,7 +796,7 @@ int rs_decode(
 	io_size = (io_size + 3) & 0xFFFFFFFC;	// 4の倍数にする
 	unit_size = io_size + HASH_SIZE;		// チェックサムの分だけ増やす
 	prog_base = (unsigned int)((block_size + (__int64)io_size - 1) / (__int64)io_size) * block_lost;	// 全体の断片の個数
-	//printf("io_size = %d\n", io_size);
+	//printf("io_size = %d, buf_num = %d\n", io_size, buf_num);
 
 	block_left = block_size;
 	if (galois_create_mult_tables() < 0){
@@ -596,13 +805,14 @@ int rs_decode(
 	}
 
 	// 作業バッファーを確保する
-	block = malloc(unit_size * (source_num + 1));
+	block = malloc(unit_size * (source_num * buf_num + 1));
 	if (block == NULL){
-		printf("malloc, %d\n", unit_size * (source_num + 1));
+		printf("malloc, %d\n", unit_size * (source_num * buf_num + 1));
 		err = 1;
 		goto error_end;
 	}
-	buffer = block + unit_size;
+	buffer[0] = block + unit_size;
+	buffer[1] = buffer[0] + (unit_size * source_num);
 
 	// パリティ計算用の行列演算の準備をする
 	id = malloc(sizeof(int) * source_num);
@@ -621,41 +831,41 @@ int rs_decode(
 	//for (i = 0; i < source_num; i++)
 	//	printf("id[%d] = %d\n", i, id[i]);
 
-	// chunk サイズが 2**16 なので分割数は 1～65536 の範囲になる
-	chunk_count = (unit_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	// chunk ごとにスレッドで分担して計算する
+	th.buf = buffer[0];
+	th.source_num = source_num;
+	th.unit_size = unit_size;
+	th_num = start_multiply(&th, hSub, hRun, hEnd);
+
+	// 読み込み用のスレッドを起動する (起動できなければ、メイン・スレッドで読み込む)
+	rth.files = files;
+	rth.id = id;
+	rth.source_num = source_num;
+	rth.io_size = io_size;
+	rth.unit_size = unit_size;
+	rth.stop = 0;
+	if (buf_num == 2){
+		rth.run = CreateEvent(NULL, FALSE, FALSE, NULL);
+		rth.end = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((rth.run != NULL) && (rth.end != NULL))
+			hRead = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_read, (LPVOID)&rth, 0, NULL);
+		if (hRead == NULL){
+			if (rth.run != NULL)
+				CloseHandle(rth.run);
+			if (rth.end != NULL)
+				CloseHandle(rth.end);
+		}
+	}
+
+	// 最初の断片を読み込む
+	buf_now = 0;
+	rth.buf = buffer[0];
+	if (err = read_fragment(&rth))
+		goto error_end;
 
 	// バッファー・サイズごとにソース・ブロックを復元する
 	time_last = GetTickCount();
 	while (block_left > 0){
-		// バッファーにソース・ファイルとリカバリ・ファイルの内容を読み込む
-		for (i = 0; i < source_num; i++){
-			//printf("%d: id = %d, exist = %d, size = %I64u \n", i, id[i], exist[id[i]], files[id[i]].size);
-			if (files[id[i]].size > 0){
-				if (files[id[i]].size < io_size){
-					len = (unsigned int)(files[id[i]].size);
-				} else {
-					len = io_size;
-				}
-				files[id[i]].size -= len;
-				if (!ReadFile(files[id[i]].hFile, buffer + (unit_size * i), len, &rv, NULL)){
-					print_win32_err();
-					printf("ReadFile, data file %d\n", id[i]);
-					err = 1;
-					goto error_end;
-				} else if (len != rv){
-					printf("ReadFile, data file %d, %d, %d\n", id[i], len, rv);
-					err = 1;
-					goto error_end;
-				}
-				if (len < io_size)
-					memset(buffer + (unit_size * i + len), 0, io_size - len);
-				// ソース・ブロックのチェックサムを計算する
-				checksum4(buffer + (unit_size * i), buffer + (unit_size * i + io_size), io_size);
-			} else {
-				// ソース・ブロックの値が全て 0 なら、チェックサムも 0 になる。
-				memset(buffer + (unit_size * i), 0, unit_size);
-			}
-		}
 		// バッファーに読み込んだサイズ
 		if (block_left < io_size){
 			len = (unsigned int)block_left;
@@ -664,41 +874,20 @@ int rs_decode(
 		}
 		block_left -= len;
 
+		// 計算してる間に次の断片を読み込んでおく
+		if ((block_left > 0) && (hRead != NULL)){
+			rth.buf = buffer[buf_now ^ 1];
+			SetEvent(rth.run);
+			reading = 1;
+		}
+
 		// 失われたソース・ブロックごとに
+		th.buf = buffer[buf_now];
 		block_recover = 0;
 		for (i = 0; i < source_num; i++){
 			if (id[i] >= source_num){ // パリティ・ブロックで補った部分
-				/*	without strip mining
-				memset(block, 0, unit_size);	// ソース・ブロックを 0で埋める
 				// 失われたソース・ブロックを復元していく
-				for (j = 0; j < source_num; j++) {
-					factor = mat[source_num * block_recover + j];
-					if (factor == 1){
-						galois_region_xor(buffer + (unit_size * j), block, unit_size);
-					} else if (factor != 0){
-						galois_region_multiply(buffer + (unit_size * j), block, unit_size, factor);
-					}
-				}
-				*/
-				length = CHUNK_SIZE;
-				for (k = 0; k < chunk_count; k++){	// chunk の番号
-					offset = k * CHUNK_SIZE;
-					if (offset + length >= unit_size){	// 最後の chunk なら
-						length = unit_size - offset;
-						k = chunk_count;
-					}
-
-					memset(block + offset, 0, length);	// ソース・ブロックを 0で埋める
-					// 失われたソース・ブロックを復元していく
-					for (j = 0; j < source_num; j++) {
-						factor = mat[source_num * block_recover + j];
-						if (factor == 1){
-							galois_region_xor(buffer + (unit_size * j + offset), block + offset, length);
-						} else if (factor != 0){
-							galois_region_multiply(buffer + (unit_size * j + offset), block + offset, length, factor);
-						}
-					}
-				}
+				run_multiply(&th, mat + (source_num * block_recover), block, hRun, hEnd, th_num);
 
 				// 経過表示
 				prog_num++;
@@ -734,10 +923,33 @@ int rs_decode(
 				}
 			}
 		}
+
+		// 次の断片の読み込みが終わるのを待つ
+		if (reading){
+			WaitForSingleObject(rth.end, INFINITE);
+			reading = 0;
+			if (err = rth.err)
+				goto error_end;
+			buf_now ^= 1;
+		} else if (block_left > 0){
+			if (err = read_fragment(&rth))
+				goto error_end;
+		}
 	}
 	print_progress_done();	// 改行して行の先頭に戻しておく
 
 error_end:
+	stop_multiply(&th, hSub, hRun, th_num);
+	if (hRead != NULL){	// 読み込み用のスレッドを終了させる
+		if (reading)
+			WaitForSingleObject(rth.end, INFINITE);
+		rth.stop = 1;
+		SetEvent(rth.run);
+		WaitForSingleObject(hRead, INFINITE);
+		CloseHandle(hRead);
+		CloseHandle(rth.run);
+		CloseHandle(rth.end);
+	}
 	if (block)
 		free(block);
 	if (id)
@@ -384,6 +384,7 @@ wmain(int argc, wchar_t *argv[])
 	ini_path[0] = 0;
 	cp_output = GetConsoleOutputCP();
 	memory_use = 0;
+	check_cpu();	// CPU を検査する
 
 	// コマンド
 	switch (argv[1][0]){
@@ -13,7 +13,9 @@
 #endif
 
 #include <conio.h>
+#include <process.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <windows.h>
 #include <shlobj.h>
@@ -31,6 +33,8 @@ wchar_t ini_path[MAX_LEN];		// 検査結果ファイルのパス
 int base_len;		// ソース・ファイルの基準ディレクトリの長さ
 int recovery_limit;	// 作成時はリカバリ・ファイルのサイズ制限
 int first_num;		// 作成時は最初のパリティ・ブロック番号、検査時は初めて見つけた数
+int subset_num;		// 作成時に分けた recovery set の番号 (1～)
+int subset_count;	// 作成時に分けた recovery set の数 (0 = 分けない)
 
 int file_num;		// ソース・ファイルの数
 int entity_num;		// 実体のあるファイルの数 (recovery set に含まれるファイル数)
@@ -456,6 +460,146 @@ HANDLE handle_write_file(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// ファイル・リストを検索するためのハッシュ表
+// リストの先頭アドレスごとに記録して、追加された部分だけを後から登録する
+#define INDEX_SLOT_NUM	4		// 同時に保持するリストの数
+#define INDEX_MIN_LEN	4096	// これより短いリストは先頭から順に比較する
+
+typedef struct {
+	wchar_t *list;			// リストの先頭 (NULL = 未使用)
+	int total_len;			// 登録済みの文字数
+	int last_off;			// 最後に登録した項目の位置
+	unsigned int last_hash;	// 最後に登録した項目のハッシュ値
+	int item_num;			// 登録した項目数
+	int table_size;			// ハッシュ表の大きさ (2のべき乗)
+	int *table;				// 項目の位置 + 1 (0 = 空き)
+	unsigned int last_use;
+} PATH_INDEX;
+
+static PATH_INDEX path_index[INDEX_SLOT_NUM];
+static unsigned int index_count = 0;
+
+// 大文字と小文字を区別しないハッシュ値 (FNV-1a)
+static unsigned int hash_path(wchar_t *path)
+{
+	unsigned int hash = 2166136261;
+
+	while (*path != 0){
+		hash ^= towlower(*path);
+		hash *= 16777619;
+		path++;
+	}
+	return hash;
+}
+
+// ハッシュ表に項目を登録する
+static int insert_index(PATH_INDEX *idx, int off, unsigned int hash)
+{
+	int i, mask;
+
+	if (idx->item_num * 2 >= idx->table_size){	// 半分以上埋まったら拡張する
+		int *old_table, old_size;
+
+		old_table = idx->table;
+		old_size = idx->table_size;
+		idx->table_size = (old_size == 0) ? 4096 : old_size * 2;
+		idx->table = (int *)calloc(idx->table_size, sizeof(int));
+		if (idx->table == NULL){
+			idx->table = old_table;
+			idx->table_size = old_size;
+			return 1;
+		}
+		mask = idx->table_size - 1;
+		for (i = 0; i < old_size; i++){	// 登録済みの項目を移す
+			int j;
+			if (old_table[i] == 0)
+				continue;
+			j = hash_path(idx->list + old_table[i] - 1) & mask;
+			while (idx->table[j] != 0)
+				j = (j + 1) & mask;
+			idx->table[j] = old_table[i];
+		}
+		if (old_table)
+			free(old_table);
+	}
+
+	mask = idx->table_size - 1;
+	i = hash & mask;
+	while (idx->table[i] != 0)
+		i = (i + 1) & mask;
+	idx->table[i] = off + 1;
+	idx->item_num++;
+	return 0;
+}
+
+// 登録内容を消去する
+static void reset_index(PATH_INDEX *idx, wchar_t *list)
+{
+	idx->list = list;
+	idx->total_len = 0;
+	idx->item_num = 0;
+	if (idx->table)
+		memset(idx->table, 0, sizeof(int) * idx->table_size);
+}
+
+// リストに対応するハッシュ表を用意して、追加された項目を登録する
+static PATH_INDEX * get_index(wchar_t *list, int total_len)
+{
+	int i, off;
+	unsigned int hash;
+	PATH_INDEX *idx = NULL;
+
+	for (i = 0; i < INDEX_SLOT_NUM; i++){
+		if (path_index[i].list == list){
+			idx = &(path_index[i]);
+			break;
+		}
+	}
+	if (idx == NULL){	// 一番長く使ってないものを再利用する
+		idx = &(path_index[0]);
+		for (i = 1; i < INDEX_SLOT_NUM; i++){
+			if (path_index[i].last_use < idx->last_use)
+				idx = &(path_index[i]);
+		}
+		reset_index(idx, list);
+	} else if ((idx->item_num > 0) && (hash_path(list + idx->last_off) != idx->last_hash)){
+		reset_index(idx, list);	// 登録後に内容が変わってるなら作り直す
+	}
+	idx->last_use = ++index_count;
+
+	// 追加された項目を登録する
+	off = idx->total_len;
+	while (off < total_len){
+		hash = hash_path(list + off);
+		if (insert_index(idx, off, hash)){
+			reset_index(idx, NULL);
+			return NULL;
+		}
+		idx->last_off = off;
+		idx->last_hash = hash;
+		while (list[off] != 0)
+			off++;
+		off++;
+	}
+	if (total_len > idx->total_len)	// 短い範囲で検索する時は登録済みの項目を残す
+		idx->total_len = total_len;
+
+	return idx;
+}
+
+// リストの内容を書き換えたり解放する前に、対応するハッシュ表を無効にする
+void discard_index(wchar_t *list)
+{
+	int i;
+
+	if (list == NULL)
+		return;
+	for (i = 0; i < INDEX_SLOT_NUM; i++){
+		if (path_index[i].list == list)
+			reset_index(&(path_index[i]), NULL);
+	}
+}
+
 // ファイル・パスがファイル・リスト上に既に存在するか調べる
 int search_file_path(
 	wchar_t *list,			// ファイル・リスト
@@ -464,6 +608,24 @@ int search_file_path(
 {
 	int off = 0;
 
+	if (total_len >= INDEX_MIN_LEN){	// 長いリストはハッシュ表で探す
+		int i, mask;
+		PATH_INDEX *idx;
+
+		idx = get_index(list, total_len);
+		if (idx != NULL){
+			mask = idx->table_size - 1;
+			i = hash_path(search_file) & mask;
+			while (idx->table[i] != 0){
+				if ((idx->table[i] <= total_len) &&	// 指定された範囲内の項目だけ比較する
+						(_wcsicmp(list + idx->table[i] - 1, search_file) == 0))
+					return 1;
+				i = (i + 1) & mask;
+			}
+			return 0;
+		}
+	}
+
 	while (off < total_len){
 		if (_wcsicmp(list + off, search_file) == 0)
 			return 1;
@@ -477,65 +639,75 @@ int search_file_path(
 	return 0;
 }
 
+static wchar_t *sort_buf;	// 並び替え中のファイル・リスト
+
+// 数値を認識して比較する、同じなら元の順序にする
+static int __cdecl compare_path(const void *elem1, const void *elem2)
+{
+	int rv, off1, off2;
+
+	off1 = *((int *)elem1);
+	off2 = *((int *)elem2);
+	//if (wcscmp(sort_buf + off1, sort_buf + off2) > 0)	// QuickPar はこちらの順序
+	// Windows 7 以降では数値を認識できる SORT_DIGITSASNUMBERS = 0x00000008
+	rv = CompareStringEx(LOCALE_NAME_USER_DEFAULT, 0x00000008, sort_buf + off1, -1, sort_buf + off2, -1, NULL, NULL, 0);
+	if (rv != 2)
+		return rv - 2;	// CSTR_LESS_THAN = 1, CSTR_EQUAL = 2, CSTR_GREATER_THAN = 3
+	return off1 - off2;
+}
+
 // ファイル・リストの内容を並び替える
 void sort_list(
 	wchar_t *list,	// ファイル・リスト
 	int total_len)	// ファイル・リストの文字数
 {
 	wchar_t *work_buf;
-	int off1 = 0, off2, off3, work_off = 0;
+	int *item_off, item_num, off, work_off, i;
+
+	// 項目の数を数える (空の項目で終わる)
+	item_num = 0;
+	off = 0;
+	while ((off < total_len) && (list[off] != 0)){
+		item_num++;
+		while (list[off] != 0)
+			off++;
+		off++;
+	}
+	if (item_num <= 1)
+		return;
 
 	// 作業バッファーを確保する
 	work_buf = (wchar_t *)calloc(total_len, 2);
 	if (work_buf == NULL)
 		return;	// 並べ替え失敗
+	item_off = (int *)malloc(sizeof(int) * item_num);
+	if (item_off == NULL){
+		free(work_buf);
+		return;
+	}
 
-	while (off1 < total_len){
-		if (list[off1] == 0){
-			break;
-		} else if (list[off1] == '*'){	// 既にコピー済なら
-			//off1 += (wcslen(list + off1) + 1);
-			while (list[off1] != 0)
-				off1++;
-			off1++;
-			continue;
-		}
-		off3 = off1;
-
-		//off2 = off3 + wcslen(list + off3) + 1;	// 次の項目
-		off2 = off3;
-		while (list[off2] != 0)
-			off2++;
-		off2++;
-		while (off2 < total_len){
-//printf("%S (%d), %S (%d)\n", list + off3, off3, list + off2, off2);
-			if (list[off2] != '*'){	// まだなら項目を比較する
-				//if (wcscmp(list + off3, list + off2) > 0)	// QuickPar はこちらの順序
-				//if (CompareString(LOCALE_USER_DEFAULT, 0, list + off3, -1, list + off2, -1) > 2)
-				// Windows 7 以降では数値を認識できる SORT_DIGITSASNUMBERS = 0x00000008
-				if (CompareStringEx(LOCALE_NAME_USER_DEFAULT, 0x00000008, list + off3, -1, list + off2, -1, NULL, NULL, 0) > 2)
-					off3 = off2;
-			}
-			//off2 += (wcslen(list + off2) + 1);	// 次の項目
-			while (list[off2] != 0)
-				off2++;
-			off2++;
-		}
+	// 項目の位置を並び替える
+	item_num = 0;
+	off = 0;
+	while ((off < total_len) && (list[off] != 0)){
+		item_off[item_num++] = off;
+		while (list[off] != 0)
+			off++;
+		off++;
+	}
+	sort_buf = list;
+	qsort(item_off, item_num, sizeof(int), compare_path);
 
-		// 順番にコピーしていく
-//printf("get %S (%d)\n", list + off3, off3);
-		wcscpy(work_buf + work_off, list + off3);
-		work_off += ((int)wcslen(work_buf + work_off) + 1);
-		list[off3] = '*';	// コピーした印
-		if (off3 == off1){
-			//off1 += (wcslen(list + off1) + 1);
-			while (list[off1] != 0)
-				off1++;
-			off1++;
-		}
+	// 順番にコピーしていく
+	work_off = 0;
+	for (i = 0; i < item_num; i++){
+		wcscpy(work_buf + work_off, list + item_off[i]);
+		work_off += (int)wcslen(work_buf + work_off) + 1;
 	}
+	free(item_off);
 
 	// 作業バッファーから戻す
+	discard_index(list);
 	memcpy(list, work_buf, total_len * 2);
 	free(work_buf);
 }
@@ -549,7 +721,13 @@ int add_file_path(wchar_t *filename)	// 追加するファイル名
 	len = (int)wcslen(filename);
 
 	if (list_len + len >= list_max){	// 領域が足りなくなるなら拡張する
-		list_max += ALLOC_LEN;
+		// 多くのファイルを追加する際にコピーし直す回数が増えないよう、半分ずつ増やす
+		if (list_max / 2 > ALLOC_LEN){
+			list_max += list_max / 2;
+		} else {
+			list_max += ALLOC_LEN;
+		}
+		discard_index(list_buf);
 		tmp_p = (wchar_t *)realloc(list_buf, list_max * 2);
 		if (tmp_p == NULL){
 			return 1;
@@ -575,6 +753,7 @@ int remove_file_path(
 
 	if (file_off > total_len)
 		return total_len;
+	discard_index(list);
 
 	len = (int)wcslen(list + file_off) + 1;	// 末尾のNULLを含める
 	if (len < total_len){
@@ -1856,6 +2035,7 @@ unsigned int memory_use = 0;	// メモリー使用量 0=auto, 1～7 -> 1/8 ～ 7
 								// 8 = HDD, 16 = SSD, 32 = Fast SSD,
 								// 64 = Quick allocation, 128 = Sparse allocation
 								// 0xFF00 = limit GB
+int disk_rate = 0;	// ドライブの連続転送速度 (MB/s) 0=未計測, -1=計測できない
 
 static int count_bit(DWORD_PTR value)
 {
@@ -2170,11 +2350,11 @@ size_t get_mem_size(size_t trial_alloc)
 //「SSD なら動作を変えるアプリケーションを作る」by NyaRuRu
 //「SSDかどうかをC#から判別する 」by EMO
 
-// Returns 0 if |physical_drive_path| has no seek penalty.
-// Returns 1 otherwise.
-// Returns 2~ if fails to retrieve the status.
-int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
-	wchar_t *drive_letter, logical_drive[8];
+// 装置の種類を調べる (SSD なら 16、NVMe なら 32 が device_type に追加される)
+static int query_device_type(
+	wchar_t *device_path,	// "\\\\.\\C:" のような装置のパス
+	int *device_type)
+{
 	unsigned int return_value, return_size;
 	HANDLE hDevice;
 	STORAGE_PROPERTY_QUERY query_property;
@@ -2182,53 +2362,8 @@ int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
 	DEVICE_TRIM_DESCRIPTOR query_trim_desc;
 	STORAGE_ADAPTER_DESCRIPTOR query_adapter_desc;
 
-//	if (IsWindows8OrGreater()){	// Windows 8 以降なら
-//		printf("\n calling check_msft()\n");
-//		return_value = check_msft();
-//		printf("\ncheck_msft = %d\n\n", return_value);
-//	}
-
-	// ドライブ文字を取得する
-	drive_letter = dir_path;
-	if (wcsncmp(drive_letter, L"\\\\?\\", PREFIX_LEN) == 0)
-		drive_letter += PREFIX_LEN;
-	if (drive_letter[1] != ':')
-		return 2;	// 「C:\～」のような形式にだけ対応する
-	if ((drive_letter[0] >= 0x41) && (drive_letter[0] <= 0x5A)){	// 大文字の A～Z なら
-		logical_drive[4] = drive_letter[0];
-	} else if ((drive_letter[0] >= 0x61) && (drive_letter[0] <= 0x7A)){	// 小文字の a～z なら
-		logical_drive[4] = drive_letter[0];
-	} else {
-		return 3;	// ドライブ文字でないならだめ
-	}
-
-/*
-	// GetDriveType 用に "\\\\.\\C:\" のフォーマットにする
-	logical_drive[0] = '\\';
-	logical_drive[1] = '\\';
-	logical_drive[2] = '.';
-	logical_drive[3] = '\\';
-	logical_drive[5] = ':';
-	logical_drive[6] = '\\';
-	logical_drive[7] = 0;
-	return_value = GetDriveType(logical_drive);
-	//printf("GetDriveType = %d\n", return_value);
-	if (return_value == 6)	// DRIVE_RAMDISK
-		return 0;	// RAM disk は SSD と同じ扱いにする
-	if (return_value != 3)	// DRIVE_FIXED 以外は駄目
-		return 1;
-*/
-
-	// "\\\\.\\C:" のフォーマットにする
-	logical_drive[0] = '\\';
-	logical_drive[1] = '\\';
-	logical_drive[2] = '.';
-	logical_drive[3] = '\\';
-	logical_drive[5] = ':';
-	logical_drive[6] = 0;
-
 	// We do not need write permission.
-	hDevice = CreateFile(logical_drive, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+	hDevice = CreateFile(device_path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
 			NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
 	if (hDevice == INVALID_HANDLE_VALUE)
 		return 4;
@@ -2247,7 +2382,7 @@ int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
 				query_adapter_desc.Size,
 				query_adapter_desc.BusType);*/
 		if (query_adapter_desc.BusType == 17)	// BusType 17 = NVMe
-			memory_use |= 32;
+			*device_type |= 32;
 	}
 
 	// SSD なら seek penalty よりも TRIM コマンドを調べたほうが確実らしい
@@ -2265,7 +2400,7 @@ int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
 				query_trim_desc.Size,
 				query_trim_desc.TrimEnabled);*/
 		if (query_trim_desc.TrimEnabled != 0){	// TRIM command available = maybe SSD drive
-			memory_use |= 16;
+			*device_type |= 16;
 			CloseHandle(hDevice);
 			return 0;
 		}
@@ -2285,7 +2420,7 @@ int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
 				query_seek_penalty_desc.Size,
 				query_seek_penalty_desc.IncursSeekPenalty);*/
 		if (query_seek_penalty_desc.IncursSeekPenalty == 0){	// no seek penalty = maybe SSD drive
-			memory_use |= 16;
+			*device_type |= 16;
 			CloseHandle(hDevice);
 			return 0;
 		}
@@ -2295,6 +2430,85 @@ int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
 	return 1;
 }
 
+// Returns 0 if |physical_drive_path| has no seek penalty.
+// Returns 1 otherwise.
+// Returns 2~ if fails to retrieve the status.
+int check_seek_penalty(wchar_t *dir_path){	// ディレクトリを指定する
+	wchar_t *drive_letter, logical_drive[8];
+	int rv, device_type;
+
+//	if (IsWindows8OrGreater()){	// Windows 8 以降なら
+//		printf("\n calling check_msft()\n");
+//		return_value = check_msft();
+//		printf("\ncheck_msft = %d\n\n", return_value);
+//	}
+
+	// ドライブ文字を取得する
+	drive_letter = dir_path;
+	if (wcsncmp(drive_letter, L"\\\\?\\", PREFIX_LEN) == 0)
+		drive_letter += PREFIX_LEN;
+	if (drive_letter[1] != ':')
+		return 2;	// 「C:\～」のような形式にだけ対応する
+	if ((drive_letter[0] >= 0x41) && (drive_letter[0] <= 0x5A)){	// 大文字の A～Z なら
+		logical_drive[4] = drive_letter[0];
+	} else if ((drive_letter[0] >= 0x61) && (drive_letter[0] <= 0x7A)){	// 小文字の a～z なら
+		logical_drive[4] = drive_letter[0];
+	} else {
+		return 3;	// ドライブ文字でないならだめ
+	}
+
+/*
+	// GetDriveType 用に "\\\\.\\C:\" のフォーマットにする
+	logical_drive[0] = '\\';
+	logical_drive[1] = '\\';
+	logical_drive[2] = '.';
+	logical_drive[3] = '\\';
+	logical_drive[5] = ':';
+	logical_drive[6] = '\\';
+	logical_drive[7] = 0;
+	return_value = GetDriveType(logical_drive);
+	//printf("GetDriveType = %d\n", return_value);
+	if (return_value == 6)	// DRIVE_RAMDISK
+		return 0;	// RAM disk は SSD と同じ扱いにする
+	if (return_value != 3)	// DRIVE_FIXED 以外は駄目
+		return 1;
+*/
+
+	// "\\\\.\\C:" のフォーマットにする
+	logical_drive[0] = '\\';
+	logical_drive[1] = '\\';
+	logical_drive[2] = '.';
+	logical_drive[3] = '\\';
+	logical_drive[5] = ':';
+	logical_drive[6] = 0;
+
+	device_type = 0;
+	rv = query_device_type(logical_drive, &device_type);
+	memory_use |= device_type;
+	return rv;
+}
+
+// ボリューム単位で記録装置の特性を調べる
+// Returns 0 for HDD, +16 for SSD, +32 for NVMe.
+// Returns -1 if fails to retrieve the status.
+int check_volume_type(wchar_t *volume_path)	// 末尾に「\」が付いたボリュームのパス
+{
+	wchar_t volume_name[MAX_PATH];
+	int len, device_type;
+
+	// マウント・ポイントでも調べられるように「\\?\Volume{GUID}\」の形式にする
+	if (GetVolumeNameForVolumeMountPoint(volume_path, volume_name, MAX_PATH) == 0)
+		return -1;
+	len = (int)wcslen(volume_name);
+	if ((len > 0) && (volume_name[len - 1] == '\\'))
+		volume_name[len - 1] = 0;	// 装置として開く時は末尾の「\」を取り除く
+
+	device_type = 0;
+	if (query_device_type(volume_name, &device_type) >= 2)
+		return -1;
+	return device_type;
+}
+
 // Returns 0 if sparse file is supported.
 // Returns 1 if sparse file isn't supported.
 // Returns 2~ if fails to retrieve the status.
@@ -2348,6 +2562,63 @@ int check_sparse_support(wchar_t *dir_path)
 	return 1;
 }
 
+// 作業ファイルを読み書きして、ドライブの連続転送速度 (MB/s) を測る
+// Returns 0 if fails to measure.
+unsigned int measure_disk_speed(wchar_t *file_path)	// 作業ファイルを置く場所のファイル・パス
+{
+	wchar_t temp_path[MAX_LEN];
+	unsigned char *buf;
+	unsigned int rv, io_size, io_count, i, time_start, time_sec;
+	HANDLE hFile;
+
+	io_size = 4194304;	// 4 MB 単位で読み書きする
+	buf = VirtualAlloc(NULL, io_size, MEM_COMMIT, PAGE_READWRITE);	// セクター境界に揃える
+	if (buf == NULL)
+		return 0;
+	memset(buf, 0x55, io_size);
+
+	// キャッシュを通さずに読み書きする (閉じると削除される)
+	get_temp_name(file_path, temp_path);
+	hFile = CreateFile(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+	if (hFile == INVALID_HANDLE_VALUE){
+		VirtualFree(buf, 0, MEM_RELEASE);
+		return 0;
+	}
+
+	// 短すぎると計測できないので 200ms 以上は書き込んで、それを読み戻す
+	io_count = 0;
+	time_start = GetTickCount();
+	do {
+		if ((!WriteFile(hFile, buf, io_size, &rv, NULL)) || (rv != io_size)){
+			io_count = 0;
+			break;
+		}
+		io_count++;
+		time_sec = GetTickCount() - time_start;
+	} while ((time_sec < 200) && (io_count < 64));	// 最大で 256 MB
+	rv = 0;
+	if ((io_count > 0) && (SetFilePointer(hFile, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER)){
+		for (i = 0; i < io_count; i++){
+			if ((!ReadFile(hFile, buf, io_size, &rv, NULL)) || (rv != io_size))
+				break;
+		}
+		rv = 0;
+		if (i == io_count){
+			time_sec = GetTickCount() - time_start;
+			if (time_sec == 0)
+				time_sec = 1;
+			rv = (io_count * 4 * 2 * 1000) / time_sec;	// 読み書きした量を時間で割る
+			if (rv == 0)
+				rv = 1;
+		}
+	}
+
+	CloseHandle(hFile);
+	VirtualFree(buf, 0, MEM_RELEASE);
+	return rv;
+}
+
 // SE_MANAGE_VOLUME_NAME 権限を有効にする
 // Returns 0 when enabled.
 // Returns 1~ if failed.
@@ -2381,6 +2652,103 @@ int enable_volume_privilege(void)
 	return rv;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// サーバー動作時は、計算用のサブ・スレッドを終了させずに次のコマンドで使い回す
+
+#define MAX_KEEP_THREAD	(MAX_CPU + 1)	// GPU スレッドの分も含める
+
+typedef struct {
+	HANDLE h;		// 待機してるスレッド
+	HANDLE run;		// 仕事を渡した合図 (自動リセット)
+	HANDLE done;	// 仕事が終わった合図 (手動リセット、待機中はセットされてる)
+	LPTHREAD_START_ROUTINE func;	// NULL なら終了する
+	LPVOID param;
+} KEEP_THREAD;
+
+int keep_thread = 0;	// 0 以外ならサブ・スレッドを使い回す
+static KEEP_THREAD keep_th[MAX_KEEP_THREAD];
+static int keep_num = 0;
+
+static DWORD WINAPI thread_keep(LPVOID lpParameter)
+{
+	KEEP_THREAD *kt = (KEEP_THREAD *)lpParameter;
+
+	for (;;){
+		WaitForSingleObject(kt->run, INFINITE);	// 仕事を待つ
+		if (kt->func == NULL)
+			break;
+		kt->func(kt->param);
+		SetEvent(kt->done);	// 仕事が終わったことを通知する
+	}
+
+	return 0;
+}
+
+// サブ・スレッドを起動する (メイン・スレッドからだけ呼ぶこと)
+// 戻り値は終了を待つためのハンドル、待った後に CloseHandle すること
+HANDLE begin_sub_thread(LPTHREAD_START_ROUTINE func, LPVOID param)
+{
+	int i;
+	HANDLE hWait;
+	KEEP_THREAD *kt;
+
+	if (keep_thread == 0)
+		return (HANDLE)_beginthreadex(NULL, STACK_SIZE, (_beginthreadex_proc_type)func, param, 0, NULL);
+
+	// 待機中のスレッドを探す
+	kt = NULL;
+	for (i = 0; i < keep_num; i++){
+		if (WaitForSingleObject(keep_th[i].done, 0) == WAIT_OBJECT_0){
+			kt = keep_th + i;
+			break;
+		}
+	}
+	if ((kt == NULL) && (keep_num < MAX_KEEP_THREAD)){	// 足りなければ新しく起動する
+		kt = keep_th + keep_num;
+		kt->run = CreateEvent(NULL, FALSE, FALSE, NULL);
+		kt->done = CreateEvent(NULL, TRUE, TRUE, NULL);
+		kt->h = NULL;
+		if ((kt->run != NULL) && (kt->done != NULL))
+			kt->h = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_keep, (LPVOID)kt, 0, NULL);
+		if (kt->h == NULL){
+			if (kt->run != NULL)
+				CloseHandle(kt->run);
+			if (kt->done != NULL)
+				CloseHandle(kt->done);
+			kt = NULL;
+		} else {
+			keep_num++;
+		}
+	}
+	// 使い回せない場合や、終了待ち用のハンドルを作れない場合は、普通に起動する
+	if ((kt == NULL) || (!DuplicateHandle(GetCurrentProcess(), kt->done,
+			GetCurrentProcess(), &hWait, 0, FALSE, DUPLICATE_SAME_ACCESS)))
+		return (HANDLE)_beginthreadex(NULL, STACK_SIZE, (_beginthreadex_proc_type)func, param, 0, NULL);
+
+	ResetEvent(kt->done);
+	kt->func = func;
+	kt->param = param;
+	SetEvent(kt->run);	// 仕事を開始させる
+	return hWait;
+}
+
+// 使い回してたサブ・スレッドを全て終了させる
+void free_sub_thread(void)
+{
+	int i;
+
+	for (i = 0; i < keep_num; i++){
+		WaitForSingleObject(keep_th[i].done, INFINITE);
+		keep_th[i].func = NULL;
+		SetEvent(keep_th[i].run);
+		WaitForSingleObject(keep_th[i].h, INFINITE);
+		CloseHandle(keep_th[i].h);
+		CloseHandle(keep_th[i].run);
+		CloseHandle(keep_th[i].done);
+	}
+	keep_num = 0;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #define MAX_NAME_LEN	69	// 経過表示のタイトルの最大文字数 (末尾の null 文字を含む)
@@ -2388,6 +2756,34 @@ int enable_volume_privilege(void)
 int prog_last;	// 前回と同じ進捗状況は出力しないので記録しておく
 int count_last;
 
+HANDLE key_pipe = NULL;	// サーバー動作時は、キー入力の代わりにパイプから読み込む
+
+// キー入力があるか調べる
+static int key_hit(void)
+{
+	unsigned int num;
+
+	if (key_pipe == NULL)
+		return _kbhit();
+	// クライアントが切断した場合もキャンセルさせるため、入力があることにする
+	if (!PeekNamedPipe(key_pipe, NULL, 0, NULL, &num, NULL))
+		return 1;
+	return (num > 0);
+}
+
+// 入力された文字を読み込む (入力が無ければ待つ)
+static int key_get(void)
+{
+	unsigned int num;
+	char ch;
+
+	if (key_pipe == NULL)
+		return _getch();
+	if ((!ReadFile(key_pipe, &ch, 1, &num, NULL)) || (num == 0))
+		return 'c';	// 読み込めなければキャンセルする
+	return ch;
+}
+
 // ファイル・パスを短縮されたファイル名だけにしてコピーする
 // ASCII 文字は 1文字, それ以外は 2文字として数えることに注意！
 static void copy_filename(wchar_t *out, wchar_t *in)
@@ -2456,8 +2852,8 @@ int print_progress(int prog_now)	// 表示する % 値
 	if (prog_now < 0)	// 範囲外なら
 		return 0;
 
-	if (_kbhit()){	// キー入力があるか
-		int ch = _getch();
+	if (key_hit()){	// キー入力があるか
+		int ch = key_get();
 		if ((ch == 'c') || (ch == 'C')){	// Cancel
 			printf("\nCancel\n");
 			return 2;
@@ -2467,7 +2863,7 @@ int print_progress(int prog_now)	// 表示する % 値
 		if ((ch == 'p') || (ch == 'P')){	// Pause
 			printf(" Pause\r");	// パーセントを上書きする
 			do {
-				ch = _getch();	// 再度入力があるまで待つ、CPU 占有率 0%
+				ch = key_get();	// 再度入力があるまで待つ、CPU 占有率 0%
 				if ((ch == 'c') || (ch == 'C')){	// 停止中でもキャンセルは受け付ける
 					printf("\nCancel\n");
 					return 2;
@@ -2511,8 +2907,8 @@ int print_progress_file(int prog_now, int count_now, wchar_t *file_name)
 	if (prog_now < 0)	// 範囲外なら
 		return 0;
 
-	if (_kbhit()){	// キー入力があるか
-		int ch = _getch();
+	if (key_hit()){	// キー入力があるか
+		int ch = key_get();
 		if ((ch == 'c') || (ch == 'C')){	// Cancel
 			if (prog_last >= 0)
 				printf("\n");
@@ -2524,7 +2920,7 @@ int print_progress_file(int prog_now, int count_now, wchar_t *file_name)
 		if ((ch == 'p') || (ch == 'P')){	// Pause
 			printf(" Pause\r");	// パーセントを上書きする
 			do {
-				ch = _getch();	// 再度入力があるまで待つ、CPU 占有率 0%
+				ch = key_get();	// 再度入力があるまで待つ、CPU 占有率 0%
 				if ((ch == 'c') || (ch == 'C')){	// 停止中でもキャンセルは受け付ける
 					printf("\nCancel\n");
 					return 2;
@@ -2569,8 +2965,8 @@ void print_progress_done(void)	// 終了と改行を表示する
 // キャンセルと一時停止を行う
 int cancel_progress(void)
 {
-	if (_kbhit()){	// キー入力があるか
-		int ch = _getch();
+	if (key_hit()){	// キー入力があるか
+		int ch = key_get();
 		if ((ch == 'c') || (ch == 'C')){	// Cancel
 			printf("Cancel\n");
 			return 2;
@@ -2580,7 +2976,7 @@ int cancel_progress(void)
 		if ((ch == 'p') || (ch == 'P')){	// Pause
 			printf(" Pause\r");
 			do {
-				ch = _getch();	// 再度入力があるまで待つ、CPU 占有率 0%
+				ch = key_get();	// 再度入力があるまで待つ、CPU 占有率 0%
 				if ((ch == 'c') || (ch == 'C')){	// 停止中でもキャンセルは受け付ける
 					printf("Cancel\n");
 					return 2;
@@ -2598,8 +2994,8 @@ int error_progress(int error_now, int error_last)
 	if (error_now != error_last)
 		printf("Error:%d\n", error_now);
 
-	if (_kbhit()){	// キー入力があるか
-		int ch = _getch();
+	if (key_hit()){	// キー入力があるか
+		int ch = key_get();
 		if ((ch == 'c') || (ch == 'C')){	// Cancel
 			printf("Cancel\n");
 			return 2;
@@ -2609,7 +3005,7 @@ int error_progress(int error_now, int error_last)
 		if ((ch == 'p') || (ch == 'P')){	// Pause
 			printf(" Pause\r");
 			do {
-				ch = _getch();	// 再度入力があるまで待つ、CPU 占有率 0%
+				ch = key_get();	// 再度入力があるまで待つ、CPU 占有率 0%
 				if ((ch == 'c') || (ch == 'C')){	// 停止中でもキャンセルは受け付ける
 					printf("Cancel\n");
 					return 2;
@@ -35,6 +35,8 @@ extern wchar_t ini_path[MAX_LEN];		// 検査結果ファイルのパス
 extern int base_len;		// ソース・ファイルの基準ディレクトリの長さ
 extern int recovery_limit;	// 作成時はリカバリ・ファイルのサイズ制限
 extern int first_num;		// 作成時は最初のパリティ・ブロック番号、検査時は初めて見つけた数
+extern int subset_num;		// 作成時に分けた recovery set の番号 (1～)
+extern int subset_count;	// 作成時に分けた recovery set の数 (0 = 分けない)
 
 extern int file_num;		// ソース・ファイルの数
 extern int entity_num;		// 実体のあるファイルの数 (recovery set に含まれるファイル数)
@@ -240,6 +242,9 @@ int search_file_path(
 	int total_len,			// ファイル・リストの文字数
 	wchar_t *search_file);	// 検索するファイルのパス
 
+// リストの内容を書き換えたり解放する前に、対応するハッシュ表を無効にする
+void discard_index(wchar_t *list);
+
 // ファイル・リストの内容を並び替える
 void sort_list(
 	wchar_t *list,	// ファイル・リスト
@@ -360,6 +365,7 @@ int sqrt32(int num);
 extern int cpu_num;
 extern unsigned int cpu_flag, cpu_cache;
 extern unsigned int memory_use;	// メモリー使用量 0=auto, 1～7 -> 1/8 ～ 7/8
+extern int disk_rate;	// ドライブの連続転送速度 (MB/s) 0=未計測, -1=計測できない
 
 void check_cpu(void);
 int check_OS64(void);
@@ -369,11 +375,18 @@ size_t get_mem_size(size_t trial_alloc);
 
 // 記録装置の特性を調べる
 int check_seek_penalty(wchar_t *dir_path);
+int check_volume_type(wchar_t *volume_path);
 int check_sparse_support(wchar_t *dir_path);
+unsigned int measure_disk_speed(wchar_t *file_path);
 
 // SE_MANAGE_VOLUME_NAME 権限を有効にする
 int enable_volume_privilege(void);
 
+// 計算用のサブ・スレッドを起動する (keep_thread が 0 以外なら使い回す)
+extern int keep_thread;
+HANDLE begin_sub_thread(LPTHREAD_START_ROUTINE func, LPVOID param);
+void free_sub_thread(void);
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 extern int prog_last;	// 前回と同じ進捗状況は出力しないので記録しておく
@@ -388,6 +401,9 @@ void print_progress_done(void);
 // キャンセルと一時停止を行う
 int cancel_progress(void);
 
+// 設定するとキー入力の代わりにパイプから読み込む
+extern HANDLE key_pipe;
+
 // エラー発生時にキャンセルできるようにする
 int error_progress(int error_now, int error_last);
 
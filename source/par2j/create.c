@@ -106,6 +106,10 @@ void set_packet_header(
 	case 12:	// Unicode Comment packet
 		memcpy(buf + 56, "CommUni", 7);
 		break;
+	case 13:	// 複数に分けた recovery set の番号 (独自の拡張パケット)
+		memcpy(buf + 48, "MultiPar", 8);
+		memcpy(buf + 56, "SubSet", 6);
+		break;
 	}
 }
 
@@ -896,6 +900,16 @@ int set_footer_packet(
 		}
 	}
 
+	// Sub-Set packet (他の recovery set と一緒に作成したことを記録する)
+	if (subset_count > 0){
+		memcpy(buf + (off + 64), &subset_num, 4);
+		memcpy(buf + (off + 64 + 4), &subset_count, 4);
+		data_size = 8;
+		set_packet_header(buf + off, set_id, 13, data_size);	// パケット・ヘッダーを作成する
+		data_md5(buf + (off + 32), 32 + data_size, buf + (off + 16));	// パケットの MD5 を計算する
+		off += (64 + data_size);
+	}
+
 	// Creator packet
 	strcpy(ascii_buf, "par2j v" PRODUCT_VERSION);
 	len = (int)strlen(ascii_buf);
@@ -941,6 +955,10 @@ int measure_footer_packet(
 		}
 	}
 
+	// Sub-Set packet
+	if (subset_count > 0)
+		off += (64 + 8);
+
 	// Creator packet
 	//len = strlen("par2j v*.*.*\0");
 	//data_size = (len + 3) & 0xFFFFFFFC;
@@ -1046,53 +1064,45 @@ static int calc_max_num(
 // ランダムに書き込むには管理者権限が必要
 //#define RANDOM_ACCESS
 
-// リカバリ・ファイルを作成して共通パケットをコピーする
-int create_recovery_file(
-	wchar_t *recovery_path,		// 作業用
-	int packet_limit,			// リカバリ・ファイルのパケット繰り返しの制限
-	int block_distri,			// パリティ・ブロックの分配方法 (3-bit目は番号の付け方)
-	int packet_num,				// 共通パケットの数
-	unsigned char *common_buf,	// 共通パケットのバッファー
-	int common_size,			// 共通パケットのバッファー・サイズ
-	unsigned char *footer_buf,	// 末尾パケットのバッファー
-	int footer_size,			// 末尾パケットのバッファー・サイズ
-	HANDLE *rcv_hFile,			// 各リカバリ・ファイルのハンドル
-	parity_ctx_c *p_blk)		// 各パリティ・ブロックの情報
+#define MAX_WRITE_THREAD	4	// SSDで同時に書き込む最大ファイル数
+
+// リカバリ・ファイルの書き込み内容
+typedef struct {
+	wchar_t *recovery_base;		// リカバリ・ファイルの基本名 (拡張子を除く)
+	wchar_t *file_ext;			// リカバリ・ファイルの拡張子
+	int *block_start;			// 各リカバリ・ファイルの最初のパリティ・ブロック番号 (末尾に parity_num)
+	int block_start_max;		// ボリューム番号の桁数
+	int block_count_max;		// ブロック数の桁数
+	int block_distri;
+	int packet_limit;
+	int packet_num;
+	unsigned char *common_buf;
+	int common_size;
+	unsigned char *footer_buf;
+	int footer_size;
+	HANDLE *rcv_hFile;
+	parity_ctx_c *p_blk;		// 二回目に書き込む場合
+	unsigned char *p_buf;		// 一度に書き込む場合
+	unsigned char *g_buf;
+	unsigned char *packet_header;
+	unsigned int unit_size;
+	volatile LONG now;			// 次に処理するリカバリ・ファイルの番号 - 1
+	volatile LONG done;			// 書き込んだパリティ・ブロックの数
+	volatile LONG stop;			// 0 以外なら中断する
+	volatile LONG alloc_mode;	// 64 = SetFileValidData, 128 = Sparse File (失敗したら消す)
+} RECOVERY_TH;
+
+// 各リカバリ・ファイルに含めるパリティ・ブロックの範囲を決める
+static void calc_block_start(
+	int block_distri,	// パリティ・ブロックの分配方法
+	int *block_start)	// recovery_num + 1 個
 {
-	wchar_t recovery_base[MAX_LEN], file_ext[EXT_LEN], *tmp_p;
-	int i, j, num;
-	int exp_num, block_start, block_count, block_start_max, block_count_max;
-	int repeat_max, packet_to, packet_from, packet_size, common_off;
-	unsigned int time_last, prog_num = 0;
-	__int64 file_off;
+	int j, num, exp_num, block_count;
 
-#ifdef TIMER
-clock_t time_start = clock();
-#endif
-	print_progress_text(0, "Constructing recovery file");
-	time_last = GetTickCount();
-
-	// リカバリ・ファイルの拡張子には指定されたものを使う
-	file_ext[0] = 0;
-	wcscpy(recovery_base, recovery_file);
-	tmp_p = offset_file_name(recovery_base);
-	tmp_p = wcsrchr(tmp_p, '.');
-	if (tmp_p != NULL){
-		if (wcslen(tmp_p) < EXT_LEN){
-			wcscpy(file_ext, tmp_p);	// 拡張子を記録しておく
-			*tmp_p = 0;	// 拡張子を取り除く
-		}
-	}
-
-	// ボリューム番号の桁数を求める
-	block_start_max = calc_max_num(block_distri, &block_count_max);
-
-	// リカバリ・ファイルを作成して共通パケットを書き込む
-	block_start = 0;
+	block_start[0] = 0;
 	block_count = 0;
 	exp_num = 1;
 	for (num = 0; num < recovery_num; num++){
-		// リカバリ・ファイルのファイル名
 		switch (block_distri & 3){
 		case 0:	// 同じ数なら
 			block_count = parity_num / recovery_num;
@@ -1102,7 +1112,7 @@ clock_t time_start = clock();
 			break;
 		case 1:	// 倍々で異なる数にする
 			if (num == recovery_num - 1){	// 最後のファイルに余った分を入れる
-				block_count = parity_num - block_start;
+				block_count = parity_num - block_start[num];
 			} else {
 				exp_num = recovery_limit & 0xFFFF;
 				if (num >= 16){
@@ -1139,124 +1149,446 @@ clock_t time_start = clock();
 			}
 			break;
 		}
-		if (block_start + block_count > parity_num)
-			block_count = parity_num - block_start;
-		if (block_distri >> 2){
-			// ファイル番号にする、vol_1, vol_2, vol_3, ...
-			swprintf(recovery_path, MAX_LEN, L"%s.vol_%0*d%s", recovery_base, block_start_max, num + 1, file_ext);
-		} else {
-			// QuickPar方式、volXX+YY
-			swprintf(recovery_path, MAX_LEN, L"%s.vol%0*d+%0*d%s", recovery_base, block_start_max,
-				first_num + block_start, block_count_max, block_count, file_ext);
+		if (block_start[num] + block_count > parity_num)
+			block_count = parity_num - block_start[num];
+		block_start[num + 1] = block_start[num] + block_count;
+	}
+}
+
+// リカバリ・ファイルのファイル名
+static void get_recovery_name(
+	wchar_t *recovery_path,
+	RECOVERY_TH *th,
+	int num)
+{
+	int block_count;
+
+	block_count = th->block_start[num + 1] - th->block_start[num];
+	if (th->block_distri >> 2){
+		// ファイル番号にする、vol_1, vol_2, vol_3, ...
+		swprintf(recovery_path, MAX_LEN, L"%s.vol_%0*d%s", th->recovery_base, th->block_start_max, num + 1, th->file_ext);
+	} else {
+		// QuickPar方式、volXX+YY
+		swprintf(recovery_path, MAX_LEN, L"%s.vol%0*d+%0*d%s", th->recovery_base, th->block_start_max,
+			first_num + th->block_start[num], th->block_count_max, block_count, th->file_ext);
+	}
+}
+
+// パケットの繰り返し回数を計算して、リカバリ・ファイルの大きさを返す
+static __int64 calc_recovery_size(
+	RECOVERY_TH *th,
+	int block_count,
+	int *repeat_max)
+{
+	int j;
+	__int64 file_size;
+
+	*repeat_max = 1;
+	for (j = 2; j <= block_count; j *= 2)	// 繰り返し回数は log2(block_count)
+		(*repeat_max)++;
+	if ((th->packet_limit > 0) && (*repeat_max > th->packet_limit))
+		*repeat_max = th->packet_limit;	// 繰り返し回数を制限する
+	file_size = (__int64)(68 + block_size) * block_count;
+	file_size += (th->common_size * (*repeat_max)) + th->footer_size;
+	return file_size;
+}
+
+// 先に全体の領域を確保しておく
+// 複数のスレッドから呼ばれるので、設定は memory_use ではなく th->alloc_mode を使う
+static int alloc_recovery_file(
+	RECOVERY_TH *th,
+	HANDLE hFile,
+	__int64 file_size)
+{
+	int i;
+
+	if (th->alloc_mode & 128){	// Sparse File にする
+		if (!DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &i, NULL)){
+			printf("FSCTL_SET_SPARSE: ");
+			print_win32_err();
+			InterlockedAnd(&(th->alloc_mode), ~128);	// 失敗したら、それ以降は使わない
 		}
+	}
+	if (!SetFilePointerEx(hFile, *((PLARGE_INTEGER)&file_size), NULL, FILE_BEGIN)){
+		print_win32_err();
+		return 1;
+	}
+	if (!SetEndOfFile(hFile)){
+		print_win32_err();
+		return 1;
+	}
+	if (th->alloc_mode & 64){	// ファイル全体を有効にする
+		if (!SetFileValidData(hFile, file_size)){
+			printf("SetFileValidData: ");
+			print_win32_err();
+			InterlockedAnd(&(th->alloc_mode), ~64);	// 失敗したら、それ以降は使わない
+		}
+	}
+	return 0;
+}
+
+// 共通パケットを配置して、Recovery Slice packet の位置を記録する
+static DWORD WINAPI create_recovery_thread(LPVOID lpParameter)
+{
+	wchar_t recovery_path[MAX_LEN];
+	int i, j, num, err = 0;
+	int block_start, block_count, repeat_max, packet_to, packet_from, packet_size, common_off;
+	__int64 file_off;
+	HANDLE hFile;
+	RECOVERY_TH *th;
+
+	th = (RECOVERY_TH *)lpParameter;
+
+	while ((num = InterlockedIncrement(&(th->now))) < recovery_num){	// num = ++th_now
+		if (th->stop)
+			break;
+		block_start = th->block_start[num];
+		block_count = th->block_start[num + 1] - block_start;
+		get_recovery_name(recovery_path, th, num);
+
 		// リカバリ・ファイルを開く
 		//move_away_file(recovery_path);	// 既存のファイルをどかす
 		if (split_size == 1){	// 書庫ファイルに連結する場合は、後で読めるようにする
-			rcv_hFile[num] = CreateFile(recovery_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			hFile = CreateFile(recovery_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 		} else {	// 書庫ファイルに連結しないので、読み込む必要が無い
-			rcv_hFile[num] = CreateFile(recovery_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			hFile = CreateFile(recovery_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 		}
-		if (rcv_hFile[num] == INVALID_HANDLE_VALUE){
+		if (hFile == INVALID_HANDLE_VALUE){
 			print_win32_err();
-			rcv_hFile[num] = NULL;
 			printf_cp("cannot create file, %s\n", recovery_path);
-			return 1;
-		}
-
-		if (memory_use & 128){	// Sparse File にする
-			if (!DeviceIoControl(rcv_hFile[num], FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &i, NULL)){
-				printf("FSCTL_SET_SPARSE: ");
-				print_win32_err();
-				memory_use &= ~128;	// 失敗したら、それ以降は使わない
-			}
+			err = 1;
+			break;
 		}
+		th->rcv_hFile[num] = hFile;
 
-		// パケットの繰り返し回数を計算する
-		repeat_max = 1;
-		for (j = 2; j <= block_count; j *= 2)	// 繰り返し回数は log2(block_count)
-			repeat_max++;
-		if ((packet_limit > 0) && (repeat_max > packet_limit))
-			repeat_max = packet_limit;	// 繰り返し回数を制限する
-		// リカバリ・ファイルの大きさを計算する
-		file_off = (__int64)(68 + block_size) * block_count;
-		file_off += (common_size * repeat_max) + footer_size;
-		// そのサイズにする
-		if (!SetFilePointerEx(rcv_hFile[num], *((PLARGE_INTEGER)&file_off), NULL, FILE_BEGIN)){
-			print_win32_err();
-			return 1;
-		}
-		if (!SetEndOfFile(rcv_hFile[num])){
-			print_win32_err();
-			return 1;
-		}
-		if (memory_use & 64){	// ファイル全体を有効にする
-			if (!SetFileValidData(rcv_hFile[num], file_off)){
-				printf("SetFileValidData: ");
-				print_win32_err();
-				memory_use &= ~64;	// 失敗したら、それ以降は使わない
-			}
+		// リカバリ・ファイルの大きさにする
+		file_off = calc_recovery_size(th, block_count, &repeat_max);
+		if (alloc_recovery_file(th, hFile, file_off)){
+			err = 1;
+			break;
 		}
 
 		file_off = 0;
-		repeat_max *= packet_num;	// リカバリ・ファイルの共通パケットの数
+		repeat_max *= th->packet_num;	// リカバリ・ファイルの共通パケットの数
 		packet_from = 0;
 		common_off = 0;
 
 		// Recovery Slice packet は後から書き込む
 		for (j = block_start; j < block_start + block_count; j++){
-			prog_num++;
-			// 経過表示
-			if (GetTickCount() - time_last >= UPDATE_TIME){
-				if (print_progress((prog_num * 1000) / parity_num))
-					return 2;
-				time_last = GetTickCount();
-			}
-
-			if (memory_use & 128){	// packet 部分を書き込まずに済ます
+			if (th->alloc_mode & 128){	// packet 部分を書き込まずに済ます
 				FILE_ZERO_DATA_INFORMATION zdi;
 				zdi.FileOffset.QuadPart = file_off;
 				zdi.BeyondFinalZero.QuadPart = file_off + 68 + block_size;
-				if (!DeviceIoControl(rcv_hFile[num], FSCTL_SET_ZERO_DATA, &zdi, sizeof(zdi), NULL, 0, &i, NULL)){
+				if (!DeviceIoControl(hFile, FSCTL_SET_ZERO_DATA, &zdi, sizeof(zdi), NULL, 0, &i, NULL)){
 					printf("FSCTL_SET_ZERO_DATA: ");
 					print_win32_err();
-					memory_use &= ~128;	// 失敗したら、それ以降は使わない
+					InterlockedAnd(&(th->alloc_mode), ~128);	// 失敗したら、それ以降は使わない
 				}
 			}
 
 			// Recovery Slice packet
 			file_off += 68;
-			p_blk[j].file = num;
-			p_blk[j].off = file_off;	// 開始位置だけ記録しておく
+			th->p_blk[j].file = num;
+			th->p_blk[j].off = file_off;	// 開始位置だけ記録しておく
 			file_off += block_size;
 
 			// どれだけの共通パケットを書き込むか
 			packet_size = 0;
 			packet_to = (int)((__int64)repeat_max * (j - block_start + 1) / block_count);
 			while (packet_to - packet_from > 0){
-				memcpy(&i, common_buf + (common_off + (packet_size + 8)), 4);	// そのパケットのデータ・サイズを調べる
+				memcpy(&i, th->common_buf + (common_off + (packet_size + 8)), 4);	// そのパケットのデータ・サイズを調べる
 				packet_size += i;
 				packet_from++;
 			}
 			if (packet_size > 0){	// 共通パケットを書き込む
-				if (file_write_data(rcv_hFile[num], file_off, common_buf + common_off, packet_size)){
+				if (file_write_data(hFile, file_off, th->common_buf + common_off, packet_size)){
 					printf_cp("file_write_data, %s\n", recovery_path);
-					return 1;
+					err = 1;
+					break;
 				}
 				// オフセットが半分を超えたら戻しておく
 				common_off += packet_size;
-				if (common_off >= common_size)
-					common_off -= common_size;
+				if (common_off >= th->common_size)
+					common_off -= th->common_size;
 				file_off += packet_size;
 			}
+			InterlockedIncrement(&(th->done));
+			if (th->stop)
+				break;
 		}
-		block_start += block_count;
+		if (err)
+			break;
 
 		// 末尾パケットを書き込む
-		if (file_write_data(rcv_hFile[num], file_off, footer_buf, footer_size)){
+		if (file_write_data(hFile, file_off, th->footer_buf, th->footer_size)){
 			printf_cp("file_write_data, %s\n", recovery_path);
-			return 1;
+			err = 1;
+			break;
+		}
+	}
+	if (err)
+		InterlockedExchange(&(th->stop), 1);	// 他のスレッドも止める
+
+	return err;
+}
+
+// 計算済みのパリティ・ブロックと共通パケットを順に書き込む
+static DWORD WINAPI write_recovery_thread(LPVOID lpParameter)
+{
+	unsigned char *p_buf, header[68], hash[HASH_SIZE];
+	wchar_t recovery_path[MAX_LEN];
+	int j, num, err = 0;
+	int block_start, block_count, repeat_max, packet_to, packet_from, packet_size, common_off;
+	unsigned int rv;
+	__int64 file_size;
+	HANDLE hFile;
+	PHMD5 ctx;
+	RECOVERY_TH *th;
+
+	th = (RECOVERY_TH *)lpParameter;
+	memcpy(header, th->packet_header, 64);	// パケット・ヘッダーをコピーしておく
+
+	while ((num = InterlockedIncrement(&(th->now))) < recovery_num){	// num = ++th_now
+		if (th->stop)
+			break;
+		block_start = th->block_start[num];
+		block_count = th->block_start[num + 1] - block_start;
+		get_recovery_name(recovery_path, th, num);
+
+		// リカバリ・ファイルを開く
+		//move_away_file(recovery_path);	// 既存のファイルをどかす
+		if (th->rcv_hFile != NULL){	// 書庫ファイルに連結する場合は、後で読めるようにする
+			hFile = CreateFile(recovery_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		} else {	// 書庫ファイルに連結しないので、読み込む必要が無い
+			hFile = CreateFile(recovery_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		}
+		if (hFile == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			printf_cp("cannot create file, %s\n", recovery_path);
+			err = 1;
+			break;
+		}
+		if (th->rcv_hFile != NULL)
+			th->rcv_hFile[num] = hFile;	// ファイル・ハンドルを記録する
+
+		// 同時に書き込むファイルが断片化しないように、先に大きさを決めておく
+		file_size = calc_recovery_size(th, block_count, &repeat_max);
+		if (alloc_recovery_file(th, hFile, file_size)){
+			err = 1;
+		} else {
+			file_size = 0;
+			if (!SetFilePointerEx(hFile, *((PLARGE_INTEGER)&file_size), NULL, FILE_BEGIN)){
+				print_win32_err();
+				err = 1;
+			}
+		}
+
+		repeat_max *= th->packet_num;	// リカバリ・ファイルの共通パケットの数
+		packet_from = 0;
+		common_off = 0;
+
+		for (j = block_start; (err == 0) && (j < block_start + block_count); j++){
+			p_buf = th->p_buf + (size_t)(th->unit_size) * j;
+			if (th->g_buf != NULL){	// GPUを使った場合
+				// CPUスレッドと GPUスレッドの計算結果を合わせる
+				galois_align_xor(th->g_buf + (size_t)(th->unit_size) * j, p_buf, th->unit_size);
+			}
+			// パリティ・ブロックのチェックサムを検証する
+			checksum16_return(p_buf, hash, th->unit_size - HASH_SIZE);
+			if (memcmp(p_buf + th->unit_size - HASH_SIZE, hash, HASH_SIZE) != 0){
+				printf("checksum mismatch, recovery slice %d\n", first_num + j);
+				err = 1;
+				break;
+			}
+
+			// Recovery Slice packet
+			rv = first_num + j;	// 最初のパリティ・ブロック番号の分だけ足す
+			memcpy(header + 64, &rv, 4);	// Recovery Slice の番号を書き込む
+			Phmd5Begin(&ctx);	// パケットの MD5 を計算する
+			Phmd5Process(&ctx, header + 32, 36);
+			Phmd5Process(&ctx, p_buf, block_size);
+			Phmd5End(&ctx);
+			memcpy(header + 16, ctx.hash, 16);
+			if ((!WriteFile(hFile, header, 68, &rv, NULL)) || (!WriteFile(hFile, p_buf, block_size, &rv, NULL))){
+				print_win32_err();
+				printf("file_write_data, recovery slice %d\n", first_num + j);
+				err = 1;
+				break;
+			}
+			InterlockedIncrement(&(th->done));
+
+			// どれだけの共通パケットを書き込むか
+			packet_size = 0;
+			packet_to = (int)((__int64)repeat_max * (j - block_start + 1) / block_count);
+			while (packet_to - packet_from > 0){
+				memcpy(&rv, th->common_buf + (common_off + (packet_size + 8)), 4);	// そのパケットのデータ・サイズを調べる
+				packet_size += rv;
+				packet_from++;
+			}
+			if (packet_size > 0){	// 共通パケットを書き込む
+				if (!WriteFile(hFile, th->common_buf + common_off, packet_size, &rv, NULL)){
+					print_win32_err();
+					err = 1;
+					break;
+				}
+				// オフセットが半分を超えたら戻しておく
+				common_off += packet_size;
+				if (common_off >= th->common_size)
+					common_off -= th->common_size;
+			}
+			if (th->stop)
+				break;
+		}
+
+		// 末尾パケットを書き込む
+		if ((err == 0) && (th->stop == 0)){
+			if (!WriteFile(hFile, th->footer_buf, th->footer_size, &rv, NULL)){
+				print_win32_err();
+				err = 1;
+			}
+		}
+		if (th->rcv_hFile == NULL){	// 後でファイル・ハンドルが必要なければ
+			//FlushFileBuffers(hFile);	// 書き込みが完了するのを待つ？
+			// 今まで問題視されなかった訳だし、特に気にしなくていいかも・・・
+			CloseHandle(hFile);	// ファイルを閉じる
+		}
+		if (err)
+			break;
+	}
+	if (err)
+		InterlockedExchange(&(th->stop), 1);	// 他のスレッドも止める
+
+	return err;
+}
+
+// リカバリ・ファイルごとにスレッドを割り当てて書き込む
+static int run_recovery_thread(
+	RECOVERY_TH *th,
+	LPTHREAD_START_ROUTINE thread_func,
+	__int64 prog_num,	// 経過表示の開始値
+	__int64 prog_base,	// 経過表示の合計値
+	int prog_write)		// 一ブロックあたりの進捗
+{
+	int j, th_num, err = 0;
+	unsigned int rv;
+	HANDLE hSub[MAX_WRITE_THREAD];
+
+	// SSD なら複数のファイルを同時に書き込む、HDD ならシークを減らすため一個ずつ
+	th_num = 1;
+	if (memory_use & 16){
+		th_num = cpu_num;
+		if (th_num > MAX_WRITE_THREAD)
+			th_num = MAX_WRITE_THREAD;
+		if (th_num > recovery_num)
+			th_num = recovery_num;
+	}
+#ifdef TIMER
+	printf("recovery_num = %d, write thread = %d\n", recovery_num, th_num);
+#endif
+
+	memset(hSub, 0, sizeof(HANDLE) * MAX_WRITE_THREAD);
+	th->now = -1;	// 初期値 - 1
+	th->done = 0;
+	th->stop = 0;
+	th->alloc_mode = memory_use & (64 | 128);	// 書き込みを始める前に決めておく
+	for (j = 0; j < th_num; j++){
+		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE + MAX_LEN * 4, thread_func, (LPVOID)th, 0, NULL);
+		if (hSub[j] == NULL){
+			print_win32_err();
+			printf("error, sub-thread\n");
+			InterlockedExchange(&(th->stop), 1);
+			err = 1;
+			th_num = j;
+			break;
+		}
+	}
+
+	// 全てのサブ・スレッドが終了するまで待つ
+	while (th_num > 0){
+		rv = WaitForMultipleObjects(th_num, hSub, TRUE, UPDATE_TIME);
+		if (rv != WAIT_TIMEOUT)
+			break;
+		if ((err == 0) && (print_progress((int)(((prog_num + (__int64)(th->done) * prog_write) * 1000) / prog_base)))){
+			InterlockedExchange(&(th->stop), 1);	// 中断する
+			err = 2;
+		}
+	}
+	for (j = 0; j < th_num; j++){
+		WaitForSingleObject(hSub[j], INFINITE);
+		GetExitCodeThread(hSub[j], &rv);
+		if ((err == 0) && (rv != 0))
+			err = rv;
+		CloseHandle(hSub[j]);
+	}
+	// 失敗した設定は、全てのスレッドが終わってから反映させる
+	memory_use = (memory_use & ~(64 | 128)) | th->alloc_mode;
+
+	return err;
+}
+
+// リカバリ・ファイルを作成して共通パケットをコピーする
+int create_recovery_file(
+	wchar_t *recovery_path,		// 作業用
+	int packet_limit,			// リカバリ・ファイルのパケット繰り返しの制限
+	int block_distri,			// パリティ・ブロックの分配方法 (3-bit目は番号の付け方)
+	int packet_num,				// 共通パケットの数
+	unsigned char *common_buf,	// 共通パケットのバッファー
+	int common_size,			// 共通パケットのバッファー・サイズ
+	unsigned char *footer_buf,	// 末尾パケットのバッファー
+	int footer_size,			// 末尾パケットのバッファー・サイズ
+	HANDLE *rcv_hFile,			// 各リカバリ・ファイルのハンドル
+	parity_ctx_c *p_blk)		// 各パリティ・ブロックの情報
+{
+	wchar_t recovery_base[MAX_LEN], file_ext[EXT_LEN], *tmp_p;
+	int err, *block_start;
+	RECOVERY_TH th;
+
+#ifdef TIMER
+clock_t time_start = clock();
+#endif
+	print_progress_text(0, "Constructing recovery file");
+
+	// リカバリ・ファイルの拡張子には指定されたものを使う
+	file_ext[0] = 0;
+	wcscpy(recovery_base, recovery_file);
+	tmp_p = offset_file_name(recovery_base);
+	tmp_p = wcsrchr(tmp_p, '.');
+	if (tmp_p != NULL){
+		if (wcslen(tmp_p) < EXT_LEN){
+			wcscpy(file_ext, tmp_p);	// 拡張子を記録しておく
+			*tmp_p = 0;	// 拡張子を取り除く
 		}
 	}
+
+	// 各リカバリ・ファイルのパリティ・ブロックの範囲
+	block_start = (int *)malloc(sizeof(int) * (recovery_num + 1));
+	if (block_start == NULL){
+		printf("malloc, %zd\n", sizeof(int) * (recovery_num + 1));
+		return 1;
+	}
+	calc_block_start(block_distri, block_start);
+
+	memset(&th, 0, sizeof(RECOVERY_TH));
+	th.recovery_base = recovery_base;
+	th.file_ext = file_ext;
+	th.block_start = block_start;
+	// ボリューム番号の桁数を求める
+	th.block_start_max = calc_max_num(block_distri, &(th.block_count_max));
+	th.block_distri = block_distri;
+	th.packet_limit = packet_limit;
+	th.packet_num = packet_num;
+	th.common_buf = common_buf;
+	th.common_size = common_size;
+	th.footer_buf = footer_buf;
+	th.footer_size = footer_size;
+	th.rcv_hFile = rcv_hFile;
+	th.p_blk = p_blk;
+
+	// リカバリ・ファイルを作成して共通パケットを書き込む
+	err = run_recovery_thread(&th, create_recovery_thread, 0, parity_num, 1);
+	free(block_start);
+	if (err)
+		return err;
 	print_progress_done();	// 改行して行の先頭に戻しておく
 
 #ifdef TIMER
@@ -1268,7 +1600,7 @@ printf("write %.3f sec\n", (double)time_start / CLOCKS_PER_SEC);
 }
 
 // パリティ・ブロックが完成した後に、encode_method5 から直接呼び出す
-// リカバリ・ファイルを一個ずつ書き込んだ方が単純でいい！
+// リカバリ・ファイルごとに独立しているので、SSD なら同時に書き込む
 // 各リカバリ・ファイルのハンドル、各パリティ・ブロックの情報、は不要になるし
 int create_recovery_file_1pass(
 	wchar_t *recovery_base,
@@ -1285,14 +1617,13 @@ int create_recovery_file_1pass(
 	unsigned char *g_buf,		// GPU用 (GPUを使わない場合は NULLにすること)
 	unsigned int unit_size)
 {
-	unsigned char *packet_header, hash[HASH_SIZE];
+	unsigned char *packet_header;
 	wchar_t file_ext[EXT_LEN], *tmp_p;
-	int rv, j, num;
-	int exp_num, block_start, block_count, block_start_max, block_count_max;
-	int repeat_max, packet_to, packet_from, packet_size, common_off;
-	unsigned int time_last, prog_write;
+	int rv, err, *block_start;
+	unsigned int prog_write;
 	__int64 prog_num, prog_base;
 	HANDLE hFile;
+	RECOVERY_TH th;
 
 	// パリティ・ブロック計算に続いて経過表示する
 	prog_write = source_num >> 4;	// 計算で 94%、書き込みで 6% ぐらい
@@ -1300,7 +1631,6 @@ int create_recovery_file_1pass(
 		prog_write = 1;
 	prog_base = (__int64)(source_num + prog_write) * parity_num;	// ブロックの合計掛け算個数
 	prog_num = source_num  * parity_num;	// パリティ・ブロック計算が終了した直後から始める
-	time_last = GetTickCount();
 
 	if (recovery_path[MAX_LEN - 1] == 0){	// インデックス・ファイルを作るときだけ
 		// パリティ・ブロックを含まないリカバリ・ファイルを書き込む
@@ -1346,175 +1676,39 @@ int create_recovery_file_1pass(
 		}
 	}
 
-	// ボリューム番号の桁数を求める
-	block_start_max = calc_max_num(block_distri, &block_count_max);
-
-	// リカバリ・ファイルを作成して共通パケットを書き込む
-	block_start = 0;
-	block_count = 0;
-	exp_num = 1;
-	for (num = 0; num < recovery_num; num++){
-		// リカバリ・ファイルのファイル名
-		switch (block_distri & 3){
-		case 0:	// 同じ数なら
-			block_count = parity_num / recovery_num;
-			j = parity_num % recovery_num;	// 割り切れない場合は
-			if ((j > 0) && (num < j))
-				block_count++;
-			break;
-		case 1:	// 倍々で異なる数にする
-			if (num == recovery_num - 1){	// 最後のファイルに余った分を入れる
-				block_count = parity_num - block_start;
-			} else {
-				exp_num = recovery_limit & 0xFFFF;
-				if (num >= 16){
-					block_count = exp_num;
-				} else {
-					block_count = ((unsigned int)recovery_limit >> 16) << num;
-					if (block_count > exp_num)
-						block_count = exp_num;
-				}
-			}
-			break;
-		case 2:	// 1,2,4,8,16 と2の乗数なら
-			block_count = exp_num;
-			if (block_count >= recovery_limit){
-				block_count = recovery_limit;
-			} else {
-				exp_num *= 2;
-			}
-			break;
-		case 3:	// 1,1,2,5,10,10,20,50 という decimal weights sizing scheme なら
-			block_count = exp_num;
-			if (block_count >= recovery_limit){
-				block_count = recovery_limit;
-			} else {
-				switch (num % 4){
-				case 1:
-				case 3:
-					exp_num = exp_num * 2;
-					break;
-				case 2:
-					exp_num = (exp_num / 2) * 5;
-					break;
-				}
-			}
-			break;
-		}
-		if (block_start + block_count > parity_num)
-			block_count = parity_num - block_start;
-		if (block_distri >> 2){
-			// ファイル番号にする、vol_1, vol_2, vol_3, ...
-			swprintf(recovery_path, MAX_LEN, L"%s.vol_%0*d%s", recovery_base, block_start_max, num + 1, file_ext);
-		} else {
-			// QuickPar方式、volXX+YY
-			swprintf(recovery_path, MAX_LEN, L"%s.vol%0*d+%0*d%s", recovery_base, block_start_max,
-				first_num + block_start, block_count_max, block_count, file_ext);
-		}
-		// リカバリ・ファイルを開く
-		//move_away_file(recovery_path);	// 既存のファイルをどかす
-		if (rcv_hFile != NULL){	// 書庫ファイルに連結する場合は、後で読めるようにする
-			hFile = CreateFile(recovery_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		} else {	// 書庫ファイルに連結しないので、読み込む必要が無い
-			hFile = CreateFile(recovery_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		}
-		if (hFile == INVALID_HANDLE_VALUE){
-			print_win32_err();
-			printf_cp("cannot create file, %s\n", recovery_path);
-			return 1;
-		}
-		if (rcv_hFile != NULL)
-			rcv_hFile[num] = hFile;	// ファイル・ハンドルを記録する
-
-		// パケットの繰り返し回数を計算する
-		repeat_max = 1;
-		for (j = 2; j <= block_count; j *= 2)	// 繰り返し回数は log2(block_count)
-			repeat_max++;
-		if ((packet_limit > 0) && (repeat_max > packet_limit))
-			repeat_max = packet_limit;	// 繰り返し回数を制限する
-
-		repeat_max *= packet_num;	// リカバリ・ファイルの共通パケットの数
-		packet_from = 0;
-		common_off = 0;
-
-		// Recovery Slice packet は後から書き込む
-		for (j = block_start; j < block_start + block_count; j++){
-			if (g_buf != NULL){	// GPUを使った場合
-				// CPUスレッドと GPUスレッドの計算結果を合わせる
-				galois_align_xor(g_buf + (size_t)unit_size * j, p_buf, unit_size);
-			}
-			// パリティ・ブロックのチェックサムを検証する
-			checksum16_return(p_buf, hash, unit_size - HASH_SIZE);
-			if (memcmp(p_buf + unit_size - HASH_SIZE, hash, HASH_SIZE) != 0){
-				printf("checksum mismatch, recovery slice %d\n", first_num + j);
-				if (rcv_hFile == NULL)
-					CloseHandle(hFile);
-				return 1;
-			}
-
-			// Recovery Slice packet
-			memcpy(p_buf - 68, packet_header, 64);	// パケット・ヘッダーをコピーする
-			rv = first_num + j;	// 最初のパリティ・ブロック番号の分だけ足す
-			memcpy(p_buf - 4, &rv, 4);	// Recovery Slice の番号を書き込む
-			data_md5(p_buf - 36, 36 + block_size, p_buf - 52);	// パケットの MD5 を計算する
-			if (!WriteFile(hFile, p_buf - 68, 68 + block_size, &rv, NULL)){
-				print_win32_err();
-				printf("file_write_data, recovery slice %d\n", first_num + j);
-				if (rcv_hFile == NULL)
-					CloseHandle(hFile);
-				return 1;
-			}
-			p_buf += unit_size;
-
-			// 経過表示
-			prog_num += prog_write;
-			if (GetTickCount() - time_last >= UPDATE_TIME){
-				if (print_progress((int)((prog_num * 1000) / prog_base))){
-					if (rcv_hFile == NULL)
-						CloseHandle(hFile);
-					return 2;
-				}
-				time_last = GetTickCount();
-			}
-
-			// どれだけの共通パケットを書き込むか
-			packet_size = 0;
-			packet_to = (int)((__int64)repeat_max * (j - block_start + 1) / block_count);
-			while (packet_to - packet_from > 0){
-				memcpy(&rv, common_buf + (common_off + (packet_size + 8)), 4);	// そのパケットのデータ・サイズを調べる
-				packet_size += rv;
-				packet_from++;
-			}
-			if (packet_size > 0){	// 共通パケットを書き込む
-				if (!WriteFile(hFile, common_buf + common_off, packet_size, &rv, NULL)){
-					print_win32_err();
-					if (rcv_hFile == NULL)
-						CloseHandle(hFile);
-					return 1;
-				}
-				// オフセットが半分を超えたら戻しておく
-				common_off += packet_size;
-				if (common_off >= common_size)
-					common_off -= common_size;
-			}
-		}
-		block_start += block_count;
-
-		// 末尾パケットを書き込む
-		if (!WriteFile(hFile, footer_buf, footer_size, &rv, NULL)){
-			print_win32_err();
-			if (rcv_hFile == NULL)
-				CloseHandle(hFile);
-			return 1;
-		}
-		if (rcv_hFile == NULL){	// 後でファイル・ハンドルが必要なければ
-			//FlushFileBuffers(hFile);	// 書き込みが完了するのを待つ？
-			// 今まで問題視されなかった訳だし、特に気にしなくていいかも・・・
-			CloseHandle(hFile);	// ファイルを閉じる
-		}
+	// 各リカバリ・ファイルのパリティ・ブロックの範囲
+	block_start = (int *)malloc(sizeof(int) * (recovery_num + 1));
+	if (block_start == NULL){
+		printf("malloc, %zd\n", sizeof(int) * (recovery_num + 1));
+		return 1;
 	}
+	calc_block_start(block_distri, block_start);
+
+	memset(&th, 0, sizeof(RECOVERY_TH));
+	th.recovery_base = recovery_base;
+	th.file_ext = file_ext;
+	th.block_start = block_start;
+	// ボリューム番号の桁数を求める
+	th.block_start_max = calc_max_num(block_distri, &(th.block_count_max));
+	th.block_distri = block_distri;
+	th.packet_limit = packet_limit;
+	th.packet_num = packet_num;
+	th.common_buf = common_buf;
+	th.common_size = common_size;
+	th.footer_buf = footer_buf;
+	th.footer_size = footer_size;
+	th.rcv_hFile = rcv_hFile;
+	th.p_buf = p_buf;
+	th.g_buf = g_buf;
+	th.packet_header = packet_header;
+	th.unit_size = unit_size;
+
+	// リカバリ・ファイルを作成してパリティ・ブロックと共通パケットを書き込む
+	err = run_recovery_thread(&th, write_recovery_thread, prog_num, prog_base, prog_write);
+	free(block_start);
+	if (err)
+		return err;
 	print_progress_done();	// 改行して行の先頭に戻しておく
-	//printf("prog_num = %I64d / %I64d\n", prog_num, prog_base);
 
 	return 0;
 }
@@ -1674,6 +1868,8 @@ void measure_recovery_file(
 	footer_num = 1;
 	if (recovery_path[0] != 0)
 		footer_num++;
+	if (subset_count > 0)
+		footer_num++;
 
 	total_file_size = 0;	// リカバリ・ファイルの合計サイズを計算する
 	if (switch_p == 0){
@@ -105,12 +105,31 @@ void checksum16_return256(unsigned char *data, unsigned char *hash, int byte_siz
 // なぜかテーブルは 2バイト整数を使った方が速い
 static unsigned short *galois_log_table = NULL;
 static unsigned short *galois_exp_table;
+static unsigned int galois_table_flag;	// テーブルを作成した時の CPU 機能
+int galois_keep_table = 0;	// 0 以外ならテーブルを解放せずに次回も使う (サーバー用)
+
+static void free_table(unsigned int flag)
+{
+	_aligned_free(galois_log_table);
+	galois_log_table = NULL;
+#ifndef _WIN64	// 32-bit 版ならインライン・アセンブラを使う
+	if (((flag & 1) == 0) && ((flag & 128) == 0))	// SSSE3 を使わない場合、MMX の終了処理
+		_mm_empty();
+#endif
+	// SSSE3 を使わない場合で、JIT(SSE2) を使った場合の終了処理
+	if (((flag & 1) == 0) && ((flag & 128) != 0))
+		jit_free();
+}
 
 int galois_create_table(void)
 {
 	unsigned int j, b;
 
-	if (galois_log_table != NULL) return 0;
+	if (galois_log_table != NULL){
+		if (galois_table_flag == (cpu_flag & 0xFFFF)) return 0;
+		free_table(galois_table_flag);	// CPU 機能の制限が変わったら作り直す
+	}
+	galois_table_flag = cpu_flag & 0xFFFF;
 	galois_log_table = _aligned_malloc(sizeof(unsigned short) * NW * 2, 64);
 	if (galois_log_table == NULL) return -1;
 	galois_exp_table = galois_log_table + NW;	// 要素数は 65536個
@@ -234,15 +253,17 @@ unsigned short galois_reciprocal(int x)
 void galois_free_table(void) // テーブルを解放するために追加
 {
 	if (galois_log_table != NULL){
-		_aligned_free(galois_log_table);
-		galois_log_table = NULL;
-#ifndef _WIN64	// 32-bit 版ならインライン・アセンブラを使う
-		if (((cpu_flag & 1) == 0) && ((cpu_flag & 128) == 0))	// SSSE3 を使わない場合、MMX の終了処理
-			_mm_empty();
+		if (galois_keep_table){	// テーブルと JIT のコードは残しておく
+#ifndef _WIN64
+			if (((galois_table_flag & 1) == 0) && ((galois_table_flag & 128) == 0))
+				_mm_empty();
 #endif
-		// SSSE3 を使わない場合で、JIT(SSE2) を使った場合の終了処理
-		if (((cpu_flag & 1) == 0) && ((cpu_flag & 128) != 0))
-			jit_free();
+			// 次回はスレッドが変わるので、JIT の実行領域の割り当てを解除する
+			if (jit_code != NULL)
+				memset(jit_id, 0, sizeof(int) * MAX_CPU);
+			return;
+		}
+		free_table(galois_table_flag);
 	}
 }
 
@@ -18,6 +18,7 @@ unsigned short galois_divide(int x, int y);
 unsigned short galois_power(int x, int y);	// 乗数計算用に追加
 unsigned short galois_reciprocal(int x);	// 逆数計算用に追加
 void galois_free_table(void);	// 解放用に追加
+extern int galois_keep_table;	// 0 以外なら解放しないで次回も使う
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -675,6 +675,9 @@ int check_ini_file(unsigned char *set_id)
 	return match;
 }
 
+static void flush_file_usn(void);
+static void close_usn_volume(void);
+
 // 検査結果ファイルを閉じる
 void close_ini_file(void)
 {
@@ -682,6 +685,8 @@ void close_ini_file(void)
 		unsigned int new_crc, old_crc;
 		HANDLE hFile;
 
+		flush_file_usn();	// 保留中の変更番号を書き込む
+
 		// 閉じる前に検査結果の CRC-32 を計算して記録しておく
 		hFile = CreateFile(ini_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
 		if (hFile != INVALID_HANDLE_VALUE){
@@ -703,6 +708,7 @@ void close_ini_file(void)
 		CloseHandle(hIniBin);
 		hIniBin = NULL;
 	}
+	close_usn_volume();
 }
 
 void write_ini_file2(unsigned char *par_client, wchar_t *par_comment)
@@ -821,14 +827,18 @@ int read_ini_file(
 	// ファイル位置を HEADER_SIZE 直後にする
 	i = SetFilePointer(hIniBin, HEADER_SIZE, NULL, FILE_BEGIN);
 	if ((i == INVALID_SET_FILE_POINTER) && (GetLastError() != NO_ERROR)){
+		discard_index(list_buf);
 		free(list_buf);
+		list_buf = NULL;
 		delete_ini_file();
 		return 1;
 	}
 	for (j = 0; j < file_num; j++){
 		if (!ReadFile(hIniBin, buf, HEADER_EACH, &i, NULL) || (HEADER_EACH != i)){
 			print_win32_err();
+			discard_index(list_buf);
 			free(list_buf);
+			list_buf = NULL;
 			delete_ini_file();
 			return 1;
 		}
@@ -839,7 +849,9 @@ int read_ini_file(
 		memcpy(&len, buf + 40, 2);
 		if (!ReadFile(hIniBin, buf, len, &i, NULL) || (len != i)){
 			print_win32_err();
+			discard_index(list_buf);
 			free(list_buf);
+			list_buf = NULL;
 			delete_ini_file();
 			return 1;
 		}
@@ -882,6 +894,46 @@ int read_ini_file(
 	return 0;
 }
 
+// リカバリ・ファイルの検査記録を利用できるかだけを調べる (記録は変更しない)
+// 0=検査が必要, 1=記録を利用できる
+int peek_ini_recovery(HANDLE hFile)	// リカバリ・ファイルのハンドル
+{
+	unsigned char buf[16];
+	wchar_t item[32];
+	unsigned int meta[7];
+	int off;
+	BY_HANDLE_FILE_INFORMATION fi;
+
+	if ((recent_data & ~0x10) == 0)
+		return 0;
+
+	// 現在のファイル属性を取得する
+	memset(&fi, 0, sizeof(BY_HANDLE_FILE_INFORMATION));
+	if (GetFileInformationByHandle(hFile, &fi) == 0)
+		return 0;
+	if ((fi.nFileSizeLow <= REUSE_MIN) && (fi.nFileSizeHigh == 0))
+		return 0;	// 小さなファイルは検査結果を参照しない
+	meta[0] = fi.nFileSizeLow;
+	meta[1] = fi.nFileSizeHigh;
+	meta[2] = time_f_u(&(fi.ftCreationTime));
+	meta[3] = time_f_u(&(fi.ftLastWriteTime));
+	meta[4] = fi.dwVolumeSerialNumber;
+	meta[5] = fi.nFileIndexLow;
+	meta[6] = fi.nFileIndexHigh;
+
+	// 記録されてるデータと比較する
+	format_id(item, -1, meta + 4);	// ファイル識別番号を項目名にする
+	off = GetPrivateProfileInt(L"PAR", item, 0, ini_path);
+	if (off == 0)
+		return 0;
+	if (file_read_data(hIniBin, off, buf, 16) != 0)
+		return 0;
+	if (memcmp(buf, meta, 16) != 0)	// ファイル状態が異なる
+		return 0;
+
+	return 1;
+}
+
 // 検査するリカバリ・ファイルが同じであれば、再検査する必要は無い
 int check_ini_recovery(
 	HANDLE hFile,			// リカバリ・ファイルのハンドル
@@ -1269,6 +1321,320 @@ void update_ini_checksum(
 	}
 }
 
+/*
+変更ジャーナル (USN Journal) で、前回の検査後にファイルへ追記されただけかを調べる
+ジャーナルが有効な NTFS で、ボリュームを開ける権限がある場合だけ使える
+*/
+
+#define USN_RANGE_MAX	16777216	// 変更記録を調べる最大範囲 16MB
+
+// 追記以外の変更 (内容やファイル自体が変わった可能性がある)
+#define USN_REASON_NOT_APPEND	(USN_REASON_DATA_OVERWRITE | USN_REASON_DATA_TRUNCATION | \
+	USN_REASON_NAMED_DATA_OVERWRITE | USN_REASON_NAMED_DATA_EXTEND | USN_REASON_NAMED_DATA_TRUNCATION | \
+	USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_COMPRESSION_CHANGE | \
+	USN_REASON_ENCRYPTION_CHANGE | USN_REASON_REPARSE_POINT_CHANGE | USN_REASON_STREAM_CHANGE)
+
+static unsigned int usn_volume = 0;			// 最後に調べたボリューム番号
+static int usn_volume_state = 0;			// 0=未確認, 1=ジャーナルを使える, -1=使えない, -2=権限が無い
+static unsigned __int64 usn_journal_id;		// そのボリュームのジャーナル識別番号
+static HANDLE hUsnVolume = INVALID_HANDLE_VALUE;	// そのボリュームのハンドル
+
+// 変更番号の記録は、検査結果ファイルを閉じる時にまとめて書き込む
+typedef struct {
+	wchar_t item[32];	// 項目名
+	wchar_t value[64];	// ファイル状態とジャーナル識別番号と変更番号
+} usn_entry;
+
+static usn_entry *usn_list = NULL;
+static int usn_num = 0, usn_max = 0;
+
+// ファイルが存在するボリュームを開く
+static HANDLE open_file_volume(HANDLE hFile)
+{
+	wchar_t path[MAX_LEN], *tmp_p;
+
+	if (GetFinalPathNameByHandle(hFile, path, MAX_LEN, VOLUME_NAME_GUID) == 0)
+		return INVALID_HANDLE_VALUE;
+	// 「\\?\Volume{GUID}\～」の形式なので、ボリューム名だけにする
+	tmp_p = wcschr(path, '}');
+	if (tmp_p == NULL)
+		return INVALID_HANDLE_VALUE;
+	tmp_p[1] = 0;
+	return CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+}
+
+// 開いてるボリュームを閉じて、保留中の変更番号を破棄する
+static void close_usn_volume(void)
+{
+	if (hUsnVolume != INVALID_HANDLE_VALUE){
+		CloseHandle(hUsnVolume);
+		hUsnVolume = INVALID_HANDLE_VALUE;
+	}
+	if (usn_volume_state != -2)	// 権限が無いことは次回も変わらない
+		usn_volume_state = 0;
+	if (usn_list != NULL){
+		free(usn_list);
+		usn_list = NULL;
+	}
+	usn_num = 0;
+	usn_max = 0;
+}
+
+// ボリュームのジャーナル識別番号と、ファイルの最新の変更番号を取得する
+// 0=取得できた, 1=ジャーナルを使えない
+static int get_file_usn(
+	HANDLE hFile,
+	unsigned int volume,			// ボリューム番号
+	unsigned __int64 *file_ref,		// ファイル参照番号
+	__int64 *file_usn)				// 変更番号
+{
+	unsigned char buf[sizeof(USN_RECORD) + MAX_PATH * 2];
+	unsigned int rv;
+	USN_JOURNAL_DATA journal;
+	USN_RECORD *record;
+	OVERLAPPED ol;
+
+	if (usn_volume_state == -2)	// 管理者権限が無ければ、それ以降は試さない
+		return 1;
+	if ((usn_volume_state == 0) || (usn_volume != volume)){	// ボリュームが変わった時だけ確認する
+		if (hUsnVolume != INVALID_HANDLE_VALUE){
+			CloseHandle(hUsnVolume);
+			hUsnVolume = INVALID_HANDLE_VALUE;
+		}
+		usn_volume = volume;
+		usn_volume_state = -1;
+		hUsnVolume = open_file_volume(hFile);
+		if (hUsnVolume == INVALID_HANDLE_VALUE){
+			if (GetLastError() == ERROR_ACCESS_DENIED)
+				usn_volume_state = -2;
+			return 1;
+		}
+		if (DeviceIoControl(hUsnVolume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &rv, NULL) != 0){
+			usn_journal_id = journal.UsnJournalID;
+			usn_volume_state = 1;
+		} else {
+			CloseHandle(hUsnVolume);
+			hUsnVolume = INVALID_HANDLE_VALUE;
+		}
+	}
+	if (usn_volume_state < 0)
+		return 1;
+
+	// ソース・ファイルは FILE_FLAG_OVERLAPPED で開かれてるので、完了を待つ
+	memset(&ol, 0, sizeof(OVERLAPPED));
+	ol.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ol.hEvent == NULL)
+		return 1;
+	if (DeviceIoControl(hFile, FSCTL_READ_FILE_USN_DATA, NULL, 0, buf, sizeof(buf), &rv, &ol) == 0){
+		if ((GetLastError() != ERROR_IO_PENDING) || (GetOverlappedResult(hFile, &ol, &rv, TRUE) == 0)){
+			CloseHandle(ol.hEvent);
+			return 1;
+		}
+	}
+	CloseHandle(ol.hEvent);
+	record = (USN_RECORD *)buf;
+	if ((rv < sizeof(USN_RECORD) - sizeof(WCHAR)) || (record->MajorVersion != 2))	// ReFS の 128-bit 識別番号には対応しない
+		return 1;
+	*file_ref = record->FileReferenceNumber;
+	*file_usn = record->Usn;
+	return 0;
+}
+
+// 前回の変更番号から今回までに、そのファイルへの変更が追記だけかどうか
+// 0=追記だけ, 1=その他の変更がある (または判定できない)
+static int check_usn_append(
+	HANDLE hFile,
+	unsigned int volume,				// ボリューム番号
+	unsigned __int64 last_journal,		// 前回のジャーナル識別番号
+	__int64 last_usn)					// 前回の変更番号
+{
+	unsigned char buf[65536];
+	unsigned int rv, off, reason;
+	unsigned __int64 file_ref;
+	__int64 file_usn;
+	USN_JOURNAL_DATA journal;
+	READ_USN_JOURNAL_DATA read_data;
+	USN_RECORD *record;
+
+	if (get_file_usn(hFile, volume, &file_ref, &file_usn) != 0)
+		return 1;
+	if (usn_journal_id != last_journal)	// ジャーナルが作り直された
+		return 1;
+	if ((file_usn < last_usn) || (file_usn - last_usn > USN_RANGE_MAX))
+		return 1;	// 変更記録が多すぎるなら、普通に検査した方が速い
+	if (file_usn == last_usn)
+		return 0;
+
+	// get_file_usn で開いたボリュームのハンドルを使う
+	if ((DeviceIoControl(hUsnVolume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &rv, NULL) == 0) ||
+			(journal.UsnJournalID != last_journal) || (journal.FirstUsn > last_usn))
+		return 1;	// 前回の記録が既に消えてる
+
+	// 前回の変更番号以降の記録から、そのファイルの変更理由を集める
+	reason = 0;
+	memset(&read_data, 0, sizeof(read_data));
+	read_data.StartUsn = last_usn;
+	read_data.ReasonMask = 0xFFFFFFFF;
+	read_data.UsnJournalID = last_journal;
+	while (read_data.StartUsn <= file_usn){
+		if (DeviceIoControl(hUsnVolume, FSCTL_READ_USN_JOURNAL, &read_data, sizeof(read_data), buf, sizeof(buf), &rv, NULL) == 0){
+			reason = 0xFFFFFFFF;
+			break;
+		}
+		if (rv <= sizeof(USN))	// これ以上の記録は無い
+			break;
+		off = sizeof(USN);	// 先頭は次の変更番号
+		while (off < rv){
+			record = (USN_RECORD *)(buf + off);
+			if (record->MajorVersion != 2){
+				reason = 0xFFFFFFFF;
+				break;
+			}
+			// 前回の変更番号の記録には、それ以前の変更理由も含まれるので除く
+			if ((record->FileReferenceNumber == file_ref) && (record->Usn > last_usn) && (record->Usn <= file_usn))
+				reason |= record->Reason;
+			off += record->RecordLength;
+		}
+		if (reason & USN_REASON_NOT_APPEND)
+			break;
+		read_data.StartUsn = *((USN *)buf);
+	}
+#ifdef VERBOSE
+	printf("usn journal, reason = 0x%08X\n", reason);
+#endif
+
+	if (reason & USN_REASON_NOT_APPEND)
+		return 1;
+	return 0;
+}
+
+// ファイルの変更番号を、その時点のファイル状態と一緒に記録しておく
+// ジャーナルを使えない場合は何もしない (古い記録はファイル状態が一致しないので使われない)
+static void write_file_usn(
+	wchar_t *item,			// 項目名
+	unsigned int meta[7],
+	HANDLE hFile)
+{
+	unsigned __int64 file_ref;
+	__int64 file_usn;
+
+	if (get_file_usn(hFile, meta[4], &file_ref, &file_usn) != 0)
+		return;
+	if (usn_num >= usn_max){	// 領域が足りなくなるなら拡張する
+		usn_entry *tmp_p;
+		tmp_p = (usn_entry *)realloc(usn_list, sizeof(usn_entry) * (usn_max + 256));
+		if (tmp_p == NULL)
+			return;
+		usn_list = tmp_p;
+		usn_max += 256;
+	}
+	wcscpy(usn_list[usn_num].item, item);
+	swprintf(usn_list[usn_num].value, _countof(usn_list[usn_num].value), L"%08X%08X%08X_%I64X_%I64X",
+			meta[0], meta[1], meta[3], usn_journal_id, file_usn);
+	usn_num++;
+}
+
+// 保留中の変更番号を、既存の記録と合わせて一度に書き込む
+static void flush_file_usn(void)
+{
+	wchar_t *old_buf, *new_buf, *tmp_p;
+	int i, len, old_len, new_len, old_max;
+
+	if (usn_num == 0)
+		return;
+
+	// 既存の記録を読み込む
+	old_max = 4096;
+	old_buf = NULL;
+	do {
+		old_max *= 2;
+		tmp_p = (wchar_t *)realloc(old_buf, old_max * 2);
+		if (tmp_p == NULL){
+			if (old_buf)
+				free(old_buf);
+			return;
+		}
+		old_buf = tmp_p;
+		old_len = GetPrivateProfileSection(L"Usn", old_buf, old_max, ini_path);
+	} while (old_len >= old_max - 2);	// 全て読み込めるまで領域を増やす
+
+	// 今回の記録と重複しない古い記録を残す
+	new_buf = (wchar_t *)malloc((old_len + usn_num * (32 + 64) + 1) * 2);
+	if (new_buf == NULL){
+		free(old_buf);
+		return;
+	}
+	new_len = 0;
+	tmp_p = old_buf;
+	while (*tmp_p != 0){
+		len = (int)wcslen(tmp_p);
+		for (i = 0; i < usn_num; i++){
+			int item_len = (int)wcslen(usn_list[i].item);
+			if ((_wcsnicmp(tmp_p, usn_list[i].item, item_len) == 0) && (tmp_p[item_len] == '='))
+				break;
+		}
+		if (i == usn_num){
+			wcscpy(new_buf + new_len, tmp_p);
+			new_len += len + 1;
+		}
+		tmp_p += len + 1;
+	}
+	free(old_buf);
+	for (i = 0; i < usn_num; i++){
+		new_len += swprintf(new_buf + new_len, 32 + 64, L"%s=%s", usn_list[i].item, usn_list[i].value) + 1;
+	}
+	new_buf[new_len] = 0;	// 末尾は二重の null 文字
+	WritePrivateProfileSection(L"Usn", new_buf, ini_path);
+	free(new_buf);
+}
+
+// 完全だったファイルに追記されただけなら、前回の検査結果を使う
+// -3=前回の範囲は変わってない, -2=検査し直す
+static int check_state_append(
+	wchar_t *item,			// 項目名
+	unsigned int meta[7],	// 今回のファイル状態
+	int state[4],			// 前回のファイル状態
+	int result,				// 前回の検査結果
+	HANDLE hFile)
+{
+	wchar_t uni_buf[64];
+	unsigned int last_meta[3];
+	unsigned __int64 last_size, last_journal;
+	__int64 last_usn;
+
+	// 途中が破損してたなら、追記で完全になった可能性もある
+	if (result != -3)
+		return -2;
+	// 作成日時が同じで、サイズが減ってないこと
+	if ((unsigned int)(state[2]) != meta[2])
+		return -2;
+	last_size = (unsigned int)(state[0]) | ((unsigned __int64)(unsigned int)(state[1]) << 32);
+	if (((unsigned __int64)meta[1] << 32 | meta[0]) < last_size)
+		return -2;
+
+	// 前回の検査時の変更番号を読み込む
+	if (GetPrivateProfileString(L"Usn", item, L"", uni_buf, _countof(uni_buf), ini_path) == 0)
+		return -2;
+	if (swscanf(uni_buf, L"%8X%8X%8X_%I64X_%I64X", last_meta, last_meta + 1, last_meta + 2,
+			&last_journal, &last_usn) != 5)
+		return -2;
+	// 変更番号を記録した時と、検査結果のファイル状態が一致すること
+	if ((last_meta[0] != (unsigned int)(state[0])) || (last_meta[1] != (unsigned int)(state[1])) ||
+			(last_meta[2] != (unsigned int)(state[3])))
+		return -2;
+
+	if (check_usn_append(hFile, meta[4], last_journal, last_usn) != 0)
+		return -2;
+#ifdef VERBOSE
+	printf("check state, appended after last check\n");
+#endif
+
+	// 今回のファイル状態で記録し直す
+	base64_encode5(uni_buf, meta, -3);
+	WritePrivateProfileString(L"State", item, uni_buf, ini_path);
+	return -3;
+}
+
 // ソース・ファイルのハッシュ値の検査結果を記録する
 void write_ini_state(
 	int num,				// ファイル番号
@@ -1322,11 +1688,17 @@ int check_ini_state(
 	// 記録されてる状態を読み込む
 	format_id(item, num, meta + 4);	// ファイル識別番号を項目名にする
 	result = GetPrivateProfileString(L"State", item, L"", uni_buf, _countof(uni_buf), ini_path);
-	if (result == 0)	// 項目が見つからない
+	if (result == 0){	// 項目が見つからない
+		write_file_usn(item, meta, hFile);
 		return -2;
+	}
 	result = base64_decode5(uni_buf, state);
-	if (memcmp(meta, state, 16) != 0)	// ファイル状態が異なる
-		return -2;
+	if (memcmp(meta, state, 16) != 0){	// ファイル状態が異なる
+		// 追記されただけなら、前回の範囲は検査しなくていい
+		result = check_state_append(item, meta, state, result, hFile);
+		write_file_usn(item, meta, hFile);
+		return result;
+	}
 #ifdef VERBOSE
 	printf("check state, num = %d, state = %d\n", num, result);
 #endif
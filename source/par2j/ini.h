@@ -20,6 +20,9 @@ void write_ini_file2(unsigned char *par_client, wchar_t *par_comment);
 void write_ini_file(file_ctx_r *files);
 int read_ini_file(wchar_t *uni_buf, file_ctx_r *files);
 
+// リカバリ・ファイルの検査記録を利用できるかだけを調べる
+int peek_ini_recovery(HANDLE hFile);
+
 int check_ini_recovery(
 	HANDLE hFile,			// リカバリ・ファイルのハンドル
 	unsigned int meta[7]);	// サイズ、作成日時、更新日時、ボリューム番号、オブジェクト番号
@@ -80,16 +80,28 @@ extern int cpu_num;
 HMODULE hLibOpenCL = NULL;
 
 cl_context OpenCL_context = NULL;
-cl_command_queue OpenCL_command = NULL;
+cl_command_queue OpenCL_command = NULL;	// 書き込みと計算用
+cl_command_queue OpenCL_command2 = NULL;	// 読み出し用
 cl_kernel OpenCL_kernel = NULL;
-cl_mem OpenCL_src = NULL, OpenCL_dst = NULL, OpenCL_buf = NULL;
+cl_mem OpenCL_src = NULL, OpenCL_dst[2] = {NULL, NULL}, OpenCL_buf = NULL;
+cl_event OpenCL_event[2] = {NULL, NULL};	// 計算が終わった合図
+cl_event OpenCL_event2[2] = {NULL, NULL};	// 読み出しが終わった合図
+unsigned char *OpenCL_pending_buf = NULL;	// まだ読み出してない計算結果の出力先
+unsigned int OpenCL_pending_len;
+int OpenCL_pending_slot, OpenCL_slot = 0;
 size_t OpenCL_group_num;
 int OpenCL_method = 0;	// 標準では GPU を使わず、動作は自動選択される
 
+// 自動選択する際に比較するカーネルの番号
+static const int method_list1[] = {12, 10, 4, 2, 0};	// 並び替えられたデータ用
+static const int method_list2[] = {9, 1, 0};			// 並び替えられてないデータ用
+
 API_clCreateBuffer gfn_clCreateBuffer;
 API_clReleaseMemObject gfn_clReleaseMemObject;
 API_clSetKernelArg gfn_clSetKernelArg;
 API_clFinish gfn_clFinish;
+API_clFlush gfn_clFlush;
+API_clReleaseEvent gfn_clReleaseEvent;
 API_clEnqueueReadBuffer gfn_clEnqueueReadBuffer;
 API_clEnqueueWriteBuffer gfn_clEnqueueWriteBuffer;
 API_clEnqueueMapBuffer gfn_clEnqueueMapBuffer;
@@ -98,6 +110,172 @@ API_clEnqueueNDRangeKernel gfn_clEnqueueNDRangeKernel;
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// カーネルを繰り返し実行して、一秒あたりの実行回数を測る
+static double time_kernel(
+	cl_kernel kernel,
+	size_t group_num)		// work group 数
+{
+	size_t global_size, local_size;
+	int loop_count;
+	cl_int ret;
+	LARGE_INTEGER freq, time_start, time_now;
+
+	local_size = 256;	// テーブルやキャッシュのため、work item 数は 256 に固定する
+	global_size = group_num * 256;
+	if (!QueryPerformanceFrequency(&freq))
+		return 0;
+
+	// 最初の実行は準備に時間がかかるので計測しない
+	ret = gfn_clEnqueueNDRangeKernel(OpenCL_command, kernel, 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+	if (ret != CL_SUCCESS)
+		return 0;
+	ret = gfn_clFinish(OpenCL_command);
+	if (ret != CL_SUCCESS)
+		return 0;
+
+	loop_count = 0;
+	QueryPerformanceCounter(&time_start);
+	do {	// 短すぎると計測できないので 20ms 以上は繰り返す
+		ret = gfn_clEnqueueNDRangeKernel(OpenCL_command, kernel, 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+		if (ret != CL_SUCCESS)
+			return 0;
+		ret = gfn_clFinish(OpenCL_command);
+		if (ret != CL_SUCCESS)
+			return 0;
+		loop_count++;
+		QueryPerformanceCounter(&time_now);
+	} while (time_now.QuadPart - time_start.QuadPart < freq.QuadPart / 50);
+
+	return (double)loop_count * (double)freq.QuadPart / (double)(time_now.QuadPart - time_start.QuadPart);
+}
+
+// 候補のカーネルと work group 数を実際に動かして比較し、一番速い組み合わせを選ぶ
+// 選んだカーネルは OpenCL_kernel に、work group 数は OpenCL_group_num にセットされる
+static int tune_kernel(
+	cl_program program,
+	cl_device_id device,
+	unsigned int unit_size,
+	int src_max,
+	const int *method_list)	// 候補の番号、0 で終わる
+{
+	char buf[16];
+	unsigned short factor[32];
+	int i, select_method, test_num, group_max, block_num;
+	size_t data_size, group_base, group_num, work_size;
+	double speed, speed_best;
+	cl_int ret;
+	cl_kernel kernel;
+	cl_mem src_buf, dst_buf, factor_buf;
+	API_clCreateKernel fn_clCreateKernel;
+	API_clGetKernelWorkGroupInfo fn_clGetKernelWorkGroupInfo;
+	API_clReleaseKernel fn_clReleaseKernel;
+
+	fn_clCreateKernel = (API_clCreateKernel)GetProcAddress(hLibOpenCL, "clCreateKernel");
+	fn_clGetKernelWorkGroupInfo = (API_clGetKernelWorkGroupInfo)GetProcAddress(hLibOpenCL, "clGetKernelWorkGroupInfo");
+	fn_clReleaseKernel = (API_clReleaseKernel)GetProcAddress(hLibOpenCL, "clReleaseKernel");
+	if ((fn_clCreateKernel == NULL) || (fn_clGetKernelWorkGroupInfo == NULL) || (fn_clReleaseKernel == NULL))
+		return 0;
+
+	// 計測用の領域を確保する (内容は何でもいい)
+	test_num = 67108864 / unit_size;	// 64MB 分までにする
+	if (test_num > 16)
+		test_num = 16;
+	if (test_num > src_max)
+		test_num = src_max;
+	if (test_num < 1)
+		test_num = 1;
+	for (i = 0; i < test_num * 2; i++)
+		factor[i] = (unsigned short)(i + 2);
+	src_buf = gfn_clCreateBuffer(OpenCL_context, CL_MEM_READ_ONLY, (size_t)unit_size * test_num, NULL, &ret);
+	if (ret != CL_SUCCESS)
+		return 0;
+	dst_buf = gfn_clCreateBuffer(OpenCL_context, CL_MEM_WRITE_ONLY, (size_t)unit_size * 2, NULL, &ret);
+	if (ret != CL_SUCCESS){
+		gfn_clReleaseMemObject(src_buf);
+		return 0;
+	}
+	factor_buf = gfn_clCreateBuffer(OpenCL_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(unsigned short) * test_num * 2, factor, &ret);
+	if (ret != CL_SUCCESS){
+		gfn_clReleaseMemObject(src_buf);
+		gfn_clReleaseMemObject(dst_buf);
+		return 0;
+	}
+
+	group_base = OpenCL_group_num;	// COMPUTE_UNITS 数を基準にする
+	select_method = 0;
+	speed_best = 0;
+	for (; *method_list != 0; method_list++){
+		wsprintfA(buf, "method%d", *method_list);
+		kernel = fn_clCreateKernel(program, buf, &ret);
+		if (ret != CL_SUCCESS)
+			continue;
+		// カーネルが実行できる work item 数を調べる (最低でも 256 以上は必要)
+		ret = fn_clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &work_size, NULL);
+		if ((ret != CL_SUCCESS) || (work_size < 256)){
+			fn_clReleaseKernel(kernel);
+			continue;
+		}
+		ret = gfn_clSetKernelArg(kernel, 0, sizeof(cl_mem), &src_buf);
+		if (ret == CL_SUCCESS)
+			ret = gfn_clSetKernelArg(kernel, 1, sizeof(cl_mem), &dst_buf);
+		if (ret == CL_SUCCESS)
+			ret = gfn_clSetKernelArg(kernel, 2, sizeof(cl_mem), &factor_buf);
+		if (ret == CL_SUCCESS)
+			ret = gfn_clSetKernelArg(kernel, 3, sizeof(int), &test_num);
+		if (ret != CL_SUCCESS){
+			fn_clReleaseKernel(kernel);
+			continue;
+		}
+
+		// work group 一個が担当するサイズより多くしても意味が無い
+		if (*method_list & 4){
+			data_size = unit_size / 8192;
+		} else if (*method_list & 2){
+			data_size = unit_size / 2048;
+		} else {
+			data_size = unit_size / 1024;
+		}
+		if (data_size < 1)
+			data_size = 1;
+		block_num = (*method_list & 8) ? 2 : 1;	// 一回の実行で何ブロック計算するか
+
+		// COMPUTE_UNITS 数の 1倍、2倍、4倍の work group 数を試す
+		for (group_max = 1; group_max <= 4; group_max *= 2){
+			group_num = group_base * group_max;
+			if (group_num > data_size){
+				if (group_max > 1)
+					break;
+				group_num = data_size;
+			}
+			speed = time_kernel(kernel, group_num) * block_num;
+#ifdef DEBUG_OUTPUT
+			printf("Testing %s, group num = %zd, %.0f blocks/s\n", buf, group_num, speed);
+#endif
+			if (speed > speed_best){
+				speed_best = speed;
+				OpenCL_group_num = group_num;
+				if (select_method != *method_list){
+					if (OpenCL_kernel != NULL)
+						fn_clReleaseKernel(OpenCL_kernel);
+					OpenCL_kernel = kernel;
+					select_method = *method_list;
+				}
+			}
+		}
+		if (OpenCL_kernel != kernel)
+			fn_clReleaseKernel(kernel);
+	}
+
+	gfn_clReleaseMemObject(src_buf);
+	gfn_clReleaseMemObject(dst_buf);
+	gfn_clReleaseMemObject(factor_buf);
+#ifdef DEBUG_OUTPUT
+	if (select_method != 0)
+		printf("\nSelected method%d, group num = %zd\n", select_method, OpenCL_group_num);
+#endif
+	return select_method;
+}
+
 /*
 入力
 OpenCL_method : どのデバイスや関数を選ぶか
@@ -105,6 +283,7 @@ OpenCL_method : どのデバイスや関数を選ぶか
   0x10000 = 1ブロックずつ計算する, 0x20000 = 2ブロックずつ計算しようとする
   0x40000 = 4-byte memory access,  0x80000 = try 16-byte memory access
  0x100000 = CL_MEM_COPY_HOST_PTR, 0x200000 = CL_MEM_USE_HOST_PTR
+ 0x400000 = GPU 以外の機器も選ぶ
 unit_size : ブロックの単位サイズ
 src_max : ソース・ブロック個数
 
@@ -227,6 +406,12 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 	gfn_clFinish = (API_clFinish)GetProcAddress(hLibOpenCL, "clFinish");
 	if (gfn_clFinish == NULL)
 		return err;
+	gfn_clFlush = (API_clFlush)GetProcAddress(hLibOpenCL, "clFlush");
+	if (gfn_clFlush == NULL)
+		return err;
+	gfn_clReleaseEvent = (API_clReleaseEvent)GetProcAddress(hLibOpenCL, "clReleaseEvent");
+	if (gfn_clReleaseEvent == NULL)
+		return err;
 	gfn_clEnqueueNDRangeKernel = (API_clEnqueueNDRangeKernel)GetProcAddress(hLibOpenCL, "clEnqueueNDRangeKernel");
 	if (gfn_clEnqueueNDRangeKernel == NULL)
 		return err;
@@ -254,7 +439,12 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 #endif
 
 		// 環境内の OpenCL 対応機器の数
-		if (fn_clGetDeviceIDs(platform_id[i], CL_DEVICE_TYPE_GPU, MAX_DEVICE, device_id, &num_devices) != CL_SUCCESS)
+		if (OpenCL_method & 0x400000){	// CPU 用の OpenCL 環境でも動作を確かめられるようにする
+			ret = fn_clGetDeviceIDs(platform_id[i], CL_DEVICE_TYPE_ALL, MAX_DEVICE, device_id, &num_devices);
+		} else {
+			ret = fn_clGetDeviceIDs(platform_id[i], CL_DEVICE_TYPE_GPU, MAX_DEVICE, device_id, &num_devices);
+		}
+		if (ret != CL_SUCCESS)
 			continue;
 		if (num_devices > MAX_DEVICE)
 			num_devices = MAX_DEVICE;
@@ -361,6 +551,10 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 	OpenCL_command = fn_clCreateCommandQueue(OpenCL_context, selected_device, 0, &ret);
 	if (ret != CL_SUCCESS)
 		return (ret << 8) | 12;
+	// 計算中に前の結果を読み出せるように、読み出し用のキューを別にする
+	OpenCL_command2 = fn_clCreateCommandQueue(OpenCL_context, selected_device, 0, &ret);
+	if (ret != CL_SUCCESS)
+		return (ret << 8) | 15;
 
 	// 最大で何ブロック分のメモリー領域を保持できるのか（ここではまだ確保しない）
 	// 後で実際に確保する量はこれよりも少なくなる
@@ -484,109 +678,10 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 			select_method = 4;
 		} else if (OpenCL_method & 0x10000){	// 4-byte
 			select_method = 2;
-		} else {	// kernel を作って詳細を確かめる
-			size_t item2, item4, item10, item12;
-			cl_kernel kernel2, kernel4, kernel10, kernel12;
-			item2 = item4 = item10 = item12 = 0;
-			// まずは一番重くて速い奴を調べる
-			wsprintfA(buf, "method%d", 12);
-			kernel12 = fn_clCreateKernel(program, buf, &ret);
-			if (ret == CL_SUCCESS){
-				ret = fn_clGetKernelWorkGroupInfo(kernel12, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item12, NULL);
-				if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-					printf("\nTesting %s\n", buf);
-					printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item12);
-#endif
-				}
-			}
-			if (item12 >= 32){	// 32以上あれば余裕で動くとみなす
-				select_method = 12;
-				OpenCL_kernel = kernel12;
-#ifdef DEBUG_OUTPUT
-				printf("\nSelected method%d\n", select_method);
-#endif
-			} else {	// 他の奴と比較する
-				wsprintfA(buf, "method%d", 2);
-				kernel2 = fn_clCreateKernel(program, buf, &ret);
-				if (ret == CL_SUCCESS){
-					ret = fn_clGetKernelWorkGroupInfo(kernel2, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item2, NULL);
-					if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-						printf("\nTesting %s\n", buf);
-						printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item2);
-#endif
-					}
-				}
-				if (item12 >= item2){
-					select_method = 12;
-					OpenCL_kernel = kernel12;
-					ret = fn_clReleaseKernel(kernel2);
-#ifdef DEBUG_OUTPUT
-					if (ret != CL_SUCCESS)
-						printf("clReleaseKernel : Failed\n");
-					printf("\nSelected method%d\n", select_method);
-#endif
-				} else {
-					ret = fn_clReleaseKernel(kernel12);
-#ifdef DEBUG_OUTPUT
-					if (ret != CL_SUCCESS)
-						printf("clReleaseKernel : Failed\n");
-#endif
-					wsprintfA(buf, "method%d", 10);
-					kernel10 = fn_clCreateKernel(program, buf, &ret);
-					if (ret == CL_SUCCESS){
-						ret = fn_clGetKernelWorkGroupInfo(kernel10, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item10, NULL);
-						if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-							printf("\nTesting %s\n", buf);
-							printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item10);
-#endif
-						}
-					}
-					if (item10 >= item2){
-						select_method = 10;
-						OpenCL_kernel = kernel10;
-						ret = fn_clReleaseKernel(kernel2);
-#ifdef DEBUG_OUTPUT
-						if (ret != CL_SUCCESS)
-							printf("clReleaseKernel : Failed\n");
-						printf("\nSelected method%d\n", select_method);
-#endif
-					} else {
-						wsprintfA(buf, "method%d", 4);
-						kernel4 = fn_clCreateKernel(program, buf, &ret);
-						if (ret == CL_SUCCESS){
-							ret = fn_clGetKernelWorkGroupInfo(kernel4, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item4, NULL);
-							if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-								printf("\nTesting %s\n", buf);
-								printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item4);
-#endif
-							}
-						}
-						if (item4 >= item2){
-							select_method = 4;
-							OpenCL_kernel = kernel4;
-							ret = fn_clReleaseKernel(kernel2);
-#ifdef DEBUG_OUTPUT
-							if (ret != CL_SUCCESS)
-								printf("clReleaseKernel : Failed\n");
-							printf("\nSelected method%d\n", select_method);
-#endif
-						} else {
-							select_method = 2;
-							OpenCL_kernel = kernel2;
-							ret = fn_clReleaseKernel(kernel4);
-#ifdef DEBUG_OUTPUT
-							if (ret != CL_SUCCESS)
-								printf("clReleaseKernel : Failed\n");
-							printf("\nSelected method%d\n", select_method);
-#endif
-						}
-					}
-				}
-			}
+		} else {	// kernel を実際に動かして速いものを選ぶ
+			select_method = tune_kernel(program, selected_device, unit_size, *src_max, method_list1);
+			if (select_method == 0)
+				select_method = 2;	// 計測できなければ標準的な奴にする
 		}
 		OpenCL_method |= select_method;
 	} else if (((cpu_flag & 128) != 0) && (sse_unit == 256)){
@@ -600,60 +695,10 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 			select_method = 9;
 		} else if (OpenCL_method & 0x10000){	// 4-byte
 			select_method = 1;
-		} else {	// kernel を作って詳細を確かめる
-			size_t item1, item9;
-			cl_kernel kernel1, kernel9;
-			item1 = item9 = 0;
-			// まずは一番重くて速い奴を調べる
-			wsprintfA(buf, "method%d", 9);
-			kernel9 = fn_clCreateKernel(program, buf, &ret);
-			if (ret == CL_SUCCESS){
-				ret = fn_clGetKernelWorkGroupInfo(kernel9, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item9, NULL);
-				if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-					printf("\nTesting %s\n", buf);
-					printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item9);
-#endif
-				}
-			}
-			if (item9 >= 32){	// 32以上あれば余裕で動くとみなす
-				select_method = 9;
-				OpenCL_kernel = kernel9;
-#ifdef DEBUG_OUTPUT
-				printf("\nSelected method%d\n", select_method);
-#endif
-			} else {	// 他の奴と比較する
-				wsprintfA(buf, "method%d", 1);
-				kernel1 = fn_clCreateKernel(program, buf, &ret);
-				if (ret == CL_SUCCESS){
-					ret = fn_clGetKernelWorkGroupInfo(kernel1, selected_device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &item1, NULL);
-					if (ret == CL_SUCCESS){
-#ifdef DEBUG_OUTPUT
-						printf("\nTesting %s\n", buf);
-						printf("PREFERRED_WORK_GROUP_SIZE_MULTIPLE = %zu\n", item1);
-#endif
-					}
-				}
-				if (item9 >= item1){
-					select_method = 9;
-					OpenCL_kernel = kernel9;
-					ret = fn_clReleaseKernel(kernel1);
-#ifdef DEBUG_OUTPUT
-					if (ret != CL_SUCCESS)
-						printf("clReleaseKernel : Failed\n");
-					printf("\nSelected method%d\n", select_method);
-#endif
-				} else {
-					select_method = 1;
-					OpenCL_kernel = kernel1;
-					ret = fn_clReleaseKernel(kernel9);
-#ifdef DEBUG_OUTPUT
-					if (ret != CL_SUCCESS)
-						printf("clReleaseKernel : Failed\n");
-					printf("\nSelected method%d\n", select_method);
-#endif
-				}
-			}
+		} else {	// kernel を実際に動かして速いものを選ぶ
+			select_method = tune_kernel(program, selected_device, unit_size, *src_max, method_list2);
+			if (select_method == 0)
+				select_method = 1;	// 計測できなければ標準的な奴にする
 		}
 		OpenCL_method |= select_method;
 	}
@@ -726,16 +771,18 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 		}
 	}
 
-	// 出力先は1ブロック分だけあればいい
+	// 出力先は1ブロック分ずつ交互に使う (前の結果を読み出す間に次を計算する)
 	// CL_MEM_ALLOC_HOST_PTRを使えばpinned memoryになるらしい
 	data_size = unit_size;
 	if (OpenCL_method & 8)
 		data_size *= 2;	// 2ブロックずつ計算できるように、2倍確保しておく
-	OpenCL_dst = gfn_clCreateBuffer(OpenCL_context, CL_MEM_ALLOC_HOST_PTR, data_size, NULL, &ret);
-	if (ret != CL_SUCCESS)
-		return (ret << 8) | 13;
+	for (i = 0; i < 2; i++){
+		OpenCL_dst[i] = gfn_clCreateBuffer(OpenCL_context, CL_MEM_ALLOC_HOST_PTR, data_size, NULL, &ret);
+		if (ret != CL_SUCCESS)
+			return (ret << 8) | 13;
+	}
 #ifdef DEBUG_OUTPUT
-	printf("dst buf : %zd KB (%zd Bytes), OK\n", data_size >> 10, data_size);
+	printf("dst buf : %zd KB (%zd Bytes) * 2, OK\n", data_size >> 10, data_size);
 #endif
 
 	// factor は最大個数分 (src_max個)
@@ -750,7 +797,7 @@ int init_OpenCL(unsigned int unit_size, int *src_max)
 #endif
 
 	// カーネル引数を指定する
-	ret = gfn_clSetKernelArg(OpenCL_kernel, 1, sizeof(cl_mem), &OpenCL_dst);
+	ret = gfn_clSetKernelArg(OpenCL_kernel, 1, sizeof(cl_mem), &(OpenCL_dst[0]));
 	if (ret != CL_SUCCESS)
 		return (ret << 8) | 101;
 	ret = gfn_clSetKernelArg(OpenCL_kernel, 2, sizeof(cl_mem), &OpenCL_buf);
@@ -771,7 +818,7 @@ int free_OpenCL(void)
 	API_clReleaseContext fn_clReleaseContext;
 	API_clReleaseCommandQueue fn_clReleaseCommandQueue;
 	API_clReleaseKernel fn_clReleaseKernel;
-	int err = 0;	// 最初のエラーだけ記録する
+	int i, err = 0;	// 最初のエラーだけ記録する
 	cl_int ret;
 
 	if (hLibOpenCL == NULL)
@@ -783,6 +830,22 @@ int free_OpenCL(void)
 		ret = gfn_clFinish(OpenCL_command);
 		if ((err == 0) && (ret != CL_SUCCESS))
 			err = (ret << 8) | 1;
+		if (OpenCL_command2 != NULL){
+			ret = gfn_clFinish(OpenCL_command2);
+			if ((err == 0) && (ret != CL_SUCCESS))
+				err = (ret << 8) | 2;
+		}
+		OpenCL_pending_buf = NULL;
+		for (i = 0; i < 2; i++){
+			if (OpenCL_event[i] != NULL){
+				gfn_clReleaseEvent(OpenCL_event[i]);
+				OpenCL_event[i] = NULL;
+			}
+			if (OpenCL_event2[i] != NULL){
+				gfn_clReleaseEvent(OpenCL_event2[i]);
+				OpenCL_event2[i] = NULL;
+			}
+		}
 
 		if (OpenCL_buf != NULL){
 			ret = gfn_clReleaseMemObject(OpenCL_buf);
@@ -796,11 +859,13 @@ int free_OpenCL(void)
 				err = (ret << 8) | 11;
 			OpenCL_src = NULL;
 		}
-		if (OpenCL_dst != NULL){
-			ret = gfn_clReleaseMemObject(OpenCL_dst);
-			if ((err == 0) && (ret != CL_SUCCESS))
-				err = (ret << 8) | 12;
-			OpenCL_dst = NULL;
+		for (i = 0; i < 2; i++){
+			if (OpenCL_dst[i] != NULL){
+				ret = gfn_clReleaseMemObject(OpenCL_dst[i]);
+				if ((err == 0) && (ret != CL_SUCCESS))
+					err = (ret << 8) | 12;
+				OpenCL_dst[i] = NULL;
+			}
 		}
 		if (OpenCL_kernel != NULL){
 			fn_clReleaseKernel = (API_clReleaseKernel)GetProcAddress(hLibOpenCL, "clReleaseKernel");
@@ -815,6 +880,10 @@ int free_OpenCL(void)
 		}
 		fn_clReleaseCommandQueue = (API_clReleaseCommandQueue)GetProcAddress(hLibOpenCL, "clReleaseCommandQueue");
 		if (fn_clReleaseCommandQueue != NULL){
+			if (OpenCL_command2 != NULL){
+				fn_clReleaseCommandQueue(OpenCL_command2);
+				OpenCL_command2 = NULL;
+			}
 			ret = fn_clReleaseCommandQueue(OpenCL_command);
 			OpenCL_command = NULL;
 		} else {
@@ -871,6 +940,9 @@ void info_OpenCL(char *buf, int buf_size)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 // ソース・ブロックをデバイス側にコピーする
+// 次のソース・ブロックは、全てのスレッドが計算を終えてからメイン・スレッドが
+// 同じバッファーに読み込むので、今の計算中に次の分を転送することはできない。
+// 転送と計算を重ねるのは、計算結果の読み出し (gpu_multiply_blocks) だけにする。
 int gpu_copy_blocks(
 	unsigned char *data,	// ブロックのバッファー (境界は 4096にすること)
 	unsigned int unit_size,	// 4096の倍数にすること
@@ -905,7 +977,49 @@ int gpu_copy_blocks(
 	return 0;
 }
 
+// 前回の計算結果をホスト側に読み出して XOR する
+static int read_pending(void)
+{
+	unsigned __int64 *vram, *src, *dst;
+	unsigned int len;
+	int slot;
+	cl_int ret;
+
+	slot = OpenCL_pending_slot;
+	len = OpenCL_pending_len;
+	dst = (unsigned __int64 *)OpenCL_pending_buf;
+	OpenCL_pending_buf = NULL;
+
+	// 計算が終わるのを待ってから、出力内容をホスト側に反映させる
+	vram = gfn_clEnqueueMapBuffer(OpenCL_command2, OpenCL_dst[slot], CL_TRUE, CL_MAP_READ, 0, len, 1, &(OpenCL_event[slot]), NULL, &ret);
+	if (ret != CL_SUCCESS)
+		return (ret << 8) | 13;
+	gfn_clReleaseEvent(OpenCL_event[slot]);
+	OpenCL_event[slot] = NULL;
+
+	// 8バイトごとに XOR する (SSE2 で XOR しても速くならず)
+	src = vram;
+	while (len > 0){
+		*dst ^= *src;
+		dst++;
+		src++;
+		len -= 8;
+	}
+
+	// ホスト側でデータを変更しなくても、clEnqueueMapBufferと対で呼び出さないといけない
+	// 次にこの領域へ出力する計算は、解除が終わるまで待たせる
+	ret = gfn_clEnqueueUnmapMemObject(OpenCL_command2, OpenCL_dst[slot], vram, 0, NULL, &(OpenCL_event2[slot]));
+	if (ret != CL_SUCCESS)
+		return (ret << 8) | 14;
+	ret = gfn_clFlush(OpenCL_command2);
+	if (ret != CL_SUCCESS)
+		return (ret << 8) | 15;
+
+	return 0;
+}
+
 // ソース・ブロックを掛け算する
+// 計算を開始したら前回の結果を読み出すので、最後の結果は gpu_finish で読み出される
 int gpu_multiply_blocks(
 	int src_num,			// Number of multiplying source blocks
 	unsigned short *mat,	// Matrix of numbers to multiply by
@@ -913,81 +1027,104 @@ int gpu_multiply_blocks(
 	unsigned char *buf,		// Products go here
 	unsigned int len)		// Byte length
 {
-	unsigned __int64 *vram, *src, *dst;
 	size_t global_size, local_size;
+	int slot;
 	cl_int ret;
 
 	// 倍率の配列をデバイス側に書き込む
+	// 呼び出し元は戻った後に配列を書き換えるので、最後の書き込みは完了を待つ
 	if (mat2 == NULL){	// 1ブロック分だけコピーする
-		ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_FALSE, 0, sizeof(short) * src_num, mat, 0, NULL, NULL);
+		ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_TRUE, 0, sizeof(short) * src_num, mat, 0, NULL, NULL);
 	} else {	// 2ブロックずつ計算する場合は、配列のサイズも２倍になる
 		if ((size_t)mat2 == 1){	// アドレスが 1 になることはあり得ないので、識別できる
-			ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_FALSE, 0, sizeof(short) * src_num * 2, mat, 0, NULL, NULL);
+			ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_TRUE, 0, sizeof(short) * src_num * 2, mat, 0, NULL, NULL);
 		} else {	// 2回コピーする
 			size_t data_size = sizeof(short) * src_num;
 			ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_FALSE, 0, data_size, mat, 0, NULL, NULL);
 			if (ret != CL_SUCCESS)
 				return (ret << 8) | 10;
 			// もう一つの配列は違う場所からコピーする
-			ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_FALSE, data_size, data_size, mat2, 0, NULL, NULL);
+			ret = gfn_clEnqueueWriteBuffer(OpenCL_command, OpenCL_buf, CL_TRUE, data_size, data_size, mat2, 0, NULL, NULL);
 		}
 	}
 	if (ret != CL_SUCCESS)
 		return (ret << 8) | 11;
 
-	// 引数を指定する
+	// 引数を指定する (出力先は交互に切り替える)
+	slot = OpenCL_slot;
+	ret = gfn_clSetKernelArg(OpenCL_kernel, 1, sizeof(cl_mem), &(OpenCL_dst[slot]));
+	if (ret != CL_SUCCESS)
+		return (ret << 8) | 101;
 	ret = gfn_clSetKernelArg(OpenCL_kernel, 3, sizeof(int), &src_num);
 	if (ret != CL_SUCCESS)
 		return (ret << 8) | 103;
 
-	// カーネル並列実行
+	// カーネル並列実行 (出力先の読み出しが終わってから)
 	local_size = 256;	// テーブルやキャッシュのため、work item 数は 256 に固定する
 	global_size = OpenCL_group_num * 256;
 	//printf("group num = %d, global size = %d, local size = %d \n", OpenCL_group_num, global_size, local_size);
-	ret = gfn_clEnqueueNDRangeKernel(OpenCL_command, OpenCL_kernel, 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+	if (OpenCL_event2[slot] != NULL){
+		ret = gfn_clEnqueueNDRangeKernel(OpenCL_command, OpenCL_kernel, 1, NULL, &global_size, &local_size, 1, &(OpenCL_event2[slot]), &(OpenCL_event[slot]));
+		gfn_clReleaseEvent(OpenCL_event2[slot]);
+		OpenCL_event2[slot] = NULL;
+	} else {
+		ret = gfn_clEnqueueNDRangeKernel(OpenCL_command, OpenCL_kernel, 1, NULL, &global_size, &local_size, 0, NULL, &(OpenCL_event[slot]));
+	}
 	if (ret != CL_SUCCESS)
 		return (ret << 8) | 12;
-
-	// 出力内容をホスト側に反映させる
-	vram = gfn_clEnqueueMapBuffer(OpenCL_command, OpenCL_dst, CL_TRUE, CL_MAP_READ, 0, len, 0, NULL, NULL, &ret);
+	ret = gfn_clFlush(OpenCL_command);	// すぐに計算を始めさせる
 	if (ret != CL_SUCCESS)
-		return (ret << 8) | 13;
+		return (ret << 8) | 16;
 
-	// 8バイトごとに XOR する (SSE2 で XOR しても速くならず)
-	src = vram;
-	dst = (unsigned __int64 *)buf;
-	while (len > 0){
-		*dst ^= *src;
-		dst++;
-		src++;
-		len -= 8;
+	// 計算中に前回の結果を読み出す
+	if (OpenCL_pending_buf != NULL){
+		ret = read_pending();
+		if (ret != 0)
+			return ret;
 	}
-
-	// ホスト側でデータを変更しなくても、clEnqueueMapBufferと対で呼び出さないといけない
-	ret = gfn_clEnqueueUnmapMemObject(OpenCL_command, OpenCL_dst, vram, 0, NULL, NULL);
-	if (ret != CL_SUCCESS)
-		return (ret << 8) | 14;
+	OpenCL_pending_buf = buf;
+	OpenCL_pending_len = len;
+	OpenCL_pending_slot = slot;
+	OpenCL_slot = slot ^ 1;
 
 	return 0;
 }
 
 // 確保したVRAMとメモリーを解放する
+// エラーが発生しても、イベントとソース・ブロックの領域は必ず解放する
 int gpu_finish(void)
 {
+	int i, err = 0;	// 最初のエラーだけ記録する
 	cl_int ret;
 
+	// 最後の計算結果を読み出す
+	if (OpenCL_pending_buf != NULL)
+		err = read_pending();
+
 	// 全ての処理が終わるのを待つ
 	ret = gfn_clFinish(OpenCL_command);
-	if (ret != CL_SUCCESS)
-		return (ret << 8) | 30;
+	if ((err == 0) && (ret != CL_SUCCESS))
+		err = (ret << 8) | 30;
+	ret = gfn_clFinish(OpenCL_command2);
+	if ((err == 0) && (ret != CL_SUCCESS))
+		err = (ret << 8) | 32;
+	for (i = 0; i < 2; i++){
+		if (OpenCL_event[i] != NULL){
+			gfn_clReleaseEvent(OpenCL_event[i]);
+			OpenCL_event[i] = NULL;
+		}
+		if (OpenCL_event2[i] != NULL){
+			gfn_clReleaseEvent(OpenCL_event2[i]);
+			OpenCL_event2[i] = NULL;
+		}
+	}
 
 	if (OpenCL_src != NULL){	// 確保されてる場合は解除する
 		ret = gfn_clReleaseMemObject(OpenCL_src);
-		if (ret != CL_SUCCESS)
-			return (ret << 8) | 31;
+		if ((err == 0) && (ret != CL_SUCCESS))
+			err = (ret << 8) | 31;
 		OpenCL_src = NULL;
 	}
 
-	return 0;
+	return err;
 }
-
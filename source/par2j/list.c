@@ -14,6 +14,7 @@
 
 #include <process.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <windows.h>
 
@@ -350,10 +351,130 @@ printf("\n hash %.3f sec, %.0f MB/s\n", time_sec, time_speed);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-// SSD 上で複数ファイルを同時に検査する
+// SSD 上や複数の装置で複数ファイルを同時に検査する
 
 // MAX_MULTI_READ の２倍ぐらいにする？
 #define MAX_READ_NUM 12
+#define MAX_DEVICE_NUM 8	// 区別する装置の最大数
+
+typedef struct {
+	unsigned int serial;	// ボリュームのシリアル番号
+	int limit;	// 同時に検査するファイル数
+	int run;	// 検査中のファイル数
+	int next;	// 次に検査するファイル番号
+} device_ctx;
+
+// 装置の種類に応じて同時に検査するファイル数を決める
+static int device_read_num(int type)
+{
+	int read_num;
+
+	if (type & 32){	// NVMe SSD
+		read_num = (cpu_num + 2) / 3 + 1;	// 3=2, 4~6=3, 7~9=4, 10~12=5, 13~=6
+		if (read_num > MAX_READ_NUM / 2)
+			read_num = MAX_READ_NUM / 2;
+	} else if (type & 16){	// SATA SSD
+		read_num = 2;
+	} else {	// HDD は順番に読み込む
+		read_num = 1;
+	}
+
+	return read_num;
+}
+
+// ソース・ファイルが存在する装置を区別して、全体で同時に検査するファイル数を返す
+static int classify_file_device(
+	wchar_t *file_path,		// 作業用、基準ディレクトリが入ってる
+	int *file_dev,			// 各ファイルが存在する装置の番号
+	int *dev_num,			// 装置の数
+	device_ctx *dev,		// 各装置の情報
+	file_ctx_r *files)		// 各ソース・ファイルの情報
+{
+	wchar_t vol_path[MAX_PATH], last_path[MAX_PATH];
+	int i, num, type, last_dev, read_num;
+	unsigned int serial;
+
+	// 基準ディレクトリの装置の種類は既に調べてある
+	serial = 0;
+	if (GetVolumePathName(base_dir, vol_path, MAX_PATH) != 0)
+		GetVolumeInformation(vol_path, NULL, 0, &serial, NULL, NULL, NULL, 0);
+	dev[0].serial = serial;
+	dev[0].limit = device_read_num(memory_use);
+	*dev_num = 1;
+
+	last_path[0] = 0;
+	last_dev = 0;
+	for (num = 0; num < entity_num; num++){
+		file_dev[num] = -1;	// 検査しない印
+		if (files[num].size == 0)
+			continue;
+		file_dev[num] = 0;	// 判らなければ基準ディレクトリと同じ装置にする
+		wcscpy(file_path + base_len, list_buf + files[num].name);
+		if (GetVolumePathName(file_path, vol_path, MAX_PATH) == 0)
+			continue;
+		if (_wcsicmp(vol_path, last_path) == 0){	// 直前と同じボリューム
+			file_dev[num] = last_dev;
+			continue;
+		}
+		wcscpy(last_path, vol_path);
+		last_dev = 0;
+		if (GetVolumeInformation(vol_path, NULL, 0, &serial, NULL, NULL, NULL, 0) != 0){
+			for (i = 0; i < *dev_num; i++){
+				if (dev[i].serial == serial)
+					break;
+			}
+			if (i == *dev_num){	// 新しい装置なら種類を調べる
+				if (i < MAX_DEVICE_NUM){
+					type = check_volume_type(vol_path);
+					if (type < 0)	// 調べられなければ基準ディレクトリと同じにする
+						type = memory_use;
+					dev[i].serial = serial;
+					dev[i].limit = device_read_num(type);
+					*dev_num += 1;
+				} else {
+					i = 0;
+				}
+			}
+			last_dev = i;
+		}
+		file_dev[num] = last_dev;
+	}
+
+	// 装置ごとの最初のファイルと、全体の同時検査数
+	read_num = 0;
+	for (i = 0; i < *dev_num; i++){
+		dev[i].run = 0;
+		dev[i].next = entity_num;
+		for (num = 0; num < entity_num; num++){
+			if (file_dev[num] == i){
+				dev[i].next = num;
+				read_num += dev[i].limit;
+				break;
+			}
+		}
+	}
+	if (read_num > MAX_READ_NUM / 2)
+		read_num = MAX_READ_NUM / 2;
+
+	return read_num;
+}
+
+// 空きのある装置から、次に検査するファイルの番号を返す (無ければ -1)
+static int next_device_file(
+	int dev_num,			// 装置の数
+	device_ctx *dev)		// 各装置の情報
+{
+	int i, num;
+
+	num = entity_num;
+	for (i = 0; i < dev_num; i++){
+		if ((dev[i].run < dev[i].limit) && (dev[i].next < num))
+			num = dev[i].next;
+	}
+	if (num == entity_num)
+		return -1;
+	return num;
+}
 
 int check_file_complete_multi(
 	char *ascii_buf,
@@ -363,34 +484,45 @@ int check_file_complete_multi(
 {
 	int err = 0, i, rv;
 	int num, bad_flag, multi_read, multi_num, id, id_prog;
+	int pos, file_count, dev_num, *file_dev;
 	unsigned int time_last;
 	__int64 file_size;	// 存在するファイルのサイズは本来のサイズとは異なることもある
 	HANDLE hFile;
 	HANDLE hSub[MAX_READ_NUM];
 	FILE_CHECK_TH th[MAX_READ_NUM];
+	device_ctx dev[MAX_DEVICE_NUM];
 #ifdef TIMER
 clock_t time_start = clock();
 #endif
 
-	memset(hSub, 0, sizeof(HANDLE) * MAX_READ_NUM);
-	// Core数に応じてスレッド数を増やす
-	if ((memory_use & 32) != 0){	// NVMe SSD
-		multi_read = (cpu_num + 2) / 3 + 1;	// 3=2, 4~6=3, 7~9=4, 10~12=5, 13~=6
-		if (multi_read > MAX_READ_NUM / 2)
-			multi_read = MAX_READ_NUM / 2;
-	} else {	// SATA SSD
-		multi_read = 2;
+	file_dev = (int *)malloc(sizeof(int) * entity_num);
+	if (file_dev == NULL){
+		printf("malloc, %d\n", (int)sizeof(int) * entity_num);
+		return 1;
+	}
+	wcscpy(file_path, base_dir);
+	// 装置ごとに同時検査数を決める (HDD は一個ずつ、SSD は Core数に応じて増やす)
+	multi_read = classify_file_device(file_path, file_dev, &dev_num, dev, files);
+	file_count = 0;
+	for (num = 0; num < entity_num; num++){
+		if (file_dev[num] >= 0)
+			file_count++;
 	}
-	if (multi_read > entity_num)
-		multi_read = entity_num;
+	if (multi_read > file_count)
+		multi_read = file_count;
+	if (multi_read < 2){	// 同時に検査できないなら一個ずつ処理する
+		free(file_dev);
+		return check_file_complete(ascii_buf, file_path, files, s_blk);
+	}
+
+	memset(hSub, 0, sizeof(HANDLE) * MAX_READ_NUM);
 	multi_num = 0;
 #ifdef TIMER
-	printf("\n cpu_num = %d, entity_num = %d, multi_read = %d\n", cpu_num, entity_num, multi_read);
+	printf("\n cpu_num = %d, entity_num = %d, dev_num = %d, multi_read = %d\n", cpu_num, entity_num, dev_num, multi_read);
 #endif
 	id_prog = -1;
 	for (i = 0; i < MAX_READ_NUM; i++)
 		th[i].num = -1;	// データ未使用の印
-	wcscpy(file_path, base_dir);
 
 	printf("\nVerifying Input File   :\n");
 	printf("         Size Status   :  Filename\n");
@@ -398,15 +530,24 @@ clock_t time_start = clock();
 	time_last = GetTickCount();
 	count_last = 0;
 	first_num = 0;	// 初めて見つけたソース・ブロックの数
-	for (num = 0; num < entity_num; num++){
+	for (pos = 0; pos < file_count; pos++){
 		if (cancel_progress() != 0){	// キャンセル処理
 			err = 2;
 			goto error_end;
 		}
 
-		// ソース・ファイルの状態 (完全、消失、破損) を判定する
-		// チェックサムが欠落してても完全かどうかは判る
-		if (files[num].size > 0){
+		// 空きのある装置のファイルから順に検査する
+		num = next_device_file(dev_num, dev);
+		if (num >= 0){
+			// その装置で次に検査するファイルを探しておく
+			i = file_dev[num];
+			for (dev[i].next = num + 1; dev[i].next < entity_num; dev[i].next++){
+				if (file_dev[dev[i].next] == i)
+					break;
+			}
+
+			// ソース・ファイルの状態 (完全、消失、破損) を判定する
+			// チェックサムが欠落してても完全かどうかは判る
 			for (id = 0; id < MAX_READ_NUM; id++){	// 未使用のスレッドを探す
 				if (th[id].num < 0)
 					break;
@@ -455,6 +596,7 @@ clock_t time_start = clock();
 							goto error_end;
 						}
 						multi_num++;
+						dev[file_dev[num]].run++;
 					} else {
 						CloseHandle(hFile);
 					}
@@ -479,6 +621,7 @@ clock_t time_start = clock();
 					CloseHandle(hSub[id]);
 					hSub[id] = NULL;
 					multi_num--;
+					dev[file_dev[th[id].num]].run--;
 				}
 			}
 			if (hSub[id] == NULL){
@@ -554,6 +697,7 @@ clock_t time_start = clock();
 							CloseHandle(hSub[id]);
 							hSub[id] = NULL;
 							multi_num--;
+							dev[file_dev[th[id].num]].run--;
 						}
 					}
 					// 経過表示してない状態なら、他の終了したスレッドの結果も表示する
@@ -581,7 +725,8 @@ clock_t time_start = clock();
 					if (th[i].num < 0)
 						break;
 				}
-				if ((num + 1 == entity_num) || (multi_num == multi_read) || (i == MAX_READ_NUM)){
+				if ((pos + 1 == file_count) || (multi_num == multi_read) || (i == MAX_READ_NUM) ||
+						(next_device_file(dev_num, dev) < 0)){
 					id = id_prog;
 					//printf("wait: num = %d, multi_num = %d, id = %d, id_prog = %d\n", num, multi_num, id, id_prog);
 					if (hSub[id]){	// 終了してるか調べる
@@ -590,6 +735,7 @@ clock_t time_start = clock();
 							CloseHandle(hSub[id]);
 							hSub[id] = NULL;
 							multi_num--;
+							dev[file_dev[th[id].num]].run--;
 						}
 						// 経過表示
 						if (GetTickCount() - time_last >= UPDATE_TIME){
@@ -656,6 +802,7 @@ error_end:
 			CloseHandle(hSub[i]);
 		}
 	}
+	free(file_dev);
 
 	return err;
 }
@@ -687,48 +834,137 @@ static int is_folder_empty(wchar_t *folder_path)	// フォルダのパス
 	return len;
 }
 
-// 指定フォルダ内の別名ファイルを探す
+// 別名ファイルの候補
+typedef struct {
+	__int64 size;			// ファイル・サイズ
+	int name;				// 基準ディレクトリからの相対パスの位置
+	int flag;				// 0=未計算, 1=MD5-16k 計算済み, -1=読み込めない
+	unsigned char hash[16];	// 先頭 16KB のハッシュ値
+} misnamed_ctx;
+
+typedef struct {
+	wchar_t *name_buf;
+	misnamed_ctx *cand;
+	int cand_num;
+	volatile long now;	// 次に計算する候補の番号
+	volatile int stop;
+} MISNAMED_TH;
+
+static int *size_list;		// 探す対象のファイル番号をサイズ順に並べたもの
+static int size_num;
+static file_ctx_r *size_files;
+
+static wchar_t *cand_buf;	// 候補ファイルの相対パスのリスト
+static int cand_len, cand_max;
+static misnamed_ctx *cand;	// 候補ファイルの情報
+static int cand_num, cand_alloc;
+
+// サイズ順、同じならファイル番号の順にする
+static int __cdecl compare_size(const void *elem1, const void *elem2)
+{
+	int num1, num2;
+
+	num1 = *((int *)elem1);
+	num2 = *((int *)elem2);
+	if (size_files[num1].size < size_files[num2].size)
+		return -1;
+	if (size_files[num1].size > size_files[num2].size)
+		return 1;
+	return num1 - num2;
+}
+
+// 指定サイズの探す対象が最初に現れる位置を返す (無ければ -1)
+static int find_size(__int64 file_size)
+{
+	int min = 0, max = size_num, mid;
+
+	while (min < max){
+		mid = (min + max) / 2;
+		if (size_files[size_list[mid]].size < file_size){
+			min = mid + 1;
+		} else {
+			max = mid;
+		}
+	}
+	if ((min < size_num) && (size_files[size_list[min]].size == file_size))
+		return min;
+	return -1;
+}
+
+// 候補ファイルを記録する
+static int add_candidate(wchar_t *file_name, __int64 file_size)
+{
+	int len;
+
+	len = (int)wcslen(file_name) + 1;
+	if (cand_len + len > cand_max){	// 領域が足りなくなるなら拡張する
+		wchar_t *tmp_p;
+		cand_max += (cand_max / 2 > ALLOC_LEN) ? cand_max / 2 : ALLOC_LEN;
+		tmp_p = (wchar_t *)realloc(cand_buf, cand_max * 2);
+		if (tmp_p == NULL){
+			printf("realloc, %d\n", cand_max);
+			return 1;
+		}
+		cand_buf = tmp_p;
+	}
+	if (cand_num >= cand_alloc){
+		misnamed_ctx *tmp_p;
+		cand_alloc += (cand_alloc / 2 > 256) ? cand_alloc / 2 : 256;
+		tmp_p = (misnamed_ctx *)realloc(cand, sizeof(misnamed_ctx) * cand_alloc);
+		if (tmp_p == NULL){
+			printf("realloc, %d\n", (int)sizeof(misnamed_ctx) * cand_alloc);
+			return 1;
+		}
+		cand = tmp_p;
+	}
+
+	cand[cand_num].size = file_size;
+	cand[cand_num].name = cand_len;
+	cand[cand_num].flag = 0;
+	wcscpy(cand_buf + cand_len, file_name);
+	cand_len += len;
+	cand_num++;
+	return 0;
+}
+
+// 指定フォルダ以下を一度だけ巡回して、サイズが一致するファイルを候補として集める
+// フォルダと空ファイルは名前で判定できるので、この時点で検出する
 // 0=正常終了, 1=エラー, 2=キャンセル
-static int recursive_search(
+static int collect_misnamed(
 	char *ascii_buf,		// 作業用
-	wchar_t *search_path,	// 検索するファイルの親ディレクトリ、見つけた別名ファイルの相対パスが戻る
+	wchar_t *search_path,	// 検索するファイルの親ディレクトリ
 	int dir_len,			// ディレクトリ部分の長さ
-	file_ctx_r *files,		// 各ソース・ファイルの情報
-	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
+	int source_len,			// ソース・ファイル名の領域の文字数 (先頭の null 文字を含む)
+	file_ctx_r *files)		// 各ソース・ファイルの情報
 {
 	__int64 file_size;	// 存在するファイルのサイズは本来のサイズとは異なることもある
-	int rv, i, num, b_last, source_len;
-	unsigned int meta_data[7];
-	HANDLE hFile, hFind;
+	int rv, i, num;
+	HANDLE hFind;
 	WIN32_FIND_DATA FindData;
 
-	// ソース・ファイル名の領域までしか比較しない (別名ファイルが検出されるのは一回だけ)
-	source_len = list_len - 1;
-
-	// 指定されたディレクトリ直下のファイルと比較する
 	wcscpy(search_path + dir_len, L"*");
 	hFind = FindFirstFile(search_path, &FindData);
-	if (hFind != INVALID_HANDLE_VALUE){
-		do {
-			if (cancel_progress() != 0){	// キャンセル処理
-				FindClose(hFind);
-				return 2;
-			}
-			if ((FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0){	// フォルダなら
-				// 親ディレクトリは無視する
-				if ((wcscmp(FindData.cFileName, L".") == 0) || (wcscmp(FindData.cFileName, L"..") == 0))
-					continue;
-				// 発見したフォルダ名が長すぎる場合は無視する
-				if (dir_len + wcslen(FindData.cFileName) + 2 >= MAX_LEN)	// 末尾に「\*」が追加される
-					continue;
-				// 現在のディレクトリ部分に見つかったフォルダ名を連結する
-				wcscpy(search_path + dir_len, FindData.cFileName);
-				wcscat(search_path + dir_len, L"\\");
-				// 他のソース・ファイルは無視する
-				if (search_file_path(list_buf + 1, source_len, search_path + base_len))	// 基準ディレクトリからの相対パスで比較する
-					continue;
-
-				// フォルダ名が検出対象と一致するかどうか確かめる
+	if (hFind == INVALID_HANDLE_VALUE)
+		return 0;
+	do {
+		if (cancel_progress() != 0){	// キャンセル処理
+			FindClose(hFind);
+			return 2;
+		}
+		if ((FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0){	// フォルダなら
+			if (switch_v & 8)	// 基準ディレクトリ直下のファイルだけを検査する
+				continue;
+			// 親ディレクトリは無視する
+			if ((wcscmp(FindData.cFileName, L".") == 0) || (wcscmp(FindData.cFileName, L"..") == 0))
+				continue;
+			// 発見したフォルダ名が長すぎる場合は無視する
+			if (dir_len + wcslen(FindData.cFileName) + 2 >= MAX_LEN)	// 末尾に「\*」が追加される
+				continue;
+			// 現在のディレクトリ部分に見つかったフォルダ名を連結する
+			wcscpy(search_path + dir_len, FindData.cFileName);
+			wcscat(search_path + dir_len, L"\\");	// ディレクトリ記号は「\」に統一してある
+			// 他のソース・ファイルでなければ、フォルダ名が検出対象と一致するかどうか確かめる
+			if (!search_file_path(list_buf, source_len, search_path + base_len)){	// 基準ディレクトリからの相対パスで比較する
 				for (num = entity_num; num < file_num; num++){	// 空フォルダは non-recovery set にしか存在しない
 					if (files[num].state == 65){	// 消失したフォルダなら
 						if (_wcsicmp(search_path + dir_len, offset_file_name(list_buf + files[num].name)) == 0){
@@ -751,316 +987,253 @@ static int recursive_search(
 						}
 					}
 				}
-				continue;
 			}
+			// そのフォルダの内部も続けて調べる
+			rv = collect_misnamed(ascii_buf, search_path, (int)wcslen(search_path), source_len, files);
+			if (rv != 0){	// エラー発生、またはキャンセルされた
+				FindClose(hFind);
+				return rv;
+			}
+			continue;
+		}
 
-			// 発見したファイル名が長すぎる場合は無視する
-			if (dir_len + wcslen(FindData.cFileName) >= MAX_LEN)
-				continue;
-			// 現在のディレクトリ部分に見つかったファイル名を連結する
-			wcscpy(search_path + dir_len, FindData.cFileName);
-			// 破損してないリカバリ・ファイルは無視する
-			if (search_file_path(recv_buf, recv_len, search_path))	// フル・パスで比較する
-				continue;
-			// 他のソース・ファイルは無視する
-			if (search_file_path(list_buf + 1, source_len, search_path + base_len))	// 基準ディレクトリからの相対パスで比較する
-				continue;
+		// 発見したファイル名が長すぎる場合は無視する
+		if (dir_len + wcslen(FindData.cFileName) >= MAX_LEN)
+			continue;
+		// 現在のディレクトリ部分に見つかったファイル名を連結する
+		wcscpy(search_path + dir_len, FindData.cFileName);
+		// 破損してないリカバリ・ファイルは無視する
+		if (search_file_path(recv_buf, recv_len, search_path))	// フル・パスで比較する
+			continue;
+		// 他のソース・ファイルは無視する
+		if (search_file_path(list_buf, source_len, search_path + base_len))	// 基準ディレクトリからの相対パスで比較する
+			continue;
 
-			// ファイル・サイズが検出対象のサイズと一致するかどうか
-			file_size = ((__int64)(FindData.nFileSizeHigh) << 32) | (__int64)(FindData.nFileSizeLow);
-			for (num = 0; num < file_num; num++){
-				if ((files[num].state & 0x03) && (files[num].size == file_size)){
-					if (file_size > 0){
-						//printf("find size %I64d, %S\n", file_size, search_path + base_len);
-						// 別名ファイルのハッシュ値を調べる
-						hFile = CreateFile(search_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
-						if (hFile != INVALID_HANDLE_VALUE){	// ファイルを開けたなら内容を確認する
-							prog_last = -1;	// 経過表示がまだの印
-							rv = check_ini_state(num, meta_data, hFile);
-							if (rv == -2){	// 検査結果の記録が無ければ
-								if ((num >= entity_num) || ((files[num].state & 0x80) != 0)){
-									// non-recovery set のファイルまたはチェックサムが欠落したソース・ファイル
-									rv = file_hash_check(num, FindData.cFileName, hFile, INT_MAX, files, NULL);
-								} else {	// 普通のソース・ファイル
-									if (files[num].state & 0x02){	// 本来のファイルが破損ならスライスの重複カウントを避ける
-										rv = files[num].state >> 8;
-									} else {
-										rv = 0;
-									}
-									rv = file_hash_check(num, FindData.cFileName, hFile, rv, files, s_blk);
-								}
-								if (rv == -2){
-									CloseHandle(hFile);
-									FindClose(hFind);
-									return 2;	// エラーは無視して続行するが、キャンセルなら中断する
-								}
-								// MD5-16k が一致した時だけ検査結果を記録する
-								if (rv != -1)
-									write_ini_state(num, meta_data, rv);
-							}
-							CloseHandle(hFile);
-							if (rv == -3){	// ファイルのハッシュ値が一致した
-								b_last = files[num].b_off + files[num].b_num;
-								for (i = files[num].b_off; i < b_last; i++)
-									s_blk[i].exist = 1;	// 全ブロックが有効と見なす
-								files[num].name2 = list_len;	// 別名・移動のファイル名を記録する
-								if (add_file_path(search_path + base_len)){
-									printf("add_file_path\n");
-									FindClose(hFind);
-									return 1;
-								}
-								if (files[num].state & 0x01){	// 本来のファイルが消失してるなら
-									files[num].state ^= 0x21;	// 消失して別名・移動 0x01 -> 0x20
-									first_num += files[num].b_num;	// ブロック数を集計する
-								} else {
-									files[num].state ^= 0x2A;	// 破損して別名・移動 0x02 -> 0x28 (スライス個数は維持する)
-									first_num += files[num].b_num - (files[num].state >> 8);	// 新たなブロック数だけ追加する
-								}
-								print_progress_file(-1, first_num, NULL);	// 重複を除外した利用可能なソース・ブロック数を表示する
-								utf16_to_cp(search_path + base_len, ascii_buf, cp_output);	// 別名・移動のファイル名を表示する
-								printf("%13I64d Found    : \"%s\"\n", file_size, ascii_buf);
-								utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);	// 本来のファイル名を表示する
-								if (compare_directory(list_buf + files[num].name, search_path + base_len) == 0){	// 同じ場所なら別名
-									printf("            = Misnamed : \"%s\"\n", ascii_buf);
-								} else {	// 別の場所なら移動
-									printf("            = Moved    : \"%s\"\n", ascii_buf);
-								}
-								break;	// 見つかった場合は、それ以降のソース・ファイルと比較しない
-							} else {
-								if (rv > 0){	// 別名の破損ファイル内にスライスを見つけたら、自動的に検査対象に追加する
-									//printf("rv = %d, %S\n", rv, search_path + base_len);
-									if (list2_buf == NULL){
-										list2_len = 0;
-										list2_max = ALLOC_LEN;
-										list2_buf = (wchar_t *)malloc(list2_max * 2);
-									}
-									if (list2_buf){
-										wchar_t *tmp_p;
-										int len = (int)wcslen(search_path);
-										if (!search_file_path(list2_buf, list2_len, search_path)){	// ファイル名が重複しないようにする
-											if (list2_len + len >= list2_max){ // 領域が足りなくなるなら拡張する
-												list2_max += ALLOC_LEN;
-												tmp_p = (wchar_t *)realloc(list2_buf, list2_max * 2);
-												if (tmp_p == NULL){
-													printf("realloc, %d\n", list2_max);
-													FindClose(hFind);
-													return 1;
-												} else {
-													list2_buf = tmp_p;
-												}
-											}
-											// そのファイルを追加する
-											//printf_cp("add external file, %s\n", search_path);
-											wcscpy(list2_buf + list2_len, search_path);
-											list2_len += len + 1;
-										}
-									}
-									if (prog_last >= 0)	// 途中までのスライス数を表示してた場合
-										print_progress_file(-1, first_num, NULL);	// 元の数に戻しておく
-								}
-								print_progress_done();	// 経過表示があれば 100% にしておく
-							}
-						}
-					} else {	// サイズが 0 (空ファイル) の場合
-						if (files[num].state & 64)
-							continue;	// 比較対象がフォルダなら無視する (ファイル名の比較ではねられるから不要？)
-						// ファイル名が同じかどうか確かめる
-						if (_wcsicmp(FindData.cFileName, offset_file_name(list_buf + files[num].name)) == 0){
-							// 移動されたファイルが見つかった
-							files[num].name2 = list_len;	// 移動されたファイル名を記録する
-							if (add_file_path(search_path + base_len)){
-								printf("add_file_path\n");
-								FindClose(hFind);
-								return 1;
-							}
-							utf16_to_cp(search_path + base_len, ascii_buf, cp_output);	// 移動されたファイル名を表示する
-							printf("            0 Found    : \"%s\"\n", ascii_buf);
-							files[num].state = 0x20;	// 空ファイルは破損しないので、消失して移動のみ
-							utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);	// 本来のファイル名を表示する
-							printf("            = Moved    : \"%s\"\n", ascii_buf);
-							break;	// 見つかった場合は、それ以降のソース・ファイルと比較しない
-						}
-					}
-				}
+		// ファイル・サイズが検出対象のサイズと一致するかどうか
+		file_size = ((__int64)(FindData.nFileSizeHigh) << 32) | (__int64)(FindData.nFileSizeLow);
+		i = find_size(file_size);
+		if (i < 0)
+			continue;
+		if (file_size > 0){	// 内容の比較は後でまとめて行う
+			if (add_candidate(search_path + base_len, file_size)){
+				FindClose(hFind);
+				return 1;
 			}
-		} while (FindNextFile(hFind, &FindData));	// 次のファイルを検索する
-	}
-	FindClose(hFind);
+			continue;
+		}
 
-	// 指定されたディレクトリ以下のフォルダ内も再帰的に調べる
-	wcscpy(search_path + dir_len, L"*");
-	hFind = FindFirstFile(search_path, &FindData);
-	if (hFind != INVALID_HANDLE_VALUE){
-		do {
-			// フォルダ以外は無視する
-			if ((FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
-				continue;
-			// 親ディレクトリは無視する
-			if ((wcscmp(FindData.cFileName, L".") == 0) || (wcscmp(FindData.cFileName, L"..") == 0))
-				continue;
-			// 発見したフォルダ名が長すぎる場合は無視する
-			if (dir_len + wcslen(FindData.cFileName) + 2 >= MAX_LEN)	// 末尾に「\*」が追加される
+		// サイズが 0 (空ファイル) の場合
+		for (; i < size_num; i++){
+			num = size_list[i];
+			if (files[num].size != 0)
+				break;
+			if ((files[num].state & 0x03) == 0)
 				continue;
-			// そのフォルダの内部を新たな検索対象にする
-			wcscpy(search_path + dir_len, FindData.cFileName);
-			wcscat(search_path + dir_len, L"\\");	// ディレクトリ記号は「\」に統一してある
-			//printf_cp("inner search... %s\n", search_path + base_len);
-			rv = recursive_search(ascii_buf, search_path, (int)wcslen(search_path), files, s_blk);
-			if (rv != 0){
-				// エラー発生、またはキャンセルされた
-				FindClose(hFind);
-				return rv;
+			if (files[num].state & 64)
+				continue;	// 比較対象がフォルダなら無視する
+			// ファイル名が同じかどうか確かめる
+			if (_wcsicmp(FindData.cFileName, offset_file_name(list_buf + files[num].name)) == 0){
+				// 移動されたファイルが見つかった
+				files[num].name2 = list_len;	// 移動されたファイル名を記録する
+				if (add_file_path(search_path + base_len)){
+					printf("add_file_path\n");
+					FindClose(hFind);
+					return 1;
+				}
+				utf16_to_cp(search_path + base_len, ascii_buf, cp_output);	// 移動されたファイル名を表示する
+				printf("            0 Found    : \"%s\"\n", ascii_buf);
+				files[num].state = 0x20;	// 空ファイルは破損しないので、消失して移動のみ
+				utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);	// 本来のファイル名を表示する
+				printf("            = Moved    : \"%s\"\n", ascii_buf);
+				break;	// 見つかった場合は、それ以降のソース・ファイルと比較しない
 			}
-		} while (FindNextFile(hFind, &FindData));	// 次のフォルダを検索する
-	}
+		}
+	} while (FindNextFile(hFind, &FindData));	// 次のファイルを検索する
 	FindClose(hFind);
 
 	return 0;
 }
 
-// フォルダを無視して、指定フォルダ内の別名ファイルを探す（サブ・フォルダに移動したファイルは検出不能）
+// 候補ファイルの先頭 16KB のハッシュ値を計算する
+static DWORD WINAPI misnamed_hash_thread(LPVOID lpParameter)
+{
+	wchar_t file_path[MAX_LEN];
+	int i;
+	MISNAMED_TH *th;
+
+	th = (MISNAMED_TH *)lpParameter;
+	wcscpy(file_path, base_dir);
+	while (th->stop == 0){
+		i = InterlockedIncrement(&(th->now));	// 次の候補
+		if (i >= th->cand_num)
+			break;
+		if (th->cand[i].size <= 16384)
+			continue;	// 16KB 以下のファイルは全体を比較するので不要
+		wcscpy(file_path + base_len, th->name_buf + th->cand[i].name);
+		if (file_md5_16(file_path, th->cand[i].hash) == 0){
+			th->cand[i].flag = 1;
+		} else {
+			th->cand[i].flag = -1;	// 読み込めないファイルは無視する
+		}
+	}
+
+	return 0;
+}
+
+// 全ての候補の MD5-16k を、装置に応じた数のスレッドで計算する
 // 0=正常終了, 1=エラー, 2=キャンセル
-static int direct_search(
+static int hash_candidate(void)
+{
+	int i, err = 0, thread_num;
+	HANDLE hSub[MAX_READ_NUM];
+	MISNAMED_TH th;
+
+	thread_num = 0;
+	for (i = 0; i < cand_num; i++){
+		if (cand[i].size > 16384)
+			thread_num++;	// 先頭部分を読み込む候補の数
+	}
+	if (thread_num == 0)
+		return 0;
+	i = device_read_num(memory_use);	// HDD は一個ずつ、SSD は同時に読み込む
+	if (thread_num > i)
+		thread_num = i;
+
+	th.name_buf = cand_buf;
+	th.cand = cand;
+	th.cand_num = cand_num;
+	th.now = -1;
+	th.stop = 0;
+	for (i = 0; i < thread_num; i++){
+		hSub[i] = (HANDLE)_beginthreadex(NULL, STACK_SIZE + MAX_LEN * 2, misnamed_hash_thread, (LPVOID)&th, 0, NULL);
+		if (hSub[i] == NULL){
+			print_win32_err();
+			printf("error, sub-thread\n");
+			th.stop = 1;
+			thread_num = i;
+			err = 1;
+			break;
+		}
+	}
+
+	// 計算が終わるまで待つ
+	if (thread_num > 0){
+		while (WaitForMultipleObjects(thread_num, hSub, TRUE, UPDATE_TIME) == WAIT_TIMEOUT){
+			if ((th.stop == 0) && (cancel_progress() != 0)){	// キャンセル処理
+				th.stop = 1;
+				err = 2;
+			}
+		}
+		for (i = 0; i < thread_num; i++)
+			CloseHandle(hSub[i]);
+	}
+
+	return err;
+}
+
+// 候補ファイルが探す対象と一致するか、全体のハッシュ値を調べる
+// 0=一致しない, 1=エラー, 2=キャンセル, 3=一致した
+static int check_misnamed(
 	char *ascii_buf,		// 作業用
-	wchar_t *search_path,	// 検索するファイルの親ディレクトリ、見つけた別名ファイルの相対パスが戻る
-	int dir_len,			// ディレクトリ部分の長さ
+	wchar_t *file_path,		// 候補ファイルのフル・パス
+	__int64 file_size,		// 候補ファイルのサイズ
+	int num,				// file_ctx におけるファイル番号
 	file_ctx_r *files,		// 各ソース・ファイルの情報
 	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
 {
-	__int64 file_size;	// 存在するファイルのサイズは本来のサイズとは異なることもある
-	int rv, i, num, b_last, source_len;
+	int rv, i, b_last;
 	unsigned int meta_data[7];
-	HANDLE hFile, hFind;
-	WIN32_FIND_DATA FindData;
-
-	// ソース・ファイル名の領域までしか比較しない (別名ファイルが検出されるのは一回だけ)
-	source_len = list_len - 1;
+	HANDLE hFile;
 
-	// 指定されたディレクトリ直下のファイルとだけ比較する
-	wcscpy(search_path + dir_len, L"*");
-	hFind = FindFirstFile(search_path, &FindData);
-	if (hFind != INVALID_HANDLE_VALUE){
-		do {
-			if (cancel_progress() != 0){	// キャンセル処理
-				FindClose(hFind);
-				return 2;
+	//printf("find size %I64d, %S\n", file_size, file_path + base_len);
+	// 別名ファイルのハッシュ値を調べる
+	hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)	// ファイルを開けなければ無視する
+		return 0;
+	prog_last = -1;	// 経過表示がまだの印
+	rv = check_ini_state(num, meta_data, hFile);
+	if (rv == -2){	// 検査結果の記録が無ければ
+		if ((num >= entity_num) || ((files[num].state & 0x80) != 0)){
+			// non-recovery set のファイルまたはチェックサムが欠落したソース・ファイル
+			rv = file_hash_check(num, offset_file_name(file_path), hFile, INT_MAX, files, NULL);
+		} else {	// 普通のソース・ファイル
+			if (files[num].state & 0x02){	// 本来のファイルが破損ならスライスの重複カウントを避ける
+				rv = files[num].state >> 8;
+			} else {
+				rv = 0;
 			}
-			if ((FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)	// フォルダなら無視する
-				continue;
-
-			// 発見したファイル名が長すぎる場合は無視する
-			if (dir_len + wcslen(FindData.cFileName) >= MAX_LEN)
-				continue;
-			// 現在のディレクトリ部分に見つかったファイル名を連結する
-			wcscpy(search_path + dir_len, FindData.cFileName);
-			// 破損してないリカバリ・ファイルは無視する
-			if (search_file_path(recv_buf, recv_len, search_path))	// フル・パスで比較する
-				continue;
-			// 他のソース・ファイルは無視する
-			if (search_file_path(list_buf + 1, source_len, search_path + base_len))	// 基準ディレクトリからの相対パスで比較する
-				continue;
+			rv = file_hash_check(num, offset_file_name(file_path), hFile, rv, files, s_blk);
+		}
+		if (rv == -2){
+			CloseHandle(hFile);
+			return 2;	// エラーは無視して続行するが、キャンセルなら中断する
+		}
+		// MD5-16k が一致した時だけ検査結果を記録する
+		if (rv != -1)
+			write_ini_state(num, meta_data, rv);
+	}
+	CloseHandle(hFile);
+
+	if (rv == -3){	// ファイルのハッシュ値が一致した
+		b_last = files[num].b_off + files[num].b_num;
+		for (i = files[num].b_off; i < b_last; i++)
+			s_blk[i].exist = 1;	// 全ブロックが有効と見なす
+		files[num].name2 = list_len;	// 別名・移動のファイル名を記録する
+		if (add_file_path(file_path + base_len)){
+			printf("add_file_path\n");
+			return 1;
+		}
+		if (files[num].state & 0x01){	// 本来のファイルが消失してるなら
+			files[num].state ^= 0x21;	// 消失して別名・移動 0x01 -> 0x20
+			first_num += files[num].b_num;	// ブロック数を集計する
+		} else {
+			files[num].state ^= 0x2A;	// 破損して別名・移動 0x02 -> 0x28 (スライス個数は維持する)
+			first_num += files[num].b_num - (files[num].state >> 8);	// 新たなブロック数だけ追加する
+		}
+		print_progress_file(-1, first_num, NULL);	// 重複を除外した利用可能なソース・ブロック数を表示する
+		utf16_to_cp(file_path + base_len, ascii_buf, cp_output);	// 別名・移動のファイル名を表示する
+		printf("%13I64d Found    : \"%s\"\n", file_size, ascii_buf);
+		utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);	// 本来のファイル名を表示する
+		if (compare_directory(list_buf + files[num].name, file_path + base_len) == 0){	// 同じ場所なら別名
+			printf("            = Misnamed : \"%s\"\n", ascii_buf);
+		} else {	// 別の場所なら移動
+			printf("            = Moved    : \"%s\"\n", ascii_buf);
+		}
+		return 3;
+	}
 
-			// ファイル・サイズが検出対象のサイズと一致するかどうか
-			file_size = ((__int64)(FindData.nFileSizeHigh) << 32) | (__int64)(FindData.nFileSizeLow);
-			for (num = 0; num < file_num; num++){
-				if ((files[num].state & 0x03) && (files[num].size == file_size)){
-					if (file_size > 0){	// サイズが 0 (空ファイル) でなければ
-						//printf("find size %I64d, %S\n", file_size, search_path + base_len);
-						// 別名ファイルのハッシュ値を調べる
-						hFile = CreateFile(search_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
-						if (hFile != INVALID_HANDLE_VALUE){	// ファイルを開けたなら内容を確認する
-							prog_last = -1;	// 経過表示がまだの印
-							rv = check_ini_state(num, meta_data, hFile);
-							if (rv == -2){	// 検査結果の記録が無ければ
-								if ((num >= entity_num) || ((files[num].state & 0x80) != 0)){
-									// non-recovery set のファイルまたはチェックサムが欠落したソース・ファイル
-									rv = file_hash_check(num, FindData.cFileName, hFile, INT_MAX, files, NULL);
-								} else {	// 普通のソース・ファイル
-									if (files[num].state & 0x02){	// 本来のファイルが破損ならスライスの重複カウントを避ける
-										rv = files[num].state >> 8;
-									} else {
-										rv = 0;
-									}
-									rv = file_hash_check(num, FindData.cFileName, hFile, rv, files, s_blk);
-								}
-								if (rv == -2){
-									CloseHandle(hFile);
-									FindClose(hFind);
-									return 2;	// エラーは無視して続行するが、キャンセルなら中断する
-								}
-								// MD5-16k が一致した時だけ検査結果を記録する
-								if (rv != -1)
-									write_ini_state(num, meta_data, rv);
-							}
-							CloseHandle(hFile);
-							if (rv == -3){	// ファイルのハッシュ値が一致した
-								b_last = files[num].b_off + files[num].b_num;
-								for (i = files[num].b_off; i < b_last; i++)
-									s_blk[i].exist = 1;	// 全ブロックが有効と見なす
-								files[num].name2 = list_len;	// 別名・移動のファイル名を記録する
-								if (add_file_path(search_path + base_len)){
-									printf("add_file_path\n");
-									FindClose(hFind);
-									return 1;
-								}
-								if (files[num].state & 0x01){	// 本来のファイルが消失してるなら
-									files[num].state ^= 0x21;	// 消失して別名・移動 0x01 -> 0x20
-									first_num += files[num].b_num;	// ブロック数を集計する
-								} else {
-									files[num].state ^= 0x2A;	// 破損して別名・移動 0x02 -> 0x28 (スライス個数は維持する)
-									first_num += files[num].b_num - (files[num].state >> 8);	// 新たなブロック数だけ追加する
-								}
-								print_progress_file(-1, first_num, NULL);	// 重複を除外した利用可能なソース・ブロック数を表示する
-								utf16_to_cp(search_path + base_len, ascii_buf, cp_output);	// 別名・移動のファイル名を表示する
-								printf("%13I64d Found    : \"%s\"\n", file_size, ascii_buf);
-								utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);	// 本来のファイル名を表示する
-								if (compare_directory(list_buf + files[num].name, search_path + base_len) == 0){	// 同じ場所なら別名
-									printf("            = Misnamed : \"%s\"\n", ascii_buf);
-								} else {	// 別の場所なら移動
-									printf("            = Moved    : \"%s\"\n", ascii_buf);
-								}
-								break;	// 見つかった場合は、それ以降のソース・ファイルと比較しない
-							} else {
-								if (rv > 0){	// 別名の破損ファイル内にスライスを見つけたら、自動的に検査対象に追加する
-									//printf("rv = %d, %S\n", rv, search_path + base_len);
-									if (list2_buf == NULL){
-										list2_len = 0;
-										list2_max = ALLOC_LEN;
-										list2_buf = (wchar_t *)malloc(list2_max * 2);
-									}
-									if (list2_buf){
-										wchar_t *tmp_p;
-										int len = (int)wcslen(search_path);
-										if (!search_file_path(list2_buf, list2_len, search_path)){	// ファイル名が重複しないようにする
-											if (list2_len + len >= list2_max){ // 領域が足りなくなるなら拡張する
-												list2_max += ALLOC_LEN;
-												tmp_p = (wchar_t *)realloc(list2_buf, list2_max * 2);
-												if (tmp_p == NULL){
-													printf("realloc, %d\n", list2_max);
-													FindClose(hFind);
-													return 1;
-												} else {
-													list2_buf = tmp_p;
-												}
-											}
-											// そのファイルを追加する
-											//printf_cp("add external file, %s\n", search_path);
-											wcscpy(list2_buf + list2_len, search_path);
-											list2_len += len + 1;
-										}
-									}
-									if (prog_last >= 0)	// 途中までのスライス数を表示してた場合
-										print_progress_file(-1, first_num, NULL);	// 元の数に戻しておく
-								}
-								print_progress_done();	// 経過表示があれば 100% にしておく
-							}
-						}
+	if (rv > 0){	// 別名の破損ファイル内にスライスを見つけたら、自動的に検査対象に追加する
+		//printf("rv = %d, %S\n", rv, file_path + base_len);
+		if (list2_buf == NULL){
+			list2_len = 0;
+			list2_max = ALLOC_LEN;
+			list2_buf = (wchar_t *)malloc(list2_max * 2);
+		}
+		if (list2_buf){
+			wchar_t *tmp_p;
+			int len = (int)wcslen(file_path);
+			if (!search_file_path(list2_buf, list2_len, file_path)){	// ファイル名が重複しないようにする
+				if (list2_len + len >= list2_max){ // 領域が足りなくなるなら拡張する
+					list2_max += ALLOC_LEN;
+					discard_index(list2_buf);
+					tmp_p = (wchar_t *)realloc(list2_buf, list2_max * 2);
+					if (tmp_p == NULL){
+						printf("realloc, %d\n", list2_max);
+						return 1;
+					} else {
+						list2_buf = tmp_p;
 					}
 				}
+				// そのファイルを追加する
+				//printf_cp("add external file, %s\n", file_path);
+				wcscpy(list2_buf + list2_len, file_path);
+				list2_len += len + 1;
 			}
-		} while (FindNextFile(hFind, &FindData));	// 次のファイルを検索する
+		}
+		if (prog_last >= 0)	// 途中までのスライス数を表示してた場合
+			print_progress_file(-1, first_num, NULL);	// 元の数に戻しておく
 	}
-	FindClose(hFind);
+	print_progress_done();	// 経過表示があれば 100% にしておく
 
 	return 0;
 }
@@ -1108,14 +1281,62 @@ int search_misnamed_file(
 	printf("\nSearching misnamed file: %d\n", b_last);	// 探す対象のファイル数
 	printf("         Size Status   :  Filename\n");
 	fflush(stdout);
+	// 探す対象をサイズ順に並べておく
+	size_list = (int *)malloc(sizeof(int) * b_last);
+	if (size_list == NULL){
+		printf("malloc, %d\n", (int)sizeof(int) * b_last);
+		return 1;
+	}
+	size_num = 0;
+	for (num = 0; num < file_num; num++){
+		if (files[num].state & 0x03)
+			size_list[size_num++] = num;
+	}
+	size_files = files;
+	qsort(size_list, size_num, sizeof(int), compare_size);
+	cand_buf = NULL;
+	cand_len = cand_max = 0;
+	cand = NULL;
+	cand_num = cand_alloc = 0;
+
+	// 基準ディレクトリ以下を一度だけ巡回して候補を集める
+	// ソース・ファイル名の領域までしか比較しない (別名ファイルが検出されるのは一回だけ)
 	wcscpy(find_path, base_dir);
-	if (switch_v & 8){	// 基準ディレクトリ直下のファイルだけを検査する
-		if (rv = direct_search(ascii_buf, find_path, base_len, files, s_blk))
-			return rv;
-	} else {	// 基準ディレクトリ以下を再帰的に検索する
-		if (rv = recursive_search(ascii_buf, find_path, base_len, files, s_blk))
-			return rv;
+	if (rv = collect_misnamed(ascii_buf, find_path, base_len, list_len, files))
+		goto error_end;
+
+	// サイズが一致した候補の MD5-16k を先に計算しておく
+	if (rv = hash_candidate())
+		goto error_end;
+
+	// サイズと MD5-16k が一致した候補だけ全体を検査する
+	for (i = 0; i < cand_num; i++){
+		if (cancel_progress() != 0){	// キャンセル処理
+			rv = 2;
+			goto error_end;
+		}
+		if (cand[i].flag < 0)
+			continue;	// 読み込めなかった候補は無視する
+		for (num = find_size(cand[i].size); (num >= 0) && (num < size_num); num++){
+			if (files[size_list[num]].size != cand[i].size)
+				break;
+			if ((files[size_list[num]].state & 0x03) == 0)
+				continue;	// 既に見つかってる
+			if ((cand[i].size > 16384) && (memcmp(cand[i].hash, files[size_list[num]].hash + 16, 16) != 0))
+				continue;	// 先頭 16KB が異なる
+			wcscpy(find_path + base_len, cand_buf + cand[i].name);
+			rv = check_misnamed(ascii_buf, find_path, cand[i].size, size_list[num], files, s_blk);
+			if (rv == 3)
+				break;	// 見つかった場合は、それ以降のソース・ファイルと比較しない
+			if (rv != 0)
+				goto error_end;
+		}
 	}
+	free(size_list);
+	if (cand_buf)
+		free(cand_buf);
+	if (cand)
+		free(cand);
 
 	// 状態ごとにファイル数を集計する
 	i = 0;		// 消失 0x01, 0x81, フォルダの消失 0x41 も
@@ -1134,6 +1355,14 @@ int search_misnamed_file(
 	printf("Damaged file count\t: %d\n", rv);
 	printf("Missing file count\t: %d\n", i);
 	return 0;
+
+error_end:
+	free(size_list);
+	if (cand_buf)
+		free(cand_buf);
+	if (cand)
+		free(cand);
+	return rv;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -1833,6 +1833,96 @@ time_total += clock() - time1_start;
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define MAX_ERROR_CANDIDATE	64	// 一度に検算するエラー位置の候補数
+
+// 候補をまとめて MD5 で検算する
+// 位置の小さい候補から順に調べて、エラー位置より前の MD5 計算結果を使い回す
+static int verify_error_candidate(
+	unsigned char *data_in,		// ハッシュ値を求めたバイト配列
+	unsigned int data_len,		// 入力バイト数
+	unsigned char *hash,		// ブロック・サイズ分の本来のハッシュ値 (16バイト, MD5)
+	int cand_num,				// 候補の数
+	unsigned int *cand_off,		// 候補のエラー位置 (降順に並んでる)
+	unsigned char *cand_mag,	// 候補のエラー内容
+	unsigned int *error_off,	// エラー開始位置
+	unsigned char *error_mag)	// エラー内容、XORでエラー訂正を取り消せる
+{
+	unsigned int prefix_len, len;
+	PHMD5 prefix_ctx, ctx;
+
+	Phmd5Begin(&prefix_ctx);
+	prefix_len = 0;
+	while (cand_num > 0){
+		cand_num--;
+		// エラー位置の手前までの 64バイト単位を計算済みにしておく
+		len = (cand_off[cand_num] & 0xFFFFFFC0) - prefix_len;
+		if (len > 0){
+			Phmd5Process(&prefix_ctx, data_in + prefix_len, len);
+			prefix_len += len;
+		}
+
+		// 試しにエラーを訂正してみる
+		data_in[cand_off[cand_num]] ^= cand_mag[cand_num];
+
+		// 正しく訂正できてるかを確認する
+		memcpy(&ctx, &prefix_ctx, sizeof(PHMD5));
+		Phmd5Process(&ctx, data_in + prefix_len, data_len - prefix_len);
+		if (data_len < block_size)	// ブロック・サイズまで 0で埋めて計算する
+			Phmd5ProcessZero(&ctx, block_size - data_len);
+		Phmd5End(&ctx);
+		if (memcmp(ctx.hash, hash, 16) == 0){
+			//printf("position = %d byte, magnitude = 0x%02X\n", cand_off[cand_num], cand_mag[cand_num]);
+			*error_off = cand_off[cand_num];
+			*error_mag = cand_mag[cand_num];
+			return 1;	// エラー訂正できた
+		}
+		// 訂正失敗ならデータを元に戻しておく
+		//printf("MD5 found errors\n");
+		data_in[cand_off[cand_num]] ^= cand_mag[cand_num];
+	}
+
+	return -1;
+}
+
+// CRC-32 の差からエラー位置の候補を探して、まとめて検算する
+static int correct_error_burst(
+	unsigned char *data_in,		// ハッシュ値を求めたバイト配列
+	unsigned int data_len,		// 入力バイト数
+	unsigned char *hash,		// ブロック・サイズ分の本来のハッシュ値 (16バイト, MD5)
+	unsigned int crc,			// 本来の CRC-32 とデータの CRC-32 の差
+	unsigned int *error_off,	// エラー開始位置
+	unsigned char *error_mag)	// エラー内容、XORでエラー訂正を取り消せる
+{
+	unsigned char cand_mag[MAX_ERROR_CANDIDATE];
+	unsigned int pos, cand_off[MAX_ERROR_CANDIDATE];
+	int cand_num;
+
+	// CRC-32 で 1バイト訂正を試みると、失敗する確率はエラー位置ごとに 1 / 2^24 ぐらい？
+	// データ・サイズが 1MB (1^20) だと、訂正できなくても 1/16 の確率で MD5 による検算が必要
+	// 先に CRC-32 だけで候補を絞り込んでから、MD5 の途中結果を共有して検算する
+	cand_num = 0;
+	for (pos = 1; pos <= data_len; pos++){
+		// 1 バイトずつ遡りながら最初のエラー発生位置を探す
+		crc = reverse_table[(crc >> 24)] ^ (crc << 8);
+
+		// 一定範囲内のエラーなら候補にする
+		if ((crc & 0xFFFFFF00) == 0){
+			cand_off[cand_num] = data_len - pos;	// エラーが発生した 1バイト目
+			cand_mag[cand_num] = (unsigned char)crc;
+			cand_num++;
+			if (cand_num == MAX_ERROR_CANDIDATE){	// 候補が多すぎる場合は途中で検算する
+				if (verify_error_candidate(data_in, data_len, hash, cand_num, cand_off, cand_mag, error_off, error_mag) > 0)
+					return 1;
+				cand_num = 0;
+			}
+		}
+	}
+	if (cand_num > 0)
+		return verify_error_candidate(data_in, data_len, hash, cand_num, cand_off, cand_mag, error_off, error_mag);
+
+	return -1;	// 訂正できず
+}
+
 // CRC-32 を使って 1バイト内のバースト・エラーを訂正する
 // -1=エラー訂正できず, 0=エラー無し, 1=エラー訂正できた
 // 全て 0 のデータの判定は他で行うこと
@@ -1845,7 +1935,7 @@ int correct_error(
 	unsigned char *error_mag)	// エラー内容、XORでエラー訂正を取り消せる
 {
 	unsigned char data_hash[16];
-	unsigned int data_crc, pos;
+	unsigned int data_crc;
 
 	// まずエラーが存在するかを調べる
 	data_crc = crc_update(0, data_in, data_len);
@@ -1858,35 +1948,9 @@ int correct_error(
 	}
 	if (data_len > 0x100000)
 		return -1;	// 1MB 以上ならエラー訂正しない
-	// CRC-32 で 1バイト訂正を試みると、失敗する確率はエラー位置ごとに 1 / 2^24 ぐらい？
-	// データ・サイズが 1MB (1^20) だと、訂正できなくても 1/16 の確率で MD5 による検算が必要
 
 	// エラー位置と程度を計算する
-	crc ^= data_crc;	// CRC-32 の差にする
-	for (pos = 1; pos <= data_len; pos++){
-		// 1 バイトずつ遡りながら最初のエラー発生位置を探す
-		crc = reverse_table[(crc >> 24)] ^ (crc << 8);
-
-		// 一定範囲内のエラーを訂正する
-		if ((crc & 0xFFFFFF00) == 0){
-			// 試しにエラーを訂正してみる
-			*error_mag = (unsigned char)crc;
-			data_in[data_len - pos] ^= *error_mag;	// エラーが発生した 1バイト目
-
-			// 正しく訂正できてるかを確認する
-			data_md5_block(data_in, data_len, data_hash);
-			if (memcmp(data_hash, hash, 16) == 0){
-				//printf("position = %d byte from end, magnitude = 0x%08X\n", pos - 1, crc);
-				*error_off = data_len - pos;
-				return 1;	// エラー訂正できた
-			}
-			// 訂正失敗ならデータを元に戻しておく
-			//printf("MD5 found errors\n");
-			data_in[data_len - pos] ^= *error_mag;
-		}
-	}
-
-	return -1;	// 訂正できず
+	return correct_error_burst(data_in, data_len, hash, crc ^ data_crc, error_off, error_mag);
 }
 
 // CRC-32 を使って 1バイト内のバースト・エラーを訂正する
@@ -1901,38 +1965,317 @@ int correct_error2(
 	unsigned int *error_off,	// エラー開始位置
 	unsigned char *error_mag)	// エラー内容、XORでエラー訂正を取り消せる
 {
-	unsigned char data_hash[16];
-	unsigned int pos;
-
 	if (data_len > 0x100000)
 		return -1;	// 1MB 以上ならエラー訂正しない
 
 	// エラー位置と程度を計算する
-	crc ^= data_crc;	// CRC-32 の差にする
-	for (pos = 1; pos <= data_len; pos++){
-		// 1 バイトずつ遡りながら最初のエラー発生位置を探す
-		crc = reverse_table[(crc >> 24)] ^ (crc << 8);
+	return correct_error_burst(data_in, data_len, hash, crc ^ data_crc, error_off, error_mag);
+}
 
-		// 一定範囲内のエラーを訂正する
-		if ((crc & 0xFFFFFF00) == 0){
-			// 試しにエラーを訂正してみる
-			*error_mag = (unsigned char)crc;
-			data_in[data_len - pos] ^= *error_mag;	// エラーが発生した 1バイト目
-
-			// 正しく訂正できてるかを確認する
-			data_md5_block(data_in, data_len, data_hash);
-			if (memcmp(data_hash, hash, 16) == 0){
-				//printf("position = %d byte from end, magnitude = 0x%08X\n", pos - 1, crc);
-				*error_off = data_len - pos;
-				return 1;	// エラー訂正できた
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// CRC-32 のシンドロームを使って、複数ビットのエラーを訂正する
+
+// 候補の数はデータ・サイズと共に増えて、それぞれ MD5 で検算する必要がある
+// 破損がひどいスライスでも無駄な計算が少なくなるように、対象を小さなスライスに限る
+#define BURST16_MAX_LEN		65536		// 16ビットのバースト・エラー訂正を試みる最大サイズ 64KB
+#define BIT2_MAX_LEN		16384		// 2ビットのエラー訂正を試みる最大サイズ 16KB
+#define BIT3_MAX_LEN		256			// 3ビットのエラー訂正を試みる最大サイズ 256バイト
+#define MAX_BIT_CANDIDATE	1024		// 一度に検算するエラー候補の数
+
+// CRC-32 の 1ビットずつの計算
+#define CRC_SHIFT1(x) (((x) >> 1) ^ (0xEDB88320 & ~(((x) & 1) - 1)))
+
+// エラー候補の内容
+typedef struct {
+	unsigned int off[3];	// エラー位置 (昇順)
+	unsigned char mag[3];	// エラー内容
+	int count;
+} error_cand;
+
+// シンドロームとエラー位置の組
+typedef struct {
+	unsigned int syndrome;	// 1ビット反転させた時の CRC-32 の差
+	unsigned int pos;		// 末尾から何ビット目か (1 ～)
+} syndrome_ctx;
+
+static syndrome_ctx *syndrome_table = NULL;
+static unsigned int *syndrome_index = NULL;	// 上位 16ビットごとの開始位置
+static unsigned int syndrome_count = 0;
+
+static int syndrome_cmp(const void *elem1, const void *elem2)
+{
+	unsigned int syn1, syn2;
+
+	syn1 = ((syndrome_ctx *)elem1)->syndrome;
+	syn2 = ((syndrome_ctx *)elem2)->syndrome;
+	if (syn1 < syn2)
+		return -1;
+	if (syn1 > syn2)
+		return 1;
+	return 0;
+}
+
+// CRC-32 のビット・エラー位置テーブルを作る
+// 末尾から m ビット目を反転させると、CRC-32 の差は 1 を m ビット分だけ計算した値になる
+// (reverse_table で遡る時とは逆向き)
+int init_syndrome_table(unsigned int max_len)	// 訂正するデータの最大サイズ
+{
+	unsigned int i, syn;
+
+	if (max_len > BIT2_MAX_LEN)
+		max_len = BIT2_MAX_LEN;
+	if (syndrome_count >= max_len * 8)
+		return 0;	// 作成済み
+	free_syndrome_table();
+
+	syndrome_table = (syndrome_ctx *)malloc(sizeof(syndrome_ctx) * max_len * 8);
+	syndrome_index = (unsigned int *)malloc(sizeof(unsigned int) * 65537);
+	if ((syndrome_table == NULL) || (syndrome_index == NULL)){
+		printf("malloc, %zd\n", sizeof(syndrome_ctx) * max_len * 8);
+		free_syndrome_table();
+		return 1;
+	}
+	syndrome_count = max_len * 8;
+
+	syn = 1;
+	for (i = 0; i < syndrome_count; i++){
+		syn = CRC_SHIFT1(syn);
+		syndrome_table[i].syndrome = syn;
+		syndrome_table[i].pos = i + 1;
+	}
+	// CRC-32 の周期は 2^32 - 1 ビットなので、同じ値は存在しない
+	qsort(syndrome_table, syndrome_count, sizeof(syndrome_ctx), syndrome_cmp);
+
+	// 上位 16ビットで範囲を絞り込めるようにする
+	i = 0;
+	for (syn = 0; syn <= 65536; syn++){
+		while ((i < syndrome_count) && ((syndrome_table[i].syndrome >> 16) < syn))
+			i++;
+		syndrome_index[syn] = i;
+	}
+
+	return 0;
+}
+
+void free_syndrome_table(void)
+{
+	if (syndrome_table){
+		free(syndrome_table);
+		syndrome_table = NULL;
+	}
+	if (syndrome_index){
+		free(syndrome_index);
+		syndrome_index = NULL;
+	}
+	syndrome_count = 0;
+}
+
+// シンドロームからエラー位置を探す (見つからなければ 0)
+static unsigned int syndrome_search(unsigned int syn)
+{
+	unsigned int min, max, i;
+
+	min = syndrome_index[syn >> 16];
+	max = syndrome_index[(syn >> 16) + 1];
+	while (min < max){
+		i = (min + max) >> 1;
+		if (syndrome_table[i].syndrome < syn){
+			min = i + 1;
+		} else if (syndrome_table[i].syndrome > syn){
+			max = i;
+		} else {
+			return syndrome_table[i].pos;
+		}
+	}
+
+	return 0;
+}
+
+static int error_cand_cmp(const void *elem1, const void *elem2)
+{
+	unsigned int off1, off2;
+
+	off1 = ((error_cand *)elem1)->off[0];
+	off2 = ((error_cand *)elem2)->off[0];
+	if (off1 < off2)
+		return -1;
+	if (off1 > off2)
+		return 1;
+	return 0;
+}
+
+// 候補に複数のビット位置を追加する (位置は末尾からのビット数で降順に渡す)
+static void add_bit_cand(
+	error_cand *ec,
+	unsigned int data_len,
+	int count,
+	unsigned int *pos)
+{
+	unsigned int bit;
+	int i;
+
+	for (i = 0; i < count; i++){
+		bit = data_len * 8 - pos[i];	// 先頭からのビット位置
+		ec->off[count - 1 - i] = bit >> 3;	// 先頭からの位置が昇順になる
+		ec->mag[count - 1 - i] = (unsigned char)(1 << (bit & 7));
+	}
+	ec->count = count;
+}
+
+// 複数のエラー候補を位置の順に MD5 で検算する
+static int verify_bit_candidate(
+	unsigned char *data_in,		// ハッシュ値を求めたバイト配列
+	unsigned int data_len,		// 入力バイト数
+	unsigned char *hash,		// ブロック・サイズ分の本来のハッシュ値 (16バイト, MD5)
+	int cand_num,				// 候補の数
+	error_cand *ec)				// エラー候補
+{
+	unsigned int prefix_len, len;
+	int i, j;
+	PHMD5 prefix_ctx, ctx;
+
+	qsort(ec, cand_num, sizeof(error_cand), error_cand_cmp);
+	Phmd5Begin(&prefix_ctx);
+	prefix_len = 0;
+	for (i = 0; i < cand_num; i++){
+		// 最初のエラー位置の手前までの 64バイト単位を計算済みにしておく
+		len = (ec[i].off[0] & 0xFFFFFFC0) - prefix_len;
+		if (len > 0){
+			Phmd5Process(&prefix_ctx, data_in + prefix_len, len);
+			prefix_len += len;
+		}
+
+		// 試しにエラーを訂正してみる
+		for (j = 0; j < ec[i].count; j++)
+			data_in[ec[i].off[j]] ^= ec[i].mag[j];
+
+		// 正しく訂正できてるかを確認する
+		memcpy(&ctx, &prefix_ctx, sizeof(PHMD5));
+		Phmd5Process(&ctx, data_in + prefix_len, data_len - prefix_len);
+		if (data_len < block_size)	// ブロック・サイズまで 0で埋めて計算する
+			Phmd5ProcessZero(&ctx, block_size - data_len);
+		Phmd5End(&ctx);
+		if (memcmp(ctx.hash, hash, 16) == 0)
+			return 1;	// エラー訂正できた
+
+		// 訂正失敗ならデータを元に戻しておく
+		for (j = 0; j < ec[i].count; j++)
+			data_in[ec[i].off[j]] ^= ec[i].mag[j];
+	}
+
+	return -1;
+}
+
+// CRC-32 を使って複数ビットのエラーや 16ビット以内のバースト・エラーを訂正する
+// -1=エラー訂正できず, 0=エラー無し, 1=エラー訂正できた
+// 位置が順当なスライスに対して使うこと (全ての位置を試すので時間がかかる)
+int correct_error_bits(
+	unsigned char *data_in,		// ハッシュ値を求めたバイト配列
+	unsigned int data_len,		// 入力バイト数
+	unsigned char *hash,		// ブロック・サイズ分の本来のハッシュ値 (16バイト, MD5)
+	unsigned int crc)			// 入力バイト数分の本来の CRC-32
+{
+	unsigned char data_hash[16], err_mag;
+	unsigned int data_crc, diff, pos[3], bit_len, h, l, err_off;
+	int cand_num;
+	error_cand *ec;
+
+	// まずエラーが存在するかを調べる
+	data_crc = crc_update(0, data_in, data_len);
+	if (data_crc == crc){
+		data_md5_block(data_in, data_len, data_hash);
+		if (memcmp(data_hash, hash, 16) == 0)
+			return 0;	// エラー無し
+		return -1;	// CRC-32 でエラーを検出できない場合は訂正もできない
+	}
+	if (data_len > BURST8_MAX_LEN)
+		return -1;
+	diff = crc ^ data_crc;	// CRC-32 の差にする
+
+	// 1バイト内のバースト・エラーならすぐに見つかる
+	if (correct_error_burst(data_in, data_len, hash, diff, &err_off, &err_mag) > 0)
+		return 1;
+	if (data_len > BURST16_MAX_LEN)
+		return -1;
+
+	ec = (error_cand *)malloc(sizeof(error_cand) * MAX_BIT_CANDIDATE);
+	if (ec == NULL)
+		return -1;
+	cand_num = 0;
+
+	// 16ビット以内のバースト・エラー
+	// 遡った位置から 3バイト以内にエラーが収まってれば、CRC-32 の差がそのままエラー内容になる
+	h = diff;
+	for (pos[0] = 1; pos[0] <= data_len; pos[0]++){
+		h = reverse_table[(h >> 24)] ^ (h << 8);
+		if (((h & 0xFF) == 0) || ((h & 0xFF000000) != 0) || ((h & 0xFFFFFF00) == 0))
+			continue;	// 先頭バイトにエラーが無い、範囲外、1バイト以内は検査済み
+		for (l = 0; (h & (1 << l)) == 0; l++);
+		for (bit_len = 23; (h & (1 << bit_len)) == 0; bit_len--);
+		if ((bit_len - l >= 16) || (data_len - pos[0] + (bit_len >> 3) >= data_len))
+			continue;
+		err_off = data_len - pos[0];
+		ec[cand_num].off[0] = err_off;
+		ec[cand_num].off[1] = err_off + 1;
+		ec[cand_num].off[2] = err_off + 2;
+		ec[cand_num].mag[0] = (unsigned char)h;
+		ec[cand_num].mag[1] = (unsigned char)(h >> 8);
+		ec[cand_num].mag[2] = (unsigned char)(h >> 16);
+		ec[cand_num].count = (bit_len >= 16) ? 3 : 2;
+		cand_num++;
+		if (cand_num == MAX_BIT_CANDIDATE){
+			if (verify_bit_candidate(data_in, data_len, hash, cand_num, ec) > 0)
+				goto found;
+			cand_num = 0;
+		}
+	}
+
+	// 離れた位置の 2～3ビットのエラー
+	bit_len = data_len * 8;
+	if ((data_len <= BIT2_MAX_LEN) && (syndrome_count >= bit_len)){
+		// 1ビット目の位置を順に変えて、残りの差をテーブルから探す
+		h = 1;
+		for (pos[0] = 1; pos[0] <= bit_len; pos[0]++){
+			h = CRC_SHIFT1(h);
+			pos[1] = syndrome_search(diff ^ h);
+			if ((pos[1] > pos[0]) && (pos[1] <= bit_len)){
+				add_bit_cand(ec + cand_num, data_len, 2, pos);
+				cand_num++;
+				if (cand_num == MAX_BIT_CANDIDATE){
+					if (verify_bit_candidate(data_in, data_len, hash, cand_num, ec) > 0)
+						goto found;
+					cand_num = 0;
+				}
+			}
+
+			if (data_len <= BIT3_MAX_LEN){
+				// 2ビット目の位置も変えて、3ビット目を探す
+				l = h;
+				for (pos[1] = pos[0] + 1; pos[1] <= bit_len; pos[1]++){
+					l = CRC_SHIFT1(l);
+					pos[2] = syndrome_search(diff ^ h ^ l);
+					if ((pos[2] > pos[1]) && (pos[2] <= bit_len)){
+						add_bit_cand(ec + cand_num, data_len, 3, pos);
+						cand_num++;
+						if (cand_num == MAX_BIT_CANDIDATE){
+							if (verify_bit_candidate(data_in, data_len, hash, cand_num, ec) > 0)
+								goto found;
+							cand_num = 0;
+						}
+					}
+				}
 			}
-			// 訂正失敗ならデータを元に戻しておく
-			//printf("MD5 found errors\n");
-			data_in[data_len - pos] ^= *error_mag;
 		}
 	}
 
+	if ((cand_num > 0) && (verify_bit_candidate(data_in, data_len, hash, cand_num, ec) > 0))
+		goto found;
+	free(ec);
 	return -1;	// 訂正できず
+
+found:
+	free(ec);
+	return 1;	// エラー訂正できた
 }
 
 /*
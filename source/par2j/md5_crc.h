@@ -120,6 +120,22 @@ int correct_error2(
 	unsigned int *error_off,	// エラー開始位置
 	unsigned char *error_mag);	// エラー内容、XORでエラー訂正を取り消せる
 
+#define BURST8_MAX_LEN		1048576		// 1バイトのバースト・エラー訂正を試みる最大サイズ 1MB (correct_error と同じ)
+
+// 2ビットの誤り位置を探すための表を作る
+int init_syndrome_table(
+	unsigned int max_len);		// 表が対応する最大バイト数
+
+void free_syndrome_table(void);
+
+// CRC-32 を使って数ビットの反転や 16ビット以内のバースト・エラーを訂正する
+// 訂正できれば 1、エラー無しなら 0、訂正できなければ -1
+int correct_error_bits(
+	unsigned char *data_in,		// ハッシュ値を求めるバイト配列 (訂正される)
+	unsigned int data_len,		// 入力バイト数
+	unsigned char *hash,		// ブロック・サイズ分のハッシュ値 (16バイト, MD5)
+	unsigned int orig_crc);		// 入力バイト数分の CRC-32
+
 
 #ifdef __cplusplus
 }
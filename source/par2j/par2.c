@@ -13,6 +13,7 @@
 #endif
 
 #include <malloc.h>
+#include <math.h>
 #include <stdio.h>
 
 #include <windows.h>
@@ -26,6 +27,7 @@
 #include "list.h"
 #include "verify.h"
 #include "repair.h"
+#include "update.h"
 #include "ini.h"
 #include "reedsolomon.h"
 
@@ -91,6 +93,8 @@ int par2_create(
 		common_size += ((64 + 16 + 2) * file_num) + (list_len * 2);	// Unicode Filename packet
 	common_size *= 2;	// 2倍確保する
 	common_size += 64 + 12;	// Creator packet "par2j v*.*.*"
+	if (subset_count > 0)
+		common_size += 64 + 8;	// Sub-Set packet
 	if (uni_buf[0] != 0){
 		//common_size += 64 + 3 + wcslen(uni_buf);	// ASCII Comment packet
 		common_size += 64 + 16 + 2 + (int)(wcslen(uni_buf) * 2);	// Unicode Comment packet
@@ -337,12 +341,211 @@ error_end:
 	return err;
 }
 
+// 要求された冗長性を満たすパリティ・ブロック数を計算する (create_set と同じ基準)
+static int trial_parity_num(
+	int parity_need,	// 指定値 (正なら個数, 負なら冗長性 % の 100倍, -200000 以下なら復元できるファイル数)
+	int parity_org,		// 本来の設定でのパリティ・ブロック数
+	int source_org,		// 本来の設定でのソース・ブロック数
+	__int64 *file_size)	// ソース・ファイルのサイズ
+{
+	int i, id, num, block_count, block_need, possible_count, extra_rate;
+	int *file_block;
+
+	if (parity_need > 0)	// 個数を指定したなら、ブロック・サイズによらない
+		return parity_need;
+
+	if ((parity_need < 0) && (parity_need > -200000)){	// 冗長性(%)
+		parity_need = -parity_need;	// % の 100倍
+		num = (int)(((unsigned int)parity_need * (unsigned int)source_num) / 10000);
+		if (((num * 10000) / source_num != parity_need) &&
+				(((num + 1) * 10000) / source_num == parity_need))
+			num++;	// 1個増やして冗長性を一致させる
+		if (num == 0)
+			num = 1;
+		return num;
+	}
+
+	if (parity_need <= -200000){	// 復元できるファイル数
+		possible_count = parity_need * -1 - 200000;
+		extra_rate = possible_count % 100;
+		possible_count /= 100;
+		if (possible_count >= entity_num)
+			return source_num;
+		file_block = (int *)malloc(sizeof(int) * file_num);
+		if (file_block != NULL){
+			block_need = 0;
+			for (i = 0; i < file_num; i++){
+				file_block[i] = 0;
+				if (file_size[i] > 0)
+					file_block[i] = (int)((file_size[i] + block_size) / block_size);
+			}
+			// ブロック数が多いファイルから順に加えていく
+			do {
+				block_count = 0;
+				id = 0;
+				for (i = 0; i < file_num; i++){
+					if (block_count < file_block[i]){
+						block_count = file_block[i];
+						id = i;
+					}
+				}
+				file_block[id] = 0;
+				block_need += block_count;
+				possible_count--;
+			} while ((possible_count > 0) && (block_count > 0));
+			free(file_block);
+			if (possible_count < 0){	// 一個未満なら最大ファイルの割合にする
+				block_need = (block_need * extra_rate + 99) / 100;
+			} else {
+				block_need = (block_need * (100 + extra_rate) + 99) / 100;
+			}
+			if (block_need > source_num)
+				block_need = source_num;
+			if (block_need == 0)
+				block_need = 1;
+			return block_need;
+		}
+	}
+
+	// 指定が不明なら、同じ冗長性になるようにする
+	return (int)(((__int64)parity_org * source_num + source_org - 1) / source_org);
+}
+
+// ブロック・サイズとブロック数を変えた場合の処理方式と、作成時と修復時の処理時間を見積もる
+// 修復時間は、パリティ・ブロックの数だけソース・ブロックが失われた場合を想定する
+static void plan_trial_setting(
+	__int64 total_data_size,	// ソース・ファイルの合計サイズ
+	int parity_need)			// 要求された冗長性
+{
+	char *method_name[7] = {"none", "single", "2-pass", "1-pass", "2-pass GPU", "1-pass GPU", "2-pass spill"};
+	wchar_t file_path[MAX_LEN];
+	int i, j, list_off, method, read_count, block_lost, source_org, parity_org, source_last;
+	int source_best, source_best2;
+	unsigned int speed, block_org, block_best, block_best2;
+	__int64 *file_size, new_size, buf_size;
+	double disk_speed, seek_time, time_calc, time_read, time_write, time_create, time_repair;
+	double time_best, time_best2;
+	WIN32_FILE_ATTRIBUTE_DATA AttrData;
+
+	// ソース・ファイルのサイズを調べておく
+	file_size = (__int64 *)malloc(sizeof(__int64) * file_num);
+	if (file_size == NULL)
+		return;
+	wcscpy(file_path, base_dir);
+	list_off = 0;
+	for (i = 0; i < file_num; i++){
+		wcscpy(file_path + base_len, list_buf + list_off);
+		while (list_buf[list_off] != 0)
+			list_off++;
+		list_off++;
+		file_size[i] = 0;
+		if (GetFileAttributesEx(file_path, GetFileExInfoStandard, &AttrData)){
+			if ((AttrData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+				file_size[i] = ((__int64)AttrData.nFileSizeHigh << 32) | (unsigned __int64)AttrData.nFileSizeLow;
+		}
+	}
+
+	speed = rs_encode_speed();
+	if (speed == 0){
+		free(file_size);
+		return;
+	}
+	get_disk_speed(&disk_speed, &seek_time);	// 測った転送速度を使う
+	printf("\nEncode speed\t\t: %u MB/s x %d threads\n", speed, cpu_num);
+	printf("Disk speed\t\t: %d MB/s\n", (int)(disk_speed / 1048576));
+	printf(" Slice size  Slice  Recovery  Method      Memory MB  Read  Create sec  Repair sec\n");
+
+	// ブロック数を 1/4 ~ 4倍の範囲で 2^(1/4) 倍ずつ変えて、要求された冗長性を満たす構成を試す
+	block_org = block_size;
+	source_org = source_num;
+	parity_org = parity_num;
+	block_best = block_best2 = block_org;
+	source_best = source_best2 = source_org;
+	time_best = time_best2 = 0;
+	source_last = 0;
+	for (j = 8; j >= -8; j--){
+		if (j == 0){
+			new_size = block_org;
+		} else {
+			new_size = (__int64)((double)block_org * pow(2.0, (double)j / 4));
+			new_size = (new_size + 3) & ~3;	// 4の倍数にする
+		}
+		if ((new_size < 4) || (new_size > MAX_BLOCK_SIZE))
+			continue;
+		block_size = (unsigned int)new_size;
+		source_num = 0;
+		for (i = 0; i < file_num; i++){
+			if (file_size[i] > 0)	// ブロック数を計算する
+				source_num += (int)((file_size[i] + block_size - 1) / (__int64)block_size);
+		}
+		if ((source_num == 0) || (source_num > MAX_SOURCE_NUM) || ((source_num == source_last) && (j != 0)))
+			continue;	// ブロック数が変わらないなら、大きくしても無意味
+		source_last = source_num;
+		parity_num = trial_parity_num(parity_need, parity_org, source_org, file_size);
+		if ((parity_num <= 0) || (parity_num + first_num > MAX_PARITY_NUM))
+			continue;
+
+		// 作成時、計算中に次のソース・ブロックを読み込むので、遅い方の時間がかかる
+		method = rs_encode_plan(&read_count, &buf_size);
+		time_calc = (double)block_size * (double)source_num * (double)parity_num / ((double)speed * 1048576 * cpu_num);
+		time_read = (double)total_data_size / disk_speed + (double)entity_num * seek_time;
+		time_write = (double)(block_size + 68) * (double)parity_num / disk_speed;
+		time_create = time_read * (read_count - 1) + time_write;
+		if (time_calc > time_read){
+			time_create += time_calc;
+		} else {
+			time_create += time_read;
+		}
+
+		// 修復時、検査で一回読み込んで、残りのブロックとパリティ・ブロックから復元して書き込む
+		// 逆行列の計算は一スレッドで行列の行ごとに掛け合わせる
+		block_lost = parity_num;
+		if (block_lost > source_num)
+			block_lost = source_num;
+		time_calc = (double)block_size * (double)source_num * (double)block_lost / ((double)speed * 1048576 * cpu_num);
+		time_calc += (double)block_lost * (double)block_lost * (double)source_num * 2 / ((double)speed * 1048576);
+		time_write = (double)block_size * (double)block_lost / disk_speed;
+		time_repair = time_read * read_count + time_write;
+		if (time_calc > time_read)
+			time_repair += time_calc - time_read;
+
+		printf("%c%10u %6d %9d  %-10s %10I64d %5d %11.1f %11.1f\n", (block_size == block_org) ? '*' : ' ',
+			block_size, source_num, parity_num, method_name[method], buf_size >> 20, read_count, time_create, time_repair);
+		if ((time_best == 0) || (time_create < time_best)){
+			time_best = time_create;
+			block_best = block_size;
+			source_best = source_num;
+		}
+		if ((time_best2 == 0) || (time_repair < time_best2)){
+			time_best2 = time_repair;
+			block_best2 = block_size;
+			source_best2 = source_num;
+		}
+	}
+	block_size = block_org;
+	source_num = source_org;
+	parity_num = parity_org;
+	free(file_size);
+
+	if (block_best != block_org){
+		printf("Fastest to create\t: /ss%u (%d slices)\n", block_best, source_best);
+	} else {
+		printf("Fastest to create\t: current\n");
+	}
+	if (block_best2 != block_org){
+		printf("Fastest to repair\t: /ss%u (%d slices)\n", block_best2, source_best2);
+	} else {
+		printf("Fastest to repair\t: current\n");
+	}
+}
+
 // リカバリ・ファイルの構成を試算する
 int par2_trial(
 	wchar_t *uni_buf,	// 作業用、入力されたコメントが入ってる
 	int packet_limit,	// リカバリ・ファイルのパケット繰り返しの制限数
 	int block_distri,	// パリティ・ブロックの分配方法
-	int switch_p)		// インデックス・ファイルを作らない, ユニコードのファイル名も記録する
+	int switch_p,		// インデックス・ファイルを作らない, ユニコードのファイル名も記録する
+	int parity_need)	// 要求された冗長性 (処理時間の見積もり用)
 {
 	int packet_num, common_size, footer_size;
 	__int64 total_data_size;
@@ -381,6 +584,10 @@ int par2_trial(
 	printf("Blocks in PAR files\t: %d.%d%%\n", footer_size / 10, footer_size % 10);
 	printf("Efficiency rate\t\t: %d.%d%%\n", common_size / 10, common_size % 10);
 
+	// 処理方法と時間を見積もる
+	if ((source_num > 0) && (parity_num > 0))
+		plan_trial_setting(total_data_size, parity_need);
+
 	printf("\nTrial end\n");
 	return 0;
 }
@@ -531,7 +738,7 @@ int par2_verify(
 
 	// ソース・ファイルが完全かどうかを調べる
 	// ファイルの状態は 完全、消失、追加、破損(完全なブロックの数) の4種類
-	if ((memory_use & 16) && (cpu_num >= 3) && (entity_num >= 2)){	// SSDなら複数ファイルを同時に処理する
+	if ((cpu_num >= 3) && (entity_num >= 2)){	// SSD や複数の装置なら複数ファイルを同時に処理する
 		err = check_file_complete_multi(ascii_buf, uni_buf, files, s_blk);
 	} else {
 		err = check_file_complete(ascii_buf, uni_buf, files, s_blk);
@@ -548,6 +755,7 @@ int par2_verify(
 		goto error_end;
 
 	// 検査が終わったらメモリーを解放する
+	discard_index(recv_buf);
 	free(recv_buf);
 	recv_buf = NULL;
 	if (switch_b & 16){
@@ -557,10 +765,17 @@ int par2_verify(
 		recv2_buf = NULL;
 	}
 	if (list2_buf){
+		discard_index(list2_buf);
 		free(list2_buf);
 		list2_buf = NULL;
 	}
 
+	// 破損ファイル内のスライスを訂正して、利用可能なブロックを増やす
+	if ((first_num < source_num) && ((switch_v & 5) != 1)){	// 簡易検査では訂正しない
+		if (err = search_bit_error_slice(uni_buf, files, s_blk))
+			goto error_end;
+	}
+
 	// ソース・ブロックを比較して、利用可能なブロックを増やす
 	if (first_num < source_num)
 		search_calculable_slice(files, s_blk);
@@ -574,8 +789,10 @@ int par2_verify(
 
 error_end:
 	close_ini_file();
-	if (recv_buf)
+	if (recv_buf){
+		discard_index(recv_buf);
 		free(recv_buf);
+	}
 	if (recv2_buf)
 		free(recv2_buf);
 	if (s_blk)
@@ -743,7 +960,7 @@ int par2_repair(
 
 	// ソース・ファイルが完全かどうかを一覧表示する
 	// ファイルの状態は 完全、消失、追加、破損(完全なブロックの数) の4種類
-	if ((memory_use & 16) && (cpu_num >= 3) && (entity_num >= 2)){	// SSDなら複数ファイルを同時に処理する
+	if ((cpu_num >= 3) && (entity_num >= 2)){	// SSD や複数の装置なら複数ファイルを同時に処理する
 		err = check_file_complete_multi(ascii_buf, uni_buf, files, s_blk);
 	} else {
 		err = check_file_complete(ascii_buf, uni_buf, files, s_blk);
@@ -776,6 +993,7 @@ int par2_repair(
 		goto error_end;
 
 	// 検査が終わったらメモリーを解放する
+	discard_index(recv_buf);
 	free(recv_buf);
 	recv_buf = NULL;
 	if (switch_b & 16){
@@ -785,10 +1003,17 @@ int par2_repair(
 		recv2_buf = NULL;
 	}
 	if (list2_buf){
+		discard_index(list2_buf);
 		free(list2_buf);
 		list2_buf = NULL;
 	}
 
+	// 破損ファイル内のスライスを訂正して、利用可能なブロックを増やす
+	if ((first_num < source_num) && ((switch_v & 5) != 1)){	// 簡易検査では訂正しない
+		if (err = search_bit_error_slice(uni_buf, files, s_blk))
+			goto error_end;
+	}
+
 	// ソース・ブロックを比較して、利用可能なブロックを増やす
 	block_count = 0;	// 逆算可能なブロック数
 	if (first_num < source_num)
@@ -930,8 +1155,10 @@ repair_end:
 
 error_end:
 	close_ini_file();
-	if (recv_buf)
+	if (recv_buf){
+		discard_index(recv_buf);
 		free(recv_buf);
+	}
 	if (recv2_buf)
 		free(recv2_buf);
 	if (s_blk)
@@ -953,6 +1180,454 @@ error_end:
 	return err;
 }
 
+// 変更されたソース・ファイルに合わせてリカバリ・ファイルを更新する
+int par2_update(
+	wchar_t *uni_buf)	// 作業用
+{
+	char ascii_buf[MAX_LEN * 3];
+	unsigned char set_id[16], *work_buf = NULL, *sum = NULL;
+	int err = 0, i, j, parity_now, recovery_lost, change_num, rewrite_flag = 0;
+	HANDLE *rcv_hFile = NULL;
+	file_ctx_r *files = NULL;
+	source_ctx_r *s_blk = NULL;
+	parity_ctx_r *p_blk = NULL;
+
+	recent_data = 0;	// 更新前の検査結果は使わない
+	init_crc_table();	// CRC 計算用のテーブルを作成する
+
+	// リカバリ・ファイルを検索する
+	if (search_recovery_files() != 0){
+		err = 1;
+		goto error_end;
+	}
+
+	// Main packet を探す (パケット・サイズは SEARCH_SIZE * 2 まで)
+	work_buf = (unsigned char *)malloc(SEARCH_SIZE * 3);
+	if (work_buf == NULL){
+		printf("malloc, %d\n", SEARCH_SIZE * 3);
+		err = 1;
+		goto error_end;
+	}
+	if (err = search_main_packet(work_buf, set_id)){
+		printf("valid file is not found\n");
+		goto error_end;
+	}
+
+	// ソース・ファイルの情報
+	files = (file_ctx_r *)malloc(sizeof(file_ctx_r) * file_num);
+	if (files == NULL){
+		printf("malloc, %zd\n", sizeof(file_ctx_r) * file_num);
+		err = 1;
+		goto error_end;
+	}
+	// Main packet から File ID を読み取る
+	for (i = 0; i < file_num; i++){
+		memcpy(files[i].id, work_buf + (16 * i), 16);
+		files[i].name = -1;
+	}
+	onepass_window_gen(block_size);	// CRC の初期値を取り除くための値を計算する
+
+	// 検査結果の記録は使わずに、ファイル情報のパケットを探す
+	if (err = search_file_packet(ascii_buf, work_buf, uni_buf, set_id, 1, files))
+		goto error_end;
+	if (err = set_file_data(ascii_buf, files))	// ソース・ファイル情報を確認して集計する
+		goto error_end;
+
+	// リカバリ・ファイルのハンドル
+	rcv_hFile = (HANDLE *)calloc(recovery_num, sizeof(HANDLE));
+	if (rcv_hFile == NULL){
+		printf("calloc, %zd\n", sizeof(HANDLE) * recovery_num);
+		err = 1;
+		goto error_end;
+	}
+	// ソース・ブロックの情報
+	s_blk = (source_ctx_r *)malloc(sizeof(source_ctx_r) * source_num);
+	if (s_blk == NULL){
+		printf("malloc, %zd\n", sizeof(source_ctx_r) * source_num);
+		err = 1;
+		goto error_end;
+	}
+	for (i = 0; i < entity_num; i++){
+		// ファイルごとにソース・ブロックの情報を設定する
+		j = files[i].b_off;	// そのファイル内のブロックの開始番号
+		parity_now = (int)(files[i].size / (__int64)block_size);
+		while (parity_now > 0){	// フルサイズのブロック
+			s_blk[j].file = i;
+			s_blk[j].size = block_size;
+			s_blk[j].exist = 0;
+			j++;
+			parity_now--;
+		}
+		parity_now = (int)(files[i].size % (__int64)block_size);
+		if (parity_now > 0){	// 半端なブロック
+			s_blk[j].file = i;
+			s_blk[j].size = parity_now;
+			s_blk[j].exist = 0;
+			j++;
+		}
+	}
+	if (parity_num > 0){
+		p_blk = (parity_ctx_r *)malloc(sizeof(parity_ctx_r) * parity_num);
+		if (p_blk == NULL){
+			printf("malloc, %zd\n", sizeof(parity_ctx_r) * parity_num);
+			err = 1;
+			goto error_end;
+		}
+		for (i = 0; i < parity_num; i++)
+			p_blk[i].exist = 0;
+	}
+
+	// 修復用のパケットを探す
+	recovery_lost = search_recovery_packet(ascii_buf, work_buf, uni_buf, set_id, rcv_hFile, files, s_blk, p_blk);
+	if (recovery_lost < 0){
+		err = -recovery_lost;
+		goto error_end;
+	}
+	free(work_buf);
+	work_buf = NULL;
+	// 破損したリカバリ・ファイルはリストから取り除かれて書き換えられないので、
+	// 古いチェックサムのパケットが同じ Set ID で残ってしまう
+	if (recovery_lost > 0){
+		j = 0;
+		for (i = 0; i < recv2_len; i += (int)wcslen(recv2_buf + i) + 1){
+			if (search_file_path(recv_buf, recv_len, recv2_buf + i) == 0)
+				j++;	// 破損してたファイル
+		}
+		if (j > 0){
+			printf("\n%d recovery file(s) are damaged, repair or create them again\n", j);
+			err = 1;
+			goto error_end;
+		}
+	}
+	// 変更箇所を調べるにはチェックサムが全て必要
+	for (i = 0; i < entity_num; i++){
+		if (files[i].state & 0x80){
+			printf("\nInput File Slice Checksum packet is missing\n");
+			err = 1;
+			goto error_end;
+		}
+	}
+
+	parity_now = first_num;	// 利用可能なパリティ・ブロックの数
+	printf("\nRecovery Slice count\t: %d\n", parity_num);
+	printf("Recovery Slice found\t: %d\n", parity_now);
+	if (parity_now == 0){
+		printf("\nRecovery Slice is not found\n");
+		err = 1;
+		goto error_end;
+	}
+
+	// ソース・ファイルの変更されたスライスを調べる
+	sum = (unsigned char *)malloc(20 * source_num);
+	if (sum == NULL){
+		printf("malloc, %d\n", 20 * source_num);
+		err = 1;
+		goto error_end;
+	}
+	if (err = check_file_change(ascii_buf, uni_buf, &change_num, sum, files, s_blk))
+		goto error_end;
+	if (change_num == 0){
+		printf("\nInput files are not changed\n");
+		goto error_end;
+	}
+	if (change_num > parity_now){	// 変更前のスライスを復元できない
+		printf("\nToo many changed slices, create recovery files again\n");
+		err = 1;
+		goto error_end;
+	}
+
+	// 全てのパリティ・ブロックを書き換えられるか確かめる
+	if (err = check_update_packet(set_id, rcv_hFile, files, p_blk))
+		goto error_end;
+
+	// テンポラリ・ファイルにコピーしてから書き換えて、最後に置き換える
+	printf("\nUpdating file   :\n");
+	rewrite_flag = 1;
+	if (err = copy_update_file(rcv_hFile))
+		goto error_end;
+	// 変更前のスライスを復元して、変更後との差分をパリティ・ブロックに追加する
+	if (err = rs_update(uni_buf, change_num, rcv_hFile, files, s_blk, p_blk))
+		goto error_end;
+	if (err = update_file_packet(set_id, rcv_hFile, sum, files, p_blk))
+		goto error_end;
+	rewrite_flag = 0;
+	if (err = finish_append_file(1, rcv_hFile))
+		goto error_end;
+	printf("\nUpdated successfully\n");
+
+	// 検査結果の記録が残ってると、古いチェックサムを読み込んでしまう
+	if (ini_path[0] != 0)
+		reset_ini_file(set_id);
+
+error_end:
+	if (rewrite_flag)	// 書き換え途中のリカバリ・ファイルを削除する
+		finish_append_file(0, rcv_hFile);
+	if (work_buf)
+		free(work_buf);
+	if (recv_buf){
+		discard_index(recv_buf);
+		free(recv_buf);
+	}
+	if (recv2_buf)
+		free(recv2_buf);
+	if (sum)
+		free(sum);
+	if (s_blk)
+		free(s_blk);
+	if (p_blk)
+		free(p_blk);
+	if (rcv_hFile){
+		for (i = 0; i < recovery_num; i++){
+			if (rcv_hFile[i])
+				CloseHandle(rcv_hFile[i]);
+		}
+		free(rcv_hFile);
+	}
+	if (files)
+		free(files);
+	return err;
+}
+
+// 既存のリカバリ・ファイルにソース・ファイルを追加する
+int par2_add(
+	wchar_t *uni_buf,	// 作業用
+	int switch_u)		// ユニコードのファイル名も記録する
+{
+	char ascii_buf[MAX_LEN * 3];
+	unsigned char set_id[16], set_id2[16], *work_buf = NULL, *main_buf = NULL, *add_packet = NULL;
+	wchar_t *add_buf;
+	int err = 0, i, j, parity_now, recovery_lost, add_num, add_size, main_size, rewrite_flag = 0;
+	int *old_index = NULL;
+	HANDLE *rcv_hFile = NULL;
+	file_ctx_r *files = NULL;
+	source_ctx_r *s_blk = NULL, *old_blk = NULL;
+	parity_ctx_r *p_blk = NULL;
+
+	// 追加するファイルのリストを退避する (既存のファイルのリストは検索時に作られる)
+	add_buf = list_buf;
+	add_num = file_num;
+	list_buf = NULL;
+	recent_data = 0;	// 追加前の検査結果は使わない
+	init_crc_table();	// CRC 計算用のテーブルを作成する
+
+	// リカバリ・ファイルを検索する
+	if (search_recovery_files() != 0){
+		err = 1;
+		goto error_end;
+	}
+
+	// Main packet を探す (パケット・サイズは SEARCH_SIZE * 2 まで)
+	work_buf = (unsigned char *)malloc(SEARCH_SIZE * 3);
+	if (work_buf == NULL){
+		printf("malloc, %d\n", SEARCH_SIZE * 3);
+		err = 1;
+		goto error_end;
+	}
+	if (err = search_main_packet(work_buf, set_id)){
+		printf("valid file is not found\n");
+		goto error_end;
+	}
+	if (block_size == 0){	// 空のファイルやフォルダだけのセットなら
+		printf("\nslice size is unknown, create recovery files again\n");
+		err = 1;
+		goto error_end;
+	}
+
+	// ソース・ファイルの情報 (追加するファイルの分も確保しておく)
+	files = (file_ctx_r *)malloc(sizeof(file_ctx_r) * (file_num + add_num));
+	if (files == NULL){
+		printf("malloc, %zd\n", sizeof(file_ctx_r) * (file_num + add_num));
+		err = 1;
+		goto error_end;
+	}
+	// Main packet から File ID を読み取る
+	for (i = 0; i < file_num; i++){
+		memcpy(files[i].id, work_buf + (16 * i), 16);
+		files[i].name = -1;
+	}
+	onepass_window_gen(block_size);	// CRC の初期値を取り除くための値を計算する
+
+	// 検査結果の記録は使わずに、ファイル情報のパケットを探す
+	if (err = search_file_packet(ascii_buf, work_buf, uni_buf, set_id, 1, files))
+		goto error_end;
+	if (err = set_file_data(ascii_buf, files))	// ソース・ファイル情報を確認して集計する
+		goto error_end;
+
+	// リカバリ・ファイルのハンドル
+	rcv_hFile = (HANDLE *)calloc(recovery_num, sizeof(HANDLE));
+	if (rcv_hFile == NULL){
+		printf("calloc, %zd\n", sizeof(HANDLE) * recovery_num);
+		err = 1;
+		goto error_end;
+	}
+	// ソース・ブロックの情報
+	old_blk = (source_ctx_r *)malloc(sizeof(source_ctx_r) * source_num);
+	if (old_blk == NULL){
+		printf("malloc, %zd\n", sizeof(source_ctx_r) * source_num);
+		err = 1;
+		goto error_end;
+	}
+	for (i = 0; i < entity_num; i++){
+		// ファイルごとにソース・ブロックの情報を設定する
+		j = files[i].b_off;	// そのファイル内のブロックの開始番号
+		parity_now = (int)(files[i].size / (__int64)block_size);
+		while (parity_now > 0){	// フルサイズのブロック
+			old_blk[j].file = i;
+			old_blk[j].size = block_size;
+			old_blk[j].exist = 0;
+			j++;
+			parity_now--;
+		}
+		parity_now = (int)(files[i].size % (__int64)block_size);
+		if (parity_now > 0){	// 半端なブロック
+			old_blk[j].file = i;
+			old_blk[j].size = parity_now;
+			old_blk[j].exist = 0;
+			j++;
+		}
+	}
+	if (parity_num > 0){
+		p_blk = (parity_ctx_r *)malloc(sizeof(parity_ctx_r) * parity_num);
+		if (p_blk == NULL){
+			printf("malloc, %zd\n", sizeof(parity_ctx_r) * parity_num);
+			err = 1;
+			goto error_end;
+		}
+		for (i = 0; i < parity_num; i++)
+			p_blk[i].exist = 0;
+	}
+
+	// 修復用のパケットを探す
+	recovery_lost = search_recovery_packet(ascii_buf, work_buf, uni_buf, set_id, rcv_hFile, files, old_blk, p_blk);
+	if (recovery_lost < 0){
+		err = -recovery_lost;
+		goto error_end;
+	}
+	free(work_buf);
+	work_buf = NULL;
+	// ブロック番号が変わるかもしれないので、チェックサムが全て必要
+	for (i = 0; i < file_num; i++){
+		if ((i < entity_num) && (files[i].state & 0x80)){
+			printf("\nInput File Slice Checksum packet is missing\n");
+			err = 1;
+			goto error_end;
+		}
+		files[i].state = 0;	// 追加したファイルと区別する
+	}
+	printf("\nRecovery Slice count\t: %d\n", parity_num);
+	printf("Recovery Slice found\t: %d\n", first_num);
+
+	// 全てのリカバリ・ファイルを作り直せるか確かめる
+	if (err = check_update_packet(set_id, rcv_hFile, files, p_blk))
+		goto error_end;
+
+	// 追加するファイルの情報を集める
+	if (err = get_append_files(ascii_buf, uni_buf, add_buf, add_num, files))
+		goto error_end;
+	printf("\nInput File count\t: %d\n", file_num);
+	printf("Input File Slice count\t: %d\n", source_num);
+
+	// ファイルを並べ替えて、新しい Main packet と Recovery Set ID を作る
+	old_index = (int *)malloc(sizeof(int) * source_num);
+	s_blk = (source_ctx_r *)malloc(sizeof(source_ctx_r) * source_num);
+	main_size = 64 + 12 + (16 * file_num);
+	main_buf = (unsigned char *)malloc(main_size);
+	if ((old_index == NULL) || (s_blk == NULL) || (main_buf == NULL)){
+		printf("malloc, %d\n", main_size);
+		err = 1;
+		goto error_end;
+	}
+	i = set_append_order(main_buf + 64, old_index, files, s_blk, old_blk);
+	data_md5(main_buf + 64, i, set_id2);	// 新しい Recovery Set ID を計算する
+	set_packet_header(main_buf, set_id2, 1, i);	// パケット・ヘッダーを作成する
+	data_md5(main_buf + 32, 32 + i, main_buf + 16);	// パケットの MD5 を計算する
+	free(old_blk);
+	old_blk = NULL;
+
+	// 追加されたファイルのパケットを作る
+	add_size = 0;
+	for (i = 0; i < file_num; i++){
+		if ((files[i].state & 16) == 0)
+			continue;
+		j = (int)wcslen(list_buf + files[i].name);
+		add_size += 64 + 56 + 3 + (j * 3);	// File Description packet
+		add_size += 64 + 16 + (20 * files[i].b_num);	// Input File Slice Checksum packet
+		if (switch_u != 0)
+			add_size += 64 + 16 + 2 + (j * 2);	// Unicode Filename packet
+	}
+	if (add_size == 0){	// 追加するファイルが無い
+		printf("\nthere is no file to add\n");
+		err = 1;
+		goto error_end;
+	}
+	add_packet = (unsigned char *)malloc(add_size);
+	if (add_packet == NULL){
+		printf("malloc, %d\n", add_size);
+		err = 1;
+		goto error_end;
+	}
+	add_size = set_append_packet(ascii_buf, add_packet, set_id2, switch_u, files, s_blk);
+	if (add_size <= 2){	// パケットのサイズではなくエラー (1) かキャンセル (2)
+		err = add_size;
+		goto error_end;
+	}
+
+	// リカバリ・ファイルを作り直して、パリティ・ブロックに追加分を足す
+	rewrite_flag = 1;
+	if (err = rewrite_append_file(set_id, main_buf, main_size, add_packet, add_size, rcv_hFile, p_blk))
+		goto error_end;
+	if (parity_num > 0){
+		if (err = rs_append(uni_buf, rcv_hFile, files, s_blk, p_blk, old_index))
+			goto error_end;
+	}
+	rewrite_flag = 0;
+	if (err = finish_append_file(1, rcv_hFile))
+		goto error_end;
+	printf("\nAdded successfully\n");
+
+	// 古い Set ID の検査結果は不要になる
+	if (ini_path[0] != 0)
+		reset_ini_file(set_id);
+
+error_end:
+	if (rewrite_flag)	// 作り直したリカバリ・ファイルを削除する
+		finish_append_file(0, rcv_hFile);
+	if (add_buf){
+		discard_index(add_buf);
+		free(add_buf);
+	}
+	if (work_buf)
+		free(work_buf);
+	if (main_buf)
+		free(main_buf);
+	if (add_packet)
+		free(add_packet);
+	if (recv_buf){
+		discard_index(recv_buf);
+		free(recv_buf);
+	}
+	if (recv2_buf)
+		free(recv2_buf);
+	if (old_index)
+		free(old_index);
+	if (old_blk)
+		free(old_blk);
+	if (s_blk)
+		free(s_blk);
+	if (p_blk)
+		free(p_blk);
+	if (rcv_hFile){
+		for (i = 0; i < recovery_num; i++){
+			if (rcv_hFile[i])
+				CloseHandle(rcv_hFile[i]);
+		}
+		free(rcv_hFile);
+	}
+	if (files)
+		free(files);
+	return err;
+}
+
 // ソース・ファイルの一覧を表示する
 int par2_list(
 	wchar_t *uni_buf,	// 作業用
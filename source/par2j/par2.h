@@ -18,7 +18,8 @@ int par2_trial(
 	wchar_t *uni_buf,	// 作業用、入力されたコメントが入ってる
 	int packet_limit,	// リカバリ・ファイルのパケット繰り返しの制限数
 	int block_distri,	// パリティ・ブロックの分配方法
-	int switch_p);		// インデックス・ファイルを作らない, ユニコードのファイル名も記録する
+	int switch_p,		// インデックス・ファイルを作らない, ユニコードのファイル名も記録する
+	int parity_need);	// 要求された冗長性 (処理時間の見積もり用)
 
 // ソース・ファイルの破損や欠損を調べる
 int par2_verify(wchar_t *uni_buf);	// 作業用
@@ -26,6 +27,14 @@ int par2_verify(wchar_t *uni_buf);	// 作業用
 // ソース・ファイルの破損や欠損を修復する
 int par2_repair(wchar_t *uni_buf);	// 作業用
 
+// 変更されたソース・ファイルに合わせてリカバリ・ファイルを更新する
+int par2_update(wchar_t *uni_buf);	// 作業用
+
+// 既存のリカバリ・ファイルにソース・ファイルを追加する
+int par2_add(
+	wchar_t *uni_buf,	// 作業用
+	int switch_u);		// ユニコードのファイル名も記録する
+
 // ソース・ファイルの一覧を表示する
 int par2_list(
 	wchar_t *uni_buf,	// 作業用
@@ -12,11 +12,15 @@
 #define _WIN32_WINNT 0x0601	// Windows 7 or later
 #endif
 
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
 #include <stdio.h>
 
 #include <windows.h>
 
 #include "common2.h"
+#include "gf16.h"
 #include "par2.h"
 #include "ini.h"
 #include "json.h"
@@ -30,12 +34,18 @@ static void print_help(void)
 "Usage\n"
 "t(rial)  [options] <par file> [input files]\n"
 "c(reate) [options] <par file> [input files]\n"
-"  available: f,fu,fo,fa,fe,ss,sn,sr,sm,rr,rn,rp,rs,rd,rf,ri,\n"
+"  available: f,fu,fo,fa,fe,ss,sn,sr,sm,sw,rr,rn,rp,rs,rd,rf,ri,\n"
 "\t     lr,lp,ls,lc,m,vs,vd,c,d,in,up,uo\n"
 "v(erify) [options] <par file> [external files]\n"
 "r(epair) [options] <par file> [external files]\n"
 "  available: f,fu,fo,lc,m,vl,vs,vd,d,uo,w,b,br,bi\n"
+"u(pdate) [options] <par file>\n"
+"  available: lc,m,vd,d,uo\n"
+"a(dd)    [options] <par file> [input files]\n"
+"  available: f,fu,fo,fa,fe,lc,m,vd,d,up,uo\n"
 "l(ist)   [uo,h   ] <par file>\n"
+"b(atch)  [fu     ] <command list>\n"
+"s(erver)           <pipe name>\n"
 "\nOption\n"
 " /f    : Use file-list instead of filename\n"
 " /fu   : Use file-list which is encoded with UTF-8\n"
@@ -46,6 +56,7 @@ static void print_help(void)
 " /sn<n>: Number of source blocks\n"
 " /sr<n>: Rate of source block count and size\n"
 " /sm<n>: Slice size becomes a multiple of this value\n"
+" /sw   : Split into multiple recovery sets for small slice size\n"
 " /rr<n>: Rate of redundancy (%%)\n"
 " /rn<n>: Number of recovery blocks\n"
 " /rp<n>: Number of possible recovered files\n"
@@ -284,95 +295,251 @@ fclose(fp);
 	return 0;
 }
 
-// ファイルを検索してファイル・リストに追加する
-static int search_files(
-	wchar_t *search_path,	// 検索するファイルのフル・パス、* ? も可
-	int dir_len,			// ディレクトリ部分の長さ
-	unsigned int filter,	//  2, FILE_ATTRIBUTE_HIDDEN    = 隠しファイルを無視する
-							//  4, FILE_ATTRIBUTE_SYSTEM    = システムファイルを無視する
-							// 16, FILE_ATTRIBUTE_DIRECTORY = ディレクトリを無視する
-	int single_file)		// -1 = *や?で検索指定、0～ = 単独指定
-{
-	int len, dir_len2, old_num;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// 子フォルダの内容を複数のスレッドで先に列挙しておく
+
+#define MAX_WALK_NUM	16	// 列挙するスレッドの最大数 (ネットワーク上では待ち時間が長い)
+
+typedef struct walk_node_ walk_node;
+
+// 列挙したファイルやフォルダ
+typedef struct {
+	__int64 size;			// ファイル・サイズ
+	unsigned int attrib;	// 属性
+	int name;				// 名前の開始位置
+	int flag;				// 1=除外対象のファイル
+	walk_node *child;		// 子フォルダの内容 (列挙しない場合は NULL)
+} walk_entry;
+
+// 列挙したフォルダ
+struct walk_node_ {
+	wchar_t *path;			// 検索するパス (末尾は「*」)
+	int dir_len;			// ディレクトリ部分の長さ
+	wchar_t *name_buf;		// 見つけた名前のリスト
+	walk_entry *entry;
+	int entry_num;
+	volatile long done;		// 0=列挙待ち, 1=列挙済み, 2=エラー
+};
+
+static struct {
+	walk_node **queue;		// 列挙待ちのフォルダ
+	int queue_num;
+	int queue_max;
+	int queue_next;			// 次に列挙するフォルダの番号
+	unsigned int filter;	// 無視する属性
 	unsigned int attrib_filter;
-	__int64 file_size;
+	int single_file;
+	CRITICAL_SECTION cs;
+	HANDLE hSem;			// 列挙待ちの数
+	HANDLE hDone;			// 列挙が終わった合図
+	volatile int stop;
+} walk;
+
+// フォルダを列挙待ちに追加する
+static walk_node * walk_push(wchar_t *path, int dir_len)
+{
+	walk_node *node;
+
+	node = (walk_node *)calloc(1, sizeof(walk_node));
+	if (node == NULL)
+		return NULL;
+	node->path = (wchar_t *)malloc((dir_len + 2) * 2);
+	if (node->path == NULL){
+		free(node);
+		return NULL;
+	}
+	memcpy(node->path, path, dir_len * 2);
+	node->path[dir_len    ] = '*';
+	node->path[dir_len + 1] = 0;
+	node->dir_len = dir_len;
+
+	EnterCriticalSection(&(walk.cs));
+	if (walk.queue_num >= walk.queue_max){	// 領域が足りなくなるなら拡張する
+		walk_node **tmp_p;
+		int new_max = walk.queue_max + ((walk.queue_max > 1024) ? walk.queue_max / 2 : 1024);
+		tmp_p = (walk_node **)realloc(walk.queue, sizeof(walk_node *) * new_max);
+		if (tmp_p == NULL){
+			LeaveCriticalSection(&(walk.cs));
+			free(node->path);
+			free(node);
+			return NULL;
+		}
+		walk.queue = tmp_p;
+		walk.queue_max = new_max;
+	}
+	walk.queue[walk.queue_num++] = node;
+	LeaveCriticalSection(&(walk.cs));
+	ReleaseSemaphore(walk.hSem, 1, NULL);
+
+	return node;
+}
+
+// 列挙待ちのフォルダを一個取り出す (無ければ NULL)
+static walk_node * walk_pop(void)
+{
+	walk_node *node = NULL;
+
+	EnterCriticalSection(&(walk.cs));
+	if (walk.queue_next < walk.queue_num)
+		node = walk.queue[walk.queue_next++];
+	LeaveCriticalSection(&(walk.cs));
+
+	return node;
+}
+
+// フォルダの内容を列挙して、子フォルダを列挙待ちに追加する
+// 除外するファイルの判定もここで行う
+static void walk_list(walk_node *node)
+{
+	wchar_t path[MAX_LEN];
+	int len, name_len, name_max, entry_max, err = 0;
 	HANDLE hFind;
 	WIN32_FIND_DATA FindData;
 
-	// 隠しファイルを見つけるかどうか
-	attrib_filter = filter & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
-	if (attrib_filter == 0)
-		attrib_filter = INVALID_FILE_ATTRIBUTES;
+	name_len = name_max = entry_max = 0;
+	memcpy(path, node->path, node->dir_len * 2);
+	// 一度に多くの項目を取得して、ネットワーク上での往復を減らす
+	hFind = FindFirstFileEx(node->path, FindExInfoBasic, &FindData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (hFind != INVALID_HANDLE_VALUE){
+		do {
+			if ((wcscmp(FindData.cFileName, L".") == 0) || (wcscmp(FindData.cFileName, L"..") == 0))
+				continue;	// 自分や親のパスは無視する
+
+			len = (int)wcslen(FindData.cFileName) + 1;
+			if (name_len + len > name_max){	// 領域が足りなくなるなら拡張する
+				wchar_t *tmp_p;
+				name_max += (name_max > 4096) ? name_max / 2 : 4096;
+				if (name_max < name_len + len)
+					name_max = name_len + len;
+				tmp_p = (wchar_t *)realloc(node->name_buf, name_max * 2);
+				if (tmp_p == NULL){
+					err = 1;
+					break;
+				}
+				node->name_buf = tmp_p;
+			}
+			if (node->entry_num >= entry_max){
+				walk_entry *tmp_p;
+				entry_max += (entry_max > 256) ? entry_max / 2 : 256;
+				tmp_p = (walk_entry *)realloc(node->entry, sizeof(walk_entry) * entry_max);
+				if (tmp_p == NULL){
+					err = 1;
+					break;
+				}
+				node->entry = tmp_p;
+			}
+			node->entry[node->entry_num].size = ((__int64)FindData.nFileSizeHigh << 32) | (__int64)FindData.nFileSizeLow;
+			node->entry[node->entry_num].attrib = FindData.dwFileAttributes;
+			node->entry[node->entry_num].name = name_len;
+			node->entry[node->entry_num].flag = 0;
+			node->entry[node->entry_num].child = NULL;
+			wcscpy(node->name_buf + name_len, FindData.cFileName);
+			name_len += len;
+			node->entry_num++;
+
+			// 長すぎる名前はエラーになるので、それ以上調べない
+			if (node->dir_len + len - 1 >= MAX_LEN - ADD_LEN - 2)
+				continue;
+			if ((walk.single_file < 0) && ((FindData.dwFileAttributes & walk.attrib_filter) == walk.attrib_filter))
+				continue;	// 検索中は隠し属性が付いてるファイルを無視する
+			wcscpy(path + node->dir_len, FindData.cFileName);
+			if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){	// フォルダなら
+				if ((walk.filter & FILE_ATTRIBUTE_DIRECTORY) == 0){
+					wcscat(path, L"\\");
+					node->entry[node->entry_num - 1].child = walk_push(path, node->dir_len + len);
+					if (node->entry[node->entry_num - 1].child == NULL){
+						err = 1;
+						break;
+					}
+				}
+			} else if ((walk.single_file < 0) && (list2_buf)){	// 除外するファイル名が指定されてるなら
+				if (exclude_path(path + base_len) != 0)
+					node->entry[node->entry_num - 1].flag = 1;
+			}
+		} while (FindNextFile(hFind, &FindData)); // 次のファイルを検索する
+		FindClose(hFind);
+	}
 
-	if (list_buf == NULL){
-		list_len = 0;
-		list_max = ALLOC_LEN;
-		list_buf = (wchar_t *)malloc(list_max * 2);
-		if (list_buf == NULL){
-			printf("malloc, %d\n", list_max * 2);
-			return 1;
-		}
+	InterlockedExchange(&(node->done), 1 + err);
+	SetEvent(walk.hDone);
+}
+
+static DWORD WINAPI walk_thread(LPVOID lpParameter)
+{
+	walk_node *node;
+
+	while (walk.stop == 0){
+		WaitForSingleObject(walk.hSem, INFINITE);	// 列挙待ちが追加されるまで待つ
+		if (walk.stop != 0)
+			break;
+		node = walk_pop();
+		if (node != NULL)
+			walk_list(node);
 	}
 
-	// 末尾に「\」を付けてフォルダを指定してるなら内部を検索しない
-	len = (int)wcslen(search_path);
-	if (search_path[len - 1] == '\\'){
-		unsigned int rv;
-		rv = GetFileAttributes(search_path);
-		if ((rv != INVALID_FILE_ATTRIBUTES) && (rv & FILE_ATTRIBUTE_DIRECTORY)){	// そのフォルダが存在するなら
-			if (!search_file_path(list_buf, list_len, search_path + base_len)){	// フォルダ名が重複しないようにする
-				// そのフォルダを追加する
-				if (add_file_path(search_path + base_len)){
-					printf("add_file_path\n");
-					return 1;
-				}
-				file_num++;
-			}
+	return 0;
+}
+
+// 指定フォルダの列挙が終わるまで待つ (待つ間は他のフォルダを列挙する)
+static int walk_wait(walk_node *node)
+{
+	walk_node *node2;
+
+	while (node->done == 0){
+		node2 = walk_pop();
+		if (node2 != NULL){
+			walk_list(node2);
+		} else {
+			WaitForSingleObject(walk.hDone, INFINITE);
 		}
-		return 0;
 	}
 
-	// 検索する
-	hFind = FindFirstFile(search_path, &FindData);
-	if (hFind == INVALID_HANDLE_VALUE)	// 見つからなかったら
-		return 0;
-	do {
-		if ((wcscmp(FindData.cFileName, L".") == 0) || (wcscmp(FindData.cFileName, L"..") == 0))
-			continue;	// 自分や親のパスは無視する
-		if ((single_file < 0) && ((FindData.dwFileAttributes & attrib_filter) == attrib_filter))
+	return node->done - 1;	// 0=正常, 1=エラー
+}
+
+static void walk_free(walk_node *node)
+{
+	if (node->path)
+		free(node->path);
+	if (node->name_buf)
+		free(node->name_buf);
+	if (node->entry)
+		free(node->entry);
+	free(node);
+}
+
+// 列挙済みのフォルダ内容をファイル・リストに追加する
+static int add_walk_files(
+	wchar_t *search_path,	// 作業用、ディレクトリ部分が入ってる
+	int dir_len,			// ディレクトリ部分の長さ
+	walk_node *node)		// 列挙したフォルダ
+{
+	int i, len, dir_len2, old_num;
+	wchar_t *file_name;
+	walk_entry *entry;
+
+	if (walk_wait(node)){
+		printf("cannot list folder\n");
+		return 1;
+	}
+
+	for (i = 0; i < node->entry_num; i++){
+		entry = &(node->entry[i]);
+		file_name = node->name_buf + entry->name;
+		if ((walk.single_file < 0) && ((entry->attrib & walk.attrib_filter) == walk.attrib_filter))
 			continue;	// 検索中は隠し属性が付いてるファイルを無視する
 
-		len = (int)wcslen(FindData.cFileName);	// 見つけたファイル名の文字数
+		len = (int)wcslen(file_name);	// 見つけたファイル名の文字数
 		if (dir_len + len >= MAX_LEN - ADD_LEN - 2){	// 末尾に「\*」を付けて再検索するので
-			FindClose(hFind);
 			printf("filename is too long\n");
 			return 1;
 		}
 		// 現在のディレクトリ部分に見つかったファイル名を連結する
-		wcscpy(search_path + dir_len, FindData.cFileName);
+		wcscpy(search_path + dir_len, file_name);
 
 		// フォルダなら
-		if (FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){
-			if ((filter & FILE_ATTRIBUTE_DIRECTORY) == 0){
-/*
-				if (list2_buf){	// 途中のフォルダ名も比較して除外するなら
-					int off = 0;
-					while (off < list2_len){
-						if (list2_buf[off++] == '-'){	// deny
-							if (PathMatchWild(search_path + base_len, list2_buf + off) != 0){
-								printf_cp("deny : \"%s\"", search_path + base_len);
-								printf_cp(" : \"%s\"\n", list2_buf + off);
-								off = -1;
-								break;
-							}
-						}
-						off += wcslen(list2_buf + off) + 1;
-					}
-					if (off < 0)
-						continue;	// 除外対象なら無視する
-				}
-*/
-
+		if (entry->attrib & FILE_ATTRIBUTE_DIRECTORY){
+			if ((walk.filter & FILE_ATTRIBUTE_DIRECTORY) == 0){
 				// フォルダの末尾は「\」にする
 				wcscat(search_path, L"\\");
 				if (!search_file_path(list_buf, list_len, search_path + base_len)){	// フォルダ名が重複しないようにする
@@ -381,15 +548,12 @@ static int search_files(
 
 					// そのフォルダの中身を更に検索する
 					dir_len2 = (int)wcslen(search_path);
-					search_path[dir_len2    ] = '*';	// 末尾に「*」を追加する
-					search_path[dir_len2 + 1] = 0;
-					if (search_files(search_path, dir_len2, filter, single_file)){
-						FindClose(hFind);
+					if (add_walk_files(search_path, dir_len2, entry->child)){
 						printf("cannot search inner folder\n");
 						return 1;
 					}
 					if (old_num == file_num){	// 空のフォルダも含める
-						search_path[dir_len2] = 0;	// 検索用に追加した「*」を取り除く
+						search_path[dir_len2] = 0;	// 中身の検索で追加された名前を取り除く
 
 						if (list2_buf){	// 除外するフォルダ名が指定されてるなら
 							if (exclude_path(search_path + base_len) != 0)
@@ -398,7 +562,6 @@ static int search_files(
 
 						// リストにコピーする
 						if (add_file_path(search_path + base_len)){
-							FindClose(hFind);
 							printf("add_file_path\n");
 							return 1;
 						}
@@ -407,34 +570,136 @@ static int search_files(
 				}
 			}
 		} else {	// ファイルなら
-			if ((single_file < 0) && (list2_buf)){	// 除外するファイル名が指定されてるなら
-				if (exclude_path(search_path + base_len) != 0)
-					continue;	// 除外対象なら無視する
-			}
+			if (entry->flag)	// 除外対象ならスレッド側で判定済み
+				continue;
 
 			if (!search_file_path(list_buf, list_len, search_path + base_len)){	// ファイル名が重複しないようにする
 				// リストにコピーする
 				if (add_file_path(search_path + base_len)){
-					FindClose(hFind);
 					printf("add_file_path\n");
 					return 1;
 				}
 				file_num++;
-				file_size = ((__int64)FindData.nFileSizeHigh << 32) | (__int64)FindData.nFileSizeLow;
-				total_file_size += file_size;
-				if (file_size > 0)
+				total_file_size += entry->size;
+				if (entry->size > 0)
 					entity_num++;
 				// サブ・ディレクトリまたはフォルダを含む場合はファイル分割を無効にする
 				if ((split_size != 0) && (wcschr(search_path + base_len, '\\') != NULL))
 					split_size = 0;
 			}
 		}
-	} while (FindNextFile(hFind, &FindData)); // 次のファイルを検索する
-	FindClose(hFind);
+	}
 
 	return 0;
 }
 
+// ファイルを検索してファイル・リストに追加する
+// 子フォルダの内容は複数のスレッドで列挙しながら、元と同じ順序で追加していく
+static int search_files(
+	wchar_t *search_path,	// 検索するファイルのフル・パス、* ? も可
+	int dir_len,			// ディレクトリ部分の長さ
+	unsigned int filter,	//  2, FILE_ATTRIBUTE_HIDDEN    = 隠しファイルを無視する
+							//  4, FILE_ATTRIBUTE_SYSTEM    = システムファイルを無視する
+							// 16, FILE_ATTRIBUTE_DIRECTORY = ディレクトリを無視する
+	int single_file)		// -1 = *や?で検索指定、0～ = 単独指定
+{
+	int i, len, err = 0, thread_num;
+	HANDLE hSub[MAX_WALK_NUM];
+	walk_node *root;
+
+	if (list_buf == NULL){
+		list_len = 0;
+		list_max = ALLOC_LEN;
+		list_buf = (wchar_t *)malloc(list_max * 2);
+		if (list_buf == NULL){
+			printf("malloc, %d\n", list_max * 2);
+			return 1;
+		}
+	}
+
+	// 末尾に「\」を付けてフォルダを指定してるなら内部を検索しない
+	len = (int)wcslen(search_path);
+	if (search_path[len - 1] == '\\'){
+		unsigned int rv;
+		rv = GetFileAttributes(search_path);
+		if ((rv != INVALID_FILE_ATTRIBUTES) && (rv & FILE_ATTRIBUTE_DIRECTORY)){	// そのフォルダが存在するなら
+			if (!search_file_path(list_buf, list_len, search_path + base_len)){	// フォルダ名が重複しないようにする
+				// そのフォルダを追加する
+				if (add_file_path(search_path + base_len)){
+					printf("add_file_path\n");
+					return 1;
+				}
+				file_num++;
+			}
+		}
+		return 0;
+	}
+
+	// 隠しファイルを見つけるかどうか
+	memset(&walk, 0, sizeof(walk));
+	walk.filter = filter;
+	walk.attrib_filter = filter & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+	if (walk.attrib_filter == 0)
+		walk.attrib_filter = INVALID_FILE_ATTRIBUTES;
+	walk.single_file = single_file;
+	InitializeCriticalSection(&(walk.cs));
+	walk.hSem = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	walk.hDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+	root = (walk_node *)calloc(1, sizeof(walk_node));
+	if ((walk.hSem == NULL) || (walk.hDone == NULL) || (root == NULL)){
+		print_win32_err();
+		err = 1;
+		goto error_end;
+	}
+
+	// 指定された場所はここで列挙する
+	root->path = search_path;
+	root->dir_len = dir_len;
+	walk_list(root);
+	root->path = NULL;
+
+	// 子フォルダがあれば、スレッドを起動して先に列挙していく
+	thread_num = 0;
+	if (walk.queue_num > 0){
+		len = (cpu_num & 0xFFFF) * 2;	// 待ち時間が長いので Core 数よりも多くする
+		if (len > MAX_WALK_NUM)
+			len = MAX_WALK_NUM;
+		for (i = 0; i < len; i++){
+			hSub[thread_num] = (HANDLE)_beginthreadex(NULL, STACK_SIZE + MAX_LEN * 2, walk_thread, NULL, 0, NULL);
+			if (hSub[thread_num] == NULL)
+				break;	// 起動できなくても、待つ間にメイン・スレッドで列挙する
+			thread_num++;
+		}
+	}
+
+	// 元の順序でファイル・リストに追加する
+	err = add_walk_files(search_path, dir_len, root);
+
+	// スレッドを終了させる
+	walk.stop = 1;
+	if (thread_num > 0){
+		ReleaseSemaphore(walk.hSem, thread_num, NULL);
+		WaitForMultipleObjects(thread_num, hSub, TRUE, INFINITE);
+		for (i = 0; i < thread_num; i++)
+			CloseHandle(hSub[i]);
+	}
+
+error_end:
+	if (root)
+		walk_free(root);
+	for (i = 0; i < walk.queue_num; i++)
+		walk_free(walk.queue[i]);
+	if (walk.queue)
+		free(walk.queue);
+	if (walk.hSem)
+		CloseHandle(walk.hSem);
+	if (walk.hDone)
+		CloseHandle(walk.hDone);
+	DeleteCriticalSection(&(walk.cs));
+
+	return err;
+}
+
 // 外部ファイルのリストを読み込んでバッファーに書き込む
 static int read_external_list(
 	wchar_t *list_path,		// リストのパス
@@ -494,6 +759,7 @@ static int read_external_list(
 		if (!search_file_path(list2_buf, list2_len, file_path)){	// ファイル名が重複しないようにする
 			if (list2_len + len >= list2_max){ // 領域が足りなくなるなら拡張する
 				list2_max += ALLOC_LEN;
+				discard_index(list2_buf);
 				tmp_p = (wchar_t *)realloc(list2_buf, list2_max * 2);
 				if (tmp_p == NULL){
 					fclose(fp);
@@ -543,6 +809,7 @@ static int search_external_files(
 		if (!search_file_path(list2_buf, list2_len, search_path)){	// ファイル名が重複しないようにする
 			if (list2_len + len >= list2_max){ // 領域が足りなくなるなら拡張する
 				list2_max += ALLOC_LEN;
+				discard_index(list2_buf);
 				tmp_p = (wchar_t *)realloc(list2_buf, list2_max * 2);
 				if (tmp_p == NULL){
 					printf("realloc, %d\n", list2_max);
@@ -1231,7 +1498,456 @@ static int calc_required_parity(int possible_count)
 	return block_need;
 }
 
-wmain(int argc, wchar_t *argv[])
+// 一個の recovery set を作成する (試すだけなら trial = 1)
+static int create_set(
+	wchar_t *uni_buf,			// 作業用、入力されたコメントが入ってる
+	unsigned int switch_set,	// 作成時のオプション
+	int trial)
+{
+	int i, j, k, parity_need;
+
+	parity_need = parity_num;	// 試算時にブロック数を変えて見積もるため、指定値を残しておく
+	if (parity_num == 0)	// リカバリ・ファイルを作らない場合は、必ずインデックス・ファイルを作る
+		switch_set &= ~0x01;
+	if (check_recovery_match(switch_set & 0x01))
+		return 1;
+
+	if (total_file_size == 0){	// ファイル・サイズが全て 0 だとブロックも無いはず
+		block_size = 0;
+		source_num = 0;
+		parity_num = 0;
+	} else {	// ブロック数を計算する
+		// 最適なブロック・サイズを調べる
+		i = 0;
+		if (block_size != 0){	// ブロック・サイズを指定
+			i = block_size;
+		} else {	// ブロック・サイズとブロック数の割合を指定
+			i = ((unsigned int)switch_b >> 22) * -10;	// 割合を 0.01% 刻みにする
+		}
+		j = 0;	// 標準ではソース・ブロック数を制限しない
+		if (source_num != 0){	// ブロック数を指定
+			j = source_num;
+		} else if (i == 0){	// 全てを指定してなければ
+			i = -100;	// 割合で 1% にする
+			j = 3000;	// 3000ブロックまでにする
+		}
+		if (check_block_size(switch_b & 0x003FFFFC, i, j))
+			return 1;
+
+		if (parity_num <= -200000){	// 復元できるファイル数でパリティ・ブロック数を決める
+			j = calc_required_parity(parity_num * -1 - 200000);
+			if (j < 0)
+				return 1;
+			parity_num = j;
+		} else if (parity_num < 0){	// 冗長性(%)でパリティ・ブロック数を決める
+			parity_num = -parity_num;	// % の 100倍になってることに注意
+			i = (int)(((unsigned int)parity_num * (unsigned int)source_num) / 10000);
+			j = (i * 10000) / source_num;
+			//printf("num0 = %d, rate = %d, target = %d \n", i, j, parity_num);
+			if (j != parity_num){
+				j = ((i + 1) * 10000) / source_num;
+				//printf("num1 = %d, rate = %d, target = %d \n", i + 1, j, parity_num);
+				if (j == parity_num)
+					i++;	// 1個増やして冗長性を一致させる
+			}
+			if (i > MAX_PARITY_NUM)
+				i = MAX_PARITY_NUM;
+			if (i == 0)
+				i = 1;
+			parity_num = i;
+		}
+	}
+	// 分割サイズはブロック・サイズの倍数にする
+	if (split_size >= 4){
+		if (split_size <= block_size){
+			split_size = block_size;
+		} else {
+			split_size -= split_size % block_size;
+		}
+	}
+	// リカバリ・ファイルの数とその最大ブロック数を計算する
+	if (parity_num > 0){
+		if (recovery_limit == 0){	// 制限値が未設定ならパリティ・ブロック数にする
+			recovery_limit = parity_num;
+		} else if (recovery_limit < 0){	// ソース・ファイルの最大ブロック数を制限値にする
+			recovery_limit = -recovery_limit;
+			if (split_size >= 4){	// ソース・ファイルを分割する場合はその分割サイズまで
+				j = split_size / block_size;	// 分割ファイル内のブロック数
+				if (recovery_limit > j)
+					recovery_limit = j;
+			}
+		} else {
+			if (split_size == 2){	// 制限をブロック数ではなく、サイズとして認識する
+				recovery_limit /= block_size;
+				if (recovery_limit < 1)
+					recovery_limit = 1;
+			}
+			if (recovery_limit > MAX_PARITY_NUM)	// パリティ・ブロック数の最大値を超えない
+				recovery_limit = MAX_PARITY_NUM;
+		}
+		// パリティ・ブロックをリカバリ・ファイルに分配する方法
+		i = (switch_set & 0x30000) >> 16;
+		if (i == 0){	// 同じ量ずつ割り振る
+			if (recovery_num == 0){	// 未設定なら、ソース・ファイル数と冗長性から計算する
+				recovery_num = entity_num * parity_num / source_num;
+				if (recovery_num < 1){
+					recovery_num = 1;
+				} else if (recovery_num > 10){
+					recovery_num = 10;	// QuickPar と同じく 10個までにする
+				}
+			}
+			if (recovery_num > parity_num)
+				recovery_num = parity_num;
+			// 制限数から最低ファイル数を計算する
+			j = (parity_num + recovery_limit - 1) / recovery_limit;
+			if (recovery_num < j)
+				recovery_num = j;
+		} else if (i == 1){	// 倍々で異なる量にする
+			if (recovery_num == 0){	// 未設定なら、ソース・ファイル数と冗長性から計算する
+				recovery_num = entity_num * parity_num / source_num;
+				if (recovery_num < 3){
+					if (parity_num >= 7){
+						recovery_num = 3;	// 大中小で 3個にする。
+					} else if (parity_num >= 3){
+						recovery_num = 2;	// 大小で 2個にする。
+					} else {
+						recovery_num = 1;
+					}
+				} else if (recovery_num > 10){
+					recovery_num = 10;	// QuickPar と同じく 10個までにする
+				}
+			}
+			// 基準値が1の場合のファイル数 = 最大ファイル数
+			i = 1;	// recovery_num
+			j = 1;	// total count
+			k = 1;	// count in the file
+			while (j < parity_num){
+				k *= 2;
+				if (k > recovery_limit){
+					i += (parity_num - j + recovery_limit - 1) / recovery_limit;
+					break;
+				}
+				j += k;
+				i++;
+			}
+			//printf("recovery_num = %d, max = %d (%d blocks)\n", recovery_num, i, k);
+			if (recovery_num > i)
+				recovery_num = i;
+			i = (1 << recovery_num) - 1;	// 分割数
+			k = (parity_num + i - 1) / i;	// 倍率
+			//printf("recovery_num = %d, split = %d, base = %d\n", recovery_num, i, k);
+			if (recovery_limit < parity_num){
+				if (recovery_limit * recovery_num < parity_num){	// ファイル数が少なすぎるなら増やす
+					recovery_num = (parity_num + recovery_limit - 1) / recovery_limit;
+					//printf("min = %d, * %d = %d\n", recovery_num, recovery_limit, recovery_limit * recovery_num);
+				}
+				i = parity_num;
+				j = recovery_num;
+				if (j > 16){	// 限界を超えてる分は省く
+					i -= recovery_limit * (j - 16);
+					j = 16;
+				}
+				k = (1 << j) - 1;	// 分割数
+				k = (i + k - 1) / k;	// 倍率
+				//printf("rest = %d blocks on %d files, base = %d, last = %d, %d, limit = %d\n", i, j, k, k << (j - 2), i - ((1 << (j - 1)) - 1) * k, recovery_limit);
+				while ((j >= 2) && (k < recovery_limit) && (((k << (j - 2)) > recovery_limit) || (i - ((1 << (j - 1)) - 1) * k > recovery_limit))){
+					i -= recovery_limit;
+					j--;
+					k = (1 << j) - 1;	// 分割数
+					k = (i + k - 1) / k;	// 倍率
+					//printf("rest = %d blocks on %d files, base = %d, last = %d, %d\n", i, j, k, k << (j - 2), i - ((1 << (j - 1)) - 1) * k);
+				}
+			}
+			recovery_limit = (recovery_limit & 0xFFFF) | (k << 16);
+		} else {
+			if (i == 2){	// 1,2,4,8,16 と2の乗数にする
+				recovery_num = 0;
+				i = 1;	// exp_num
+				j = 0;	// total count
+				k = 0;	// count in the file
+				while (j < parity_num){
+					k = i;
+					if (k >= recovery_limit){	// サイズが制限されてるなら
+						k = recovery_limit;
+					} else {
+						i *= 2;
+					}
+					j += k;
+					recovery_num++;
+				}
+				recovery_limit = k;
+			} else {	// 1,1,2,5,10,10,20,50 という decimal weights sizing scheme にする
+				recovery_num = 0;
+				i = 1;	// exp_num
+				j = 0;	// total count
+				k = 0;	// count in the file
+				while (j < parity_num){
+					k = i;
+					if (k >= recovery_limit){	// サイズが制限されてるなら
+						k = recovery_limit;
+					} else {
+						switch (recovery_num % 4){
+						case 1:
+						case 3:
+							i = i * 2;
+							break;
+						case 2:
+							i = (i / 2) * 5;
+							break;
+						}
+					}
+					j += k;
+					recovery_num++;
+				}
+				recovery_limit = k;
+			}
+		}
+	} else {
+		recovery_num = 0;
+	}
+	printf("Input File count\t: %d\n", file_num);
+	printf("Input File total size\t: %I64d\n", total_file_size);
+	printf("Input File Slice size\t: %u\n", block_size);
+	printf("Input File Slice count\t: %d\n", source_num);
+	printf("Recovery Slice count\t: %d\n", parity_num);
+	if (first_num > 0)
+		printf("Recovery Slice start\t: %d\n", first_num);
+	if (source_num != 0){
+		i = (10000 * parity_num) / source_num;
+	} else {
+		i = 0;
+	}
+	printf("Redundancy rate\t\t: %d.%02d%%\n", i / 100, i % 100);
+	printf("Recovery File count\t: %d\n", recovery_num);	// Index File の分は含まない
+	if (parity_num > 0){
+		i = (switch_set & 0x30000) >> 16;
+		printf("Slice distribution\t: %d, ", i);
+		switch (i){
+		case 0:
+			printf("uniform (until %d)\n", recovery_limit);
+			break;
+		case 1:
+			printf("variable (base %d until %d)\n", (unsigned int)recovery_limit >> 16, recovery_limit & 0xFFFF);
+			break;
+		case 2:
+			printf("power of two (until %d)\n", recovery_limit);
+			break;
+		case 3:
+			printf("decimal weights (until %d)\n", recovery_limit);
+			break;
+		}
+		k = (switch_set & 0x0700) >> 8;
+		printf("Packet Repetition limit\t: %d\n", k);
+	}
+	if (split_size == 1){	// 書庫にリカバリ・レコードを追加できるか
+		if ((file_num != 1) || (total_file_size < 54)){
+			split_size = 0;	// zip's min = 100-byte, 7z's min = 74-byte
+		} else {	// 拡張子を調べる
+			j = (int)wcslen(list_buf);
+			if ((_wcsicmp(list_buf + j - 4, L".zip") != 0) && (_wcsicmp(list_buf + j - 3, L".7z") != 0)){
+				split_size = 0;
+			} else {
+				printf_cp("Append recovery record\t: \"%s\"\n", list_buf);
+			}
+		}
+	} else if (split_size >= 4){	// 分割サイズは指定された時だけ表示する
+		if (total_file_size == 0){
+			split_size = 0;
+		} else {
+			printf("Split size\t\t: %u\n", split_size);
+		}
+	}
+	if (parity_num + first_num > MAX_PARITY_NUM){	// ブロック数の制限
+		printf("too many recovery blocks %d\n", parity_num + first_num);
+		return 1;
+	}
+	j = (switch_set & 0x01) | ((switch_set & 0x08) >> 2);
+	if (trial == 0){
+		i = par2_create(uni_buf, (switch_set & 0x0700) >> 8, (switch_set & 0x70000) >> 16, j);
+	} else {
+		i = par2_trial(uni_buf, (switch_set & 0x0700) >> 8, (switch_set & 0x70000) >> 16, j, parity_need);
+	}
+	return i;
+}
+
+// 指定されたブロック・サイズではブロック数が多すぎる場合に、
+// ソース・ファイルを複数の recovery set に分けて、それぞれを作成する
+static int create_subset(
+	wchar_t *uni_buf,			// 作業用、入力されたコメントが入ってる
+	unsigned int switch_set,	// 作成時のオプション
+	int trial)
+{
+	wchar_t file_path[MAX_LEN], par_path[MAX_LEN], file_ext[EXT_LEN], *all_buf, *tmp_p;
+	int err = 0, i, num, off, len, all_len, all_max, all_num, set_num, set_count, digit;
+	int set_block, set_file, block_num, *file_block;
+	int save_source, save_parity, save_recovery, save_limit, save_first;
+	unsigned int base_size, save_block, save_split;
+	__int64 *file_size, all_size;
+	WIN32_FILE_ATTRIBUTE_DATA AttrData;
+
+	if (block_size == 0){	// ブロック・サイズが指定されてなければ分ける必要がない
+		if (file_num > MAX_SOURCE_NUM){	// ファイル数だけでは分けない
+			printf("too many input files %d\n", file_num);
+			return 1;
+		}
+		return create_set(uni_buf, switch_set, trial);
+	}
+
+	// 単位の倍数にしたブロック・サイズで、各ファイルのブロック数を数える
+	base_size = switch_b & 0x003FFFFC;
+	if (base_size == 0)
+		base_size = 4;
+	save_block = ((block_size + (base_size / 2)) / base_size) * base_size;
+	if (save_block == 0)
+		save_block = base_size;
+	file_size = (__int64 *)malloc((sizeof(__int64) + sizeof(int)) * file_num);
+	if (file_size == NULL){
+		printf("malloc, %d\n", (int)(sizeof(__int64) + sizeof(int)) * file_num);
+		return 1;
+	}
+	file_block = (int *)(file_size + file_num);
+	wcscpy(file_path, base_dir);
+	off = 0;
+	block_num = 0;
+	for (num = 0; num < file_num; num++){
+		wcscpy(file_path + base_len, list_buf + off);
+		if (!GetFileAttributesEx(file_path, GetFileExInfoStandard, &AttrData)){
+			print_win32_err();
+			printf_cp("GetFileAttributesEx, %s\n", list_buf + off);
+			free(file_size);
+			return 1;
+		}
+		if (AttrData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){	// フォルダなら
+			file_size[num] = 0;
+		} else {
+			file_size[num] = ((__int64)AttrData.nFileSizeHigh << 32) | (unsigned __int64)AttrData.nFileSizeLow;
+		}
+		file_block[num] = (int)((file_size[num] + save_block - 1) / save_block);
+		if (file_block[num] > MAX_SOURCE_NUM){	// 一個のファイルは分けられない
+			printf_cp("too large file for slice size, %s\n", list_buf + off);
+			free(file_size);
+			return 1;
+		}
+		block_num += file_block[num];
+		while (list_buf[off] != 0)
+			off++;
+		off++;
+	}
+	if ((block_num <= MAX_SOURCE_NUM) && (file_num <= MAX_SOURCE_NUM)){	// 一個の recovery set に収まるなら分けない
+		free(file_size);
+		return create_set(uni_buf, switch_set, trial);
+	}
+
+	// 先頭から順に、ブロック数が最大値を超えないように分ける
+	set_count = 1;
+	set_block = 0;
+	set_file = 0;
+	for (num = 0; num < file_num; num++){
+		if ((set_block + file_block[num] > MAX_SOURCE_NUM) || (set_file >= MAX_SOURCE_NUM)){
+			set_count++;
+			set_block = 0;
+			set_file = 0;
+		}
+		set_block += file_block[num];
+		set_file++;
+	}
+	digit = 1;
+	for (i = set_count; i >= 10; i /= 10)
+		digit++;
+
+	// 各 recovery set の PAR ファイル名は「base.set#.ext」にする
+	wcscpy(par_path, recovery_file);
+	file_ext[0] = 0;
+	tmp_p = offset_file_name(par_path);
+	tmp_p = wcsrchr(tmp_p, '.');
+	if ((tmp_p != NULL) && (wcslen(tmp_p) < EXT_LEN)){
+		wcscpy(file_ext, tmp_p);	// 拡張子を記録しておく
+		*tmp_p = 0;	// 拡張子を取り除く
+	}
+	if (wcslen(par_path) + 5 + digit + wcslen(file_ext) >= MAX_LEN - ADD_LEN){
+		free(file_size);
+		printf("filename is too long\n");
+		return 1;
+	}
+
+	// 全体の情報と、指定された値を保存しておく
+	all_buf = list_buf;
+	all_len = list_len;
+	all_max = list_max;
+	all_num = file_num;
+	all_size = total_file_size;
+	save_block = block_size;
+	save_source = source_num;
+	save_parity = parity_num;
+	save_recovery = recovery_num;
+	save_limit = recovery_limit;
+	save_first = first_num;
+	save_split = split_size;
+	printf("Input File total count\t: %d\n", all_num);
+	printf("Input File total slice\t: %d\n", block_num);
+	printf("Recovery Set count\t: %d\n", set_count);
+	subset_count = set_count;
+
+	off = 0;
+	num = 0;
+	for (set_num = 1; set_num <= set_count; set_num++){
+		// この recovery set に含めるファイルを選ぶ
+		list_buf = all_buf + off;
+		file_num = 0;
+		entity_num = 0;
+		total_file_size = 0;
+		set_block = 0;
+		while ((num < all_num) && (set_block + file_block[num] <= MAX_SOURCE_NUM) && (file_num < MAX_SOURCE_NUM)){
+			set_block += file_block[num];
+			file_num++;
+			total_file_size += file_size[num];
+			if (file_size[num] > 0)
+				entity_num++;
+			while (all_buf[off] != 0)
+				off++;
+			off++;
+			num++;
+		}
+		list_len = (int)(all_buf + off - list_buf);
+		list_max = list_len;
+
+		// 指定された値に戻してから作成する
+		block_size = save_block;
+		source_num = save_source;
+		parity_num = save_parity;
+		recovery_num = save_recovery;
+		recovery_limit = save_limit;
+		first_num = save_first;
+		split_size = save_split;
+		subset_num = set_num;
+		swprintf(recovery_file, MAX_LEN, L"%s.set%0*d%s", par_path, digit, set_num, file_ext);
+		printf("\nRecovery Set number\t: %d / %d\n", set_num, set_count);
+		printf_cp("Recovery Set file\t: \"%s\"\n", offset_file_name(recovery_file));
+		err = create_set(uni_buf, switch_set, trial);
+		discard_index(list_buf);	// 途中から始まる部分リストの登録を消しておく
+		if (err != 0)	// エラーかキャンセルなら中断する
+			break;
+	}
+
+	// 全体の情報に戻す
+	list_buf = all_buf;
+	list_len = all_len;
+	list_max = all_max;
+	file_num = all_num;
+	total_file_size = all_size;
+	subset_num = 0;
+	subset_count = 0;
+	free(file_size);
+
+	return err;
+}
+
+// 最初に一度だけ調べた CPU の情報 (オプションで変更される前の値)
+static unsigned int save_cpu_num, save_cpu_flag, save_cpu_cache, save_memory_use;
+static int save_OpenCL_method;
+
+// 一個のコマンドを実行する (確保したリストは呼び出し元で解放する)
+static int exec_command(int argc, wchar_t *argv[])
 {
 	wchar_t uni_buf[MAX_LEN], *tmp_p;
 	int i, j, k;
@@ -1246,24 +1962,8 @@ w = switch_set & 0x00000020
 lp= switch_set & 0x00000700
 rd= switch_set & 0x00030000
 ri= switch_set & 0x00040000
+sw= switch_set & 0x00080000
 */
-	printf("Parchive 2.0 client version " FILE_VERSION " by Yutaka Sawada\n\n");
-	if (argc < 3){
-		printf("Self-Test: ");
-		i = par2_checksum(uni_buf);
-		if (i == 0){
-			printf("Success");
-		} else if (i == 2){
-			printf("PE checksum is different");
-		} else if (i == 3){
-			printf("CRC-32 is different");
-		} else {
-			printf("Error\0thedummytext");
-		}
-		printf("\n\n");
-		print_help();
-		return 0;
-	}
 
 	// 初期化
 	recovery_file[0] = 0;
@@ -1283,11 +1983,23 @@ ri= switch_set & 0x00040000
 	split_size = 0;
 	total_file_size = 0;
 	list_buf = NULL;
+	list_len = 0;
 	recv_buf = NULL;
 	recv2_buf = NULL;
 	list2_buf = NULL;
-	cp_output = GetConsoleOutputCP();
-	check_cpu();	// CPU を検査する
+	list2_len = 0;
+	recent_data = 0;	// 検査結果の再利用はコマンドごとに指定する
+	if (key_pipe != NULL){	// サーバー動作時はパイプに UTF-8 で出力する
+		cp_output = CP_UTF8;
+	} else {
+		cp_output = GetConsoleOutputCP();
+	}
+	cpu_num = save_cpu_num;	// CPU の検査結果は最初に調べたものを使う
+	cpu_flag = save_cpu_flag;
+	cpu_cache = save_cpu_cache;
+	memory_use = save_memory_use;
+	disk_rate = 0;	// 転送速度はコマンドごとに測り直す
+	OpenCL_method = save_OpenCL_method;
 
 	// コマンド
 	switch (argv[1][0]){
@@ -1295,6 +2007,8 @@ ri= switch_set & 0x00040000
 	case 't':	// trial
 	case 'v':	// verify
 	case 'r':	// repair
+	case 'u':	// update
+	case 'a':	// add
 	case 'l':	// list
 		break;
 	default:
@@ -1315,6 +2029,8 @@ ri= switch_set & 0x00040000
 				switch_set |= 0x01;
 			} else if (wcscmp(tmp_p, L"up") == 0){
 				switch_set |= 0x08;
+			} else if (wcscmp(tmp_p, L"sw") == 0){
+				switch_set |= 0x80000;
 			// 検査時のオプション
 			} else if (wcscmp(tmp_p, L"h") == 0){
 				switch_set |= 0x10;
@@ -1536,7 +2252,7 @@ ri= switch_set & 0x00040000
 						j++;
 					}
 					if (k & 0x300){	// GPU を使う
-						OpenCL_method = k & 0x003F0300;
+						OpenCL_method = k & 0x007F0300;
 					}
 					if (k & 1024)	// CLMUL と ALTMAP を使わない
 						cpu_flag = (cpu_flag & 0xFFFFFFF7) | 256;
@@ -1600,7 +2316,7 @@ ri= switch_set & 0x00040000
 				wcscpy(uni_buf, tmp_p);
 			} else if ((wcsncmp(tmp_p, L"fa", 2) == 0) || (wcsncmp(tmp_p, L"fe", 2) == 0)){
 				tmp_p += 2;
-				if ((argv[1][0] == 'c') || (argv[1][0] == 't')){
+				if ((argv[1][0] == 'c') || (argv[1][0] == 't') || (argv[1][0] == 'a')){
 					j = (int)wcslen(tmp_p);
 					if ((j == 0) || (list2_len + j + 1 > ALLOC_LEN - MAX_LEN))
 						continue;
@@ -1785,8 +2501,8 @@ return 0;
 		get_base_dir(recovery_file, base_dir);	// リカバリ・ファイルの位置にする
 	base_len = (int)wcslen(base_dir);
 
-	// 検査結果ファイルの位置が指定されてないなら
-	if (((recent_data != 0) || ((switch_set & 0x20) != 0)) && (ini_path[0] == 0)){
+	// 検査結果ファイルの位置が指定されてないなら (更新や追加時は古い検査結果を削除する為に使う)
+	if (((recent_data != 0) || ((switch_set & 0x20) != 0) || (argv[1][0] == 'u') || (argv[1][0] == 'a')) && (ini_path[0] == 0)){
 		// 実行ファイルのディレクトリにする
 		j = GetModuleFileName(NULL, ini_path, MAX_LEN);
 		if ((j == 0) || (j >= MAX_LEN)){
@@ -1812,8 +2528,12 @@ return 0;
 	switch (argv[1][0]){
 	case 'c':
 	case 't':
+	case 'a':
 		// リカバリ・ファイル作成ならソース・ファイルのリストがいる
-		if (i >= argc){	// もうファイル指定が無いなら
+		if ((i >= argc) && (argv[1][0] == 'a')){	// 追加するファイルは省略できない
+			printf("input file is not specified\n");
+			return 1;
+		} else if (i >= argc){	// もうファイル指定が無いなら
 			wchar_t search_path[MAX_LEN];
 			int dir_len;
 			// リカバリ・ファイルの拡張子を取り除いたものがソース・ファイルと見なす
@@ -1832,18 +2552,15 @@ return 0;
 				dir_len--;
 			dir_len++;
 			if (search_files(search_path, dir_len, FILE_ATTRIBUTE_DIRECTORY, 0)){	// ファイルだけを探す
-				free(list_buf);
 				return 1;
 			}
 			if (file_num != 1){	// ファイルが見つかったか確かめる
-				free(list_buf);
 				printf_cp("input file is not found, %s\n", search_path + base_len);
 				return 1;
 			}
 		} else if (switch_set & 0x06){	// ファイル・リストの読み込み
 			j = (switch_set & 0x04) ? CP_UTF8 : CP_OEMCP;
 			if (read_list(argv[i], j)){
-				free(list_buf);
 				return 1;
 			}
 		} else {	// 入力ファイルの指定
@@ -1873,12 +2590,10 @@ return 0;
 				tmp_p = argv[i];
 				j = copy_path_prefix(search_path, MAX_LEN - ADD_LEN - 2, tmp_p, base_dir);	// 絶対パスにしてから比較する
 				if (j == 0){
-					free(list_buf);
 					printf_cp("filename is invalid, %s\n", tmp_p);
 					return 1;
 				}
 				if ((j <= base_len) || (_wcsnicmp(base_dir, search_path, base_len) != 0)){	// 基準ディレクトリ外なら
-					free(list_buf);
 					printf_cp("out of base-directory, %s\n", tmp_p);
 					return 1;
 				}
@@ -1894,19 +2609,18 @@ return 0;
 					dir_len--;
 				dir_len++;
 				if (search_files(search_path, dir_len, filter, j)){
-					free(list_buf);
 					return 1;
 				}
 				// ファイルが見つかったか確かめる (すでに登録済みならいい)
 				if ((j != -1) && (j == file_num) &&
 						(search_file_path(list_buf, list_len, search_path + base_len) == 0)){
-					free(list_buf);
 					printf_cp("input file is not found, %s\n", search_path + base_len);
 					return 1;
 				}
 			}
 		}
 		if (list2_buf){	// 除外ファイル・リストを消去する
+			discard_index(list2_buf);
 			free(list2_buf);
 			list2_buf = NULL;
 		}
@@ -1917,281 +2631,25 @@ fwrite(list_buf, 2, list_len, fp);
 fclose(fp);
 }*/
 		if (file_num < 1){
-			free(list_buf);
 			printf("input file is not found\n");
 			return 1;
 		}
-		if (file_num > MAX_SOURCE_NUM){
-			free(list_buf);
+		// /sw ならファイル数が多くても複数の recovery set に分ける
+		if ((file_num > MAX_SOURCE_NUM) && ((argv[1][0] == 'a') || ((switch_set & 0x80000) == 0))){
 			printf("too many input files %d\n", file_num);
 			return 1;
 		}
-		if (parity_num == 0)	// リカバリ・ファイルを作らない場合は、必ずインデックス・ファイルを作る
-			switch_set &= ~0x01;
-		if (check_recovery_match(switch_set & 0x01)){
-			free(list_buf);
-			return 1;
-		}
-
-		if (total_file_size == 0){	// ファイル・サイズが全て 0 だとブロックも無いはず
-			block_size = 0;
-			source_num = 0;
-			parity_num = 0;
-		} else {	// ブロック数を計算する
-			// 最適なブロック・サイズを調べる
-			i = 0;
-			if (block_size != 0){	// ブロック・サイズを指定
-				i = block_size;
-			} else {	// ブロック・サイズとブロック数の割合を指定
-				i = ((unsigned int)switch_b >> 22) * -10;	// 割合を 0.01% 刻みにする
-			}
-			j = 0;	// 標準ではソース・ブロック数を制限しない
-			if (source_num != 0){	// ブロック数を指定
-				j = source_num;
-			} else if (i == 0){	// 全てを指定してなければ
-				i = -100;	// 割合で 1% にする
-				j = 3000;	// 3000ブロックまでにする
-			}
-			if (check_block_size(switch_b & 0x003FFFFC, i, j)){
-				free(list_buf);
+		if (argv[1][0] == 'a'){	// 既存のリカバリ・ファイルに追加する
+			if (check_recovery_match(0)){
 				return 1;
 			}
-
-			if (parity_num <= -200000){	// 復元できるファイル数でパリティ・ブロック数を決める
-				j = calc_required_parity(parity_num * -1 - 200000);
-				if (j < 0){
-					free(list_buf);
-					return 1;
-				}
-				parity_num = j;
-			} else if (parity_num < 0){	// 冗長性(%)でパリティ・ブロック数を決める
-				parity_num = -parity_num;	// % の 100倍になってることに注意
-				i = (int)(((unsigned int)parity_num * (unsigned int)source_num) / 10000);
-				j = (i * 10000) / source_num;
-				//printf("num0 = %d, rate = %d, target = %d \n", i, j, parity_num);
-				if (j != parity_num){
-					j = ((i + 1) * 10000) / source_num;
-					//printf("num1 = %d, rate = %d, target = %d \n", i + 1, j, parity_num);
-					if (j == parity_num)
-						i++;	// 1個増やして冗長性を一致させる
-				}
-				if (i > MAX_PARITY_NUM)
-					i = MAX_PARITY_NUM;
-				if (i == 0)
-					i = 1;
-				parity_num = i;
-			}
-		}
-		// 分割サイズはブロック・サイズの倍数にする
-		if (split_size >= 4){
-			if (split_size <= block_size){
-				split_size = block_size;
-			} else {
-				split_size -= split_size % block_size;
-			}
-		}
-		// リカバリ・ファイルの数とその最大ブロック数を計算する
-		if (parity_num > 0){
-			if (recovery_limit == 0){	// 制限値が未設定ならパリティ・ブロック数にする
-				recovery_limit = parity_num;
-			} else if (recovery_limit < 0){	// ソース・ファイルの最大ブロック数を制限値にする
-				recovery_limit = -recovery_limit;
-				if (split_size >= 4){	// ソース・ファイルを分割する場合はその分割サイズまで
-					j = split_size / block_size;	// 分割ファイル内のブロック数
-					if (recovery_limit > j)
-						recovery_limit = j;
-				}
-			} else {
-				if (split_size == 2){	// 制限をブロック数ではなく、サイズとして認識する
-					recovery_limit /= block_size;
-					if (recovery_limit < 1)
-						recovery_limit = 1;
-				}
-				if (recovery_limit > MAX_PARITY_NUM)	// パリティ・ブロック数の最大値を超えない
-					recovery_limit = MAX_PARITY_NUM;
-			}
-			// パリティ・ブロックをリカバリ・ファイルに分配する方法
-			i = (switch_set & 0x30000) >> 16;
-			if (i == 0){	// 同じ量ずつ割り振る
-				if (recovery_num == 0){	// 未設定なら、ソース・ファイル数と冗長性から計算する
-					recovery_num = entity_num * parity_num / source_num;
-					if (recovery_num < 1){
-						recovery_num = 1;
-					} else if (recovery_num > 10){
-						recovery_num = 10;	// QuickPar と同じく 10個までにする
-					}
-				}
-				if (recovery_num > parity_num)
-					recovery_num = parity_num;
-				// 制限数から最低ファイル数を計算する
-				j = (parity_num + recovery_limit - 1) / recovery_limit;
-				if (recovery_num < j)
-					recovery_num = j;
-			} else if (i == 1){	// 倍々で異なる量にする
-				if (recovery_num == 0){	// 未設定なら、ソース・ファイル数と冗長性から計算する
-					recovery_num = entity_num * parity_num / source_num;
-					if (recovery_num < 3){
-						if (parity_num >= 7){
-							recovery_num = 3;	// 大中小で 3個にする。
-						} else if (parity_num >= 3){
-							recovery_num = 2;	// 大小で 2個にする。
-						} else {
-							recovery_num = 1;
-						}
-					} else if (recovery_num > 10){
-						recovery_num = 10;	// QuickPar と同じく 10個までにする
-					}
-				}
-				// 基準値が1の場合のファイル数 = 最大ファイル数
-				i = 1;	// recovery_num
-				j = 1;	// total count
-				k = 1;	// count in the file
-				while (j < parity_num){
-					k *= 2;
-					if (k > recovery_limit){
-						i += (parity_num - j + recovery_limit - 1) / recovery_limit;
-						break;
-					}
-					j += k;
-					i++;
-				}
-				//printf("recovery_num = %d, max = %d (%d blocks)\n", recovery_num, i, k);
-				if (recovery_num > i)
-					recovery_num = i;
-				i = (1 << recovery_num) - 1;	// 分割数
-				k = (parity_num + i - 1) / i;	// 倍率
-				//printf("recovery_num = %d, split = %d, base = %d\n", recovery_num, i, k);
-				if (recovery_limit < parity_num){
-					if (recovery_limit * recovery_num < parity_num){	// ファイル数が少なすぎるなら増やす
-						recovery_num = (parity_num + recovery_limit - 1) / recovery_limit;
-						//printf("min = %d, * %d = %d\n", recovery_num, recovery_limit, recovery_limit * recovery_num);
-					}
-					i = parity_num;
-					j = recovery_num;
-					if (j > 16){	// 限界を超えてる分は省く
-						i -= recovery_limit * (j - 16);
-						j = 16;
-					}
-					k = (1 << j) - 1;	// 分割数
-					k = (i + k - 1) / k;	// 倍率
-					//printf("rest = %d blocks on %d files, base = %d, last = %d, %d, limit = %d\n", i, j, k, k << (j - 2), i - ((1 << (j - 1)) - 1) * k, recovery_limit);
-					while ((j >= 2) && (k < recovery_limit) && (((k << (j - 2)) > recovery_limit) || (i - ((1 << (j - 1)) - 1) * k > recovery_limit))){
-						i -= recovery_limit;
-						j--;
-						k = (1 << j) - 1;	// 分割数
-						k = (i + k - 1) / k;	// 倍率
-						//printf("rest = %d blocks on %d files, base = %d, last = %d, %d\n", i, j, k, k << (j - 2), i - ((1 << (j - 1)) - 1) * k);
-					}
-				}
-				recovery_limit = (recovery_limit & 0xFFFF) | (k << 16);
-			} else {
-				if (i == 2){	// 1,2,4,8,16 と2の乗数にする
-					recovery_num = 0;
-					i = 1;	// exp_num
-					j = 0;	// total count
-					k = 0;	// count in the file
-					while (j < parity_num){
-						k = i;
-						if (k >= recovery_limit){	// サイズが制限されてるなら
-							k = recovery_limit;
-						} else {
-							i *= 2;
-						}
-						j += k;
-						recovery_num++;
-					}
-					recovery_limit = k;
-				} else {	// 1,1,2,5,10,10,20,50 という decimal weights sizing scheme にする
-					recovery_num = 0;
-					i = 1;	// exp_num
-					j = 0;	// total count
-					k = 0;	// count in the file
-					while (j < parity_num){
-						k = i;
-						if (k >= recovery_limit){	// サイズが制限されてるなら
-							k = recovery_limit;
-						} else {
-							switch (recovery_num % 4){
-							case 1:
-							case 3:
-								i = i * 2;
-								break;
-							case 2:
-								i = (i / 2) * 5;
-								break;
-							}
-						}
-						j += k;
-						recovery_num++;
-					}
-					recovery_limit = k;
-				}
-			}
-		} else {
-			recovery_num = 0;
-		}
-		printf("Input File count\t: %d\n", file_num);
-		printf("Input File total size\t: %I64d\n", total_file_size);
-		printf("Input File Slice size\t: %u\n", block_size);
-		printf("Input File Slice count\t: %d\n", source_num);
-		printf("Recovery Slice count\t: %d\n", parity_num);
-		if (first_num > 0)
-			printf("Recovery Slice start\t: %d\n", first_num);
-		if (source_num != 0){
-			i = (10000 * parity_num) / source_num;
-		} else {
-			i = 0;
-		}
-		printf("Redundancy rate\t\t: %d.%02d%%\n", i / 100, i % 100);
-		printf("Recovery File count\t: %d\n", recovery_num);	// Index File の分は含まない
-		if (parity_num > 0){
-			i = (switch_set & 0x30000) >> 16;
-			printf("Slice distribution\t: %d, ", i);
-			switch (i){
-			case 0:
-				printf("uniform (until %d)\n", recovery_limit);
-				break;
-			case 1:
-				printf("variable (base %d until %d)\n", (unsigned int)recovery_limit >> 16, recovery_limit & 0xFFFF);
-				break;
-			case 2:
-				printf("power of two (until %d)\n", recovery_limit);
-				break;
-			case 3:
-				printf("decimal weights (until %d)\n", recovery_limit);
-				break;
-			}
-			k = (switch_set & 0x0700) >> 8;
-			printf("Packet Repetition limit\t: %d\n", k);
-		}
-		if (split_size == 1){	// 書庫にリカバリ・レコードを追加できるか
-			if ((file_num != 1) || (total_file_size < 54)){
-				split_size = 0;	// zip's min = 100-byte, 7z's min = 74-byte
-			} else {	// 拡張子を調べる
-				j = (int)wcslen(list_buf);
-				if ((_wcsicmp(list_buf + j - 4, L".zip") != 0) && (_wcsicmp(list_buf + j - 3, L".7z") != 0)){
-					split_size = 0;
-				} else {
-					printf_cp("Append recovery record\t: \"%s\"\n", list_buf);
-				}
-			}
-		} else if (split_size >= 4){	// 分割サイズは指定された時だけ表示する
-			if (total_file_size == 0){
-				split_size = 0;
-			} else {
-				printf("Split size\t\t: %u\n", split_size);
-			}
-		}
-		if (parity_num + first_num > MAX_PARITY_NUM){	// ブロック数の制限
-			free(list_buf);
-			printf("too many recovery blocks %d\n", parity_num + first_num);
-			return 1;
+			i = par2_add(uni_buf, (switch_set & 0x08) >> 3);
+			break;
 		}
-		j = (switch_set & 0x01) | ((switch_set & 0x08) >> 2);
-		if (argv[1][0] == 'c'){
-			i = par2_create(uni_buf, (switch_set & 0x0700) >> 8, (switch_set & 0x70000) >> 16, j);
+		if (switch_set & 0x80000){	// ブロック数が多すぎるなら、複数の recovery set に分ける
+			i = create_subset(uni_buf, switch_set, argv[1][0] == 't');
 		} else {
-			i = par2_trial(uni_buf, (switch_set & 0x0700) >> 8, (switch_set & 0x70000) >> 16, j);
+			i = create_set(uni_buf, switch_set, argv[1][0] == 't');
 		}
 		break;
 	case 'v':
@@ -2210,15 +2668,16 @@ fclose(fp);
 
 			if (switch_set & 0x06){	// ファイル・リストの読み込み
 				j = (switch_set & 0x04) ? CP_UTF8 : CP_OEMCP;
-				if (read_external_list(argv[i], j))
+				if (read_external_list(argv[i], j)){
+					discard_index(list2_buf);
 					list2_len = 0;
+				}
 				i = argc;	// それ以上読み込まない
 			}
 
 			for (; i < argc; i++){
 				j = copy_path_prefix(search_path, MAX_LEN, argv[i], NULL);
 				if (j == 0){
-					free(list2_buf);
 					printf_cp("filename is invalid, %s\n", argv[i]);
 					return 1;
 				}
@@ -2232,11 +2691,9 @@ fclose(fp);
 				if (wcspbrk(search_path + dir_len, L"*?") == NULL)
 					j = list2_len;
 				if (search_external_files(search_path, dir_len, j)){
-					free(list2_buf);
 					return 1;
 				}
 				if ((j != -1) && (j == list2_len)){	// ファイルが見つかったか確かめる
-					free(list2_buf);
 					printf_cp("external file is not found, %s\n", search_path);
 					return 1;
 				}
@@ -2248,6 +2705,7 @@ fwrite(list2_buf, 2, list2_len, fp);
 fclose(fp);
 }*/
 			if (list2_len == 0){	// 有効なファイルが見つからなかった場合
+				discard_index(list2_buf);
 				free(list2_buf);
 				list2_buf = NULL;
 			}
@@ -2260,17 +2718,300 @@ fclose(fp);
 			i = par2_repair(uni_buf);
 		}
 		json_close();
-		if (list2_buf)
-			free(list2_buf);
+		break;
+	case 'u':
+		i = par2_update(uni_buf);
 		break;
 	case 'l':
 		i = par2_list(uni_buf, (switch_set & 0x10) >> 4);
 		break;
 	}
 
-	if (list_buf);
-		free(list_buf);
 	//printf("ExitCode: 0x%02X\n", i);
 	return i;
 }
 
+// 一個のコマンドを実行して、途中で終了した場合もリストを解放する
+static int run_command(int argc, wchar_t *argv[])
+{
+	int rv;
+
+	rv = exec_command(argc, argv);
+	if (list_buf){
+		discard_index(list_buf);
+		free(list_buf);
+		list_buf = NULL;
+	}
+	if (list2_buf){
+		discard_index(list2_buf);
+		free(list2_buf);
+		list2_buf = NULL;
+	}
+	return rv;
+}
+
+// 一覧ファイルに書かれたコマンドを、一つのプロセス内で順番に実行する (逐次バッチ)
+// 処理中の recovery set の情報は大域変数に置かれるので、複数の set を同時に処理することはできない
+// 前のコマンドが終わってから次を始めるだけで、set をまたいだ読み込みや計算の割り振りはしない
+// 0=正常終了, それ以外は各コマンドの終了コードを OR したもの
+static int run_batch(int argc, wchar_t *argv[])
+{
+	char buf[MAX_LEN * 3];
+	wchar_t cmd_line[MAX_LEN + 8], **cmd_argv;
+	int i, len, rv, exit_code = 0, cmd_argc, line_num = 0, cmd_count = 0;
+	unsigned int code_page = CP_OEMCP;
+	FILE *fp;
+
+	// オプションは一覧ファイルの読み込み方だけ
+	for (i = 2; i < argc - 1; i++){
+		if (((argv[i][0] == '/') || (argv[i][0] == '-')) && (wcscmp(argv[i] + 1, L"fu") == 0))
+			code_page = CP_UTF8;
+	}
+
+	// 読み込むファイルを開く
+	fp = _wfopen(argv[argc - 1], L"rb");
+	if (fp == NULL){
+		printf_cp("cannot open batch-list, %s\n", argv[argc - 1]);
+		return 1;
+	}
+
+	printf("Batch mode\t: sequential\n\n");
+
+	// 一行ずつ読み込んで、コマンドとして実行する
+	wcscpy(cmd_line, L"par2j ");	// 先頭は実行ファイル名として扱われる
+	while (fgets(buf, MAX_LEN * 3, fp)){
+		if (ferror(fp))
+			break;
+		buf[MAX_LEN * 3 - 1] = 0;
+		line_num++;
+		// 末尾に改行があれば削除する
+		for (len = 0; len < MAX_LEN * 3; len++){
+			if (buf[len] == 0)
+				break;
+			if ((buf[len] == '\n') || (buf[len] == '\r')){
+				buf[len] = 0;
+				break;
+			}
+		}
+		i = 0;
+		if ((line_num == 1) && (code_page == CP_UTF8) && (memcmp(buf, "\xEF\xBB\xBF", 3) == 0))
+			i = 3;	// UTF-8 の BOM を無視する
+		if ((buf[i] == 0) || (buf[i] == ';'))
+			continue;	// 空行と注釈は無視する
+
+		// 読み込んだ内容をユニコードに変換して、引数に分ける
+		if (!MultiByteToWideChar(code_page, 0, buf + i, -1, cmd_line + 6, MAX_LEN)){
+			printf("MultiByteToWideChar, %s\n", buf + i);
+			exit_code |= 1;
+			break;
+		}
+		cmd_argv = CommandLineToArgvW(cmd_line, &cmd_argc);
+		if (cmd_argv == NULL){
+			print_win32_err();
+			exit_code |= 1;
+			break;
+		}
+		cmd_count++;
+		printf("Batch command %d (line %d)\n", cmd_count, line_num);
+		if ((cmd_argc < 3) || (cmd_argv[1][0] == 'b') || (cmd_argv[1][0] == 's')){
+			printf("invalid command\n");
+			rv = 1;
+		} else {
+			rv = run_command(cmd_argc, cmd_argv);
+		}
+		LocalFree(cmd_argv);
+		printf("ExitCode: 0x%02X\n\n", rv);
+		fflush(stdout);
+		exit_code |= rv;
+		if (rv & 2)	// キャンセルされたら、残りのコマンドも実行しない
+			break;
+	}
+	fclose(fp);
+
+	return exit_code;
+}
+
+// 名前付きパイプで受け取ったコマンドを、一つのプロセス内で順番に実行する
+// 一行 (UTF-8) を一個のコマンドとして、その出力 (UTF-8) と終了コードをパイプに返す
+// コマンドの実行中にクライアントが "c" を送るか切断すると、キャンセルする
+static int run_server(int argc, wchar_t *argv[])
+{
+	char buf[MAX_LEN * 3];
+	wchar_t pipe_name[MAX_LEN], cmd_line[MAX_LEN + 8], **cmd_argv;
+	int i, len, rv, fd, save_fd, cmd_argc, quit = 0, cmd_count = 0;
+	unsigned int num;
+	HANDLE hPipe, hNext, hDup;
+
+	if (wcslen(argv[argc - 1]) >= MAX_LEN - 10){
+		printf("invalid pipe name\n");
+		return 1;
+	}
+	wcscpy(pipe_name, L"\\\\.\\pipe\\");
+	wcscat(pipe_name, argv[argc - 1]);
+	printf_cp("Pipe Name\t: %s\n\n", pipe_name);
+	fflush(stdout);
+
+	// 他のプロセスが同じ名前のパイプを作ってないか確かめる
+	hPipe = CreateNamedPipe(pipe_name, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			2, IO_SIZE, IO_SIZE, 0, NULL);
+	if (hPipe == INVALID_HANDLE_VALUE){
+		print_win32_err();
+		return 1;
+	}
+
+	wcscpy(cmd_line, L"par2j ");	// 先頭は実行ファイル名として扱われる
+	while (quit == 0){
+		if ((!ConnectNamedPipe(hPipe, NULL)) && (GetLastError() != ERROR_PIPE_CONNECTED)){
+			print_win32_err();
+			CloseHandle(hPipe);
+			return 1;
+		}
+
+		// 次のクライアントが接続できるように、先に次のインスタンスを作っておく
+		// そのクライアントは、このコマンドが終わるまで待たされる
+		hNext = CreateNamedPipe(pipe_name, PIPE_ACCESS_DUPLEX,
+				PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+				2, IO_SIZE, IO_SIZE, 0, NULL);
+		if (hNext == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			quit = 1;	// このコマンドを最後にする
+		}
+
+		// 改行までを一個のコマンドとして読み込む
+		len = 0;
+		i = -1;
+		while ((i < 0) && (len < MAX_LEN * 3 - 1)){
+			if ((!ReadFile(hPipe, buf + len, MAX_LEN * 3 - 1 - len, &num, NULL)) || (num == 0))
+				break;
+			while (num > 0){
+				if (buf[len] == '\n'){
+					i = len;
+					break;
+				}
+				len++;
+				num--;
+			}
+		}
+		if (i < 0)
+			i = len;
+		if ((i > 0) && (buf[i - 1] == '\r'))
+			i--;
+		buf[i] = 0;
+
+		if (strcmp(buf, "quit") == 0){	// サーバーを終了する
+			strcpy(buf, "Server stopped\r\n");
+			WriteFile(hPipe, buf, (unsigned int)strlen(buf), &num, NULL);
+			quit = 1;
+		} else if (buf[0] != 0){
+			cmd_count++;
+			printf("Request %d\t: ", cmd_count);
+			rv = 1;
+			cmd_argv = NULL;
+			if (!MultiByteToWideChar(CP_UTF8, 0, buf, -1, cmd_line + 6, MAX_LEN)){
+				printf("MultiByteToWideChar\n");
+			} else {
+				cmd_argv = CommandLineToArgvW(cmd_line, &cmd_argc);
+				if (cmd_argv == NULL)
+					print_win32_err();
+			}
+			fflush(stdout);
+
+			// 標準出力をパイプに切り替えてからコマンドを実行する
+			save_fd = -1;
+			if ((cmd_argv != NULL) && DuplicateHandle(GetCurrentProcess(), hPipe,
+					GetCurrentProcess(), &hDup, 0, FALSE, DUPLICATE_SAME_ACCESS)){
+				fd = _open_osfhandle((intptr_t)hDup, _O_TEXT);
+				if (fd == -1){
+					CloseHandle(hDup);
+				} else {
+					save_fd = _dup(1);
+					if ((save_fd != -1) && (_dup2(fd, 1) != 0)){
+						_close(save_fd);
+						save_fd = -1;
+					}
+					_close(fd);	// 切り替えられなかった場合はパイプも閉じる
+				}
+			}
+			if (save_fd != -1){
+				if ((cmd_argc < 3) || (cmd_argv[1][0] == 'b') || (cmd_argv[1][0] == 's')){
+					printf("invalid command\n");
+				} else {
+					key_pipe = hPipe;	// キャンセルをパイプから受け付ける
+					rv = run_command(cmd_argc, cmd_argv);
+					key_pipe = NULL;
+				}
+				printf("ExitCode: 0x%02X\n", rv);
+				fflush(stdout);
+				_dup2(save_fd, 1);	// 元の標準出力に戻す
+				_close(save_fd);
+			} else {	// 標準出力を切り替えられなくても、エラーと終了コードを返す
+				sprintf(buf, "%s\r\nExitCode: 0x%02X\r\n",
+						(cmd_argv == NULL) ? "invalid command" : "cannot redirect output", rv);
+				WriteFile(hPipe, buf, (unsigned int)strlen(buf), &num, NULL);
+			}
+			if (cmd_argv != NULL)
+				LocalFree(cmd_argv);
+			printf("ExitCode: 0x%02X\n", rv);
+			fflush(stdout);
+		}
+
+		FlushFileBuffers(hPipe);
+		DisconnectNamedPipe(hPipe);
+		CloseHandle(hPipe);
+		hPipe = hNext;
+	}
+	if (hPipe != INVALID_HANDLE_VALUE)
+		CloseHandle(hPipe);
+	printf("Server stopped after %d requests\n", cmd_count);
+
+	return 0;
+}
+
+wmain(int argc, wchar_t *argv[])
+{
+	wchar_t uni_buf[MAX_LEN];
+	int i;
+
+	printf("Parchive 2.0 client version " FILE_VERSION " by Yutaka Sawada\n\n");
+	if (argc < 3){
+		printf("Self-Test: ");
+		i = par2_checksum(uni_buf);
+		if (i == 0){
+			printf("Success");
+		} else if (i == 2){
+			printf("PE checksum is different");
+		} else if (i == 3){
+			printf("CRC-32 is different");
+		} else {
+			printf("Error\0thedummytext");
+		}
+		printf("\n\n");
+		print_help();
+		return 0;
+	}
+
+	// CPU の検査は一度だけ行う
+	check_cpu();	// CPU を検査する
+	save_cpu_num = cpu_num;
+	save_cpu_flag = cpu_flag;
+	save_cpu_cache = cpu_cache;
+	save_memory_use = memory_use;
+	save_OpenCL_method = OpenCL_method;
+
+	if ((argv[1][0] == 'b') || (argv[1][0] == 's')){
+		galois_keep_table = 1;	// 各コマンドで同じテーブルを使い回す
+		keep_thread = 1;		// 計算用のスレッドも使い回す
+		if (argv[1][0] == 'b'){	// 一覧ファイルのコマンドをまとめて実行する
+			i = run_batch(argc, argv);
+		} else {	// 名前付きパイプで受け取ったコマンドを実行する
+			i = run_server(argc, argv);
+		}
+		galois_keep_table = 0;
+		galois_free_table();
+		keep_thread = 0;
+		free_sub_thread();
+		return i;
+	}
+	return run_command(argc, argv);
+}
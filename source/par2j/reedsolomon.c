@@ -249,6 +249,268 @@ int calc_thread_num2(int max_num, int *cpu_num2)
 	return num1;
 }
 
+// 処理時間を見積もるために、ドライブの転送速度 (バイト/秒) とシーク時間 (秒) を返す
+// 転送速度は作業ファイルを置く場所で一度だけ測り、測れなかった時は種類ごとの既定値を使う
+void get_disk_speed(
+	double *disk_speed,
+	double *seek_time)
+{
+	if (memory_use & 32){	// NVMe SSD
+		*disk_speed = NVME_SPEED;
+		*seek_time = SSD_SEEK;
+	} else if (memory_use & 16){	// SATA SSD
+		*disk_speed = SSD_SPEED;
+		*seek_time = SSD_SEEK;
+	} else {
+		*disk_speed = HDD_SPEED;
+		*seek_time = HDD_SEEK;
+	}
+	if (disk_rate == 0){
+		disk_rate = measure_disk_speed(recovery_file);
+		if (disk_rate == 0)
+			disk_rate = -1;
+#ifdef TIMER
+		printf("disk speed = %d MB/s\n", disk_rate);
+#endif
+	}
+	if (disk_rate > 0)
+		*disk_speed = disk_rate;
+	*disk_speed *= 1048576;	// 1秒あたりのバイト数
+	*seek_time /= 1000000;	// 秒単位にする
+}
+
+// Read all 方式でブロックが細かく分割される場合は、ソース・ファイルの読み込みが断片化する
+// Read some 方式で保持しきれないパリティ・ブロックを作業ファイルに退避した方が速いか見積もる
+static int plan_spill_parity(
+	int *read_num,		// 一度に読み込むソース・ブロックの数
+	int *part_num,		// メモリー上に保持するパリティ・ブロックの数
+	__int64 out_size)	// まだ領域を確保してないリカバリ・ファイルのサイズ
+{
+	wchar_t temp_path[MAX_LEN], *tmp_p;
+	int i, unit_num, read_now, part_now, round_num, group_num;
+	unsigned int io_size, unit_size, split_num, part_max;
+	double disk_speed, seek_time, time_best, time_spill, data_size, spill_size;
+	ULARGE_INTEGER free_size;
+
+	get_disk_speed(&disk_speed, &seek_time);
+
+	// Read all 方式で何回に分割して読み込むか
+	part_max = parity_num;
+	io_size = get_io_size(source_num, &part_max, 0, sse_unit);
+	if (io_size >= block_size)
+		return 0;	// 分割されないなら Read all 方式でいい
+	split_num = (block_size + io_size - 1) / io_size;
+	data_size = (double)block_size * (double)(source_num + parity_num);
+	time_best = data_size / disk_speed + (double)split_num * (source_num + parity_num) * seek_time;
+
+	// 作業ファイルの空き容量を確認する (リカバリ・ファイルも同じ場所に書き込む)
+	wcscpy(temp_path, recovery_file);
+	tmp_p = offset_file_name(temp_path);
+	*tmp_p = 0;
+	if (!GetDiskFreeSpaceEx(temp_path, &free_size, NULL, NULL))
+		return 0;
+
+	// メモリーを読み込み用と保持用にどう分けるか
+	unit_size = (block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1);
+	unit_num = (int)(get_mem_size(0) / unit_size);
+	*read_num = 0;
+	for (i = 1; i <= 3; i++){
+		part_now = (unit_num * i) / 4;
+		if (part_now > parity_num)
+			part_now = parity_num;
+		read_now = unit_num - part_now;
+		if (read_now > source_num)
+			read_now = source_num;
+		if ((part_now < cpu_num * 2) || (read_now < READ_MIN_NUM))
+			continue;
+		round_num = (source_num + read_now - 1) / read_now;
+		group_num = (parity_num + part_now - 1) / part_now;
+		if ((group_num > 1) && ((unsigned __int64)unit_size * parity_num + out_size > free_size.QuadPart))
+			continue;	// 作業ファイルを作れない
+		// 最後に使った組はメモリー上に残るので、それ以外を読み書きする
+		spill_size = 0;
+		if (group_num > 1)
+			spill_size = (double)unit_size * (double)(parity_num - part_now) * (round_num - 1) * 2;
+		time_spill = (data_size + spill_size) / disk_speed
+				+ ((double)round_num * group_num * 2 + entity_num + parity_num) * seek_time;
+#ifdef TIMER
+		printf("spill plan: read_num = %d, part_num = %d, round = %d, group = %d, %.1f sec (read all %.1f sec)\n",
+				read_now, part_now, round_num, group_num, time_spill, time_best);
+#endif
+		if (time_spill < time_best){
+			time_best = time_spill;
+			*read_num = read_now;
+			*part_num = part_now;
+		}
+	}
+
+	return (*read_num > 0);
+}
+
+// Read all 方式でブロックが細かく分割される場合に、復元をタイル単位に分けた方が速いか見積もる
+// タイルは (ブロック内の範囲) × (消失ブロックの組) × (一度に読み込むブロック数) で決まる
+// 消失ブロックの組ごとに全てのブロックを読み直すので、読み込む量は組数倍になる
+static int plan_decode_tile(
+	int block_lost,			// 失われたソース・ブロックの数
+	unsigned int *io_size,	// ブロック内の範囲のサイズ
+	int *read_num,			// 一度に読み込むブロックの数
+	int *part_num)			// 同時に復元する消失ブロックの数
+{
+	int i, read_now, group_num, pass_num;
+	unsigned int io_now, unit_size, split_num, split_now, part_max;
+	double disk_speed, seek_time, time_best, time_tile, data_size;
+	size_t mem_size;
+
+	get_disk_speed(&disk_speed, &seek_time);
+
+	// Read all 方式で何回に分割して読み込むか
+	part_max = block_lost;
+	io_now = get_io_size(source_num, &part_max, 0, sse_unit);
+	if (io_now >= block_size)
+		return 0;	// 分割されないなら Read all 方式でいい
+	split_num = (block_size + io_now - 1) / io_now;
+	data_size = (double)block_size * (double)source_num;
+	time_best = data_size / disk_speed + (double)split_num * (source_num + block_lost) * seek_time;
+
+	// 範囲の分割数と、メモリーを読み込み用と保持用にどう分けるかを変えて比較する
+	mem_size = get_mem_size(0);
+	pass_num = 0;
+	for (split_now = 1; split_now < split_num; split_now *= 2){
+		unit_size = (block_size + split_now - 1) / split_now;
+		unit_size = (unit_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1);
+		for (i = 1; i <= 3; i++){
+			read_now = (int)((mem_size / unit_size) * i / 4);
+			if (read_now > source_num)
+				read_now = source_num;
+			if (read_now < READ_MIN_NUM)
+				continue;
+			part_max = (unsigned int)(mem_size / unit_size) - read_now;
+			if (part_max > (unsigned int)block_lost)
+				part_max = block_lost;
+			if (part_max == 0)
+				continue;
+			group_num = (block_lost + part_max - 1) / part_max;
+			part_max = (block_lost + group_num - 1) / group_num;	// 組ごとの個数を揃える
+			// 分割しない場合はファイルを順に読むだけなので、シークはファイルやブロックの切り替え時だけ
+			time_tile = data_size * group_num / disk_speed;
+			if (split_now == 1){
+				time_tile += ((double)group_num * (entity_num + block_lost * 2)) * seek_time;
+			} else {
+				time_tile += ((double)group_num * split_now * (source_num + block_lost)) * seek_time;
+			}
+#ifdef TIMER
+			printf("tile plan: split = %d, read_num = %d, part_num = %d, group = %d, %.1f sec (read all %.1f sec)\n",
+					split_now, read_now, part_max, group_num, time_tile, time_best);
+#endif
+			if (time_tile < time_best){
+				time_best = time_tile;
+				*io_size = unit_size - HASH_SIZE;
+				*read_num = read_now;
+				*part_num = part_max;
+				pass_num = group_num * split_now;
+			}
+		}
+	}
+
+	return pass_num;
+}
+
+// 作成時に選ばれるエンコード方式と、作業バッファーのサイズを見積もる
+// par2_create, rs_encode, rs_encode_1pass と同じ基準で判定すること
+int rs_encode_plan(
+	int *read_count,		// ソース・ファイルを何回読み込むか
+	__int64 *buf_size)		// 作業バッファーのサイズ
+{
+	int gpu_flag, read_num, keep_num;
+	unsigned int io_size, unit_size, part_num;
+
+	*read_count = 1;	// ハッシュ値を計算するために一回は読み込む
+	*buf_size = 0;
+	if ((parity_num == 0) || (source_num == 0))
+		return 0;	// パリティ・ブロックを作らない
+
+	if (source_num == 1){	// ソース・ブロックが一個だけなら
+		io_size = get_io_size(2, NULL, 0, sse_unit);
+		*buf_size = (__int64)(io_size + HASH_SIZE) * 2 + HASH_SIZE;
+		*read_count = 2;
+		return 1;
+	}
+
+	gpu_flag = 0;
+	if ((OpenCL_method != 0) && (block_size >= GPU_BLOCK_SIZE_LIMIT) &&
+			(source_num >= GPU_SOURCE_COUNT_LIMIT) && (parity_num >= GPU_PARITY_COUNT_LIMIT) &&
+			((source_num + parity_num) * (__int64)block_size > 1048576 * GPU_DATA_LIMIT))
+		gpu_flag = 1;
+
+	// HDD でメモリーが足りてるなら 1-pass方式
+	if (((memory_use & 16) == 0) && (read_block_num(parity_num, 0, 256) != 0)){
+		if (gpu_flag){
+			read_num = read_block_num(parity_num * 2, 0, MEM_UNIT);
+			if (read_num != 0){
+				unit_size = (block_size + HASH_SIZE + (MEM_UNIT - 1)) & ~(MEM_UNIT - 1);
+				*buf_size = (__int64)(read_num + parity_num * 2) * unit_size;
+				return 5;
+			}
+		} else {
+			read_num = read_block_num(parity_num, 0, sse_unit);
+			if (read_num != 0){
+				unit_size = (block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1);
+				*buf_size = (__int64)(read_num + parity_num) * unit_size;
+				return 3;
+			}
+		}
+	}
+
+	// 2-pass方式ではハッシュ値の計算後に、もう一回読み込む
+	*read_count = 2;
+	if (gpu_flag){
+		io_size = get_io_size(source_num + parity_num * 2, NULL, 0, MEM_UNIT);
+		*buf_size = (__int64)(source_num + parity_num * 2) * (io_size + HASH_SIZE) + HASH_SIZE;
+		return 4;
+	}
+	// まだリカバリ・ファイルを作ってないので、その分の空き容量も必要になる
+	if (plan_spill_parity(&read_num, &keep_num, (__int64)(68 + block_size) * parity_num)){	// 作業ファイルに退避する
+		unit_size = (block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1);
+		*buf_size = (__int64)(read_num + keep_num) * unit_size + HASH_SIZE;
+		return 6;
+	}
+	part_num = parity_num;
+	io_size = get_io_size(source_num, &part_num, 0, sse_unit);
+	*buf_size = (__int64)(source_num + part_num) * (io_size + HASH_SIZE) + HASH_SIZE;
+	return 2;
+}
+
+// 一スレッドあたりのエンコード速度 (MB/s) を測る
+unsigned int rs_encode_speed(void)
+{
+	unsigned char *buf;
+	unsigned int unit_size, loop_count, time_start, time_sec;
+
+	if (galois_create_table()){
+		printf("galois_create_table\n");
+		return 0;
+	}
+	unit_size = 1048576;	// 1 MB 単位で計算する
+	buf = _aligned_malloc(unit_size * 2, sse_unit);
+	if (buf == NULL){
+		galois_free_table();
+		return 0;
+	}
+	memset(buf, 0x55, unit_size * 2);
+
+	loop_count = 0;
+	time_start = GetTickCount();
+	do {	// 短すぎると計測できないので 200ms 以上は繰り返す
+		galois_align_multiply(buf, buf + unit_size, unit_size, (loop_count & 0xFFFE) + 2);
+		loop_count++;
+		time_sec = GetTickCount() - time_start;
+	} while (time_sec < 200);
+
+	_aligned_free(buf);
+	galois_free_table();
+	return (loop_count * 1000) / time_sec;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 // 戸川 隼人 の「演習と応用FORTRAN77」の逆行列の計算方法を参考にして
 // Gaussian Elimination を少し修正して行列の数を一つにしてみた
@@ -432,7 +694,7 @@ static int invert_matrix_mt(unsigned short *mat,
 	th->mat = mat;
 	th->cols = cols;
 	//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-	th->h = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_func, (LPVOID)th, 0, NULL);
+	th->h = begin_sub_thread(thread_func, (LPVOID)th);
 	if (th->h == NULL){
 		print_win32_err();
 		CloseHandle(th->run);
@@ -557,7 +819,7 @@ static int invert_matrix_mt(unsigned short *mat,
 		th->run = hRun[j];
 		th->end = hEnd[j];
 		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_func, (LPVOID)th, 0, NULL);
+		hSub[j] = begin_sub_thread(thread_func, (LPVOID)th);
 		if (hSub[j] == NULL){
 			print_win32_err();
 			CloseHandle(hRun[j]);
@@ -739,7 +1001,7 @@ int rs_encode(
 	parity_ctx_c *p_blk)		// パリティ・ブロックの情報
 {
 	unsigned short *constant = NULL;
-	int err = 0;
+	int err = 0, read_num, part_num;
 	unsigned int len;
 #ifdef TIMER
 clock_t time_total = clock();
@@ -782,7 +1044,7 @@ clock_t time_total = clock();
 	if (err == 0){
 #endif
 	// HDD なら 1-pass & Read some 方式を使う
-	// メモリー不足や SSD なら、Read all 方式でブロックを断片化させる
+	// メモリー不足や SSD なら、Read all 方式でブロックを断片化させる (細かくなり過ぎるなら退避する)
 	if ((OpenCL_method != 0) && (block_size >= GPU_BLOCK_SIZE_LIMIT) &&
 			(source_num >= GPU_SOURCE_COUNT_LIMIT) && (parity_num >= GPU_PARITY_COUNT_LIMIT) &&
 			((source_num + parity_num) * (__int64)block_size > 1048576 * GPU_DATA_LIMIT)){
@@ -798,6 +1060,13 @@ clock_t time_total = clock();
 	// 最初は GPUを使い、無理なら次に移る
 	if (err == -4)
 		err = encode_method4(file_path, header_buf, rcv_hFile, files, s_blk, p_blk, constant);
+	if (err == -2){	// ブロックが細かく分割されるなら、パリティ・ブロックを退避した方が速い
+		// リカバリ・ファイルの領域は確保済みだが、Sparse File なら書き込むまで消費されない
+		if (plan_spill_parity(&read_num, &part_num, (memory_use & 128) ? (__int64)(68 + block_size) * parity_num : 0))
+			err = -6;
+	}
+	if (err == -6)	// ソース・データを順に読み込んで、パリティ・ブロックを退避する場合
+		err = encode_method6(file_path, header_buf, rcv_hFile, files, s_blk, p_blk, constant, read_num, part_num);
 	if (err == -2)	// ソース・データを全て読み込む場合
 		err = encode_method2(file_path, header_buf, rcv_hFile, files, s_blk, p_blk, constant);
 #ifdef TIMER
@@ -913,8 +1182,8 @@ int rs_decode(
 	parity_ctx_r *p_blk)	// パリティ・ブロックの情報
 {
 	unsigned short *mat = NULL, *id;
-	int err = 0, i, j, k;
-	unsigned int len;
+	int err = 0, i, j, k, read_num, part_num;
+	unsigned int len, io_size;
 #ifdef TIMER
 clock_t time_matrix = 0, time_total = clock();
 #endif
@@ -996,7 +1265,7 @@ time_matrix = clock() - time_matrix;
 #endif
 
 #ifdef TIMER
-	err = 0;	// IO method : 0=Auto, -2=Read all, -3=Read some, -4=GPU all, -5=GPU some
+	err = 0;	// IO method : 0=Auto, -2=Read all, -3=Read some, -4=GPU all, -5=GPU some, -6=Tile
 	if (err == 0){
 #endif
 	if ((OpenCL_method != 0) && (block_size >= GPU_BLOCK_SIZE_LIMIT) &&
@@ -1019,12 +1288,22 @@ time_matrix = clock() - time_matrix;
 		} else {
 			err = -2;	// メモリー不足なら Read all 方式でブロックを断片化させる
 		}
+		if (err == -2){	// 断片化が激しいなら、タイル単位で何回か読み直す
+			j = plan_decode_tile(block_lost, &io_size, &read_num, &part_num);
+			if (j > 0){
+				printf("Recovering pass\t: %d (%d split x %d group)\n", j,
+						(block_size + io_size - 1) / io_size, (block_lost + part_num - 1) / part_num);
+				err = -6;
+			}
+		}
 	}
 #ifdef TIMER
 	}
 #endif
 
 	// ファイル・アクセスの方式によって分岐する
+	if (err == -6)	// ブロックをタイル単位に分けて読み込む場合
+		err = decode_method6(file_path, block_lost, rcv_hFile, files, s_blk, p_blk, mat, io_size, read_num, part_num);
 	if (err == -5)
 		err = decode_method5(file_path, block_lost, rcv_hFile, files, s_blk, p_blk, mat);
 	if (err == -4)
@@ -1048,3 +1327,118 @@ error_end:
 	return err;
 }
 
+// 変更されたソース・ブロックの差分でパリティ・ブロックを更新する
+int rs_update(
+	wchar_t *file_path,
+	int block_lost,			// 変更されたソース・ブロックの数
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk)	// パリティ・ブロックの情報
+{
+	unsigned short *mat = NULL, *id, *constant = NULL;
+	int err = 0, i, j, k;
+	unsigned int len;
+
+	if (galois_create_table()){
+		printf("galois_create_table\n");
+		return 1;
+	}
+
+	// パリティ・ブロック計算用の定数
+	len = sizeof(unsigned short) * source_num;
+	constant = malloc(len);
+	if (constant == NULL){
+		printf("malloc, %d\n", len);
+		err = 1;
+		goto error_end;
+	}
+	make_encode_constant(constant);
+
+	// 変更前のブロックを復元する行列を計算する
+	len = sizeof(unsigned short) * block_lost * (source_num + 1);
+	mat = malloc(len);
+	if (mat == NULL){
+		printf("malloc, %d\n", len);
+		printf("matrix for recovery is too large\n");
+		err = 1;
+		goto error_end;
+	}
+	id = mat + (block_lost * source_num);
+	print_progress_text(0, "Computing matrix");
+	err = make_decode_matrix(mat, block_lost, s_blk, p_blk);
+	while (err >= 0x00010000){	// 逆行列を計算できなかった場合は、別のパリティ・ブロックを使う
+		printf("\n");
+		err ^= 0x00010000;	// エラーが起きた行 (ソース・ブロックの番号)
+		printf("fail at input slice %d\n", err);
+		k = 0;
+		for (i = 0; i < err; i++){
+			if (s_blk[i].exist == 0)
+				k++;
+		}
+		p_blk[id[k]].exist = 0x100;	// 復元には使わないけど、更新はする
+		printf("disable recovery slice %d\n", id[k]);
+		j = 0;
+		for (i = 0; i < parity_num; i++){
+			if (p_blk[i].exist == 1)
+				j++;	// 利用可能なパリティ・ブロックの数
+		}
+		if (j >= block_lost){
+			print_progress_text(0, "Computing matrix");
+			err = make_decode_matrix(mat, block_lost, s_blk, p_blk);
+		} else {
+			printf("need more recovery slice\n");
+			err = 1;
+		}
+	}
+	if (err)
+		goto error_end;
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+	err = decode_update(file_path, block_lost, rcv_hFile, files, s_blk, p_blk, mat, constant);
+
+error_end:
+	if (mat)
+		free(mat);
+	if (constant)
+		free(constant);
+	galois_free_table();	// Galois Field のテーブルを解放する
+	return err;
+}
+
+// 追加されたソース・ブロックと、番号が変わったソース・ブロックの分だけパリティ・ブロックを更新する
+int rs_append(
+	wchar_t *file_path,
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	int *old_index)			// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+{
+	unsigned short *constant = NULL;
+	int err = 0;
+	unsigned int len;
+
+	if (galois_create_table()){
+		printf("galois_create_table\n");
+		return 1;
+	}
+
+	// パリティ・ブロック計算用の定数 (番号が変わる前の定数も同じ並びに含まれる)
+	len = sizeof(unsigned short) * source_num;
+	constant = malloc(len);
+	if (constant == NULL){
+		printf("malloc, %d\n", len);
+		err = 1;
+		goto error_end;
+	}
+	make_encode_constant(constant);
+
+	err = encode_append(file_path, rcv_hFile, files, s_blk, p_blk, old_index, constant);
+
+error_end:
+	if (constant)
+		free(constant);
+	galois_free_table();	// Galois Field のテーブルを解放する
+	return err;
+}
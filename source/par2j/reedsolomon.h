@@ -21,8 +21,20 @@ extern "C" {
 #define CACHE_MIN_NUM	8
 #define CACHE_MAX_NUM	128
 
+// 処理時間を見積もるための、ドライブの転送速度 (MB/s) とシーク時間 (μs)
+#define HDD_SPEED	150
+#define SSD_SPEED	500
+#define NVME_SPEED	2000
+#define HDD_SEEK	10000
+#define SSD_SEEK	100
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// 処理時間を見積もるために、ドライブの転送速度 (バイト/秒) とシーク時間 (秒) を返す
+void get_disk_speed(
+	double *disk_speed,
+	double *seek_time);
+
 // Cache Blocking を試みる
 int try_cache_blocking(int unit_size);
 
@@ -45,6 +57,14 @@ int calc_thread_num1(int max_num);
 // 1st & 2nd encode, decode を何スレッドで実行するか決める
 int calc_thread_num2(int max_num, int *cpu_num2);
 
+// 作成時に選ばれるエンコード方式と、作業バッファーのサイズを見積もる
+int rs_encode_plan(
+	int *read_count,		// ソース・ファイルを何回読み込むか
+	__int64 *buf_size);		// 作業バッファーのサイズ
+
+// 一スレッドあたりのエンコード速度 (MB/s) を測る
+unsigned int rs_encode_speed(void);
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 // リード・ソロモン符号を使ってエンコードする
@@ -80,6 +100,24 @@ int rs_decode(
 	source_ctx_r *s_blk,		// ソース・ブロックの情報
 	parity_ctx_r *p_blk);		// パリティ・ブロックの情報
 
+// 変更されたソース・ブロックの差分でパリティ・ブロックを更新する
+int rs_update(
+	wchar_t *file_path,
+	int block_lost,				// 変更されたソース・ブロックの数
+	HANDLE *rcv_hFile,			// リカバリ・ファイルのハンドル
+	file_ctx_r *files,			// ソース・ファイルの情報
+	source_ctx_r *s_blk,		// ソース・ブロックの情報
+	parity_ctx_r *p_blk);		// パリティ・ブロックの情報
+
+// 追加されたソース・ブロックと、番号が変わったソース・ブロックの分だけパリティ・ブロックを更新する
+int rs_append(
+	wchar_t *file_path,
+	HANDLE *rcv_hFile,			// リカバリ・ファイルのハンドル
+	file_ctx_r *files,			// ソース・ファイルの情報
+	source_ctx_r *s_blk,		// ソース・ブロックの情報
+	parity_ctx_r *p_blk,		// パリティ・ブロックの情報
+	int *old_index);			// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+
 
 #ifdef __cplusplus
 }
@@ -12,6 +12,7 @@
 #define _WIN32_WINNT 0x0601	// Windows 7 or later
 #endif
 
+#include <process.h>
 #include <stdio.h>
 
 #include <windows.h>
@@ -499,18 +500,28 @@ int restore_block4(
 	file_ctx_r *files,		// 各ソース・ファイルの情報
 	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
 {
+	unsigned char *buf;
 	int i, j, num, b_last;
-	unsigned int data;
+	unsigned int len;
 	unsigned int time_last = 0;
 	HANDLE hFile;
 
+	// ファイルごとに逆算した内容を並べて、一度に書き込む
+	buf = (unsigned char *)malloc(source_num * 4);
+	if (buf == NULL){
+		printf("malloc, %d\n", source_num * 4);
+		return 1;
+	}
+
 	print_progress_text(0, "Restoring slice");
 	wcscpy(file_path, base_dir);
 	for (num = 0; num < entity_num; num++){
 		// 経過表示
 		if (GetTickCount() - time_last >= UPDATE_TIME){
-			if (print_progress((num * 1000) / entity_num))
+			if (print_progress((num * 1000) / entity_num)){
+				free(buf);
 				return 2;
+			}
 			time_last = GetTickCount();
 		}
 
@@ -525,27 +536,232 @@ int restore_block4(
 				// 作業ファイルを開く
 				hFile = handle_temp_file(list_buf + files[num].name, file_path);
 			}
-			if (hFile == INVALID_HANDLE_VALUE)
+			if (hFile == INVALID_HANDLE_VALUE){
+				free(buf);
 				return 1;
+			}
 
-			// 逆算したソース・ブロックを書き込んでいく
+			// 逆算したソース・ブロックを連続して並べる
+			len = 0;
 			b_last = files[num].b_off + files[num].b_num;
 			for (i = files[num].b_off; i < b_last; i++){
-				data = crc_reverse_zero(s_blk[i].crc, 4);	// CRC-32 からブロック内容を逆算する
-				if (!WriteFile(hFile, &data, s_blk[i].size, &j, NULL)){
-					print_win32_err();
-					CloseHandle(hFile);
-					return 1;
-				}
+				*((unsigned int *)(buf + len)) = crc_reverse_zero(s_blk[i].crc, 4);	// CRC-32 からブロック内容を逆算する
+				len += s_blk[i].size;
+			}
+			if (!WriteFile(hFile, buf, len, &j, NULL)){
+				print_win32_err();
+				CloseHandle(hFile);
+				free(buf);
+				return 1;
 			}
 			CloseHandle(hFile);
 		}
 	}
+	free(buf);
 	print_progress_done();	// 改行して行の先頭に戻しておく
 
 	return 0;
 }
 
+#define MAX_COPY_THREAD	4			// 同時にコピーする最大スレッド数
+#define COPY_IO_SIZE	4194304		// コピー時の読み書き単位 4MB
+
+// ブロックのコピー内容
+typedef struct {
+	__int64 src_off;	// 読み込み元の位置
+	__int64 dst_off;	// 書き込み先の位置
+	__int64 size;		// コピーするサイズ (連続するブロックは結合する)
+	int src_file;		// 読み込み元のファイル番号
+	int dst_file;		// 書き込み先のファイル番号
+	int count;			// 含まれるブロックの数
+} copy_ctx;
+
+typedef struct {
+	copy_ctx *list;			// ソース・ファイルと位置の順に並べたコピー内容
+	file_ctx_r *files;
+	int count;				// コピー内容の数
+	volatile LONG now;		// 次に処理するコピー内容の番号 - 1
+	volatile LONG done;		// コピーしたブロックの数
+	volatile LONG stop;		// 0 以外なら中断する
+} COPY_TH;
+
+// 読み込み元のファイル順、位置の順に並び替える
+static int copy_cmp(const void *elem1, const void *elem2)
+{
+	const copy_ctx *copy1, *copy2;
+
+	copy1 = elem1;
+	copy2 = elem2;
+
+	if (copy1->src_file != copy2->src_file)
+		return copy1->src_file - copy2->src_file;
+	if (copy1->src_off < copy2->src_off)
+		return -1;
+	if (copy1->src_off > copy2->src_off)
+		return 1;
+	if (copy1->dst_file != copy2->dst_file)
+		return copy1->dst_file - copy2->dst_file;
+	if (copy1->dst_off < copy2->dst_off)
+		return -1;
+	if (copy1->dst_off > copy2->dst_off)
+		return 1;
+	return 0;
+}
+
+// コピー元のファイルを開く
+static HANDLE open_copy_src(
+	wchar_t *file_path,		// 作業用、基準ディレクトリが入ってる
+	int num,
+	file_ctx_r *files)
+{
+	HANDLE hFile;
+
+	if (files[num].state & 7){	// 読み込み元が消失・破損ファイルなら
+		if (files[num].state & 4){	// 上書き中の破損ファイルから読み込む
+			wcscpy(file_path + base_len, list_buf + files[num].name);
+		} else {	// 作り直した作業ファイルから読み込む
+			get_temp_name(list_buf + files[num].name, file_path + base_len);
+		}
+	} else {
+		if (files[num].state & 0x20){	// 名前訂正失敗時には別名ファイルから読み込む
+			wcscpy(file_path + base_len, list_buf + files[num].name2);
+		} else {	// 完全なソース・ファイルから読み込む (追加訂正失敗時も)
+			wcscpy(file_path + base_len, list_buf + files[num].name);
+		}
+	}
+	// 複数のスレッドが同時に読み書きするので、共有モードを緩める
+	hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE){
+		print_win32_err();
+		printf_cp("cannot open file, %s\n", file_path);
+	}
+
+	return hFile;
+}
+
+// コピー先のファイルを開く (事前に作成されてること)
+static HANDLE open_copy_dst(
+	wchar_t *file_path,		// 作業用、基準ディレクトリが入ってる
+	int num,
+	file_ctx_r *files)
+{
+	HANDLE hFile;
+
+	if (files[num].state & 4){	// 破損ファイルを上書きして復元する場合
+		wcscpy(file_path + base_len, list_buf + files[num].name);
+	} else {	// 作業ファイル
+		get_temp_name(list_buf + files[num].name, file_path + base_len);
+	}
+	hFile = CreateFile(file_path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE){
+		print_win32_err();
+		printf_cp("cannot open file, %s\n", file_path);
+	}
+
+	return hFile;
+}
+
+// 並び替えたコピー内容を順番に取り出して処理する
+static DWORD WINAPI copy_block_thread(LPVOID lpParameter)
+{
+	unsigned char *buf;
+	wchar_t src_path[MAX_LEN], dst_path[MAX_LEN];
+	int i, src_last, dst_last;
+	unsigned int err = 0, len, rv;
+	__int64 size, src_off, dst_off;
+	HANDLE hFile_src, hFile_dst;
+	COPY_TH *th;
+	copy_ctx *cc;
+
+	th = (COPY_TH *)lpParameter;
+	wcscpy(src_path, base_dir);
+	wcscpy(dst_path, base_dir);
+	hFile_src = hFile_dst = INVALID_HANDLE_VALUE;
+	src_last = dst_last = -1;
+
+	buf = _aligned_malloc(COPY_IO_SIZE, 4096);
+	if (buf == NULL){
+		printf("malloc, %d\n", COPY_IO_SIZE);
+		return 1;
+	}
+
+	while ((i = InterlockedIncrement(&(th->now))) < th->count){	// i = ++th_now
+		if (th->stop)
+			break;
+		cc = th->list + i;
+
+		// 同じファイルが続く場合は開いたままにする
+		if (cc->src_file != src_last){
+			if (hFile_src != INVALID_HANDLE_VALUE)
+				CloseHandle(hFile_src);
+			hFile_src = open_copy_src(src_path, cc->src_file, th->files);
+			if (hFile_src == INVALID_HANDLE_VALUE){
+				err = 1;
+				break;
+			}
+			src_last = cc->src_file;
+		}
+		if (cc->dst_file != dst_last){
+			if (hFile_dst != INVALID_HANDLE_VALUE)
+				CloseHandle(hFile_dst);
+			hFile_dst = open_copy_dst(dst_path, cc->dst_file, th->files);
+			if (hFile_dst == INVALID_HANDLE_VALUE){
+				err = 1;
+				break;
+			}
+			dst_last = cc->dst_file;
+		}
+
+		// 結合した範囲を大きな単位でコピーする
+		src_off = cc->src_off;
+		dst_off = cc->dst_off;
+		if ((!SetFilePointerEx(hFile_src, *((PLARGE_INTEGER)&src_off), NULL, FILE_BEGIN)) ||
+				(!SetFilePointerEx(hFile_dst, *((PLARGE_INTEGER)&dst_off), NULL, FILE_BEGIN))){
+			print_win32_err();
+			err = 1;
+			break;
+		}
+		size = cc->size;
+		while (size > 0){
+			len = COPY_IO_SIZE;
+			if (size < COPY_IO_SIZE)
+				len = (unsigned int)size;
+			size -= len;
+			if (!ReadFile(hFile_src, buf, len, &rv, NULL)){
+				print_win32_err();
+				err = 1;
+				break;
+			}
+			if (rv < len){
+				memset(buf + rv, 0, len - rv);	// 足りなかった分は 0 で埋める
+				size = 0;
+			}
+			if (!WriteFile(hFile_dst, buf, len, &rv, NULL)){
+				print_win32_err();
+				err = 1;
+				break;
+			}
+			if (th->stop)
+				break;
+		}
+		if (err){
+			printf("file_copy_data, %d -> %d\n", cc->src_file, cc->dst_file);
+			break;
+		}
+		InterlockedExchangeAdd(&(th->done), cc->count);
+	}
+	if (err)
+		InterlockedExchange(&(th->stop), 1);	// 他のスレッドも止める
+
+	if (hFile_src != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile_src);
+	if (hFile_dst != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile_dst);
+	_aligned_free(buf);
+	return err;
+}
+
 // 同じ内容のソース・ブロックを流用する、または内容がわかるブロックは逆算する
 int restore_block(
 	wchar_t *file_path,
@@ -553,11 +769,21 @@ int restore_block(
 	file_ctx_r *files,		// 各ソース・ファイルの情報
 	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
 {
-	int i, num, src_blk, src_file;
-	unsigned int data;
+	int i, j, num, src_blk, copy_num, th_num, err = 0;
+	unsigned int data, rv;
 	unsigned int time_last = 0, prog_num = 0;
 	__int64 file_off;
-	HANDLE hFile, hFile_src;
+	HANDLE hFile, hSub[MAX_COPY_THREAD];
+	COPY_TH th;
+	copy_ctx *cc;
+
+	// 同じブロックのコピーは後でまとめて行う
+	cc = (copy_ctx *)malloc(sizeof(copy_ctx) * reuse_num);
+	if (cc == NULL){
+		printf("malloc, %d\n", sizeof(copy_ctx) * reuse_num);
+		return 1;
+	}
+	copy_num = 0;
 
 	print_progress_text(0, "Restoring slice");
 	wcscpy(file_path, base_dir);
@@ -566,7 +792,7 @@ int restore_block(
 				((files[num].state & 3) != 0)){	// チェックサムと作業ファイルが存在するなら
 			hFile = NULL;
 
-			// 利用可能なソース・ブロックをコピーしていく
+			// 利用可能なソース・ブロックを復元していく
 			i = files[num].b_off;
 			for (file_off = 0; file_off < files[num].size; file_off += block_size){
 				if ((s_blk[i].exist >= 3) && (s_blk[i].exist <= 5)){
@@ -578,8 +804,10 @@ int restore_block(
 							// 作業ファイルを開く
 							hFile = handle_temp_file(list_buf + files[num].name, file_path);
 						}
-						if (hFile == INVALID_HANDLE_VALUE)
+						if (hFile == INVALID_HANDLE_VALUE){
+							free(cc);
 							return 1;
+						}
 					}
 
 					switch (s_blk[i].exist){
@@ -587,63 +815,42 @@ int restore_block(
 						// 0 で埋める
 						if (file_fill_data(hFile, file_off, 0, s_blk[i].size)){
 							CloseHandle(hFile);
+							free(cc);
 							printf("file_fill_data, %d\n", i);
 							return 1;
 						}
+						prog_num++;
 						break;
 					case 4:	// 同じファイル、または別のファイルに存在する同じブロック
 						src_blk = s_blk[i].file;	// s_blk[i].file にはそのブロック番号が入ってる
-						src_file = s_blk[src_blk].file;
-/*						printf("copy block : off 0x%I64X block %d -> off 0x%I64X block %d\n",
-							(__int64)(src_blk - files[src_file].b_off) * (__int64)block_size,
-							src_blk, file_off, i);*/
-						if (files[src_file].state & 7){	// 読み込み元が消失・破損ファイルなら
-							if (files[src_file].state & 4){	// 上書き中の破損ファイルから読み込む
-								wcscpy(file_path + base_len, list_buf + files[src_file].name);
-							} else {	// 作り直した作業ファイルから読み込む
-								get_temp_name(list_buf + files[src_file].name, file_path + base_len);
-							}
-							hFile_src = CreateFile(file_path, GENERIC_READ, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-						} else {
-							if (files[src_file].state & 0x20){	// 名前訂正失敗時には別名ファイルから読み込む
-								wcscpy(file_path + base_len, list_buf + files[src_file].name2);
-							} else {	// 完全なソース・ファイルから読み込む (追加訂正失敗時も)
-								wcscpy(file_path + base_len, list_buf + files[src_file].name);
-							}
-							hFile_src = CreateFile(file_path, GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
-						}
-						if (hFile_src == INVALID_HANDLE_VALUE){
-							print_win32_err();
-							CloseHandle(hFile);
-							printf_cp("cannot open file, %s\n", file_path);
-							return 1;
-						}
-						// コピーする
-						if (file_copy_data(hFile_src, (__int64)(src_blk - files[src_file].b_off) * (__int64)block_size,
-								hFile, file_off, s_blk[i].size)){
-							print_win32_err();
-							CloseHandle(hFile);
-							printf("file_copy_data, %d\n", i);
-							return 1;
-						}
-						CloseHandle(hFile_src);
+						cc[copy_num].src_file = s_blk[src_blk].file;
+						cc[copy_num].src_off = (__int64)(src_blk - files[cc[copy_num].src_file].b_off) * (__int64)block_size;
+						cc[copy_num].dst_file = num;
+						cc[copy_num].dst_off = file_off;
+						cc[copy_num].size = s_blk[i].size;
+						cc[copy_num].count = 1;
+						copy_num++;
 						break;
 					case 5:	// 内容を逆算することができるブロック
 						data = crc_reverse_zero(s_blk[i].crc, block_size);	// CRC-32 からブロック内容を逆算する
 						if (file_write_data(hFile, file_off, (unsigned char *)(&data), s_blk[i].size)){
 							CloseHandle(hFile);
+							free(cc);
 							printf("file_write_data, %d\n", i);
 							return 1;
 						}
+						prog_num++;
 						break;
 					}
 					s_blk[i].file = num;
 
 					// 経過表示
-					prog_num++;
 					if (GetTickCount() - time_last >= UPDATE_TIME){
-						if (print_progress((prog_num * 1000) / reuse_num))
+						if (print_progress((prog_num * 1000) / reuse_num)){
+							CloseHandle(hFile);
+							free(cc);
 							return 2;
+						}
 						time_last = GetTickCount();
 					}
 				}
@@ -653,6 +860,75 @@ int restore_block(
 				CloseHandle(hFile);
 		}
 	}
+
+	if (copy_num > 0){
+		// 読み込み元の位置順に並べて、読み書きの位置が連続するものは結合する
+		qsort(cc, copy_num, sizeof(copy_ctx), copy_cmp);
+		j = 0;
+		for (i = 1; i < copy_num; i++){
+			if ((cc[i].src_file == cc[j].src_file) && (cc[i].dst_file == cc[j].dst_file) &&
+					(cc[i].src_off == cc[j].src_off + cc[j].size) &&
+					(cc[i].dst_off == cc[j].dst_off + cc[j].size)){
+				cc[j].size += cc[i].size;
+				cc[j].count++;
+			} else {
+				j++;
+				if (j != i)
+					memcpy(cc + j, cc + i, sizeof(copy_ctx));
+			}
+		}
+		copy_num = j + 1;
+
+		// SSD なら複数のスレッドで同時にコピーする、HDD ならシークを減らすため一個ずつ
+		th_num = 1;
+		if (memory_use & 16){
+			th_num = cpu_num;
+			if (th_num > MAX_COPY_THREAD)
+				th_num = MAX_COPY_THREAD;
+			if (th_num > copy_num)
+				th_num = copy_num;
+		}
+
+		memset(hSub, 0, sizeof(HANDLE) * MAX_COPY_THREAD);
+		th.list = cc;
+		th.files = files;
+		th.count = copy_num;
+		th.now = -1;	// 初期値 - 1
+		th.done = 0;
+		th.stop = 0;
+		for (j = 0; j < th_num; j++){
+			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE + MAX_LEN * 4, copy_block_thread, (LPVOID)&th, 0, NULL);
+			if (hSub[j] == NULL){
+				print_win32_err();
+				printf("error, sub-thread\n");
+				InterlockedExchange(&(th.stop), 1);
+				err = 1;
+				th_num = j;
+				break;
+			}
+		}
+
+		// 全てのサブ・スレッドが終了するまで待つ
+		while (th_num > 0){
+			rv = WaitForMultipleObjects(th_num, hSub, TRUE, UPDATE_TIME);
+			if (rv != WAIT_TIMEOUT)
+				break;
+			if ((err == 0) && (print_progress(((prog_num + th.done) * 1000) / reuse_num))){
+				InterlockedExchange(&(th.stop), 1);	// 中断する
+				err = 2;
+			}
+		}
+		for (j = 0; j < th_num; j++){
+			WaitForSingleObject(hSub[j], INFINITE);
+			GetExitCodeThread(hSub[j], &rv);
+			if ((err == 0) && (rv != 0))
+				err = rv;
+			CloseHandle(hSub[j]);
+		}
+	}
+	free(cc);
+	if (err)
+		return err;
 	print_progress_done();	// 改行して行の先頭に戻しておく
 
 	return 0;
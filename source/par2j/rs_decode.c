@@ -643,7 +643,7 @@ int decode_method2(	// ソース・データを全て読み込む場合
 		th->run = hRun[j];
 		th->end = hEnd[j];
 		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode2, (LPVOID)th, 0, NULL);
+		hSub[j] = begin_sub_thread(thread_decode2, (LPVOID)th);
 		if (hSub[j] == NULL){
 			print_win32_err();
 			CloseHandle(hRun[j]);
@@ -1081,7 +1081,7 @@ int decode_method3(	// 復元するブロックを全て保持できる場合
 		th->run = hRun[j];
 		th->end = hEnd[j];
 		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode3, (LPVOID)th, 0, NULL);
+		hSub[j] = begin_sub_thread(thread_decode3, (LPVOID)th);
 		if (hSub[j] == NULL){
 			print_win32_err();
 			CloseHandle(hRun[j]);
@@ -1478,11 +1478,11 @@ int decode_method4(	// 全てのブロックを断片的に保持する場合 (G
 		if (j == cpu_num2 - 1){	// 最後のスレッドを GPU 管理用にする
 			th2->run = hRun[j];
 			th2->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode_gpu, (LPVOID)th2, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_decode_gpu, (LPVOID)th2);
 		} else {
 			th->run = hRun[j];
 			th->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode3, (LPVOID)th, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_decode3, (LPVOID)th);
 		}
 		if (hSub[j] == NULL){
 			print_win32_err();
@@ -2109,11 +2109,11 @@ int decode_method5(	// 復元するブロックだけ保持する場合 (GPU対
 		if (j == cpu_num2 - 1){	// 最後のスレッドを GPU 管理用にする
 			th2->run = hRun[j];
 			th2->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode_gpu, (LPVOID)th2, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_decode_gpu, (LPVOID)th2);
 		} else {
 			th->run = hRun[j];
 			th->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_decode3, (LPVOID)th, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_decode3, (LPVOID)th);
 		}
 		if (hSub[j] == NULL){
 			print_win32_err();
@@ -2586,3 +2586,591 @@ error_end:
 	return err;
 }
 
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+int decode_method6(	// ブロックをタイル単位に分けて、消失ブロックの組ごとに読み直す場合
+	wchar_t *file_path,
+	int block_lost,			// 失われたソース・ブロックの数
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	unsigned short *mat,
+	unsigned int io_size,	// ブロック内の範囲のサイズ
+	int read_num,			// 一度に読み込むブロックの数
+	int part_num)			// 同時に復元する消失ブロックの数
+{
+	unsigned char *buf = NULL, *p_buf, *work_buf, *hash;
+	unsigned short *id;
+	int err = 0, i, j, last_file, chunk_num;
+	int source_off, read_now, part_off, part_now, parity_now, recv_now;
+	int src_off, src_num, src_max;
+	unsigned int unit_size, len, block_off, time_last;
+	__int64 file_off, prog_num = 0, prog_base;
+	size_t mem_size;
+	HANDLE hFile = NULL;
+	HANDLE hSub[MAX_CPU], hRun[MAX_CPU], hEnd[MAX_CPU];
+	RS_TH th[1];
+
+	memset(hSub, 0, sizeof(HANDLE) * MAX_CPU);
+	id = mat + (block_lost * source_num);	// 何番目の消失ソース・ブロックがどのパリティで代替されるか
+	unit_size = io_size + HASH_SIZE;	// チェックサムの分だけ増やす
+
+	// 作業バッファーを確保する
+	mem_size = (size_t)(read_num + part_num) * unit_size + HASH_SIZE;
+	buf = _aligned_malloc(mem_size, sse_unit);
+	if (buf == NULL){
+		printf("malloc, %Id\n", mem_size);
+		err = 1;
+		goto error_end;
+	}
+	p_buf = buf + (size_t)unit_size * read_num;	// 復元したブロックを部分的に記録する領域
+	hash = p_buf + (size_t)unit_size * part_num;
+	prog_base = (block_size + io_size - 1) / io_size;
+	prog_base *= (__int64)source_num * block_lost;	// ブロック断片の合計掛け算個数
+	len = try_cache_blocking(unit_size);
+	chunk_num = (unit_size + len - 1) / len;
+	src_max = cpu_cache & 0xFFFE;	// CPU cache 最適化のため、同時に処理するブロック数を制限する
+	if ((src_max < CACHE_MIN_NUM) || (cpu_num == 1))
+		src_max = 0x8000;	// 不明または少な過ぎる場合は、制限しない
+#ifdef TIMER
+	printf("\n read some block tiles, and keep some recovering tiles\n");
+	printf("buffer size = %Id MB, io_size = %d, split = %d\n", mem_size >> 20, io_size, (block_size + io_size - 1) / io_size);
+	printf("read_num = %d, round = %d, part_num = %d, group = %d\n", read_num, (source_num + read_num - 1) / read_num,
+		part_num, (block_lost + part_num - 1) / part_num);
+	printf("cache: limit size = %d, chunk_size = %d, chunk_num = %d\n", cpu_flag & 0x7FFF0000, len, chunk_num);
+#endif
+
+	// マルチ・スレッドの準備をする
+	th->buf = p_buf;
+	th->size = unit_size;
+	th->count = part_num;
+	th->len = len;	// キャッシュの最適化を試みる
+	for (j = 0; j < cpu_num; j++){	// サブ・スレッドごとに
+		hRun[j] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto Reset にする
+		if (hRun[j] == NULL){
+			print_win32_err();
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		hEnd[j] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (hEnd[j] == NULL){
+			print_win32_err();
+			CloseHandle(hRun[j]);
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		// サブ・スレッドを起動する
+		th->run = hRun[j];
+		th->end = hEnd[j];
+		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
+		hSub[j] = begin_sub_thread(thread_decode2, (LPVOID)th);
+		if (hSub[j] == NULL){
+			print_win32_err();
+			CloseHandle(hRun[j]);
+			CloseHandle(hEnd[j]);
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		WaitForSingleObject(hEnd[j], INFINITE);	// 設定終了の合図を待つ (リセットしない)
+	}
+
+	// ブロック内の範囲ごと、消失ブロックの組ごとに、全てのブロックを何回かに別けて読み込む
+	print_progress_text(0, "Recovering slice");
+	time_last = GetTickCount();
+	wcscpy(file_path, base_dir);
+	block_off = 0;
+	while (block_off < block_size){
+		recv_now = -1;	// 消失ブロックの本来のソース番号
+		part_off = 0;
+		while (part_off < block_lost){
+			part_now = part_num;
+			if (part_off + part_now > block_lost)
+				part_now = block_lost - part_off;
+			th->count = part_off;
+			th->size = part_now;
+
+			last_file = -1;
+			parity_now = 0;	// 何番目の代替ブロックか
+			source_off = 0;
+			while (source_off < source_num){
+				read_now = read_num;
+				if (read_now > source_num - source_off)
+					read_now = source_num - source_off;
+
+#ifdef TIMER
+time_start = clock();
+#endif
+				for (i = 0; i < read_now; i++){	// ブロック断片を一個ずつ読み込んでメモリー上に配置していく
+					work_buf = buf + (size_t)unit_size * i;
+					switch(s_blk[source_off + i].exist){
+					case 0:		// バッファーにパリティ・ブロックの内容を読み込む
+						len = block_size - block_off;
+						if (len > io_size)
+							len = io_size;
+						file_off = p_blk[id[parity_now]].off + (__int64)block_off;
+						if (file_read_data(rcv_hFile[p_blk[id[parity_now]].file], file_off, work_buf, len)){
+							printf("file_read_data, recovery slice %d\n", id[parity_now]);
+							err = 1;
+							goto error_end;
+						}
+						parity_now++;
+						break;
+					case 3:		// ソース・ブロックの内容は全て 0
+						len = 0;
+						break;
+					default:	// バッファーにソース・ブロックの内容を読み込む
+						if (s_blk[source_off + i].size <= block_off){
+							len = 0;
+							break;
+						}
+						if (s_blk[source_off + i].file != last_file){	// 別のファイルなら開く
+							last_file = s_blk[source_off + i].file;
+							if (hFile){
+								CloseHandle(hFile);	// 前のファイルを閉じる
+								hFile = NULL;
+							}
+							if (files[last_file].state & 4){	// 上書き中の破損ファイルから読み込む
+								wcscpy(file_path + base_len, list_buf + files[last_file].name);
+							} else if (files[last_file].state & 3){	// 作り直した作業ファイルから読み込む
+								get_temp_name(list_buf + files[last_file].name, file_path + base_len);
+							} else if (files[last_file].state & 32){	// 名前訂正失敗時には別名ファイルから読み込む
+								wcscpy(file_path + base_len, list_buf + files[last_file].name2);
+							} else {	// 完全なソース・ファイルから読み込む
+								wcscpy(file_path + base_len, list_buf + files[last_file].name);
+							}
+							hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+							if (hFile == INVALID_HANDLE_VALUE){
+								print_win32_err();
+								hFile = NULL;
+								printf_cp("cannot open file, %s\n", file_path);
+								err = 1;
+								goto error_end;
+							}
+						}
+						len = s_blk[source_off + i].size - block_off;
+						if (len > io_size)
+							len = io_size;
+						file_off = (source_off + i - files[last_file].b_off) * (__int64)block_size + (__int64)block_off;
+						if (file_read_data(hFile, file_off, work_buf, len)){
+							printf("file_read_data, input slice %d\n", source_off + i);
+							err = 1;
+							goto error_end;
+						}
+					}
+					if (len < io_size)
+						memset(work_buf + len, 0, io_size - len);
+					// ブロック断片のチェックサムを計算する
+					checksum16_altmap(work_buf, work_buf + io_size, io_size);
+				}
+#ifdef TIMER
+time_read += clock() - time_start;
+#endif
+
+				// スレッドごとに消失ブロックを計算する (最初の計算時にゼロ埋めされる)
+				src_off = source_off;
+				src_num = src_max;	// 一度に処理するブロックの数を制限する
+				while (src_off < source_off + read_now){
+					// ブロックを何個ずつ処理するか
+					if (src_off + src_num * 2 - 1 >= source_off + read_now)
+						src_num = source_off + read_now - src_off;
+
+					th->buf = buf + (size_t)unit_size * (src_off - source_off);
+					th->mat = mat + src_off;
+					th->off = src_off;
+					th->len = src_num;
+					th->now = -1;	// 初期値 - 1
+					//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを再開する
+					for (j = 0; j < cpu_num; j++){
+						ResetEvent(hEnd[j]);	// リセットしておく
+						SetEvent(hRun[j]);	// サブ・スレッドに計算を開始させる
+					}
+
+					// サブ・スレッドの計算終了の合図を UPDATE_TIME だけ待つ
+					while (WaitForMultipleObjects(cpu_num, hEnd, TRUE, UPDATE_TIME) == WAIT_TIMEOUT){
+						// th-now が最高値なので、計算が終わってるのは th-now + 1 - cpu_num 個となる
+						j = th->now + 1 - cpu_num;
+						if (j < 0)
+							j = 0;
+						j /= chunk_num;	// chunk数で割ってブロック数にする
+						// 経過表示（UPDATE_TIME 時間待った場合なので、必ず経過してるはず）
+						if (print_progress((int)(((prog_num + src_num * j) * 1000) / prog_base))){
+							err = 2;
+							goto error_end;
+						}
+						time_last = GetTickCount();
+					}
+
+					// 経過表示
+					prog_num += src_num * part_now;
+					if (GetTickCount() - time_last >= UPDATE_TIME){
+						if (print_progress((int)((prog_num * 1000) / prog_base))){
+							err = 2;
+							goto error_end;
+						}
+						time_last = GetTickCount();
+					}
+
+					src_off += src_num;
+				}
+
+				source_off += read_now;
+			}
+			if (hFile){	// 最後の読み込みファイルを閉じる
+				CloseHandle(hFile);
+				hFile = NULL;
+			}
+
+#ifdef TIMER
+time_start = clock();
+#endif
+			// 復元されたブロック断片を書き込む
+			last_file = -1;
+			work_buf = p_buf;
+			for (i = part_off; i < part_off + part_now; i++){
+				for (j = recv_now + 1; j < source_num; j++){	// 何番のソース・ブロックか
+					if (s_blk[j].exist == 0){
+						recv_now = j;
+						break;
+					}
+				}
+
+				// 復元されたブロック断片のチェックサムを検証する
+				checksum16_return(work_buf, hash, io_size);
+				if (memcmp(work_buf + io_size, hash, HASH_SIZE) != 0){
+					printf("checksum mismatch, recovered input slice %d\n", recv_now);
+					err = 1;
+					goto error_end;
+				}
+				if (s_blk[recv_now].size <= block_off){	// 書き込み不要
+					work_buf += unit_size;
+					continue;
+				}
+				// ファイルにブロック断片を書き込む
+				if (s_blk[recv_now].file != last_file){	// 別のファイルなら開く
+					last_file = s_blk[recv_now].file;
+					if (hFile){
+						CloseHandle(hFile);	// 前のファイルを閉じる
+						hFile = NULL;
+					}
+					if (files[last_file].state & 4){	// 破損ファイルを上書きして復元する場合
+						// 上書き用のソース・ファイルを開く
+						hFile = handle_write_file(list_buf + files[last_file].name, file_path, files[last_file].size);
+					} else {
+						// 作業ファイルを開く
+						hFile = handle_temp_file(list_buf + files[last_file].name, file_path);
+					}
+					if (hFile == INVALID_HANDLE_VALUE){
+						hFile = NULL;
+						err = 1;
+						goto error_end;
+					}
+				}
+				len = s_blk[recv_now].size - block_off;
+				if (len > io_size)
+					len = io_size;
+				if (file_write_data(hFile, (recv_now - files[last_file].b_off) * (__int64)block_size + block_off, work_buf, len)){
+					printf("file_write_data, input slice %d\n", recv_now);
+					err = 1;
+					goto error_end;
+				}
+				work_buf += unit_size;
+			}
+			if (hFile){	// 最後の書き込みファイルを閉じる
+				CloseHandle(hFile);
+				hFile = NULL;
+			}
+#ifdef TIMER
+time_write += clock() - time_start;
+#endif
+
+			part_off += part_now;	// 次の消失ブロックの組にする
+		}
+
+		block_off += io_size;
+	}
+	print_progress_done();
+
+#ifdef TIMER
+printf("read   %.3f sec\n", (double)time_read / CLOCKS_PER_SEC);
+printf("write  %.3f sec\n", (double)time_write / CLOCKS_PER_SEC);
+if (prog_num != prog_base)
+	printf(" prog_num = %I64d, prog_base = %I64d\n", prog_num, prog_base);
+#endif
+
+error_end:
+	InterlockedExchange(&(th->now), INT_MAX / 2);	// サブ・スレッドの計算を中断する
+	for (j = 0; j < cpu_num; j++){
+		if (hSub[j]){	// サブ・スレッドを終了させる
+			SetEvent(hRun[j]);
+			WaitForSingleObject(hSub[j], INFINITE);
+			CloseHandle(hSub[j]);
+		}
+	}
+	if (hFile)
+		CloseHandle(hFile);
+	if (buf)
+		_aligned_free(buf);
+	return err;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// 変更されたソース・ブロックの差分をパリティ・ブロックに追加する
+
+int decode_update(	// 変更前のブロックをメモリーに収まる個数ずつ復元する
+	wchar_t *file_path,
+	int block_lost,			// 変更されたソース・ブロックの数
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル (テンポラリ・ファイル)
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	unsigned short *mat,
+	unsigned short *constant)
+{
+	unsigned char *buf = NULL, *p_buf, *work_buf, *hash, header_buf[68];
+	unsigned short *id;
+	int err = 0, i, j, k, last_file, part_off, part_num, part_now;
+	unsigned int io_size, unit_size, len, crc, time_last;
+	__int64 file_off, prog_num = 0, prog_base;
+	size_t mem_size;
+	HANDLE hFile = NULL;
+	PHMD5 md_ctx;
+
+	id = mat + (block_lost * source_num);	// 何番目の変更ブロックがどのパリティで代替されるか
+
+	// 作業バッファーを確保する (メモリーが足りなければ変更前のブロックを分割して復元する)
+	io_size = ((block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1)) - HASH_SIZE;
+	unit_size = io_size + HASH_SIZE;	// チェックサムの分だけ増やす
+	file_off = (block_lost + 1) * (__int64)unit_size + HASH_SIZE;
+#ifndef _WIN64	// 32-bit 版なら
+	if (file_off > MAX_MEM_SIZE)	// 確保する最大サイズを 2GB までにする
+		file_off = MAX_MEM_SIZE;
+#endif
+	mem_size = get_mem_size((size_t)file_off);
+	part_num = (int)(mem_size / unit_size) - 1;	// 読み込み用の一個を除く
+	if (part_num > block_lost)
+		part_num = block_lost;
+	if (part_num < 1){
+		printf("cannot allocate memory for changed slices\n");
+		err = 1;
+		goto error_end;
+	}
+	file_off = (part_num + 1) * (__int64)unit_size + HASH_SIZE;
+	buf = _aligned_malloc((size_t)file_off, sse_unit);
+	if (buf == NULL){
+		printf("malloc, %I64d\n", file_off);
+		err = 1;
+		goto error_end;
+	}
+	p_buf = buf + unit_size;	// 変更前のブロックを復元する領域
+	hash = p_buf + (size_t)unit_size * part_num;
+	k = (block_lost + part_num - 1) / part_num;	// 何回に分けて処理するか
+	prog_base = (source_num + parity_num) * (__int64)k + block_lost;	// 全体のブロックの個数
+#ifdef TIMER
+	printf("\n unit_size = %d, part_num = %d, round = %d\n", unit_size, part_num, k);
+#endif
+
+	print_progress_text(0, "Updating recovery slice");
+	time_last = GetTickCount();
+	wcscpy(file_path, base_dir);
+	for (part_off = 0; part_off < block_lost; part_off += part_num){
+		part_now = block_lost - part_off;
+		if (part_now > part_num)
+			part_now = part_num;
+		memset(p_buf, 0, (size_t)unit_size * part_now);
+
+		// 全てのブロックを読み込んで、この組の変更前のブロックを復元する
+		last_file = -1;
+		k = 0;	// 何番目の代替ブロックか
+		for (i = 0; i < source_num; i++){
+			if (s_blk[i].exist == 0){	// バッファーにパリティ・ブロックの内容を読み込む
+				len = block_size;
+				if (file_read_data(rcv_hFile[p_blk[id[k]].file], p_blk[id[k]].off, buf, len)){
+					printf("file_read_data, recovery slice %d\n", id[k]);
+					err = 1;
+					goto error_end;
+				}
+				k++;
+			} else {	// バッファーにソース・ブロックの内容を読み込む
+				if (s_blk[i].file != last_file){	// 別のファイルなら開く
+					last_file = s_blk[i].file;
+					if (hFile)
+						CloseHandle(hFile);	// 前のファイルを閉じる
+					wcscpy(file_path + base_len, list_buf + files[last_file].name);
+					hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+					if (hFile == INVALID_HANDLE_VALUE){
+						print_win32_err();
+						hFile = NULL;
+						printf_cp("cannot open file, %s\n", file_path);
+						err = 1;
+						goto error_end;
+					}
+				}
+				len = s_blk[i].size;
+				file_off = (i - files[last_file].b_off) * (__int64)block_size;
+				if (file_read_data(hFile, file_off, buf, len)){
+					printf("file_read_data, input slice %d\n", i);
+					err = 1;
+					goto error_end;
+				}
+			}
+			if (len < io_size)
+				memset(buf + len, 0, io_size - len);
+			checksum16_altmap(buf, buf + io_size, io_size);
+
+			// この組の変更されたブロックごとに掛け算して追加していく
+			for (j = 0; j < part_now; j++)
+				galois_align_multiply(buf, p_buf + (size_t)unit_size * j, unit_size, mat[source_num * (part_off + j) + i]);
+
+			// 経過表示
+			prog_num++;
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress((int)((prog_num * 1000) / prog_base))){
+					err = 2;
+					goto error_end;
+				}
+				time_last = GetTickCount();
+			}
+		}
+
+		// 復元したブロックが変更前のチェックサムと一致するか確かめてから、差分に変える
+		j = 0;
+		k = 0;	// 何番目の変更ブロックか
+		for (i = 0; i < source_num; i++){
+			if (s_blk[i].exist != 0)
+				continue;
+			if (k < part_off){
+				k++;
+				continue;
+			}
+			if (j >= part_now)
+				break;
+			work_buf = p_buf + (size_t)unit_size * j;
+			checksum16_return(work_buf, hash, io_size);
+			if (memcmp(work_buf + io_size, hash, HASH_SIZE) != 0){
+				printf("checksum mismatch, recovered input slice %d\n", i);
+				err = 1;
+				goto error_end;
+			}
+			Phmd5Begin(&md_ctx);
+			Phmd5Process(&md_ctx, work_buf, block_size);
+			Phmd5End(&md_ctx);
+			crc = crc_update(0xFFFFFFFF, work_buf, block_size) ^ 0xFFFFFFFF;
+			if ((memcmp(md_ctx.hash, s_blk[i].hash, 16) != 0) || (memcmp(&crc, s_blk[i].hash + 16, 4) != 0)){
+				printf("checksum mismatch, recovered input slice %d\n", i);
+				err = 1;
+				goto error_end;
+			}
+
+			// 変更後のブロックを読み込んで XOR する
+			if (s_blk[i].file != last_file){
+				last_file = s_blk[i].file;
+				if (hFile)
+					CloseHandle(hFile);
+				wcscpy(file_path + base_len, list_buf + files[last_file].name);
+				hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+				if (hFile == INVALID_HANDLE_VALUE){
+					print_win32_err();
+					hFile = NULL;
+					printf_cp("cannot open file, %s\n", file_path);
+					err = 1;
+					goto error_end;
+				}
+			}
+			len = s_blk[i].size;
+			file_off = (i - files[last_file].b_off) * (__int64)block_size;
+			if (file_read_data(hFile, file_off, buf, len)){
+				printf("file_read_data, input slice %d\n", i);
+				err = 1;
+				goto error_end;
+			}
+			memset(buf + len, 0, unit_size - len);
+			galois_align_xor(buf, work_buf, unit_size);
+			checksum16_altmap(work_buf, work_buf + io_size, io_size);
+			j++;
+
+			// 経過表示
+			prog_num++;
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress((int)((prog_num * 1000) / prog_base))){
+					err = 2;
+					goto error_end;
+				}
+				time_last = GetTickCount();
+			}
+		}
+		if (hFile){
+			CloseHandle(hFile);
+			hFile = NULL;
+		}
+
+		// パリティ・ブロックごとに、この組の差分を追加して書き戻す
+		for (k = 0; k < parity_num; k++){
+			if (p_blk[k].exist == 0)
+				continue;	// 存在しないパリティ・ブロックは更新できない
+			// パケット・ヘッダーとパリティ・ブロックを読み込む
+			if (file_read_data(rcv_hFile[p_blk[k].file], p_blk[k].off - 68, header_buf, 68) ||
+					file_read_data(rcv_hFile[p_blk[k].file], p_blk[k].off, buf, block_size)){
+				printf("file_read_data, recovery slice %d\n", k);
+				err = 1;
+				goto error_end;
+			}
+			if (block_size < io_size)
+				memset(buf + block_size, 0, io_size - block_size);
+			checksum16_altmap(buf, buf + io_size, io_size);
+
+			// factor は変更されたソース・ブロックの定数をパリティ番号で累乗したもの
+			j = 0;
+			for (i = 0; i < source_num; i++){
+				if (s_blk[i].exist == 0){
+					if ((j >= part_off) && (j < part_off + part_now))
+						galois_align_multiply(p_buf + (size_t)unit_size * (j - part_off), buf, unit_size, galois_power(constant[i], k));
+					j++;
+				}
+			}
+
+			// パリティ・ブロックのチェックサムを検証する
+			checksum16_return(buf, hash, io_size);
+			if (memcmp(buf + io_size, hash, HASH_SIZE) != 0){
+				printf("checksum mismatch, recovery slice %d\n", k);
+				err = 1;
+				goto error_end;
+			}
+			// パケットのハッシュ値を計算し直して、テンポラリ・ファイルに書き込む
+			Phmd5Begin(&md_ctx);
+			Phmd5Process(&md_ctx, header_buf + 32, 36);
+			Phmd5Process(&md_ctx, buf, block_size);
+			Phmd5End(&md_ctx);
+			memcpy(header_buf + 16, md_ctx.hash, 16);
+			if (file_write_data(rcv_hFile[p_blk[k].file], p_blk[k].off, buf, block_size) ||
+					file_write_data(rcv_hFile[p_blk[k].file], p_blk[k].off - 68, header_buf, 68)){
+				printf("file_write_data, recovery slice %d\n", k);
+				err = 1;
+				goto error_end;
+			}
+
+			// 経過表示 (元のリカバリ・ファイルは置き換えるまで変わらないので中断できる)
+			prog_num++;
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress((int)((prog_num * 1000) / prog_base))){
+					err = 2;
+					goto error_end;
+				}
+				time_last = GetTickCount();
+			}
+		}
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+error_end:
+	if (hFile)
+		CloseHandle(hFile);
+	if (buf)
+		_aligned_free(buf);
+	return err;
+}
@@ -49,6 +49,28 @@ int decode_method5(	// 復元するブロックだけ保持する場合 (GPU対
 	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
 	unsigned short *mat);
 
+int decode_method6(	// ブロックをタイル単位に分けて、消失ブロックの組ごとに読み直す場合
+	wchar_t *file_path,
+	int block_lost,			// 失われたソース・ブロックの数
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	unsigned short *mat,
+	unsigned int io_size,	// ブロック内の範囲のサイズ
+	int read_num,			// 一度に読み込むブロックの数
+	int part_num);			// 同時に復元する消失ブロックの数
+
+int decode_update(	// 変更前のブロックをメモリーに収まる個数ずつ復元する
+	wchar_t *file_path,
+	int block_lost,			// 変更されたソース・ブロックの数
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル (テンポラリ・ファイル)
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	unsigned short *mat,
+	unsigned short *constant);
+
 
 #ifdef __cplusplus
 }
@@ -760,7 +760,7 @@ int encode_method2(	// ソース・データを全て読み込む場合
 		th->run = hRun[j];
 		th->end = hEnd[j];
 		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode2, (LPVOID)th, 0, NULL);
+		hSub[j] = begin_sub_thread(thread_encode2, (LPVOID)th);
 		if (hSub[j] == NULL){
 			print_win32_err();
 			CloseHandle(hRun[j]);
@@ -1217,7 +1217,7 @@ int encode_method3(	// パリティ・ブロックを全て保持して、一度
 		th->run = hRun[j];
 		th->end = hEnd[j];
 		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
-		hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode3, (LPVOID)th, 0, NULL);
+		hSub[j] = begin_sub_thread(thread_encode3, (LPVOID)th);
 		if (hSub[j] == NULL){
 			print_win32_err();
 			CloseHandle(hRun[j]);
@@ -1603,11 +1603,11 @@ int encode_method4(	// 全てのブロックを断片的に保持する場合 (G
 		if (j == cpu_num2 - 1){	// 最後のスレッドを GPU 管理用にする
 			th2->run = hRun[j];
 			th2->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode_gpu, (LPVOID)th2, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_encode_gpu, (LPVOID)th2);
 		} else {
 			th->run = hRun[j];
 			th->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode3, (LPVOID)th, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_encode3, (LPVOID)th);
 		}
 		if (hSub[j] == NULL){
 			print_win32_err();
@@ -2246,11 +2246,11 @@ int encode_method5(	// ソース・ブロックの一部とパリティ・ブロ
 		if (j == cpu_num2 - 1){	// 最後のスレッドを GPU 管理用にする
 			th2->run = hRun[j];
 			th2->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode_gpu, (LPVOID)th2, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_encode_gpu, (LPVOID)th2);
 		} else {
 			th->run = hRun[j];
 			th->end = hEnd[j];
-			hSub[j] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_encode3, (LPVOID)th, 0, NULL);
+			hSub[j] = begin_sub_thread(thread_encode3, (LPVOID)th);
 		}
 		if (hSub[j] == NULL){
 			print_win32_err();
@@ -2682,3 +2682,557 @@ error_end:
 	return err;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// 作業ファイルとパリティ・ブロックを読み書きする (4GB 以上にも対応する)
+static int spill_parity(
+	HANDLE hFile,
+	__int64 offset,
+	unsigned char *buf,
+	size_t size,
+	int write_flag)		// 0 = 読み込む, 1 = 書き込む
+{
+	unsigned int len;
+
+	while (size > 0){
+		len = 1073741824;	// 1GB ずつ処理する
+		if (size < len)
+			len = (unsigned int)size;
+		if (write_flag){
+			if (file_write_data(hFile, offset, buf, len))
+				return 1;
+		} else {
+			if (file_read_data(hFile, offset, buf, len))
+				return 1;
+		}
+		offset += len;
+		buf += len;
+		size -= len;
+	}
+	return 0;
+}
+
+int encode_method6(	// ソース・ブロックの一部とパリティ・ブロックの一部を保持して、残りを作業ファイルに退避する場合
+	wchar_t *file_path,
+	unsigned char *header_buf,	// Recovery Slice packet のパケット・ヘッダー
+	HANDLE *rcv_hFile,			// リカバリ・ファイルのハンドル
+	file_ctx_c *files,			// ソース・ファイルの情報
+	source_ctx_c *s_blk,		// ソース・ブロックの情報
+	parity_ctx_c *p_blk,		// パリティ・ブロックの情報
+	unsigned short *constant,
+	int read_num,				// 一度に読み込むソース・ブロックの数
+	int part_num)				// メモリー上に保持するパリティ・ブロックの数
+{
+	unsigned char *buf = NULL, *p_buf, *work_buf, *hash;
+	wchar_t temp_path[MAX_LEN];
+	int err = 0, i, j, last_file, chunk_num;
+	int source_off, read_now, part_off, part_now, part_last;
+	int group_num, group, group_now, round_num, round_now;
+	int src_off, src_num, src_max;
+	unsigned int io_size, unit_size, len, time_last;
+	__int64 prog_num = 0, prog_base;
+	size_t mem_size;
+	HANDLE hFile = NULL, hTemp = NULL;
+	HANDLE hSub[MAX_CPU], hRun[MAX_CPU], hEnd[MAX_CPU];
+	RS_TH th[1];
+	PHMD5 md_ctx;
+
+	memset(hSub, 0, sizeof(HANDLE) * MAX_CPU);
+	unit_size = (block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1);	// チェックサムの分だけ増やす
+	io_size = unit_size - HASH_SIZE;
+
+	// 作業バッファーを確保する
+	mem_size = (size_t)(read_num + part_num) * unit_size + HASH_SIZE;
+	buf = _aligned_malloc(mem_size, sse_unit);
+	if (buf == NULL){
+		printf("malloc, %Id\n", mem_size);
+		err = 1;
+		goto error_end;
+	}
+	p_buf = buf + (size_t)unit_size * read_num;	// パリティ・ブロックを部分的に記録する領域
+	hash = p_buf + (size_t)unit_size * part_num;
+	round_num = (source_num + read_num - 1) / read_num;	// ソース・ブロックを何回に別けて読み込むか
+	group_num = (parity_num + part_num - 1) / part_num;	// パリティ・ブロックを何組に別けるか
+	prog_base = (__int64)source_num * parity_num;	// ブロックの合計掛け算個数
+	len = try_cache_blocking(unit_size);
+	chunk_num = (unit_size + len - 1) / len;
+	src_max = cpu_cache & 0xFFFE;	// CPU cache 最適化のため、同時に処理するブロック数を制限する
+	if ((src_max < CACHE_MIN_NUM) || (cpu_num == 1))
+		src_max = 0x8000;	// 不明または少な過ぎる場合は、制限しない
+#ifdef TIMER
+	printf("\n read some source blocks, and spill some parity blocks\n");
+	printf("buffer size = %Id MB, read_num = %d, round = %d\n", mem_size >> 20, read_num, round_num);
+	printf("part_num = %d, group = %d, spill size = %I64d MB\n", part_num, group_num,
+		((__int64)(parity_num - part_num) * unit_size * (round_num - 1) * 2) >> 20);
+	printf("cache: limit size = %d, chunk_size = %d, chunk_num = %d\n", cpu_flag & 0x7FFF0000, len, chunk_num);
+#endif
+
+	// 保持しきれないパリティ・ブロックを退避する作業ファイル (閉じると削除される)
+	if (group_num > 1){
+		get_temp_name(recovery_file, temp_path);
+		hTemp = CreateFile(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+		if (hTemp == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			hTemp = NULL;
+			printf_cp("cannot create file, %s\n", temp_path);
+			err = 1;
+			goto error_end;
+		}
+	}
+
+	// マルチ・スレッドの準備をする
+	th->mat = constant;
+	th->buf = p_buf;
+	th->size = unit_size;
+	th->count = part_num;
+	th->len = len;	// キャッシュの最適化を試みる
+	for (j = 0; j < cpu_num; j++){	// サブ・スレッドごとに
+		hRun[j] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto Reset にする
+		if (hRun[j] == NULL){
+			print_win32_err();
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		hEnd[j] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (hEnd[j] == NULL){
+			print_win32_err();
+			CloseHandle(hRun[j]);
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		// サブ・スレッドを起動する
+		th->run = hRun[j];
+		th->end = hEnd[j];
+		//_mm_sfence();	// メモリーへの書き込みを完了してからスレッドを起動する
+		hSub[j] = begin_sub_thread(thread_encode2, (LPVOID)th);
+		if (hSub[j] == NULL){
+			print_win32_err();
+			CloseHandle(hRun[j]);
+			CloseHandle(hEnd[j]);
+			printf("error, sub-thread\n");
+			err = 1;
+			goto error_end;
+		}
+		WaitForSingleObject(hEnd[j], INFINITE);	// 設定終了の合図を待つ (リセットしない)
+	}
+
+	// ソース・ブロックを何回かに別けて順に読み込み、パリティ・ブロックを一組ずつ更新する
+	time_last = GetTickCount();
+	wcscpy(file_path, base_dir);
+	last_file = -1;
+	part_last = -1;	// メモリー上に残ってるパリティ・ブロックの組
+	source_off = 0;
+	for (round_now = 0; round_now < round_num; round_now++){
+		read_now = read_num;
+		if (read_now > source_num - source_off)
+			read_now = source_num - source_off;
+
+		// ソース・ブロックを読み込む (ファイルは先頭から順に読むだけ)
+#ifdef TIMER
+time_start = clock();
+#endif
+		for (i = 0; i < read_now; i++){
+			work_buf = buf + (size_t)unit_size * i;
+			if (s_blk[source_off + i].file != last_file){	// 別のファイルなら開く
+				if (hFile)
+					CloseHandle(hFile);	// 前のファイルを閉じる
+				last_file = s_blk[source_off + i].file;
+				wcscpy(file_path + base_len, list_buf + files[last_file].name);
+				hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+				if (hFile == INVALID_HANDLE_VALUE){
+					print_win32_err();
+					hFile = NULL;
+					printf_cp("cannot open file, %s\n", list_buf + files[last_file].name);
+					err = 1;
+					goto error_end;
+				}
+			}
+			len = s_blk[source_off + i].size;
+			if (!ReadFile(hFile, work_buf, len, &j, NULL) || (len != j)){
+				print_win32_err();
+				printf("file_read_data, input slice %d\n", source_off + i);
+				err = 1;
+				goto error_end;
+			}
+			if (len < io_size)
+				memset(work_buf + len, 0, io_size - len);
+			// ソース・ブロックのチェックサムを計算する (パディングを含む)
+			s_blk[source_off + i].crc = crc_update(0xFFFFFFFF, work_buf, block_size);
+			checksum16_altmap(work_buf, work_buf + io_size, io_size);
+		}
+#ifdef TIMER
+time_read += clock() - time_start;
+#endif
+
+		// 往復する順序で処理すると、前回の最後の組をそのまま使える
+		for (group_now = 0; group_now < group_num; group_now++){
+			if (round_now & 1){
+				group = group_num - 1 - group_now;
+			} else {
+				group = group_now;
+			}
+			part_off = part_num * group;
+			part_now = part_num;
+			if (part_off + part_now > parity_num)
+				part_now = parity_num - part_off;
+
+			// 退避しておいたパリティ・ブロックを読み込む
+			if ((round_now > 0) && (group != part_last)){
+#ifdef TIMER
+time_start = clock();
+#endif
+				if (spill_parity(hTemp, (__int64)unit_size * part_off, p_buf, (size_t)unit_size * part_now, 0)){
+					printf("file_read_data, spill\n");
+					err = 1;
+					goto error_end;
+				}
+#ifdef TIMER
+time_read += clock() - time_start;
+#endif
+			}
+
+			// スレッドごとにパリティ・ブロックを計算する (最初の計算時にゼロ埋めされる)
+			th->count = part_off;
+			th->size = part_now;
+			src_off = source_off;
+			src_num = src_max;	// 一度に処理するソース・ブロックの数を制限する
+			while (src_off < source_off + read_now){
+				// ソース・ブロックを何個ずつ処理するか
+				if (src_off + src_num * 2 - 1 >= source_off + read_now)
+					src_num = source_off + read_now - src_off;
+
+				th->buf = buf + (size_t)unit_size * (src_off - source_off);
+				th->off = src_off;
+				th->len = src_num;
+				th->now = -1;	// 初期値 - 1
+				//_mm_sfence();
+				for (j = 0; j < cpu_num; j++){
+					ResetEvent(hEnd[j]);	// リセットしておく
+					SetEvent(hRun[j]);	// サブ・スレッドに計算を開始させる
+				}
+
+				// サブ・スレッドの計算終了の合図を UPDATE_TIME だけ待ちながら、経過表示する
+				while (WaitForMultipleObjects(cpu_num, hEnd, TRUE, UPDATE_TIME) == WAIT_TIMEOUT){
+					// th-now が最高値なので、計算が終わってるのは th-now + 1 - cpu_num 個となる
+					j = th->now + 1 - cpu_num;
+					if (j < 0)
+						j = 0;
+					j /= chunk_num;	// chunk数で割ってブロック数にする
+					// 経過表示（UPDATE_TIME 時間待った場合なので、必ず経過してるはず）
+					if (print_progress((int)(((prog_num + src_num * j) * 1000) / prog_base))){
+						err = 2;
+						goto error_end;
+					}
+					time_last = GetTickCount();
+				}
+
+				// 経過表示
+				prog_num += src_num * part_now;
+				if (GetTickCount() - time_last >= UPDATE_TIME){
+					if (print_progress((int)((prog_num * 1000) / prog_base))){
+						err = 2;
+						goto error_end;
+					}
+					time_last = GetTickCount();
+				}
+
+				src_off += src_num;
+			}
+			part_last = group;
+
+			if (round_now + 1 < round_num){
+				// 次回の最初に使う組はメモリー上に残しておく
+				if (group_now + 1 < group_num){
+#ifdef TIMER
+time_start = clock();
+#endif
+					if (spill_parity(hTemp, (__int64)unit_size * part_off, p_buf, (size_t)unit_size * part_now, 1)){
+						printf("file_write_data, spill\n");
+						err = 1;
+						goto error_end;
+					}
+#ifdef TIMER
+time_write += clock() - time_start;
+#endif
+				}
+				continue;
+			}
+
+			// 完成したパリティ・ブロックをリカバリ・ファイルに書き込む
+#ifdef TIMER
+time_start = clock();
+#endif
+			work_buf = p_buf;
+			for (i = part_off; i < part_off + part_now; i++){
+				// パリティ・ブロックのチェックサムを検証する
+				checksum16_return(work_buf, hash, io_size);
+				if (memcmp(work_buf + io_size, hash, HASH_SIZE) != 0){
+					printf("checksum mismatch, recovery slice %d\n", i);
+					err = 1;
+					goto error_end;
+				}
+				// ハッシュ値を計算して、リカバリ・ファイルに書き込む
+				Phmd5Begin(&md_ctx);
+				j = first_num + i;	// 最初の番号の分だけ足す
+				memcpy(header_buf + 64, &j, 4);	// Recovery Slice の番号を書き込む
+				Phmd5Process(&md_ctx, header_buf + 32, 36);
+				Phmd5Process(&md_ctx, work_buf, block_size);
+				Phmd5End(&md_ctx);
+				memcpy(header_buf + 16, md_ctx.hash, 16);
+				// ヘッダーを書き込む
+				if (file_write_data(rcv_hFile[p_blk[i].file], p_blk[i].off - 68, header_buf, 68)){
+					printf("file_write_data, recovery slice %d\n", i);
+					err = 1;
+					goto error_end;
+				}
+				if (file_write_data(rcv_hFile[p_blk[i].file], p_blk[i].off, work_buf, block_size)){
+					printf("file_write_data, recovery slice %d\n", i);
+					err = 1;
+					goto error_end;
+				}
+				work_buf += unit_size;
+			}
+#ifdef TIMER
+time_write += clock() - time_start;
+#endif
+		}
+
+		source_off += read_now;
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+	// ファイルごとにブロックの CRC-32 を検証する
+	j = 0;
+	while (j < source_num){
+		last_file = s_blk[j].file;
+		src_num = (int)((files[last_file].size + (__int64)block_size - 1) / block_size);
+		memset(hash, 0, 16);
+		for (i = 0; i < src_num; i++)	// XOR して 16バイトに減らす
+			((unsigned int *)hash)[i & 3] ^= s_blk[j + i].crc ^ 0xFFFFFFFF;
+		if (memcmp(files[last_file].hash, hash, 16) != 0){
+			printf("checksum mismatch, input file %d\n", last_file);
+			err = 1;
+			goto error_end;
+		}
+		j += src_num;
+	}
+
+#ifdef TIMER
+printf("read   %.3f sec\n", (double)time_read / CLOCKS_PER_SEC);
+printf("write  %.3f sec\n", (double)time_write / CLOCKS_PER_SEC);
+if (prog_num != prog_base)
+	printf(" prog_num = %I64d, prog_base = %I64d\n", prog_num, prog_base);
+#endif
+
+error_end:
+	InterlockedExchange(&(th->now), INT_MAX / 2);	// サブ・スレッドの計算を中断する
+	for (j = 0; j < cpu_num; j++){
+		if (hSub[j]){	// サブ・スレッドを終了させる
+			SetEvent(hRun[j]);
+			WaitForSingleObject(hSub[j], INFINITE);
+			CloseHandle(hSub[j]);
+		}
+	}
+	if (hFile)
+		CloseHandle(hFile);
+	if (hTemp)
+		CloseHandle(hTemp);
+	if (buf)
+		_aligned_free(buf);
+	return err;
+}
+
+
+int encode_append(	// 追加・移動したソース・ブロックの分だけパリティ・ブロックを更新する場合
+	wchar_t *file_path,
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報 (exist が 0 なら計算しない)
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	int *old_index,			// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+	unsigned short *constant)
+{
+	unsigned char *buf = NULL, *p_buf, *work_buf, *hash, header_buf[68];
+	unsigned short factor;
+	int err = 0, i, j, k, last_file, part_num, part_max, block_count, exist_num, *p_list = NULL;
+	int check_flag = 1;
+	unsigned int io_size, unit_size, len, crc, time_last;
+	__int64 file_off, prog_num = 0, prog_base;
+	HANDLE hFile = NULL;
+	PHMD5 md_ctx;
+
+	// 計算が必要なソース・ブロックと、更新するパリティ・ブロックの数
+	block_count = 0;
+	for (i = 0; i < source_num; i++){
+		if (s_blk[i].exist != 0)
+			block_count++;
+	}
+	exist_num = 0;
+	for (i = 0; i < parity_num; i++){
+		if (p_blk[i].exist != 0)
+			exist_num++;
+	}
+	if ((block_count == 0) || (exist_num == 0))
+		return 0;
+
+	// 作業バッファーを確保する (パリティ・ブロックは何回かに分けて保持する)
+	io_size = ((block_size + HASH_SIZE + (sse_unit - 1)) & ~(sse_unit - 1)) - HASH_SIZE;
+	unit_size = io_size + HASH_SIZE;	// チェックサムの分だけ増やす
+	part_max = (int)((get_mem_size(0) / 2) / unit_size) - 1;	// 使えるサイズの半分までにする
+	if (part_max > exist_num)
+		part_max = exist_num;
+	if (part_max < 1)
+		part_max = 1;
+	file_off = (part_max + 1) * (__int64)unit_size + HASH_SIZE;
+	buf = _aligned_malloc((size_t)file_off, sse_unit);
+	if (buf == NULL){
+		printf("malloc, %I64d\n", file_off);
+		err = 1;
+		goto error_end;
+	}
+	p_buf = buf + unit_size;	// パリティ・ブロックを保持する領域
+	hash = p_buf + (size_t)unit_size * part_max;
+	p_list = (int *)malloc(sizeof(int) * part_max);
+	if (p_list == NULL){
+		printf("malloc, %zd\n", sizeof(int) * part_max);
+		err = 1;
+		goto error_end;
+	}
+	i = (exist_num + part_max - 1) / part_max;	// 何回に分けるか
+	prog_base = (__int64)block_count * i + exist_num * 2;
+#ifdef TIMER
+	printf("\n read some blocks, and keep %d parity blocks (%d times)\n", part_max, i);
+#endif
+
+	print_progress_text(0, "Creating recovery slice");
+	time_last = GetTickCount();
+	wcscpy(file_path, base_dir);
+	k = 0;
+	while (k < parity_num){
+		// 既存のパリティ・ブロックを読み込む
+		part_num = 0;
+		while ((k < parity_num) && (part_num < part_max)){
+			if (p_blk[k].exist != 0){
+				work_buf = p_buf + (size_t)unit_size * part_num;
+				if (file_read_data(rcv_hFile[p_blk[k].file], p_blk[k].off, work_buf, block_size)){
+					printf("file_read_data, recovery slice %d\n", k);
+					err = 1;
+					goto error_end;
+				}
+				if (block_size < io_size)
+					memset(work_buf + block_size, 0, io_size - block_size);
+				checksum16_altmap(work_buf, work_buf + io_size, io_size);
+				p_list[part_num] = k;
+				part_num++;
+				prog_num++;
+			}
+			k++;
+		}
+		if (part_num == 0)
+			break;
+
+		// 追加・移動したソース・ブロックを読み込んで、係数の差分を掛けて追加していく
+		last_file = -1;
+		for (i = 0; i < source_num; i++){
+			if (s_blk[i].exist == 0)
+				continue;	// 番号が変わらないブロックは計算済み
+			if (s_blk[i].file != last_file){	// 別のファイルなら開く
+				last_file = s_blk[i].file;
+				if (hFile)
+					CloseHandle(hFile);	// 前のファイルを閉じる
+				wcscpy(file_path + base_len, list_buf + files[last_file].name);
+				hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+				if (hFile == INVALID_HANDLE_VALUE){
+					print_win32_err();
+					hFile = NULL;
+					printf_cp("cannot open file, %s\n", file_path);
+					err = 1;
+					goto error_end;
+				}
+			}
+			len = s_blk[i].size;
+			file_off = (i - files[last_file].b_off) * (__int64)block_size;
+			if (file_read_data(hFile, file_off, buf, len)){
+				printf("file_read_data, input slice %d\n", i);
+				err = 1;
+				goto error_end;
+			}
+			if (len < io_size)
+				memset(buf + len, 0, io_size - len);
+			if (check_flag){	// 最初だけ、内容が記録と同じか確かめる
+				Phmd5Begin(&md_ctx);
+				Phmd5Process(&md_ctx, buf, block_size);
+				Phmd5End(&md_ctx);
+				crc = crc_update(0xFFFFFFFF, buf, block_size) ^ 0xFFFFFFFF;
+				if ((memcmp(md_ctx.hash, s_blk[i].hash, 16) != 0) || (memcmp(&crc, s_blk[i].hash + 16, 4) != 0)){
+					printf("checksum mismatch, input slice %d\n", i);
+					err = 1;
+					goto error_end;
+				}
+			}
+			checksum16_altmap(buf, buf + io_size, io_size);
+
+			// factor は新しい番号の定数と古い番号の定数を、パリティ番号で累乗したものの差
+			for (j = 0; j < part_num; j++){
+				factor = galois_power(constant[i], p_list[j]);
+				if (old_index[i] >= 0)
+					factor ^= galois_power(constant[old_index[i]], p_list[j]);
+				if (factor != 0)
+					galois_align_multiply(buf, p_buf + (size_t)unit_size * j, unit_size, factor);
+			}
+
+			// 経過表示
+			prog_num++;
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress((int)((prog_num * 1000) / prog_base))){
+					err = 2;
+					goto error_end;
+				}
+				time_last = GetTickCount();
+			}
+		}
+
+		// パリティ・ブロックのチェックサムを検証して、パケットのハッシュ値と共に書き込む
+		for (j = 0; j < part_num; j++){
+			work_buf = p_buf + (size_t)unit_size * j;
+			checksum16_return(work_buf, hash, io_size);
+			if (memcmp(work_buf + io_size, hash, HASH_SIZE) != 0){
+				printf("checksum mismatch, recovery slice %d\n", p_list[j]);
+				err = 1;
+				goto error_end;
+			}
+			file_off = p_blk[p_list[j]].off;
+			if (file_read_data(rcv_hFile[p_blk[p_list[j]].file], file_off - 68, header_buf, 68)){
+				printf("file_read_data, recovery slice %d\n", p_list[j]);
+				err = 1;
+				goto error_end;
+			}
+			Phmd5Begin(&md_ctx);
+			Phmd5Process(&md_ctx, header_buf + 32, 36);
+			Phmd5Process(&md_ctx, work_buf, block_size);
+			Phmd5End(&md_ctx);
+			memcpy(header_buf + 16, md_ctx.hash, 16);
+			if (file_write_data(rcv_hFile[p_blk[p_list[j]].file], file_off, work_buf, block_size) ||
+					file_write_data(rcv_hFile[p_blk[p_list[j]].file], file_off - 68, header_buf, 68)){
+				printf("file_write_data, recovery slice %d\n", p_list[j]);
+				err = 1;
+				goto error_end;
+			}
+			prog_num++;
+		}
+		check_flag = 0;
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+error_end:
+	if (hFile)
+		CloseHandle(hFile);
+	if (p_list)
+		free(p_list);
+	if (buf)
+		_aligned_free(buf);
+	return err;
+}
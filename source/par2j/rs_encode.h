@@ -64,6 +64,26 @@ int encode_method5(	// ソース・ブロックの一部とパリティ・ブロ
 	source_ctx_c *s_blk,		// ソース・ブロックの情報
 	unsigned short *constant);
 
+int encode_method6(	// ソース・ブロックの一部とパリティ・ブロックの一部を保持して、残りを作業ファイルに退避する場合
+	wchar_t *file_path,
+	unsigned char *header_buf,	// Recovery Slice packet のパケット・ヘッダー
+	HANDLE *rcv_hFile,			// リカバリ・ファイルのハンドル
+	file_ctx_c *files,			// ソース・ファイルの情報
+	source_ctx_c *s_blk,		// ソース・ブロックの情報
+	parity_ctx_c *p_blk,		// パリティ・ブロックの情報
+	unsigned short *constant,
+	int read_num,				// 一度に読み込むソース・ブロックの数
+	int part_num);				// メモリー上に保持するパリティ・ブロックの数
+
+int encode_append(	// 追加・移動したソース・ブロックの分だけパリティ・ブロックを更新する場合
+	wchar_t *file_path,
+	HANDLE *rcv_hFile,		// リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// ソース・ファイルの情報
+	source_ctx_r *s_blk,	// ソース・ブロックの情報 (exist が 0 なら計算しない)
+	parity_ctx_r *p_blk,	// パリティ・ブロックの情報
+	int *old_index,			// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+	unsigned short *constant);
+
 
 #ifdef __cplusplus
 }
@@ -12,6 +12,7 @@
 #define _WIN32_WINNT 0x0601	// Windows 7 or later
 #endif
 
+#include <process.h>
 #include <stdio.h>
 
 #include <windows.h>
@@ -149,6 +150,7 @@ int search_recovery_files(void)
 			}
 			if (recv_len + dir_len + len >= l_max){	// 領域が足りなくなるなら拡張する
 				l_max += ALLOC_LEN;
+				discard_index(recv_buf);
 				tmp_p = (wchar_t *)realloc(recv_buf, l_max * 2);
 				if (tmp_p == NULL){
 					FindClose(hFind);
@@ -183,6 +185,7 @@ int search_recovery_files(void)
 						continue;	// 長すぎるファイル名は無視する
 					if (recv_len + dir_len + len >= l_max){	// 領域が足りなくなるなら拡張する
 						l_max += ALLOC_LEN;
+						discard_index(recv_buf);
 						tmp_p = (wchar_t *)realloc(recv_buf, l_max * 2);
 						if (tmp_p == NULL){
 							FindClose(hFind);
@@ -227,6 +230,7 @@ int search_recovery_files(void)
 				((len > ext_len) && (_wcsicmp(list2_buf + (list2_off + len - ext_len), file_ext) == 0))){
 				if (recv_len + len >= l_max){	// 領域が足りなくなるなら拡張する
 					l_max += ALLOC_LEN;
+					discard_index(recv_buf);
 					tmp_p = (wchar_t *)realloc(recv_buf, l_max * 2);
 					if (tmp_p == NULL){
 						printf("realloc, %d\n", l_max * 2);
@@ -859,6 +863,7 @@ printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packe
 			off = sanitize_filename(uni_buf, files, i);
 			if (off != 0){
 				if ((off == 1) || (off == 9)){	// ディレクトリ記号を含んでる
+					discard_index(list_buf);
 					wcscpy(list_buf + files[i].name, uni_buf);
 					off ^= 1;
 				}
@@ -889,6 +894,7 @@ printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packe
 								return 1;
 							}
 						} else {	// 文字数が同じなら元の場所にコピーする
+							discard_index(list_buf);
 							wcscpy(list_buf + files[i].name, uni_buf);
 						}
 					}
@@ -902,8 +908,325 @@ printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packe
 	return 0;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// 複数のリカバリ・ファイルを同時に検査する
+
+#define MAX_SEARCH_READ	4	// 同時に検査するリカバリ・ファイルの最大数
+
+// リカバリ・ファイル内で見つけたパケットの位置
+typedef struct {
+	int id;				// パリティ・ブロックの番号 (-1 = Input File Slice Checksum packet)
+	unsigned int size;	// パケット・サイズ
+	__int64 off;		// パリティ・ブロックまたはパケットの位置
+} packet_pos;
+
+// リカバリ・ファイルごとの検査結果
+typedef struct {
+	HANDLE hFile;
+	__int64 file_size;
+	volatile __int64 file_off;	// 検査中の位置
+	packet_pos *pos;
+	int pos_num;
+	int pos_max;
+	int packet_count;
+	int bad_flag;
+	volatile long flag;	// -1=開けない, 0=未検査, 1=記録を利用する, 2=検査済み
+} recv_scan_ctx;
+
+typedef struct {
+	unsigned char *buf;		// 作業バッファー
+	unsigned char *set_id;
+	recv_scan_ctx *rs;
+	int file_count;
+	volatile long *next;	// 次に検査するファイルの番号
+	volatile long *stop;	// 0以外なら中断する
+	HANDLE hDone;			// ファイルの検査が終わったことを知らせる
+} RECV_SEARCH_TH;
+
+// 見つけたパケットの位置を記録する
+static void add_packet_pos(recv_scan_ctx *rs, int id, unsigned int size, __int64 off)
+{
+	packet_pos *tmp_p;
+
+	if (rs->pos_num >= rs->pos_max){
+		rs->pos_max = rs->pos_max * 2 + 64;
+		tmp_p = (packet_pos *)realloc(rs->pos, sizeof(packet_pos) * rs->pos_max);
+		if (tmp_p == NULL){
+			rs->bad_flag |= 128;	// 記録できなければ破損扱いにする
+			rs->pos_max = rs->pos_num;
+			return;
+		}
+		rs->pos = tmp_p;
+	}
+	rs->pos[rs->pos_num].id = id;
+	rs->pos[rs->pos_num].size = size;
+	rs->pos[rs->pos_num].off = off;
+	rs->pos_num++;
+}
+
+// リカバリ・ファイル内のパケットを探して位置を記録する
+// 0=完了, 2=キャンセル
+static int scan_recovery_file(
+	unsigned char *buf,		// 作業バッファー
+	unsigned char *set_id,	// Recovery Set ID を確かめる
+	recv_scan_ctx *rs,		// 検査結果
+	wchar_t *file_name,		// 経過表示するファイル名 (NULL なら表示しない)
+	volatile long *stop)	// 0以外なら中断する (NULL なら確認しない)
+{
+	unsigned char hash[16];
+	int j, packet_count, bad_flag, len, off, max;
+	unsigned int packet_size, time_last;
+	__int64 file_size, file_off, file_next;
+	HANDLE hFile;
+
+	hFile = rs->hFile;
+	file_size = rs->file_size;
+	rs->pos_num = 0;
+	file_off = 0;
+	time_last = GetTickCount();
+
+	// 最初はファイルの先頭 SEARCH_SIZE * 3 を読み込む
+	bad_flag = 0;
+	off = 0;
+	len = SEARCH_SIZE * 3;
+	if (file_size < SEARCH_SIZE * 3)
+		len = (unsigned int)file_size;
+	if (file_size < MIN_PACKET_SIZE){	// 小さすぎるファイルは検査しない
+		bad_flag |= 1;
+		len = 0;
+	}
+	// 最大 SEARCH_SIZE * 3 を読み込んでバッファーの先頭に入れる
+	if (file_read_data(hFile, 0, buf, len)){
+		off = len;		// 読み込み時にエラーが発生した部分は検査しない
+		bad_flag |= 128;
+		file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
+	} else {
+		file_next = len;	// 次の読み込み開始位置
+	}
+	max = len;
+	if (len > SEARCH_SIZE)
+		max = SEARCH_SIZE;
+	//printf("file_size = %I64d, max = %d, off = %d, len = %d\n", file_size, max, off, len);
+
+	// パケットを探す
+	packet_count = 0;
+	while (len > 0){
+		while (off < max){
+			if (match_magic(buf + off) == 0){
+				memcpy(&packet_size, buf + (off + 12), 4);	// パケット・サイズの上位4バイトが0以外だとだめ
+				if (packet_size != 0){
+					bad_flag |= 1;
+					off += 8;
+					continue;
+				}
+				memcpy(&packet_size, buf + (off + 8), 4);	// パケット・サイズを確かめる
+				if ((packet_size & 3) || (packet_size < MIN_PACKET_SIZE) || (file_off + (__int64)off + (__int64)packet_size > file_size)){
+					bad_flag |= 1;
+					off += 8;
+					continue;
+				}
+				if (off + packet_size > SEARCH_SIZE * 3){	// 大きすぎてバッファー内に収まってないなら
+					if (packet_size > 64 + 4 + block_size){	// Recovery Slice packet よりも大きいパケットは無いはず
+						off += 8;
+						continue;
+					}
+					// パケットが破損してないかを調べる
+					if (file_md5(hFile, file_off + off + 32, packet_size - 32, hash)){
+						off += 8;	// 計算できなかったら
+					} else {
+						if (memcmp(buf + (off + 16), hash, 16) == 0){	// 完全なパケット発見
+							if (memcmp(buf + (off + 32), set_id, 16) == 0){	// Recovery Set ID が同じなら
+								// 少なくともパケットの先頭 SEARCH_SIZE * 2 まではバッファー内に存在する
+								// バッファーに収まらないパケットは Recovery Slice packet だけのはず
+								if (memcmp(buf + (off + 48), "PAR 2.0\0RecvSlic", 16) == 0){
+									// Recovery Slice packet
+									memcpy(&j, buf + (off + 64), 4);	// パリティ・ブロックの番号
+									j &= 0xFFFF;	// 番号は 16-bit (65536以上は 0～65535 の繰り返し)
+									if (j == 65535)	// (0 と 65535 は同じ)
+										j = 0;
+									if (j < parity_num)
+										add_packet_pos(rs, j, packet_size, file_off + off + 68);
+								}
+								packet_count++;
+							} else {
+								bad_flag |= 2;	// 別の Set ID が混じってる
+							}
+							// バッファー内のオフセットとパケット・サイズ分ずらす
+							if (file_next < file_size)
+								file_next = file_off + off + packet_size;
+							off = max;	// 一気に末尾までいく
+						} else {
+							off += 8;	// 破損パケットなら
+						}
+					}
+					continue;
+				}
+				// パケットが破損してないかを調べる
+				data_md5(buf + (off + 32), (packet_size - 32), hash);
+				if (memcmp(buf + (off + 16), hash, 16) == 0){	// 完全なパケット発見
+					if (memcmp(buf + (off + 32), set_id, 16) != 0){	// Recovery Set ID が同じパケットだけ
+						bad_flag |= 2;	// 別の Set ID が混じってる
+						off += packet_size;
+						continue;
+					}
+					if (memcmp(buf + (off + 48), "PAR 2.0\0IFSC\0\0\0\0", 16) == 0){
+						// Input File Slice Checksum packet は後で読み直す
+						add_packet_pos(rs, -1, packet_size, file_off + off);
+					} else if (memcmp(buf + (off + 48), "PAR 2.0\0RecvSlic", 16) == 0){
+						// Recovery Slice packet
+						memcpy(&j, buf + (off + 64), 4);	// パリティ・ブロックの番号
+						j &= 0xFFFF;	// 番号は 16-bit (65536以上は 0～65535 の繰り返し)
+						if (j == 65535)	// (0 と 65535 は同じ)
+							j = 0;
+						if ((packet_size == 64 + 4 + block_size) && (j < parity_num))
+							add_packet_pos(rs, j, packet_size, file_off + off + 68);
+					}
+					packet_count++;
+					off += packet_size;	// パケットの終端まで一気に飛ぶ
+				} else {
+					bad_flag |= 1;
+					off += 8;
+				}
+			} else {
+				bad_flag |= 1;
+				off++;
+			}
+		}
+
+		if (file_next < file_size){	// ファイル・データがまだ残ってれば
+			if (file_next > file_off + SEARCH_SIZE * 3){	// 次の読み込み位置が前回よりも SEARCH_SIZE * 3 以上離れてるなら
+				file_off = file_next;
+				// 読み取りサイズは最大で SEARCH_SIZE * 3
+				off = 0;
+				len = SEARCH_SIZE * 3;
+				if (file_size < file_next + SEARCH_SIZE * 3)
+					len = (unsigned int)(file_size - file_next);
+				// 最大 SEARCH_SIZE * 3 を読み込んでバッファーの先頭に入れる
+				if (file_read_data(hFile, file_next, buf, len)){
+					off = len;		// 読み込み時にエラーが発生した部分は検査しない
+					bad_flag |= 128;
+					file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
+				}
+				file_next += len;	// 次の読み込み開始位置
+				max = len;
+				if (len > SEARCH_SIZE)
+					max = SEARCH_SIZE;
+			} else {	// 次の SEARCH_SIZE を読み込む
+				// バッファーの内容を前にずらす
+				memcpy(buf, buf + SEARCH_SIZE, SEARCH_SIZE);
+				memcpy(buf + SEARCH_SIZE, buf + SEARCH_SIZE * 2, SEARCH_SIZE);
+				file_off += SEARCH_SIZE;
+				// 読み取りサイズは最大で SEARCH_SIZE
+				off -= max;
+				len = SEARCH_SIZE;
+				if (file_size < file_next + SEARCH_SIZE)
+					len = (unsigned int)(file_size - file_next);
+				// 最大 SEARCH_SIZE を読み込んでバッファーの末尾 SEARCH_SIZE に入れる
+				if (file_read_data(hFile, file_next, buf + SEARCH_SIZE * 2, len)){
+					memset(buf + SEARCH_SIZE * 2, 0, len);	// 読み込み時にエラーが発生した部分は 0 にしておく
+					bad_flag |= 128;
+					file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
+				}
+				file_next += len;	// 次の読み込み開始位置
+				max = SEARCH_SIZE;
+				len += SEARCH_SIZE * 2;	// 未処理データのサイズに残ってる SEARCH_SIZE * 2 を足す
+			}
+		} else {	// バッファー内の残りデータを処理する
+			//printf("max = %d, off = %d, len = %d\n", max, off, len);
+			off -= max;
+			len -= max;
+			if (len > 0){
+				if (len > SEARCH_SIZE){
+					max = SEARCH_SIZE;
+					memcpy(buf, buf + SEARCH_SIZE, SEARCH_SIZE);
+					memcpy(buf + SEARCH_SIZE, buf + SEARCH_SIZE * 2, len - SEARCH_SIZE);
+				} else {
+					max = len;
+					memcpy(buf, buf + SEARCH_SIZE, len);	// バッファーの内容を前にずらす
+				}
+				file_off += SEARCH_SIZE;
+			}
+		}
+		rs->file_off = file_off;
+
+		// 経過表示
+		if (file_name != NULL){
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress_file((int)((file_off * 1000) / file_size), first_num, file_name))
+					return 2;
+				time_last = GetTickCount();
+			}
+		} else if ((stop != NULL) && (*stop != 0)){
+			return 2;
+		}
+	}
+
+	rs->packet_count = packet_count;
+	rs->bad_flag |= bad_flag;
+	return 0;
+}
+
+// サブ・スレッドでリカバリ・ファイルを順に検査する
+static DWORD WINAPI search_recovery_thread(LPVOID lpParameter)
+{
+	int num;
+	RECV_SEARCH_TH *th;
+
+	th = (RECV_SEARCH_TH *)lpParameter;
+	while ((num = InterlockedIncrement(th->next) - 1) < th->file_count){
+		if (*(th->stop) != 0)
+			break;
+		if (th->rs[num].flag != 0)
+			continue;	// 検査しないファイル
+		if (scan_recovery_file(th->buf, th->set_id, &(th->rs[num]), NULL, th->stop) != 0)
+			break;
+		InterlockedExchange(&(th->rs[num].flag), 2);	// 検査済みの印
+		SetEvent(th->hDone);
+	}
+	SetEvent(th->hDone);	// 待ってる場合に備えて終了も知らせる
+
+	return 0;
+}
+
+// 同時に検査するかどうかを決める (ネットワーク・ドライブか SSD なら複数、HDD なら一個ずつ)
+static int search_read_num(int scan_count)
+{
+	wchar_t root_path[4], *path;
+	int read_num;
+
+	if ((cpu_num < 2) || (scan_count < 2))
+		return 1;
+
+	path = recovery_file;
+	if (wcsncmp(path, L"\\\\?\\", 4) == 0){	// 「\\?\」の長さ
+		path += 4;
+		if (_wcsnicmp(path, L"UNC\\", 4) == 0)
+			path = L"\\\\";	// 共有フォルダ
+	}
+	read_num = 1;
+	if ((path[0] == '\\') && (path[1] == '\\')){	// 「\\MyServer\MyShare\」のような形式
+		read_num = MAX_SEARCH_READ;
+	} else if (path[1] == ':'){
+		root_path[0] = path[0];
+		root_path[1] = ':';
+		root_path[2] = '\\';
+		root_path[3] = 0;
+		if (GetDriveType(root_path) == DRIVE_REMOTE){	// ネットワーク・ドライブ
+			read_num = MAX_SEARCH_READ;
+		} else if (memory_use & 16){	// SSD
+			read_num = (memory_use & 32) ? MAX_SEARCH_READ : 2;
+		}
+	}
+	if (read_num > cpu_num)
+		read_num = cpu_num;
+	if (read_num > scan_count)
+		read_num = scan_count;
+
+	return read_num;
+}
+
 // 修復用のパケットを探す
-// 0~= 不完全なリカバリ・ファイルの数を返す、-2=Cansel
+// 0~= 不完全なリカバリ・ファイルの数を返す、-1=Error, -2=Cansel
 int search_recovery_packet(
 	char *ascii_buf,
 	unsigned char *buf,		// 作業バッファー
@@ -914,13 +1237,74 @@ int search_recovery_packet(
 	source_ctx_r *s_blk,	// 各ソース・ブロックの情報
 	parity_ctx_r *p_blk)	// 各パリティ・ブロックの情報
 {
-	unsigned char hash[16];
-	int i, j, recv_off, num, packet_count, bad_flag, file_block;
-	int find_num, find_new, recovery_lost;
-	int len, off, max;
+	int i, j, k, recv_off, num, packet_count, bad_flag, file_block;
+	int find_num, find_new, recovery_lost, file_count, scan_count;
+	int len, off, rv, multi_read;
 	unsigned int packet_size, time_last, meta_data[7];
-	__int64 file_size, file_off, file_next;
-	HANDLE hFile;
+	volatile long next_num, stop_flag;
+	HANDLE hFile, hDone = NULL;
+	HANDLE hSub[MAX_SEARCH_READ];
+	RECV_SEARCH_TH th[MAX_SEARCH_READ];
+	recv_scan_ctx *rs;
+
+	// 全てのリカバリ・ファイルを先に開いて、検査が必要かを調べておく
+	file_count = 0;
+	for (recv_off = 0; recv_off < recv_len; recv_off += (int)wcslen(recv_buf + recv_off) + 1)
+		file_count++;
+	rs = (recv_scan_ctx *)calloc(file_count + 1, sizeof(recv_scan_ctx));
+	if (rs == NULL){
+		printf("calloc, %d\n", (int)sizeof(recv_scan_ctx) * (file_count + 1));
+		return -1;
+	}
+	scan_count = 0;
+	recv_off = 0;
+	for (k = 0; k < file_count; k++){
+		rs[k].hFile = CreateFile(recv_buf + recv_off, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (rs[k].hFile == INVALID_HANDLE_VALUE){
+			rs[k].hFile = NULL;
+			rs[k].flag = -1;	// 開けなかった
+		} else if (!GetFileSizeEx(rs[k].hFile, (PLARGE_INTEGER)&(rs[k].file_size))){
+			rs[k].flag = -1;	// 属性の読み取りエラー
+		} else if (peek_ini_recovery(rs[k].hFile) != 0){
+			rs[k].flag = 1;	// 検査記録を利用する
+		} else {
+			scan_count++;
+		}
+		recv_off += (int)wcslen(recv_buf + recv_off) + 1;
+	}
+
+	// ファイルの検査はサブ・スレッドで行い、結果の集計は順番通りに行う
+	memset(hSub, 0, sizeof(HANDLE) * MAX_SEARCH_READ);
+	next_num = 0;
+	stop_flag = 0;
+	multi_read = search_read_num(scan_count);
+	if (multi_read >= 2){
+		hDone = CreateEvent(NULL, FALSE, FALSE, NULL);	// 自動リセット
+		if (hDone == NULL)
+			multi_read = 0;
+	}
+	if (multi_read < 2)
+		multi_read = 0;
+	for (i = 0; i < multi_read; i++){
+		th[i].buf = (unsigned char *)malloc(SEARCH_SIZE * 3);
+		if (th[i].buf == NULL)
+			break;	// 確保できた分だけ使う
+		th[i].set_id = set_id;
+		th[i].rs = rs;
+		th[i].file_count = file_count;
+		th[i].next = &next_num;
+		th[i].stop = &stop_flag;
+		th[i].hDone = hDone;
+		hSub[i] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, search_recovery_thread, (LPVOID)&(th[i]), 0, NULL);
+		if (hSub[i] == NULL){
+			free(th[i].buf);
+			break;
+		}
+	}
+	multi_read = i;
+#ifdef TIMER
+	printf("\n file_count = %d, scan_count = %d, multi_read = %d\n", file_count, scan_count, multi_read);
+#endif
 
 	printf("\nLoading PAR File       :\n");
 	printf(" Packet Slice Status   :  Filename\n");
@@ -930,244 +1314,111 @@ int search_recovery_packet(
 	first_num = 0;	// 初めて見つけたパリティ・ブロックの数
 	num = 0;
 	recv_off = 0;
-	while (recv_off < recv_len){
-		if (cancel_progress() != 0)	// キャンセル処理
-			return -2;
+	rv = 0;
+	for (k = 0; k < file_count; k++){
+		if (cancel_progress() != 0){	// キャンセル処理
+			rv = -2;
+			break;
+		}
 
 		//utf16_to_cp(recv_buf + recv_off, ascii_buf, cp_output);
 		//printf("verifying %s\n", ascii_buf);
-		// リカバリ・ファイルを開く
-		hFile = CreateFile(recv_buf + recv_off, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-		if (hFile == INVALID_HANDLE_VALUE){
-			i = -1;
-		} else {
-			// 検査するリカバリ・ファイルが同じであれば、再検査する必要は無い
-			i = check_ini_recovery(hFile, meta_data);
+		hFile = rs[k].hFile;
+		if (rs[k].flag < 0){	// エラーが発生したら次のリカバリ・ファイルを調べる
+			if (hFile != NULL){
+				CloseHandle(hFile);
+				rs[k].hFile = NULL;
+			}
+			while (recv_buf[recv_off] != 0)	// 次のファイルの位置にずらす
+				recv_off++;
+			recv_off++;
+			continue;
+		}
+
+		// サブ・スレッドが検査中なら終わるのを待つ
+		if ((multi_read > 0) && (rs[k].flag == 0)){
+			prog_last = -1;
+			time_last = GetTickCount();
+			while (rs[k].flag == 0){
+				WaitForSingleObject(hDone, UPDATE_TIME / 2);
+				// 経過表示
+				if (GetTickCount() - time_last >= UPDATE_TIME){
+					if (print_progress_file((int)((rs[k].file_off * 1000) / rs[k].file_size), first_num, recv_buf + recv_off)){
+						rv = -2;
+						break;
+					}
+					time_last = GetTickCount();
+				}
+			}
+			if (rv != 0)
+				break;
 		}
+
+		// 検査するリカバリ・ファイルが同じであれば、再検査する必要は無い
+		i = check_ini_recovery(hFile, meta_data);
 		if (i < 0){	// エラーが発生したら次のリカバリ・ファイルを調べる
+			CloseHandle(hFile);
+			rs[k].hFile = NULL;
 			while (recv_buf[recv_off] != 0)	// 次のファイルの位置にずらす
 				recv_off++;
 			recv_off++;
 			continue;
 		}
 		if (i == 0){
-			memcpy(&file_size, meta_data, 8);
+			if (rs[k].flag != 2){	// まだ検査してなければ、ここで検査する
+				prog_last = -1;
+				if (scan_recovery_file(buf, set_id, &(rs[k]), recv_buf + recv_off, NULL) != 0){
+					write_ini_recovery2(-1, 0, 0, meta_data);
+					rv = -2;
+					break;
+				}
+			}
+
+			// 見つけたパケットを順番に処理する
 			find_num = 0;
 			find_new = 0;
-			file_off = 0;
-			prog_last = -1;
-			time_last = GetTickCount();
+			for (j = 0; j < rs[k].pos_num; j++){
+				i = rs[k].pos[j].id;
+				if (i >= 0){	// Recovery Slice packet
+					if (p_blk[i].exist == 0){
+						find_new++;	// リカバリ・ファイル内の新しいパリティ・ブロックの数
+						first_num++;
+						p_blk[i].exist = 1;
+						p_blk[i].file = num;
+						p_blk[i].off = rs[k].pos[j].off;
+					}
+					write_ini_recovery(i, rs[k].pos[j].off);
+					find_num++;	// リカバリ・ファイル内のパリティ・ブロックの数
+					continue;
+				}
 
-			// 最初はファイルの先頭 SEARCH_SIZE * 3 を読み込む
-			bad_flag = 0;
-			off = 0;
-			len = SEARCH_SIZE * 3;
-			if (file_size < SEARCH_SIZE * 3)
-				len = (unsigned int)file_size;
-			if (file_size < MIN_PACKET_SIZE){	// 小さすぎるファイルは検査しない
-				bad_flag |= 1;
-				len = 0;
-			}
-			// 最大 SEARCH_SIZE * 3 を読み込んでバッファーの先頭に入れる
-			if (file_read_data(hFile, 0, buf, len)){
-				off = len;		// 読み込み時にエラーが発生した部分は検査しない
-				bad_flag |= 128;
-				file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
-			} else {
-				file_next = len;	// 次の読み込み開始位置
-			}
-			max = len;
-			if (len > SEARCH_SIZE)
-				max = SEARCH_SIZE;
-			//printf("file_size = %I64d, max = %d, off = %d, len = %d\n", file_size, max, off, len);
-
-			// パケットを探す
-			packet_count = 0;
-			while (len > 0){
-				while (off < max){
-					if (match_magic(buf + off) == 0){
-						memcpy(&packet_size, buf + (off + 12), 4);	// パケット・サイズの上位4バイトが0以外だとだめ
-						if (packet_size != 0){
-							bad_flag |= 1;
-							off += 8;
-							continue;
-						}
-						memcpy(&packet_size, buf + (off + 8), 4);	// パケット・サイズを確かめる
-						if ((packet_size & 3) || (packet_size < MIN_PACKET_SIZE) || (file_off + (__int64)off + (__int64)packet_size > file_size)){
-							bad_flag |= 1;
-							off += 8;
-							continue;
-						}
-						if (off + packet_size > SEARCH_SIZE * 3){	// 大きすぎてバッファー内に収まってないなら
-							if (packet_size > 64 + 4 + block_size){	// Recovery Slice packet よりも大きいパケットは無いはず
-								off += 8;
-								continue;
-							}
-							// パケットが破損してないかを調べる
-							if (file_md5(hFile, file_off + off + 32, packet_size - 32, hash)){
-								off += 8;	// 計算できなかったら
-							} else {
-								if (memcmp(buf + (off + 16), hash, 16) == 0){	// 完全なパケット発見
-									if (memcmp(buf + (off + 32), set_id, 16) == 0){	// Recovery Set ID が同じなら
-										// 少なくともパケットの先頭 SEARCH_SIZE * 2 まではバッファー内に存在する
-										// バッファーに収まらないパケットは Recovery Slice packet だけのはず
-										if (memcmp(buf + (off + 48), "PAR 2.0\0RecvSlic", 16) == 0){
-											// Recovery Slice packet
-											memcpy(&j, buf + (off + 64), 4);	// パリティ・ブロックの番号
-											j &= 0xFFFF;	// 番号は 16-bit (65536以上は 0～65535 の繰り返し)
-											if (j == 65535)	// (0 と 65535 は同じ)
-												j = 0;
-											if (j < parity_num){
-												if (p_blk[j].exist == 0){
-													find_new++;	// リカバリ・ファイル内の新しいパリティ・ブロックの数
-													first_num++;
-													p_blk[j].exist = 1;
-													p_blk[j].file = num;
-													p_blk[j].off = file_off + off + 68;
-												}
-												write_ini_recovery(j, file_off + off + 68);
-												find_num++;	// リカバリ・ファイル内のパリティ・ブロックの数
-											}
-										}
-										packet_count++;
-									} else {
-										bad_flag |= 2;	// 別の Set ID が混じってる
-									}
-									// バッファー内のオフセットとパケット・サイズ分ずらす
-									if (file_next < file_size)
-										file_next = file_off + off + packet_size;
-									off = max;	// 一気に末尾までいく
-								} else {
-									off += 8;	// 破損パケットなら
-								}
-							}
-							continue;
-						}
-						// パケットが破損してないかを調べる
-						data_md5(buf + (off + 32), (packet_size - 32), hash);
-						if (memcmp(buf + (off + 16), hash, 16) == 0){	// 完全なパケット発見
-							if (memcmp(buf + (off + 32), set_id, 16) != 0){	// Recovery Set ID が同じパケットだけ
-								bad_flag |= 2;	// 別の Set ID が混じってる
-								off += packet_size;
-								continue;
-							}
+				// Input File Slice Checksum packet を読み直す
+				packet_size = rs[k].pos[j].size;
+				if (file_read_data(hFile, rs[k].pos[j].off, buf, packet_size))
+					continue;
 /*
 memset(ascii_buf, 0, 9);
-memcpy(ascii_buf, buf + (off + 56), 8);
-printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packet_size, file_off, off);
+memcpy(ascii_buf, buf + 56, 8);
+printf(" packet : %s, size = %u, file_off = %I64d\n", ascii_buf, packet_size, rs[k].pos[j].off);
 */
-							if (memcmp(buf + (off + 48), "PAR 2.0\0IFSC\0\0\0\0", 16) == 0){
-								// Input File Slice Checksum packet
-								for (j = 0; j < entity_num; j++){
-									if (memcmp(buf + (off + 64), files[j].id, 16) == 0){	// File ID が一致すれば
-										if (files[j].state & 0x80)	// チェックサムを新しく発見したのなら
-											break;
-									}
-								}
-								file_block = files[j].b_num;	// ソース・ブロックの数
-								if ((j < entity_num) && ((int)((packet_size - 80) / 20) == file_block)){
-									files[j].state = 0;	// そのファイルのチェックサムを見つけた
-									for (i = 0; i < file_block; i++){
-										memcpy(s_blk[files[j].b_off + i].hash, buf + (off + 80 + (20 * i)), 20);
-										memcpy(&(s_blk[files[j].b_off + i].crc), buf + (off + 80 + (20 * i) + 16), 4);
-										s_blk[files[j].b_off + i].crc ^= window_mask;	// CRC の初期値と最終処理の 0xFFFFFFFF を取り除く
-									}
-								}
-							} else if (memcmp(buf + (off + 48), "PAR 2.0\0RecvSlic", 16) == 0){
-								// Recovery Slice packet
-								memcpy(&j, buf + (off + 64), 4);	// パリティ・ブロックの番号
-								j &= 0xFFFF;	// 番号は 16-bit (65536以上は 0～65535 の繰り返し)
-								if (j == 65535)	// (0 と 65535 は同じ)
-									j = 0;
-								if ((packet_size == 64 + 4 + block_size) && (j < parity_num)){
-									if (p_blk[j].exist == 0){
-										find_new++;	// リカバリ・ファイル内の新しいパリティ・ブロックの数
-										first_num++;
-										p_blk[j].exist = 1;
-										p_blk[j].file = num;
-										p_blk[j].off = file_off + off + 68;
-									}
-									write_ini_recovery(j, file_off + off + 68);
-									find_num++;	// リカバリ・ファイル内のパリティ・ブロックの数
-								}
-							}
-							packet_count++;
-							off += packet_size;	// パケットの終端まで一気に飛ぶ
-						} else {
-							bad_flag |= 1;
-							off += 8;
-						}
-					} else {
-						bad_flag |= 1;
-						off++;
+				for (i = 0; i < entity_num; i++){
+					if (memcmp(buf + 64, files[i].id, 16) == 0){	// File ID が一致すれば
+						if (files[i].state & 0x80)	// チェックサムを新しく発見したのなら
+							break;
 					}
 				}
-
-				if (file_next < file_size){	// ファイル・データがまだ残ってれば
-					if (file_next > file_off + SEARCH_SIZE * 3){	// 次の読み込み位置が前回よりも SEARCH_SIZE * 3 以上離れてるなら
-						file_off = file_next;
-						// 読み取りサイズは最大で SEARCH_SIZE * 3
-						off = 0;
-						len = SEARCH_SIZE * 3;
-						if (file_size < file_next + SEARCH_SIZE * 3)
-							len = (unsigned int)(file_size - file_next);
-						// 最大 SEARCH_SIZE * 3 を読み込んでバッファーの先頭に入れる
-						if (file_read_data(hFile, file_next, buf, len)){
-							off = len;		// 読み込み時にエラーが発生した部分は検査しない
-							bad_flag |= 128;
-							file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
-						}
-						file_next += len;	// 次の読み込み開始位置
-						max = len;
-						if (len > SEARCH_SIZE)
-							max = SEARCH_SIZE;
-					} else {	// 次の SEARCH_SIZE を読み込む
-						// バッファーの内容を前にずらす
-						memcpy(buf, buf + SEARCH_SIZE, SEARCH_SIZE);
-						memcpy(buf + SEARCH_SIZE, buf + SEARCH_SIZE * 2, SEARCH_SIZE);
-						file_off += SEARCH_SIZE;
-						// 読み取りサイズは最大で SEARCH_SIZE
-						off -= max;
-						len = SEARCH_SIZE;
-						if (file_size < file_next + SEARCH_SIZE)
-							len = (unsigned int)(file_size - file_next);
-						// 最大 SEARCH_SIZE を読み込んでバッファーの末尾 SEARCH_SIZE に入れる
-						if (file_read_data(hFile, file_next, buf + SEARCH_SIZE * 2, len)){
-							memset(buf + SEARCH_SIZE * 2, 0, len);	// 読み込み時にエラーが発生した部分は 0 にしておく
-							bad_flag |= 128;
-							file_next = file_size;	// 次は読み込まず、このファイルの検査を終える
-						}
-						file_next += len;	// 次の読み込み開始位置
-						max = SEARCH_SIZE;
-						len += SEARCH_SIZE * 2;	// 未処理データのサイズに残ってる SEARCH_SIZE * 2 を足す
-					}
-				} else {	// バッファー内の残りデータを処理する
-					//printf("max = %d, off = %d, len = %d\n", max, off, len);
-					off -= max;
-					len -= max;
-					if (len > 0){
-						if (len > SEARCH_SIZE){
-							max = SEARCH_SIZE;
-							memcpy(buf, buf + SEARCH_SIZE, SEARCH_SIZE);
-							memcpy(buf + SEARCH_SIZE, buf + SEARCH_SIZE * 2, len - SEARCH_SIZE);
-						} else {
-							max = len;
-							memcpy(buf, buf + SEARCH_SIZE, len);	// バッファーの内容を前にずらす
-						}
-						file_off += SEARCH_SIZE;
+				file_block = files[i].b_num;	// ソース・ブロックの数
+				if ((i < entity_num) && ((int)((packet_size - 80) / 20) == file_block)){
+					files[i].state = 0;	// そのファイルのチェックサムを見つけた
+					for (off = 0; off < file_block; off++){
+						memcpy(s_blk[files[i].b_off + off].hash, buf + (80 + (20 * off)), 20);
+						memcpy(&(s_blk[files[i].b_off + off].crc), buf + (80 + (20 * off) + 16), 4);
+						s_blk[files[i].b_off + off].crc ^= window_mask;	// CRC の初期値と最終処理の 0xFFFFFFFF を取り除く
 					}
 				}
-
-				// 経過表示
-				if (GetTickCount() - time_last >= UPDATE_TIME){
-					if (print_progress_file((int)((file_off * 1000) / file_size), first_num, recv_buf + recv_off)){
-						CloseHandle(hFile);
-						write_ini_recovery2(-1, 0, 0, meta_data);
-						return -2;
-					}
-					time_last = GetTickCount();
-				}
 			}
+			packet_count = rs[k].packet_count;
+			bad_flag = rs[k].bad_flag;
 			write_ini_recovery2(packet_count, find_num, bad_flag, meta_data);
 		} else {	// 検査済みなら記録を読み込む
 			find_new = read_ini_recovery(num, &packet_count, &find_num, &bad_flag, p_blk);
@@ -1179,12 +1430,17 @@ printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packe
 				first_num += find_new;	// 新たに発見したパリティ・ブロックの数を合計する
 			}
 		}
+		if (rs[k].pos != NULL){
+			free(rs[k].pos);
+			rs[k].pos = NULL;
+		}
 		print_progress_file(-1, first_num, NULL);	// 重複を除外した合計ブロック数を表示する
 		if ((find_new > 0) && (rcv_hFile != NULL)){
 			rcv_hFile[num] = hFile;	// 後から読み込めるように開いたままにする
 		} else {
 			CloseHandle(hFile);
 		}
+		rs[k].hFile = NULL;
 
 		// リカバリ・ファイルの名前
 		if (compare_directory(recovery_file, recv_buf + recv_off) == 0){	// 同じ場所なら
@@ -1227,6 +1483,26 @@ printf(" packet : %s, size = %u, file_off = %I64d, off = %d\n", ascii_buf, packe
 		fflush(stdout);
 		num++;	// 次のファイルへ
 	}
+
+	// サブ・スレッドを終了させる
+	if (rv != 0)
+		InterlockedExchange(&stop_flag, 1);
+	for (i = 0; i < multi_read; i++){
+		WaitForSingleObject(hSub[i], INFINITE);
+		CloseHandle(hSub[i]);
+		free(th[i].buf);
+	}
+	if (hDone)
+		CloseHandle(hDone);
+	for (k = 0; k < file_count; k++){
+		if (rs[k].hFile)
+			CloseHandle(rs[k].hFile);
+		if (rs[k].pos)
+			free(rs[k].pos);
+	}
+	free(rs);
+	if (rv != 0)
+		return rv;
 /*{
 FILE *fp;
 fp = fopen("par_list.txt", "wb");
@@ -0,0 +1,855 @@
+﻿// update.c
+// Copyright : 2026-10-19 Yutaka Sawada
+// License : GPL
+
+#ifndef _UNICODE
+#define _UNICODE
+#endif
+#ifndef UNICODE
+#define UNICODE
+#endif
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601	// Windows 7 or later
+#endif
+
+#include <malloc.h>
+#include <stdio.h>
+
+#include <windows.h>
+
+#include "common2.h"
+#include "md5_crc.h"
+#include "create.h"
+#include "phmd5.h"
+#include "update.h"
+
+
+// ソース・ファイルの変更されたスライスを調べる
+// ファイル・サイズと先頭 16KB が同じなら File ID は変わらないので、チェックサムだけ比較する
+int check_file_change(
+	char *ascii_buf,		// 作業用
+	wchar_t *file_path,		// 作業用
+	int *change_num,		// 変更されたスライスの数が戻る
+	unsigned char *sum,		// 変更後のチェックサム (MD5 + CRC-32) の配列
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
+{
+	unsigned char hash[16];
+	int i, j, num, bad_flag = 0;
+	unsigned int time_last;
+	__int64 file_size, prog_now = 0;
+	WIN32_FILE_ATTRIBUTE_DATA AttrData;
+
+	total_file_size = 0;	// 経過表示用に合計サイズを計算する
+	for (num = 0; num < entity_num; num++)
+		total_file_size += files[num].size;
+
+	printf("\nChecking Input File    :\n");
+	printf("         Size Status   :  Filename\n");
+	fflush(stdout);
+	time_last = GetTickCount();
+	wcscpy(file_path, base_dir);
+	*change_num = 0;
+	for (num = 0; num < entity_num; num++){
+		utf16_to_cp(list_buf + files[num].name, ascii_buf, cp_output);
+		wcscpy(file_path + base_len, list_buf + files[num].name);
+		if (!GetFileAttributesEx(file_path, GetFileExInfoStandard, &AttrData)){
+			printf("            - Missing  : \"%s\"\n", ascii_buf);
+			bad_flag = 1;
+			continue;
+		}
+		file_size = ((__int64)AttrData.nFileSizeHigh << 32) | (unsigned __int64)AttrData.nFileSizeLow;
+		if (file_size != files[num].size){	// サイズが変わると File ID も変わる
+			printf("%13I64d Resized  : \"%s\"\n", file_size, ascii_buf);
+			bad_flag = 1;
+			continue;
+		}
+		if (file_size == 0){
+			printf("            = Complete : \"%s\"\n", ascii_buf);
+			continue;
+		}
+		if (file_md5_16(file_path, hash) != 0){
+			printf_cp("file_md5_16, %s\n", file_path);
+			return 1;
+		}
+		if (memcmp(hash, files[num].hash + 16, 16) != 0){	// 先頭 16KB が変わると File ID も変わる
+			printf("%13I64d Changed  : \"%s\"\n", file_size, ascii_buf);
+			bad_flag = 1;
+			continue;
+		}
+
+		// ファイルのハッシュ値とスライスのチェックサムを計算し直す
+		i = file_hash_crc(list_buf + files[num].name, file_size, hash, sum + (20 * files[num].b_off), &time_last, &prog_now);
+		if (i != 0){
+			if (i == 1)
+				printf_cp("file_hash_crc, %s\n", file_path);
+			return i;
+		}
+		j = 0;
+		for (i = files[num].b_off; i < files[num].b_off + files[num].b_num; i++){
+			if (memcmp(sum + (20 * i), s_blk[i].hash, 20) == 0){
+				s_blk[i].exist = 1;
+			} else {	// 変更されたスライス
+				s_blk[i].exist = 0;
+				j++;
+			}
+		}
+		if (j == 0){
+			files[num].state = 0;
+			printf("            = Complete : \"%s\"\n", ascii_buf);
+		} else {
+			files[num].state = 2;	// 変更されたファイルの印
+			memcpy(files[num].hash, hash, 16);	// 変更後のハッシュ値に置き換える
+			printf("%13I64d %8d : \"%s\"\n", file_size, j, ascii_buf);
+			*change_num += j;
+		}
+		fflush(stdout);
+	}
+	print_progress_done();
+
+	if (bad_flag){
+		printf("\nFile ID was changed, create recovery files again\n");
+		return 1;
+	}
+	printf("\nChanged Slice count\t: %d\n", *change_num);
+	return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// リカバリ・ファイル内のパケットを先頭から順に調べる
+// -1=パケットが連続してない, -2=更新できないパケットがある, 0～=このセットのパケット数
+static int scan_update_packet(
+	HANDLE hFile,
+	int num,				// リカバリ・ファイルの番号 (-1 ならパリティ・ブロックを含まない)
+	unsigned char *set_id,	// Recovery Set ID
+	unsigned char *sum,		// 変更後のチェックサム (NULL なら確認だけする)
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	parity_ctx_r *p_blk)	// 各パリティ・ブロックの情報
+{
+	unsigned char header[80], hash[16], *buf;
+	int i, count = 0;
+	__int64 file_size, file_off, packet_size;
+
+	if (!GetFileSizeEx(hFile, (PLARGE_INTEGER)&file_size))
+		return -1;
+	file_off = 0;
+	while (file_off < file_size){
+		if ((file_size - file_off < 64) || file_read_data(hFile, file_off, header, 64))
+			return -1;
+		if (memcmp(header, "PAR2\0PKT", 8) != 0)
+			return -1;	// 途中にパケット以外のデータがある
+		memcpy(&packet_size, header + 8, 8);
+		if ((packet_size < 64) || (packet_size & 3) || (packet_size > file_size - file_off))
+			return -1;
+		if (memcmp(header + 32, set_id, 16) != 0){	// 別のセットのパケットは無視する
+			file_off += packet_size;
+			continue;
+		}
+		count++;
+
+		if (memcmp(header + 48, "PAR 2.0\0RecvSlic", 16) == 0){
+			// 全ての Recovery Slice packet が更新対象でないといけない
+			if ((packet_size != 68 + (__int64)block_size) || file_read_data(hFile, file_off + 64, &i, 4))
+				return -1;
+			if ((i < 0) || (i >= parity_num) || (p_blk[i].exist == 0) ||
+					(p_blk[i].file != num) || (p_blk[i].off != file_off + 68))
+				return -2;	// 重複したり破損したパリティ・ブロックは更新できない
+
+		} else if ((memcmp(header + 48, "PAR 2.0\0FileDesc", 16) == 0) ||
+				(memcmp(header + 48, "PAR 2.0\0IFSC\0\0\0\0", 16) == 0)){
+			if ((packet_size < 80) || file_read_data(hFile, file_off + 64, header + 64, 16))
+				return -1;
+			for (i = 0; i < entity_num; i++){
+				if (memcmp(header + 64, files[i].id, 16) == 0)
+					break;
+			}
+			if ((i < entity_num) && (files[i].state & 2)){	// 変更されたファイルなら
+				if (header[56] == 'I'){	// Input File Slice Checksum packet
+					if (packet_size != 80 + 20 * (__int64)(files[i].b_num))
+						return -1;
+				} else if (packet_size < 120){	// File Description packet
+					return -1;
+				}
+				if (sum != NULL){	// パケットを書き換える
+					buf = (unsigned char *)malloc((size_t)packet_size);
+					if (buf == NULL){
+						printf("malloc, %I64d\n", packet_size);
+						return -1;
+					}
+					if (file_read_data(hFile, file_off, buf, (unsigned int)packet_size)){
+						free(buf);
+						return -1;
+					}
+					// 破損してるパケットはそのままにしておく
+					data_md5(buf + 32, (unsigned int)packet_size - 32, hash);
+					if (memcmp(buf + 16, hash, 16) == 0){
+						if (header[56] == 'I'){
+							memcpy(buf + 80, sum + (20 * files[i].b_off), 20 * files[i].b_num);
+						} else {
+							memcpy(buf + 80, files[i].hash, 16);
+						}
+						data_md5(buf + 32, (unsigned int)packet_size - 32, buf + 16);
+						if (file_write_data(hFile, file_off, buf, (unsigned int)packet_size)){
+							free(buf);
+							return -1;
+						}
+					}
+					free(buf);
+				}
+			}
+		}
+		file_off += packet_size;
+	}
+
+	return count;
+}
+
+// ハンドルからリカバリ・ファイルのパスを取得する
+// search_recovery_packet の番号は recv_buf 上の順番と一致しないので、ファイルはハンドルで区別する
+static int get_handle_path(HANDLE hFile, wchar_t *file_path)
+{
+	unsigned int len;
+
+	len = GetFinalPathNameByHandle(hFile, file_path, MAX_LEN, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+	if ((len == 0) || (len >= MAX_LEN))
+		return 1;
+	if (len < MAX_PATH + 4){	// 短いパスなら表示用に「\\?\」を取り除く
+		if (wcsncmp(file_path, L"\\\\?\\UNC\\", 8) == 0){	// 「\\?\UNC\～」なら「\\～」にする
+			file_path[6] = '\\';
+			memmove(file_path, file_path + 6, (len - 6 + 1) * 2);
+		} else if ((wcsncmp(file_path, L"\\\\?\\", 4) == 0) && (file_path[5] == ':')){
+			memmove(file_path, file_path + 4, (len - 4 + 1) * 2);
+		}
+	}
+	return 0;
+}
+
+// リカバリ・ファイルを更新できるか確かめる
+// パリティ・ブロックを含むファイルは検索時の番号のまま、それ以外は空いてる番号で開いておく
+int check_update_packet(
+	unsigned char *set_id,	// Recovery Set ID
+	HANDLE *rcv_hFile,		// 各リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	parity_ctx_r *p_blk)	// 各パリティ・ブロックの情報
+{
+	wchar_t file_path[MAX_LEN];
+	unsigned int *file_id;
+	int num, recv_off, rv;
+	HANDLE hFile;
+	BY_HANDLE_FILE_INFORMATION fi;
+
+	file_id = (unsigned int *)calloc(recovery_num * 3, sizeof(unsigned int));
+	if (file_id == NULL){
+		printf("calloc, %d\n", recovery_num * 3 * (int)sizeof(unsigned int));
+		return 1;
+	}
+
+	// パリティ・ブロックを含むファイルは、検索時に開いたハンドルで調べる
+	for (num = 0; num < recovery_num; num++){
+		if (rcv_hFile[num] == NULL)
+			continue;
+		if (get_handle_path(rcv_hFile[num], file_path) != 0)
+			swprintf(file_path, MAX_LEN, L"recovery file %d", num);
+		if (!GetFileInformationByHandle(rcv_hFile[num], &fi)){
+			print_win32_err();
+			printf_cp("cannot open file, %s\n", file_path);
+			free(file_id);
+			return 1;
+		}
+		file_id[num * 3    ] = fi.dwVolumeSerialNumber;
+		file_id[num * 3 + 1] = fi.nFileIndexLow;
+		file_id[num * 3 + 2] = fi.nFileIndexHigh;
+		rv = scan_update_packet(rcv_hFile[num], num, set_id, NULL, files, p_blk);
+		if (rv == -1){
+			printf_cp("packet is not continuous, %s\n", file_path);
+			free(file_id);
+			return 1;
+		} else if (rv == -2){
+			printf_cp("recovery slice is damaged or duplicated, %s\n", file_path);
+			free(file_id);
+			return 1;
+		}
+	}
+
+	// 他のファイルも、このセットのパケットを含むなら書き換える
+	recv_off = 0;
+	while (recv_off < recv_len){
+		hFile = CreateFile(recv_buf + recv_off, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			printf_cp("cannot open file, %s\n", recv_buf + recv_off);
+			free(file_id);
+			return 1;
+		}
+		if (!GetFileInformationByHandle(hFile, &fi)){
+			print_win32_err();
+			CloseHandle(hFile);
+			printf_cp("cannot open file, %s\n", recv_buf + recv_off);
+			free(file_id);
+			return 1;
+		}
+		for (num = 0; num < recovery_num; num++){	// 既に開いてるファイルか
+			if ((rcv_hFile[num] != NULL) && (file_id[num * 3] == fi.dwVolumeSerialNumber) &&
+					(file_id[num * 3 + 1] == fi.nFileIndexLow) && (file_id[num * 3 + 2] == fi.nFileIndexHigh))
+				break;
+		}
+		if (num < recovery_num){
+			CloseHandle(hFile);
+			recv_off += (int)wcslen(recv_buf + recv_off) + 1;
+			continue;
+		}
+		rv = scan_update_packet(hFile, -1, set_id, NULL, files, p_blk);
+		if (rv == -1){
+			CloseHandle(hFile);
+			printf_cp("packet is not continuous, %s\n", recv_buf + recv_off);
+			free(file_id);
+			return 1;
+		} else if (rv == -2){
+			CloseHandle(hFile);
+			printf_cp("recovery slice is damaged or duplicated, %s\n", recv_buf + recv_off);
+			free(file_id);
+			return 1;
+		} else if (rv > 0){	// 空いてる番号に割り当てる
+			for (num = 0; num < recovery_num; num++){
+				if (rcv_hFile[num] == NULL)
+					break;
+			}
+			if (num == recovery_num){
+				CloseHandle(hFile);
+				printf("too many recovery files\n");
+				free(file_id);
+				return 1;
+			}
+			rcv_hFile[num] = hFile;
+			file_id[num * 3    ] = fi.dwVolumeSerialNumber;
+			file_id[num * 3 + 1] = fi.nFileIndexLow;
+			file_id[num * 3 + 2] = fi.nFileIndexHigh;
+		} else {
+			CloseHandle(hFile);
+		}
+		recv_off += (int)wcslen(recv_buf + recv_off) + 1;
+	}
+	free(file_id);
+
+	return 0;
+}
+
+// 書き換えるリカバリ・ファイルをテンポラリ・ファイルにコピーして、そちらを開く
+// 元のファイルは finish_append_file で置き換えるまで変更しない
+int copy_update_file(
+	HANDLE *rcv_hFile)		// 各リカバリ・ファイルのハンドル (コピーしたファイルに置き換わる)
+{
+	wchar_t file_path[MAX_LEN], temp_path[MAX_LEN];
+	int num;
+	unsigned int len;
+	__int64 file_size, file_off;
+	HANDLE hFile;
+
+	print_progress_text(0, "Copying recovery file");
+	for (num = 0; num < recovery_num; num++){
+		if (rcv_hFile[num] == NULL)
+			continue;
+		if (get_handle_path(rcv_hFile[num], file_path) != 0){
+			printf("cannot get file name, %d\n", num);
+			return 1;
+		}
+		get_temp_name(file_path, temp_path);
+		hFile = CreateFile(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			printf_cp("cannot create file, %s\n", temp_path);
+			return 1;
+		}
+		if (!GetFileSizeEx(rcv_hFile[num], (PLARGE_INTEGER)&file_size)){
+			print_win32_err();
+			file_size = -1;
+		}
+		for (file_off = 0; file_off < file_size; file_off += len){
+			len = 0x40000000;	// 1GB ずつコピーする
+			if ((__int64)len > file_size - file_off)
+				len = (unsigned int)(file_size - file_off);
+			if (file_copy_data(rcv_hFile[num], file_off, hFile, file_off, len))
+				break;
+		}
+		if (file_off != file_size){
+			printf_cp("cannot copy file, %s\n", file_path);
+			CloseHandle(hFile);
+			DeleteFile(temp_path);
+			return 1;
+		}
+
+		// 元のファイルは閉じて、コピーしたファイルを使う
+		CloseHandle(rcv_hFile[num]);
+		rcv_hFile[num] = hFile;
+
+		// 経過表示
+		if (print_progress(((num + 1) * 1000) / recovery_num))
+			return 2;
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+	return 0;
+}
+
+// 変更されたファイルの情報とチェックサムのパケットを書き換える
+int update_file_packet(
+	unsigned char *set_id,	// Recovery Set ID
+	HANDLE *rcv_hFile,		// 各リカバリ・ファイルのハンドル
+	unsigned char *sum,		// 変更後のチェックサム (MD5 + CRC-32) の配列
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	parity_ctx_r *p_blk)	// 各パリティ・ブロックの情報
+{
+	int num;
+
+	for (num = 0; num < recovery_num; num++){
+		if (rcv_hFile[num] == NULL)
+			continue;
+		if (scan_update_packet(rcv_hFile[num], num, set_id, sum, files, p_blk) < 0){
+			printf("cannot update packet, %d\n", num);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// ソート時に項目を比較する (作成時と同じ順序にする)
+static int sort_cmp(const void *elem1, const void *elem2)
+{
+	const file_ctx_r *file1, *file2;
+	int i;
+
+	file1 = elem1;
+	file2 = elem2;
+
+	// サイズが 0 の空ファイルやフォルダは non-recovery set に含める
+	if (file1->size == 0){
+		if (file2->size > 0)
+			return 1;
+	} else {
+		if (file2->size == 0)
+			return -1;
+	}
+
+	// File ID の順に並び替える
+	for (i = 15; i >= 0; i--){
+		if (file1->id[i] > file2->id[i]){
+			return 1; // 1 > 2
+		} else if (file1->id[i] < file2->id[i]){
+			return -1; // 1 < 2
+		}
+	}
+	return 0; // 1 = 2
+}
+
+// 追加するソース・ファイルの情報を集めて、File ID を計算する
+int get_append_files(
+	char *ascii_buf,		// 作業用
+	wchar_t *file_path,		// 作業用
+	wchar_t *add_buf,		// 追加するファイル名のリスト
+	int add_num,			// 追加するファイルの数
+	file_ctx_r *files)		// 各ソース・ファイルの情報 (既存のファイルの後に追加する)
+{
+	unsigned char work_buf[16 + 8 + (MAX_LEN * 3)];
+	unsigned char hash0[16] = {0xd4, 0x1d, 0x8c, 0xd9, 0x8f, 0x00, 0xb2, 0x04,
+							0xe9, 0x80, 0x09, 0x98, 0xec, 0xf8, 0x42, 0x7e};
+	wchar_t file_name[MAX_LEN];
+	int i, num, add_off = 0, len;
+	WIN32_FILE_ATTRIBUTE_DATA AttrData;
+
+	printf("\nAdding Input File      :\n");
+	printf("         Size  Slice   :  Filename\n");
+	total_file_size = 0;
+	wcscpy(file_path, base_dir);
+	for (num = file_num; num < file_num + add_num; num++){
+		wcscpy(file_name, add_buf + add_off);
+		while (add_buf[add_off] != 0)
+			add_off++;
+		add_off++;
+		utf16_to_cp(file_name, ascii_buf, cp_output);
+		// 既にセットに含まれてるファイルは追加できない
+		if (search_file_path(list_buf, list_len, file_name)){
+			printf("\nfile is already in recovery set, \"%s\"\n", ascii_buf);
+			return 1;
+		}
+
+		// 属性を調べる
+		wcscpy(file_path + base_len, file_name);
+		if (!GetFileAttributesEx(file_path, GetFileExInfoStandard, &AttrData)){
+			print_win32_err();
+			printf_cp("GetFileAttributesEx, %s\n", file_name);
+			return 1;
+		}
+		memset(files[num].hash, 0, 16);	// 全体のハッシュ値は後で計算する
+		if (AttrData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){	// フォルダなら
+			memcpy(files[num].hash + 16, hash0, 16);
+			files[num].size = 0;
+		} else {	// ファイルなら
+			files[num].size = ((__int64)AttrData.nFileSizeHigh << 32) | (unsigned __int64)AttrData.nFileSizeLow;
+			if (files[num].size == 0){	// 空のファイルなら
+				memcpy(files[num].hash + 16, hash0, 16);
+			} else {
+				// ファイルの先頭 16KB 分のハッシュ値を計算する
+				if (file_md5_16(file_path, files[num].hash + 16)){
+					printf_cp("file_md5_16, %s\n", file_name);
+					return 1;
+				}
+			}
+		}
+
+		// File ID を計算する
+		memcpy(work_buf, files[num].hash + 16, 16);
+		memcpy(work_buf + 16, &(files[num].size), 8);
+		files[num].name = list_len;	// 大文字と小文字の区別を含めて、そのまま記録する
+		if (add_file_path(file_name)){
+			printf("add_file_path\n");
+			return 1;
+		}
+		unix_directory(file_name);	// 記録時のディレクトリ記号は「/」にする
+		utf16_to_utf8(file_name, work_buf + 24);
+		len = (int)strlen(work_buf + 24);	// File ID 計算時のファイル名のサイズは 4の倍数にしない
+		data_md5(work_buf, 24 + len, files[num].id);
+		// 他のファイルと同じ File ID になってないか調べる
+		do {
+			for (i = 0; i < num; i++){
+				if (memcmp(files[num].id, files[i].id, 16) == 0){	// File ID が同じなら
+					files[num].id[0] += 1;	// 最下位バイトを変化させる
+					break;
+				}
+			}
+		} while (i < num);	// File ID を必ずユニークな値にする
+
+		files[num].b_off = -1;
+		files[num].b_num = (int)((files[num].size + (__int64)block_size - 1) / block_size);
+		files[num].name2 = 0;
+		files[num].state = 16;	// 追加されたファイルの印
+		if (files[num].size > 0){
+			entity_num++;
+			source_num += files[num].b_num;
+			total_file_size += files[num].size;
+		}
+		printf("%13I64d %8d : \"%s\"\n", files[num].size, files[num].b_num, ascii_buf);
+	}
+	file_num += add_num;
+	fflush(stdout);
+
+	if (source_num > MAX_SOURCE_NUM){	// ブロック・サイズは変えられない
+		printf("\ntoo many input slices %d, create recovery files again\n", source_num);
+		return 1;
+	}
+	return 0;
+}
+
+// ファイルを File ID の順に並べ替えて、ソース・ブロックの新しい番号を割り当てる
+// 戻り値は Main packet の内容のサイズ
+int set_append_order(
+	unsigned char *main_buf,	// Main packet の内容
+	int *old_index,				// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+	file_ctx_r *files,			// 各ソース・ファイルの情報
+	source_ctx_r *s_blk,		// 並べ替え後の各ソース・ブロックの情報
+	source_ctx_r *old_blk)		// 既存の各ソース・ブロックの情報
+{
+	int i, j, num, block_count;
+
+	// ファイルを File ID の順に並び替える
+	qsort(files, file_num, sizeof(file_ctx_r), sort_cmp);
+
+	block_count = 0;
+	for (num = 0; num < entity_num; num++){
+		for (j = 0; j < files[num].b_num; j++){
+			i = block_count + j;
+			s_blk[i].file = num;
+			s_blk[i].size = block_size;
+			if (j == files[num].b_num - 1)	// 末尾のブロック
+				s_blk[i].size = (unsigned int)(files[num].size - (__int64)block_size * j);
+			if (files[num].state & 16){	// 追加されたブロックのチェックサムは後で計算する
+				old_index[i] = -1;
+				s_blk[i].exist = 1;
+			} else {	// 番号が変わったブロックは計算し直す必要がある
+				old_index[i] = files[num].b_off + j;
+				memcpy(s_blk[i].hash, old_blk[old_index[i]].hash, 20);
+				s_blk[i].exist = (old_index[i] != i) ? 1 : 0;
+			}
+		}
+		files[num].b_off = block_count;
+		block_count += files[num].b_num;
+	}
+
+	// Main packet の内容を作る
+	memcpy(main_buf, &block_size, 4);
+	memset(main_buf + 4, 0, 4);
+	memcpy(main_buf + 8, &entity_num, 4);
+	for (num = 0; num < file_num; num++)	// 並び替えられた順序で File ID をコピーする
+		memcpy(main_buf + (12 + (16 * num)), files[num].id, 16);
+
+	return 12 + (16 * file_num);
+}
+
+// 追加されたファイルのハッシュ値を計算して、ファイルごとのパケットを作成する
+int set_append_packet(
+	char *ascii_buf,		// 作業用
+	unsigned char *buf,		// パケットを格納するバッファー
+	unsigned char *set_id,	// 新しい Recovery Set ID
+	int switch_u,			// ユニコードのファイル名も記録する
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
+{
+	unsigned char file_hash[16];
+	wchar_t file_name[MAX_LEN];
+	int i, err, off, off2, num, len, data_size;
+	unsigned int time_last;
+	__int64 prog_now = 0;
+
+	print_progress_text(0, "Computing file hash");
+	time_last = GetTickCount();
+	off = 0;
+	for (num = 0; num < file_num; num++){
+		if ((files[num].state & 16) == 0)
+			continue;	// 既存のファイルのパケットはリカバリ・ファイルからコピーする
+
+		// File Description packet
+		off2 = off;	// 位置を記録しておく
+		memcpy(buf + (off + 64), files[num].id, 16);
+		memcpy(buf + (off + 64 + 32), files[num].hash + 16, 16);	// 全体のハッシュ値は後で書き込む
+		memcpy(buf + (off + 64 + 48), &(files[num].size), 8);
+		// ファイル名を UTF-8 に変換する
+		wcscpy(file_name, list_buf + files[num].name);
+		unix_directory(file_name);	// 記録時のディレクトリ記号は「/」にする
+		utf16_to_utf8(file_name, ascii_buf);
+		len = (int)strlen(ascii_buf);
+		for (i = len + 1; i < len + 4; i++)
+			ascii_buf[i] = 0;
+		len = (len + 3) & 0xFFFFFFFC;
+		memcpy(buf + (off + 64 + 56), ascii_buf, len);
+		data_size = 56 + len;
+		set_packet_header(buf + off, set_id, 2, data_size);	// パケット・ヘッダーを作成する
+		off += (64 + data_size);
+
+		if (files[num].size > 0){	// Input File Slice Checksum packet
+			memcpy(buf + (off + 64), files[num].id, 16);
+			// ファイルの MD5 ハッシュ値とブロックのチェックサムを同時に計算する
+			err = file_hash_crc(list_buf + files[num].name, files[num].size, file_hash, buf + (off + 64 + 16), &time_last, &prog_now);
+			if (err){
+				if (err == 1)
+					printf_cp("file_hash_crc, %s\n", list_buf + files[num].name);
+				return err;
+			}
+			for (i = 0; i < files[num].b_num; i++)	// パリティ計算時に内容が同じか確かめる
+				memcpy(s_blk[files[num].b_off + i].hash, buf + (off + 64 + 16 + 20 * i), 20);
+			i = 16 + 20 * files[num].b_num;	// パケット内容のサイズ
+			set_packet_header(buf + off, set_id, 3, i);	// パケット・ヘッダーを作成する
+			data_md5(buf + (off + 32), 32 + i, buf + (off + 16));	// パケットの MD5 を計算する
+			off += (64 + i);
+		} else {
+			memcpy(file_hash, files[num].hash + 16, 16);	// 空なら先頭 16KB と同じ
+		}
+
+		// File Description packet の続き
+		memcpy(files[num].hash, file_hash, 16);
+		memcpy(buf + (off2 + 64 + 16), file_hash, 16);	// 計算したハッシュ値をここで書き込む
+		data_md5(buf + (off2 + 32), 32 + data_size, buf + (off2 + 16));	// パケットの MD5 を計算する
+
+		if (switch_u != 0){	// ユニコードのファイル名
+			// 指定があってもファイル名が ASCII 文字だけならユニコードのパケットは作らない
+			len = (int)wcslen(file_name);
+			for (i = 0; i < len; i++){
+				if (file_name[i] != ascii_buf[i])
+					break;
+			}
+			if (i < len){
+				// Unicode Filename packet
+				memcpy(buf + (off + 64), files[num].id, 16);
+				len = (int)wcslen(file_name) * 2;
+				memcpy(buf + (off + 64 + 16), file_name, len);
+				if (len & 3)
+					memset(buf + (off + 64 + 16 + len), 0, 2);
+				data_size = 16 + ((len + 3) & 0xFFFFFFFC);
+				set_packet_header(buf + off, set_id, 10, data_size);	// パケット・ヘッダーを作成する
+				data_md5(buf + (off + 32), 32 + data_size, buf + (off + 16));	// パケットの MD5 を計算する
+				off += (64 + data_size);
+			}
+		}
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+
+	return off;
+}
+
+// 書き換えたパケットを含むリカバリ・ファイルを作り直す
+// 他のセットのパケットはそのままコピーして、このセットのパケットは新しい Set ID にする
+// Recovery Slice packet の内容は後で更新する
+int rewrite_append_file(
+	unsigned char *set_id,		// 元の Recovery Set ID
+	unsigned char *main_buf,	// 新しい Main packet
+	int main_size,				// Main packet のサイズ
+	unsigned char *add_buf,		// 追加されたファイルのパケット
+	int add_size,				// 追加されたパケットのサイズ
+	HANDLE *rcv_hFile,			// 各リカバリ・ファイルのハンドル (作り直したファイルに置き換わる)
+	parity_ctx_r *p_blk)		// 各パリティ・ブロックの情報
+{
+	unsigned char header[68], *buf, *slice_buf;
+	wchar_t file_path[MAX_LEN], temp_path[MAX_LEN];
+	int i, num, main_flag;
+	__int64 file_size, file_off, write_off, packet_size;
+	HANDLE hFile;
+	PHMD5 md_ctx;
+
+	// Set ID を書き換えたパケットのハッシュ値を計算し直すために、スライスを読み込む
+	slice_buf = (unsigned char *)malloc(block_size);
+	if (slice_buf == NULL){
+		printf("malloc, %d\n", block_size);
+		return 1;
+	}
+
+	print_progress_text(0, "Constructing recovery file");
+	for (num = 0; num < recovery_num; num++){
+		if (rcv_hFile[num] == NULL)	// このセットのパケットを含まないファイル
+			continue;
+		if (get_handle_path(rcv_hFile[num], file_path) != 0){
+			printf("cannot get file name, %d\n", num);
+			free(slice_buf);
+			return 1;
+		}
+		get_temp_name(file_path, temp_path);
+		hFile = CreateFile(temp_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			print_win32_err();
+			printf_cp("cannot create file, %s\n", temp_path);
+			free(slice_buf);
+			return 1;
+		}
+		if (!GetFileSizeEx(rcv_hFile[num], (PLARGE_INTEGER)&file_size)){
+			print_win32_err();
+			goto error_end;
+		}
+
+		// パケットを先頭から順にコピーする (連続してることは確認済み)
+		main_flag = 0;
+		file_off = 0;
+		write_off = 0;
+		while (file_off < file_size){
+			if (file_read_data(rcv_hFile[num], file_off, header, 64))
+				goto error_end;
+			memcpy(&packet_size, header + 8, 8);
+			if (memcmp(header + 32, set_id, 16) != 0){	// 別のセットのパケットはそのまま
+				if (file_copy_data(rcv_hFile[num], file_off, hFile, write_off, (unsigned int)packet_size))
+					goto error_end;
+
+			} else if (memcmp(header + 48, "PAR 2.0\0RecvSlic", 16) == 0){
+				// パケット・ヘッダーの Set ID を書き換えて、ハッシュ値を計算し直す
+				if (file_read_data(rcv_hFile[num], file_off + 64, header + 64, 4) ||
+						file_read_data(rcv_hFile[num], file_off + 68, slice_buf, block_size))
+					goto error_end;
+				memcpy(header + 32, main_buf + 32, 16);
+				Phmd5Begin(&md_ctx);
+				Phmd5Process(&md_ctx, header + 32, 36);
+				Phmd5Process(&md_ctx, slice_buf, block_size);
+				Phmd5End(&md_ctx);
+				memcpy(header + 16, md_ctx.hash, 16);
+				memcpy(&i, header + 64, 4);
+				p_blk[i].off = write_off + 68;	// 作り直したファイル内の位置にする
+				if (file_write_data(hFile, write_off, header, 68) ||
+						file_write_data(hFile, write_off + 68, slice_buf, block_size))
+					goto error_end;
+
+			} else if (memcmp(header + 48, "PAR 2.0\0Main\0\0\0\0", 16) == 0){
+				// 追加されたファイルのパケットを Main packet の前に挿入する
+				if (file_write_data(hFile, write_off, add_buf, add_size))
+					goto error_end;
+				write_off += add_size;
+				if (file_write_data(hFile, write_off, main_buf, main_size))
+					goto error_end;
+				write_off += main_size;
+				main_flag++;
+				file_off += packet_size;
+				continue;
+
+			} else {	// その他のパケットは Set ID を書き換えてハッシュ値を計算し直す
+				buf = (unsigned char *)malloc((size_t)packet_size);
+				if (buf == NULL){
+					printf("malloc, %I64d\n", packet_size);
+					goto error_end;
+				}
+				if (file_read_data(rcv_hFile[num], file_off, buf, (unsigned int)packet_size)){
+					free(buf);
+					goto error_end;
+				}
+				memcpy(buf + 32, main_buf + 32, 16);
+				data_md5(buf + 32, (unsigned int)packet_size - 32, buf + 16);
+				i = file_write_data(hFile, write_off, buf, (unsigned int)packet_size);
+				free(buf);
+				if (i)
+					goto error_end;
+			}
+			file_off += packet_size;
+			write_off += packet_size;
+		}
+		if (main_flag == 0){	// Main packet が無かったファイルには末尾に追加する
+			if (file_write_data(hFile, write_off, add_buf, add_size) ||
+					file_write_data(hFile, write_off + add_size, main_buf, main_size))
+				goto error_end;
+		}
+
+		// 元のファイルは閉じて、作り直したファイルを使う
+		CloseHandle(rcv_hFile[num]);
+		rcv_hFile[num] = hFile;
+
+		// 経過表示
+		if (print_progress(((num + 1) * 1000) / recovery_num)){
+			free(slice_buf);
+			return 2;
+		}
+	}
+	print_progress_done();	// 改行して行の先頭に戻しておく
+	free(slice_buf);
+
+	return 0;
+
+error_end:
+	printf_cp("cannot construct file, %s\n", file_path);
+	CloseHandle(hFile);
+	DeleteFile(temp_path);
+	free(slice_buf);
+	return 1;
+}
+
+// 作り直したリカバリ・ファイルで元のファイルを置き換える、または作り直したファイルを削除する
+int finish_append_file(
+	int replace_flag,		// 0=削除する, 1=置き換える
+	HANDLE *rcv_hFile)		// 各リカバリ・ファイルのハンドル
+{
+	wchar_t file_path[MAX_LEN], temp_path[MAX_LEN];
+	int num, len, err = 0;
+
+	for (num = 0; num < recovery_num; num++){
+		if (rcv_hFile[num] == NULL)
+			continue;
+		len = get_handle_path(rcv_hFile[num], temp_path);
+		CloseHandle(rcv_hFile[num]);
+		rcv_hFile[num] = NULL;
+		if (len != 0){
+			printf("cannot get file name, %d\n", num);
+			err = 1;
+			continue;
+		}
+		// get_temp_name で末尾に追加した部分が無ければ、作り直す前の元のファイル
+		len = (int)wcslen(temp_path) - 8;
+		if ((len <= 0) || (_wcsicmp(temp_path + len, L"_par.tmp") != 0))
+			continue;
+		if (replace_flag == 0){
+			DeleteFile(temp_path);
+		} else {
+			wcscpy(file_path, temp_path);
+			file_path[len] = 0;
+			if (replace_file(file_path, temp_path) != 0){
+				printf_cp("cannot replace file, %s\n", file_path);
+				err = 1;
+			}
+		}
+	}
+
+	return err;
+}
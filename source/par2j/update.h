@@ -0,0 +1,84 @@
+﻿#ifndef _UPDATE_H_
+#define _UPDATE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// ソース・ファイルの変更されたスライスを調べる
+int check_file_change(
+	char *ascii_buf,		// 作業用
+	wchar_t *file_path,		// 作業用
+	int *change_num,		// 変更されたスライスの数が戻る
+	unsigned char *sum,		// 変更後のチェックサム (MD5 + CRC-32) の配列
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk);	// 各ソース・ブロックの情報
+
+// リカバリ・ファイルを更新できるか確かめる
+// パリティ・ブロックを含むファイルは検索時の番号のまま、それ以外は空いてる番号で開いておく
+int check_update_packet(
+	unsigned char *set_id,	// Recovery Set ID
+	HANDLE *rcv_hFile,		// 各リカバリ・ファイルのハンドル
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	parity_ctx_r *p_blk);	// 各パリティ・ブロックの情報
+
+// 書き換えるリカバリ・ファイルをテンポラリ・ファイルにコピーして、そちらを開く
+int copy_update_file(
+	HANDLE *rcv_hFile);		// 各リカバリ・ファイルのハンドル (コピーしたファイルに置き換わる)
+
+// 変更されたファイルの情報とチェックサムのパケットを書き換える
+int update_file_packet(
+	unsigned char *set_id,	// Recovery Set ID
+	HANDLE *rcv_hFile,		// 各リカバリ・ファイルのハンドル
+	unsigned char *sum,		// 変更後のチェックサム (MD5 + CRC-32) の配列
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	parity_ctx_r *p_blk);	// 各パリティ・ブロックの情報
+
+
+// 追加するソース・ファイルの情報を集めて、File ID を計算する
+int get_append_files(
+	char *ascii_buf,		// 作業用
+	wchar_t *file_path,		// 作業用
+	wchar_t *add_buf,		// 追加するファイル名のリスト
+	int add_num,			// 追加するファイルの数
+	file_ctx_r *files);		// 各ソース・ファイルの情報 (既存のファイルの後に追加する)
+
+// ファイルを File ID の順に並べ替えて、ソース・ブロックの新しい番号を割り当てる
+int set_append_order(
+	unsigned char *main_buf,	// Main packet の内容
+	int *old_index,				// 移動前のソース・ブロック番号 (-1 なら追加されたブロック)
+	file_ctx_r *files,			// 各ソース・ファイルの情報
+	source_ctx_r *s_blk,		// 並べ替え後の各ソース・ブロックの情報
+	source_ctx_r *old_blk);		// 既存の各ソース・ブロックの情報
+
+// 追加されたファイルのハッシュ値を計算して、ファイルごとのパケットを作成する
+int set_append_packet(
+	char *ascii_buf,		// 作業用
+	unsigned char *buf,		// パケットを格納するバッファー
+	unsigned char *set_id,	// 新しい Recovery Set ID
+	int switch_u,			// ユニコードのファイル名も記録する
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk);	// 各ソース・ブロックの情報
+
+// 書き換えたパケットを含むリカバリ・ファイルを作り直す
+int rewrite_append_file(
+	unsigned char *set_id,		// 元の Recovery Set ID
+	unsigned char *main_buf,	// 新しい Main packet
+	int main_size,				// Main packet のサイズ
+	unsigned char *add_buf,		// 追加されたファイルのパケット
+	int add_size,				// 追加されたパケットのサイズ
+	HANDLE *rcv_hFile,			// 各リカバリ・ファイルのハンドル (作り直したファイルに置き換わる)
+	parity_ctx_r *p_blk);		// 各パリティ・ブロックの情報
+
+// 作り直したリカバリ・ファイルで元のファイルを置き換える、または作り直したファイルを削除する
+int finish_append_file(
+	int replace_flag,		// 0=削除する, 1=置き換える
+	HANDLE *rcv_hFile);		// 各リカバリ・ファイルのハンドル
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2373,7 +2373,7 @@ int check_file_slice(
 			continue;
 		// ソース・ファイルや検査済みの分割・類似名ファイルは無視する
 		wcscpy(file_path, temp_path + base_len);	// 基準ディレクトリからの相対ファイル・パスにする
-		if (search_file_path(list_buf + 1, list_len - 1, file_path))
+		if (search_file_path(list_buf, list_len, file_path))
 			continue;
 		// 破損したソース・ファイルの作業ファイルは無視する・・・付加部分をチェックしてるので不要
 		//printf_cp("verify = %s\n", file_path);
@@ -2505,7 +2505,7 @@ int search_file_split(
 			continue;
 		// ソース・ファイルや検査済みの分割・類似名ファイルは無視する
 		wcscpy(file_path, temp_path + base_len);	// 基準ディレクトリからの相対ファイル・パスにする
-		if (search_file_path(list_buf + 1, list_len - 1, file_path))
+		if (search_file_path(list_buf, list_len, file_path))
 			continue;
 		// 破損したソース・ファイルの作業ファイルは無視する・・・付加部分をチェックしてるので不要
 		//printf_cp("verify = %s\n", file_path);
@@ -2617,7 +2617,7 @@ fclose(fp);
 		if (_wcsnicmp(base_dir, file_name, base_len) == 0){	// 同じディレクトリなら
 			// ソース・ファイルや検査済みの分割・類似名ファイルは無視する
 			// 破損したソース・ファイルの作業ファイルは無視する
-			if ((search_file_path(list_buf + 1, list_len - 1, file_name + base_len)) ||
+			if ((search_file_path(list_buf, list_len, file_name + base_len)) ||
 					(avoid_temp_file(file_name + base_len, files))){
 				list2_off += len + 1;
 				continue;
@@ -2793,7 +2793,7 @@ int search_additional_file(
 		if (search_file_path(recv_buf, recv_len, file_path))
 			continue;
 		// ソース・ファイルや検査済みの分割・類似名ファイルは無視する
-		if (search_file_path(list_buf + 1, list_len - 1, FindData.cFileName))
+		if (search_file_path(list_buf, list_len, FindData.cFileName))
 			continue;
 		// 破損したソース・ファイルの作業ファイルは無視する
 		if (avoid_temp_file(FindData.cFileName, files))
@@ -2858,6 +2858,152 @@ int search_additional_file(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define BIT_ERROR_MAX_SIZE	268435456	// ビット単位の訂正を試みるスライスの合計サイズ 256MB
+
+// 破損ファイル内の本来の位置にある失われたスライスを、CRC-32 でビット単位の誤り訂正する
+// 0=完了, 1=エラー, 2=キャンセル
+int search_bit_error_slice(
+	wchar_t *file_path,		// 作業用
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk)	// 各ソース・ブロックの情報
+{
+	unsigned char *buf;
+	int i, num, b_last, lost_count, prog_num, fix_count;
+	unsigned int crc, time_last;
+	__int64 file_off, now_size, try_size;
+	HANDLE hFile, hFile_tmp;
+
+	if (block_size > BURST8_MAX_LEN)
+		return 0;	// 大きすぎるスライスは訂正しない
+
+	// 破損ファイル内で失われてるスライスの数
+	lost_count = 0;
+	for (num = 0; num < entity_num; num++){
+		// 上書き修復する場合も含めて、本来の名前で破損してるファイルだけ
+		if ((files[num].state & 0xFB) == 0x02){
+			b_last = files[num].b_off + files[num].b_num;
+			for (i = files[num].b_off; i < b_last; i++){
+				if (s_blk[i].exist == 0)
+					lost_count++;
+			}
+		}
+	}
+	if (lost_count == 0)
+		return 0;
+
+	buf = (unsigned char *)malloc(block_size);
+	if (buf == NULL){
+		printf("malloc, %d\n", block_size);
+		return 1;
+	}
+	init_syndrome_table(block_size);	// 表を作れなくても他の訂正は試す
+
+	printf("\nCorrecting lost slice\t: %d\n", lost_count);
+	fflush(stdout);
+	fix_count = 0;
+	prog_num = 0;
+	prog_last = -1;
+	try_size = 0;
+	time_last = GetTickCount();
+	for (num = 0; num < entity_num; num++){
+		if ((files[num].state & 0xFB) != 0x02)
+			continue;
+		// ひどく破損してる場合は訂正できないので、試す量を制限する
+		if (try_size >= BIT_ERROR_MAX_SIZE)
+			break;
+		b_last = files[num].b_off + files[num].b_num;
+		for (i = files[num].b_off; i < b_last; i++){
+			if (s_blk[i].exist == 0)
+				break;
+		}
+		if (i == b_last)
+			continue;
+
+		wcscpy(file_path, base_dir);
+		wcscpy(file_path + base_len, list_buf + files[num].name);
+		// 上書き修復では同じファイルに書き戻すので、FILE_SHARE_WRITE も付ける
+		hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			continue;	// 開けないファイルは無視する
+		if (!GetFileSizeEx(hFile, (PLARGE_INTEGER)&now_size))
+			now_size = 0;
+
+		hFile_tmp = NULL;
+		for (; i < b_last; i++){
+			if (s_blk[i].exist != 0)
+				continue;
+			prog_num++;
+			// 本来の位置にスライスの全体が存在する場合だけ
+			file_off = (__int64)(i - files[num].b_off) * (__int64)block_size;
+			if (file_off + s_blk[i].size > now_size)
+				continue;
+			if (try_size >= BIT_ERROR_MAX_SIZE)
+				break;
+			if (file_read_data(hFile, file_off, buf, s_blk[i].size))
+				continue;	// 読み込めないスライスは無視する
+			try_size += s_blk[i].size;
+
+			// 半端なスライスは本来のサイズ分の CRC-32 と比較する
+			crc = s_blk[i].crc;
+			if (s_blk[i].size < block_size)
+				crc = crc_reverse_zero(crc, block_size - s_blk[i].size);
+			if (correct_error_bits(buf, s_blk[i].size, s_blk[i].hash, crc) > 0){
+				if (switch_v & 16){	// 訂正したスライスを書き込む
+					if (hFile_tmp == NULL){
+						if (files[num].state & 4){	// 上書き中の破損ファイルに書き戻す
+							hFile_tmp = handle_write_file(list_buf + files[num].name, file_path, files[num].size);
+						} else {	// 作業ファイルに書き込む
+							hFile_tmp = handle_temp_file(list_buf + files[num].name, file_path);
+						}
+						if (hFile_tmp == INVALID_HANDLE_VALUE){
+							CloseHandle(hFile);
+							free(buf);
+							free_syndrome_table();
+							return 1;
+						}
+					}
+					if (file_write_data(hFile_tmp, file_off, buf, s_blk[i].size)){
+						printf("file_write_data, %d\n", i);
+						CloseHandle(hFile_tmp);
+						CloseHandle(hFile);
+						free(buf);
+						free_syndrome_table();
+						return 1;
+					}
+				}
+				s_blk[i].exist = 2;	// 破損ファイル内で訂正できた
+				fix_count++;
+				first_num++;
+			}
+
+			// 経過表示
+			if (GetTickCount() - time_last >= UPDATE_TIME){
+				if (print_progress((int)(((__int64)prog_num * 1000) / lost_count))){
+					if (hFile_tmp)
+						CloseHandle(hFile_tmp);
+					CloseHandle(hFile);
+					free(buf);
+					free_syndrome_table();
+					return 2;
+				}
+				time_last = GetTickCount();
+			}
+		}
+		if (hFile_tmp)
+			CloseHandle(hFile_tmp);
+		CloseHandle(hFile);
+	}
+	print_progress_done();	// 経過表示があれば 100% にしておく
+	free(buf);
+	free_syndrome_table();
+
+	printf("Bit-flip corrected slice\t: %d\n", fix_count);
+	fflush(stdout);
+	return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 // スライスを逆算するか、共通してるスライスを探す
 int search_calculable_slice(
 	file_ctx_r *files,		// 各ソース・ファイルの情報
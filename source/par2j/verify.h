@@ -50,6 +50,12 @@ int search_additional_file(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// 破損ファイル内の失われたスライスを、CRC-32 でビット単位の誤り訂正する
+int search_bit_error_slice(
+	wchar_t *file_path,		// 作業用
+	file_ctx_r *files,		// 各ソース・ファイルの情報
+	source_ctx_r *s_blk);	// 各ソース・ブロックの情報
+
 // スライスを逆算するか、共通してるスライスを探す
 int search_calculable_slice(
 	file_ctx_r *files,		// 各ソース・ファイルの情報
@@ -34,6 +34,8 @@ int switch_v;	// 検査レベル 0=記載ファイルのみ検査, 2=全ての
 				// 作成時 256=時刻を追加, 512=時刻とサイズを追加
 				//        1024=ファイルリスト, 2048=UTF-8のファイルリスト
 
+int access_mode;	// 記録装置の種類 0=自動判別, 8=HDD, 16=SSD, +32=NVMe SSD
+
 // 可変長サイズの領域にテキストを保存する
 wchar_t *text_buf;	// チェックサム・ファイルのテキスト内容
 int text_len;		// テキストの文字数
@@ -1190,3 +1192,59 @@ unsigned int get_show_hidden(void)
 	return rv;
 }
 
+// ファイルが存在する記録装置の種類を調べる
+// 戻り値 : 8 = HDD (または判別できない), 16 = SSD, 16 | 32 = NVMe SSD
+int check_device_type(wchar_t *file_path)
+{
+	wchar_t volume_path[MAX_LEN], volume_name[MAX_PATH];
+	int len, device_type;
+	unsigned int rv;
+	HANDLE hDevice;
+	STORAGE_PROPERTY_QUERY query;
+	STORAGE_ADAPTER_DESCRIPTOR adapter_desc;
+	DEVICE_TRIM_DESCRIPTOR trim_desc;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR seek_desc;
+
+	// マウント・ポイントからボリューム名 "\\?\Volume{GUID}\" を取得する
+	if (!GetVolumePathName(file_path, volume_path, MAX_LEN))
+		return 8;
+	if (!GetVolumeNameForVolumeMountPoint(volume_path, volume_name, MAX_PATH))
+		return 8;	// ネットワーク・ドライブなど
+	len = (int)wcslen(volume_name);
+	if ((len > 0) && (volume_name[len - 1] == '\\'))
+		volume_name[len - 1] = 0;	// 末尾の「\」を取り除くとボリュームを開ける
+
+	// 書き込み権限は要らない
+	hDevice = CreateFile(volume_name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE)
+		return 8;
+
+	// TRIM が有効か、シークの遅延が無いなら SSD とみなす
+	device_type = 8;
+	query.QueryType = 0;	// PropertyStandardQuery
+	query.PropertyId = 8;	// StorageDeviceTrimProperty
+	if (DeviceIoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+			&trim_desc, sizeof(trim_desc), &rv, NULL) && (rv >= sizeof(trim_desc))
+			&& (trim_desc.TrimEnabled != 0)){
+		device_type = 16;
+	} else {
+		query.PropertyId = 7;	// StorageDeviceSeekPenaltyProperty
+		if (DeviceIoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+				&seek_desc, sizeof(seek_desc), &rv, NULL) && (rv >= sizeof(seek_desc))
+				&& (seek_desc.IncursSeekPenalty == 0))
+			device_type = 16;
+	}
+
+	// SSD が NVMe で接続されてるか (BusType 17 = NVMe)
+	if (device_type == 16){
+		query.PropertyId = 1;	// StorageAdapterProperty
+		if (DeviceIoControl(hDevice, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+				&adapter_desc, sizeof(adapter_desc), &rv, NULL) && (rv >= sizeof(adapter_desc))
+				&& (adapter_desc.BusType == 17))
+			device_type |= 32;
+	}
+
+	CloseHandle(hDevice);
+	return device_type;
+}
+
@@ -18,6 +18,8 @@ extern int file_num;		// ソース・ファイルの数
 
 extern int switch_v;	// 検査レベル
 
+extern int access_mode;	// 記録装置の種類
+
 // 可変長サイズの領域にテキストを保存する
 extern wchar_t *text_buf;	// チェックサム・ファイルのテキスト内容
 extern int text_len;		// テキストの文字数
@@ -167,3 +169,6 @@ void print_win32_err(void);
 // エクスプローラーで隠しファイルを表示する設定になってるか調べる
 unsigned int get_show_hidden(void);
 
+// ファイルが存在する記録装置の種類を調べる (8 = HDD, 16 = SSD, 16 | 32 = NVMe SSD)
+int check_device_type(wchar_t *file_path);
+
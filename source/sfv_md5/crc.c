@@ -1,7 +1,21 @@
 ﻿// crc.c
 // Copyright : 2021-05-14 Yutaka Sawada
 // License : The MIT license
+//           (crc_update は Chromium の BSD ライセンス)
 
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601	// Windows 7 or later
+#endif
+
+#include <stdlib.h>
+#include <process.h>
+
+#include <windows.h>
+#include <intrin.h>
+#include <nmmintrin.h>	// MMX ~ SSE4.2 命令セットを使用する場合インクルード
+#include <wmmintrin.h>	// AES, CLMUL 命令セットを使用する場合インクルード
+
+#include "common.h"
 #include "crc.h"
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -10,10 +24,12 @@
 // CRC-32
 #define CRC_POLY	0xEDB88320	// (little endian)
 unsigned int crc_table[256];
+static int clmul_flag;	// PCLMULQDQ と SSE4.1 が使えるか
 
 // CRC 計算用のテーブルを作る
 void init_crc_table(void)
 {
+	int CPUInfo[4];
 	unsigned int i, j, r;
 
 	for (i = 0; i < 256; i++){	// CRC-32
@@ -22,15 +38,25 @@ void init_crc_table(void)
 			r = (r >> 1) ^ (CRC_POLY & ~((r & 1) - 1));
 		crc_table[i] = r;
 	}
+
+	// CLMUL 命令 (と _mm_extract_epi32 用の SSE4.1) に対応してるか
+	__cpuid(CPUInfo, 1);
+	clmul_flag = ((CPUInfo[2] & ((1 << 1) | (1 << 19))) == ((1 << 1) | (1 << 19)));
 }
 
 // CRC-32 を更新する
-unsigned int crc_update(unsigned int crc, unsigned char *buf, unsigned int len)
+unsigned int crc_update_std(unsigned int crc, unsigned char *buf, unsigned int len)
 {
 /*
 	while (len--)
 		crc = crc_table[(crc & 0xFF) ^ (*buf++)] ^ (crc >> 8);
 */
+	// 4バイト境界までは 1バイトずつ計算する
+	while ((len > 0) && (((ULONG_PTR)buf) & 3)){
+		crc = crc_table[(crc & 0xFF) ^ (*buf++)] ^ (crc >> 8);
+		len--;
+	}
+
 	// 4バイトごとに計算する
 	while (len >= 4){
 		crc ^= *((unsigned int *)buf);
@@ -49,3 +75,357 @@ unsigned int crc_update(unsigned int crc, unsigned char *buf, unsigned int len)
 	return crc;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// CRC-32 with PCLMULQDQ Instruction is based on crc32_simd.c in Chromium's zlib.
+// It isn't taken from par2j/crc.c (GPL).
+
+/*
+ * Copyright 2017 The Chromium Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the Chromium source repository LICENSE file.
+ *
+ * The algorithm follows the Intel white paper below.
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+ * http://www.intel.com/content/dam/www/public/us/en/documents/white-papers/fast-crc-computation-generic-polynomials-pclmulqdq-paper.pdf
+ */
+
+// PCLMULQDQ を使って CRC-32 を更新する
+unsigned int crc_update(unsigned int crc, unsigned char *buf, unsigned int len)
+{
+	unsigned int fold_len;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	// 64バイト未満なら 1バイトずつ計算する
+	if ((clmul_flag == 0) || (len < 64))
+		return crc_update_std(crc, buf, len);
+	fold_len = len & ~15;	// 16バイト単位で計算する
+	len -= fold_len;
+
+	// 最初の 64バイトを読み込んで初期値を加える
+	x1 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	fold_len -= 64;
+
+	// 64バイトずつ 4個並行して畳み込む; k1 = 0x154442bd4, k2 = 0x1c6e41596
+	x0 = _mm_set_epi32(0x00000001, 0xc6e41596, 0x00000001, 0x54442bd4);
+	while (fold_len >= 64){
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		fold_len -= 64;
+	}
+
+	// 4個を 128-bit に畳み込む; k3 = 0x1751997d0, k4 = 0xccaa009e
+	x0 = _mm_set_epi32(0x00000000, 0xccaa009e, 0x00000001, 0x751997d0);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// 残りを 16バイトずつ畳み込む
+	while (fold_len >= 16){
+		x2 = _mm_loadu_si128((__m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		fold_len -= 16;
+	}
+
+	// 128-bit から 64-bit に減らす; k5 = 0x163cd6124
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_set_epi32(0x00000000, 0x00000000, 0x00000001, 0x63cd6124);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett Reduction で 32-bit にする; P' = 0x1db710641, u' = 0x1f7011641
+	x0 = _mm_set_epi32(0x00000001, 0xf7011641, 0x00000001, 0xdb710641);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	crc = _mm_extract_epi32(x1, 1);
+
+	// 余りは 1バイトずつ計算する
+	return crc_update_std(crc, buf, len);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// 複数のファイルの CRC-32 を並行して計算する
+
+#define POOL_MAX	8		// 同時に読み込むファイル数の上限 (NVMe SSD)
+#define POOL_SSD	4		// SATA SSD などで同時に読み込むファイル数の上限
+#define POOL_IO		1048576	// 一度に読み込むバイト数
+#define POOL_LIMIT	((__int64)1 << 32)	// 開始したけど未回収なファイルの合計サイズの上限
+#define STACK_SIZE	65536
+
+typedef struct {
+	wchar_t *path;		// ファイルのパス
+	__int64 size;		// ファイル・サイズ
+	__int64 done;		// 計算済みのバイト数
+	unsigned int crc;
+	unsigned int error;	// Win32 API のエラー・コード
+	int state;			// -1 = 計算中, 0 = 完了, 1 = 開けない, 2 = 読み込みエラー, 3 = サイズ取得エラー
+	int flight;			// 未回収のサイズに含めてるか
+} POOL_FILE;
+
+static CRITICAL_SECTION pool_cs;
+static CONDITION_VARIABLE pool_cv;
+static HANDLE pool_th[POOL_MAX];
+static POOL_FILE *pool_file;
+static unsigned char *pool_buf;
+static __int64 pool_flight;	// 開始したけど未回収なファイルの合計サイズ
+static int pool_num, pool_thread, pool_next, pool_admit;
+static volatile int pool_stop;	// 終了の合図
+
+static DWORD WINAPI thread_crc(LPVOID lpParameter)
+{
+	unsigned char *buf;
+	unsigned int len, rv, crc;
+	int i, state;
+	__int64 file_left;
+	HANDLE hFile;
+	POOL_FILE *pf;
+
+	buf = (unsigned char *)lpParameter;
+	for (;;){
+		// 次のファイルを受け持つ
+		EnterCriticalSection(&pool_cs);
+		i = pool_next;
+		if ((pool_stop != 0) || (i >= pool_num)){
+			LeaveCriticalSection(&pool_cs);
+			break;
+		}
+		pool_next++;
+		LeaveCriticalSection(&pool_cs);
+		pf = pool_file + i;
+
+		// ファイルを開いてサイズを調べる
+		state = 0;
+		hFile = CreateFile(pf->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			pf->error = GetLastError();
+			state = 1;
+		} else if (!GetFileSizeEx(hFile, (PLARGE_INTEGER)&(pf->size))){
+			pf->error = GetLastError();
+			state = 3;
+		}
+
+		// 先に開始したファイルの後で、未回収のサイズが上限未満になるまで待つ
+		EnterCriticalSection(&pool_cs);
+		while ((pool_stop == 0) && ((pool_admit != i) ||
+				((state == 0) && (pool_flight >= POOL_LIMIT))))
+			SleepConditionVariableCS(&pool_cv, &pool_cs, INFINITE);
+		pool_admit++;
+		if (state == 0){
+			pool_flight += pf->size;
+			pf->flight = 1;
+		} else {
+			pf->state = state;
+		}
+		WakeAllConditionVariable(&pool_cv);
+		LeaveCriticalSection(&pool_cs);
+		if (state != 0){
+			if (hFile != INVALID_HANDLE_VALUE)
+				CloseHandle(hFile);
+			continue;
+		}
+
+		// CRC を計算する
+		crc = 0xFFFFFFFF;	// 初期化
+		file_left = pf->size;
+		while ((file_left > 0) && (pool_stop == 0)){
+			len = POOL_IO;
+			if (file_left < POOL_IO)
+				len = (unsigned int)file_left;
+			if (!ReadFile(hFile, buf, len, &rv, NULL) || (len != rv)){
+				pf->error = GetLastError();
+				state = 2;
+				break;
+			}
+			file_left -= len;
+			crc = crc_update(crc, buf, len);
+
+			EnterCriticalSection(&pool_cs);
+			pf->done = pf->size - file_left;
+			LeaveCriticalSection(&pool_cs);
+		}
+		CloseHandle(hFile);
+
+		EnterCriticalSection(&pool_cs);
+		pf->crc = crc ^ 0xFFFFFFFF;	// 最終処理
+		pf->state = state;
+		WakeAllConditionVariable(&pool_cv);
+		LeaveCriticalSection(&pool_cs);
+	}
+
+	return 0;
+}
+
+// 各ファイルの CRC-32 を計算するスレッドを起動する
+// 戻り値 : 0 = 起動した, 1 = 起動しなかった (一個ずつ計算すること)
+int crc_pool_start(
+	wchar_t *list,	// ファイルのパスを null 文字で区切って並べたもの
+	int num)		// ファイルの個数
+{
+	int i, j;
+	DWORD_PTR ProcessAffinityMask, SystemAffinityMask;
+
+	// 使用可能なコア個数を調べる
+	j = 0;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &ProcessAffinityMask, &SystemAffinityMask) != 0){
+		while (ProcessAffinityMask != 0){
+			j++;
+			ProcessAffinityMask &= (ProcessAffinityMask - 1);
+		}
+	}
+	// HDD では読み込みが競合して遅くなるので、一個ずつ計算する
+	if ((access_mode & (8 | 16)) == 0)	// 記録装置の種類を自動判別する
+		access_mode = check_device_type(list);
+	if ((access_mode & 16) == 0)
+		return 1;
+	if (access_mode & 32){
+		if (j > POOL_MAX)
+			j = POOL_MAX;
+	} else {
+		if (j > POOL_SSD)
+			j = POOL_SSD;
+	}
+	if (j > num)
+		j = num;
+	if (j < 2)
+		return 1;	// 並行して計算しない
+
+	pool_file = (POOL_FILE *)malloc(sizeof(POOL_FILE) * num);
+	if (pool_file == NULL)
+		return 1;
+	pool_buf = (unsigned char *)malloc(POOL_IO * j);
+	if (pool_buf == NULL){
+		free(pool_file);
+		pool_file = NULL;
+		return 1;
+	}
+	for (i = 0; i < num; i++){
+		pool_file[i].path = list;
+		pool_file[i].size = 0;
+		pool_file[i].done = 0;
+		pool_file[i].crc = 0;
+		pool_file[i].error = 0;
+		pool_file[i].state = -1;
+		pool_file[i].flight = 0;
+		list += wcslen(list) + 1;
+	}
+	pool_num = num;
+	pool_next = 0;
+	pool_admit = 0;
+	pool_stop = 0;
+	pool_flight = 0;
+	InitializeCriticalSection(&pool_cs);
+	InitializeConditionVariable(&pool_cv);
+
+	pool_thread = 0;
+	for (i = 0; i < j; i++){
+		pool_th[pool_thread] = (HANDLE)_beginthreadex(NULL, STACK_SIZE, thread_crc, (LPVOID)(pool_buf + POOL_IO * i), 0, NULL);
+		if (pool_th[pool_thread] == NULL)
+			break;
+		pool_thread++;
+	}
+	if (pool_thread == 0){	// 一個も起動できなかった
+		DeleteCriticalSection(&pool_cs);
+		free(pool_buf);
+		free(pool_file);
+		pool_file = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+// 指定したファイルの計算結果を待って回収する
+// 戻り値 : -1 = 計算中 (wait_time ms 経過した), 0 = 完了, 1 = 開けない, 2 = 読み込みエラー, 3 = サイズ取得エラー
+// エラー時は GetLastError でエラー・コードを取得できる
+int crc_pool_wait(
+	int index,				// ファイル番号
+	unsigned int wait_time,	// 最大で待つ時間 (ms)
+	unsigned int *crc,		// 計算した CRC-32
+	__int64 *file_size,		// ファイル・サイズ
+	__int64 *done)			// 計算済みのバイト数
+{
+	int state;
+	POOL_FILE *pf;
+
+	pf = pool_file + index;
+	EnterCriticalSection(&pool_cs);
+	if (pf->state < 0)
+		SleepConditionVariableCS(&pool_cv, &pool_cs, wait_time);
+	state = pf->state;
+	*file_size = pf->size;
+	*done = pf->done;
+	if (state >= 0){
+		*crc = pf->crc;
+		if (pf->flight != 0){	// 未回収のサイズから取り除く
+			pool_flight -= pf->size;
+			pf->flight = 0;
+			WakeAllConditionVariable(&pool_cv);
+		}
+	}
+	LeaveCriticalSection(&pool_cs);
+	if (state > 0)
+		SetLastError(pf->error);
+
+	return state;
+}
+
+// スレッドを終了させる
+void crc_pool_stop(void)
+{
+	int i;
+
+	if (pool_file == NULL)
+		return;
+
+	EnterCriticalSection(&pool_cs);
+	pool_stop = 1;
+	WakeAllConditionVariable(&pool_cv);
+	LeaveCriticalSection(&pool_cs);
+	WaitForMultipleObjects(pool_thread, pool_th, TRUE, INFINITE);
+	for (i = 0; i < pool_thread; i++)
+		CloseHandle(pool_th[i]);
+	pool_thread = 0;
+
+	DeleteCriticalSection(&pool_cs);
+	free(pool_buf);
+	free(pool_file);
+	pool_file = NULL;
+}
+
@@ -1,7 +1,20 @@
-﻿
-// CRC 計算用のテーブルを作る
+﻿// CRC 計算用のテーブルを作る
 void init_crc_table(void);
 
 // CRC-32 を更新する
+unsigned int crc_update_std(unsigned int crc, unsigned char *buf, unsigned int len);
+
+// PCLMULQDQ が使えれば使って CRC-32 を更新する
 unsigned int crc_update(unsigned int crc, unsigned char *buf, unsigned int len);
 
+// 各ファイルの CRC-32 を計算するスレッドを起動する
+// 戻り値 : 0 = 起動した, 1 = 起動しなかった (一個ずつ計算すること)
+int crc_pool_start(wchar_t *list, int num);
+
+// 指定したファイルの計算結果を待って回収する
+// 戻り値 : -1 = 計算中, 0 = 完了, 1 = 開けない, 2 = 読み込みエラー, 3 = サイズ取得エラー
+int crc_pool_wait(int index, unsigned int wait_time, unsigned int *crc, __int64 *file_size, __int64 *done);
+
+// スレッドを終了させる
+void crc_pool_stop(void);
+
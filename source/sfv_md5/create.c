@@ -28,60 +28,79 @@
 int create_sfv(
 	wchar_t *uni_buf,
 	wchar_t *file_name,		// 検査対象のファイル名
+	int num,				// 他のスレッドで計算してる場合のファイル番号 (-1 なら自分で計算する)
 	unsigned int *time_last,
 	__int64 *prog_now,		// 経過表示での現在位置
 	__int64 total_size)		// 合計ファイル・サイズ
 {
 	unsigned char buf[IO_SIZE];
 	unsigned int rv, len, crc;
+	int state;
 	__int64 file_size = 0, file_left;
 	HANDLE hFile;
 
-	// 読み込むファイルを開く
-	wcscpy(uni_buf, base_dir);
-	wcscpy(uni_buf + base_len, file_name);
-	hFile = CreateFile(uni_buf, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-	if (hFile == INVALID_HANDLE_VALUE){
-		printf("\n");
-		print_win32_err();
-		return 1;
-	}
-	if (!GetFileSizeEx(hFile, (PLARGE_INTEGER)&file_size)){
-		printf("\n");
-		print_win32_err();
-		CloseHandle(hFile);
-		return 1;
-	}
-	file_left = file_size;
-
-	// CRC を計算する
-	crc = 0xFFFFFFFF;	// 初期化
-	while (file_left > 0){
-		len = IO_SIZE;
-		if (file_left < IO_SIZE)
-			len = (unsigned int)file_left;
-		if (!ReadFile(hFile, buf, len, &rv, NULL) || (len != rv)){
+	if (num >= 0){	// 他のスレッドで計算した結果を回収する
+		while ((state = crc_pool_wait(num, UPDATE_TIME, &crc, &file_size, &file_left)) < 0){
+			// 経過表示
+			if (GetTickCount() / UPDATE_TIME != (*time_last)){
+				if (print_progress((int)((((*prog_now) + file_left) * 1000) / total_size)))
+					return 2;
+				(*time_last) = GetTickCount() / UPDATE_TIME;
+			}
+		}
+		if (state != 0){
+			printf("\n");
+			print_win32_err();
+			return 1;
+		}
+		(*prog_now) += file_size;
+	} else {
+		// 読み込むファイルを開く
+		wcscpy(uni_buf, base_dir);
+		wcscpy(uni_buf + base_len, file_name);
+		hFile = CreateFile(uni_buf, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			printf("\n");
+			print_win32_err();
+			return 1;
+		}
+		if (!GetFileSizeEx(hFile, (PLARGE_INTEGER)&file_size)){
 			printf("\n");
 			print_win32_err();
 			CloseHandle(hFile);
 			return 1;
 		}
-		file_left-= len;
-		(*prog_now) += len;
-		// CRC-32 を更新する
-		crc = crc_update(crc, buf, len);
-
-		// 経過表示
-		if (GetTickCount() / UPDATE_TIME != (*time_last)){
-			if (print_progress((int)(((*prog_now) * 1000) / total_size))){
+		file_left = file_size;
+
+		// CRC を計算する
+		crc = 0xFFFFFFFF;	// 初期化
+		while (file_left > 0){
+			len = IO_SIZE;
+			if (file_left < IO_SIZE)
+				len = (unsigned int)file_left;
+			if (!ReadFile(hFile, buf, len, &rv, NULL) || (len != rv)){
+				printf("\n");
+				print_win32_err();
 				CloseHandle(hFile);
-				return 2;
+				return 1;
+			}
+			file_left-= len;
+			(*prog_now) += len;
+			// CRC-32 を更新する
+			crc = crc_update(crc, buf, len);
+
+			// 経過表示
+			if (GetTickCount() / UPDATE_TIME != (*time_last)){
+				if (print_progress((int)(((*prog_now) * 1000) / total_size))){
+					CloseHandle(hFile);
+					return 2;
+				}
+				(*time_last) = GetTickCount() / UPDATE_TIME;
 			}
-			(*time_last) = GetTickCount() / UPDATE_TIME;
 		}
+		crc ^= 0xFFFFFFFF;	// 最終処理
+		CloseHandle(hFile);
 	}
-	crc ^= 0xFFFFFFFF;	// 最終処理
-	CloseHandle(hFile);
 
 	// チェックサムを記録する
 	len = wcslen(file_name);
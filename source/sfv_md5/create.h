@@ -3,6 +3,7 @@
 int create_sfv(
 	wchar_t *uni_buf,
 	wchar_t *file_name,		// 検査対象のファイル名
+	int num,				// 他のスレッドで計算してる場合のファイル番号 (-1 なら自分で計算する)
 	unsigned int *time_last,
 	__int64 *prog_end,		// 経過表示での終了位置
 	__int64 total_size);	// 合計ファイル・サイズ
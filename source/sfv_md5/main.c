@@ -30,8 +30,8 @@ void print_help(void)
 {
 	printf(
 "Usage\n"
-"c(reate) [f,fu,fo, t,      d,u] <checksum file> [input files]\n"
-"v(erify) [     fo,vl,vs,vd,d,u] <checksum file>\n"
+"c(reate) [f,fu,fo, t,      d,u,m] <checksum file> [input files]\n"
+"v(erify) [     fo,vl,vs,vd,d,u,m] <checksum file>\n"
 "\nOption\n"
 " /f    : Use file-list instead of files\n"
 " /fu   : Use file-list which is encoded with UTF-8\n"
@@ -42,6 +42,7 @@ void print_help(void)
 " /vd\"*\": Set directory of recent result\n"
 " /d\"*\" : Set directory of input files\n"
 " /u    : Console output is encoded with UTF-8\n"
+" /m<n> : File access mode\n"
 	);
 }
 
@@ -368,8 +369,8 @@ static int write_checksum(wchar_t *uni_buf,
 	wchar_t *list_buf, int list_len, __int64 total_size, int switch_t)
 {
 	char *ascii_buf;
-	wchar_t *ads_p;
-	int err = 0, rv, len, hash_type;
+	wchar_t *ads_p, *pool_buf;
+	int err = 0, rv, len, num, hash_type;
 	unsigned int time_last;
 	__int64 prog_now = 0;
 	HANDLE hFile;
@@ -442,10 +443,31 @@ static int write_checksum(wchar_t *uni_buf,
 	printf("\n");
 	print_progress_text(0, "Computing file hash");
 	time_last = GetTickCount() / UPDATE_TIME;	// 時刻の変化時に経過を表示する
+	pool_buf = NULL;
+	if ((hash_type == 0) && (file_num > 1)){	// CRC-32 は他のスレッドで計算する
+		pool_buf = (wchar_t *)malloc((file_num * base_len + list_len) * 2);
+		if (pool_buf != NULL){
+			num = 0;
+			rv = 0;
+			len = 0;
+			while (len < list_len){
+				wcscpy(pool_buf + rv, base_dir);
+				wcscpy(pool_buf + rv + base_len, list_buf + len);
+				rv += wcslen(pool_buf + rv) + 1;
+				len += wcslen(list_buf + len) + 1;
+				num++;
+			}
+			if (crc_pool_start(pool_buf, num) != 0){
+				free(pool_buf);
+				pool_buf = NULL;
+			}
+		}
+	}
+	num = 0;
 	len = 0;
 	while (len < list_len){
 		if (hash_type == 0){
-			rv = create_sfv(uni_buf, list_buf + len, &time_last, &prog_now, total_size);
+			rv = create_sfv(uni_buf, list_buf + len, (pool_buf != NULL) ? num : -1, &time_last, &prog_now, total_size);
 		} else if (hash_type == 1){
 			rv = create_md5(uni_buf, list_buf + len, &time_last, &prog_now, total_size);
 		} else if (hash_type == 2){
@@ -456,20 +478,29 @@ static int write_checksum(wchar_t *uni_buf,
 			rv = 1;
 		}
 		if (rv != 0){
-			free(text_buf);
-			return rv;	// エラー、キャンセルなど
+			err = rv;	// エラー、キャンセルなど
+			break;
 		}
 
 		// 経過表示
 		if (GetTickCount() / UPDATE_TIME != time_last){
 			if (print_progress((int)((prog_now * 1000) / total_size))){
-				free(text_buf);
-				return 2;
+				err = 2;
+				break;
 			}
 			time_last = GetTickCount() / UPDATE_TIME;
 		}
 
 		len += wcslen(list_buf + len) + 1;
+		num++;
+	}
+	if (pool_buf != NULL){
+		crc_pool_stop();
+		free(pool_buf);
+	}
+	if (err != 0){
+		free(text_buf);
+		return err;
 	}
 	print_progress_done();	// 改行して行の先頭に戻しておく
 
@@ -743,6 +774,7 @@ wmain(int argc, wchar_t *argv[])
 	ini_path[0] = 0;
 	file_num = 0;
 	switch_v = 0;
+	access_mode = 0;
 	cp_output = GetConsoleOutputCP();
 
 	// コマンド
@@ -793,6 +825,13 @@ wmain(int argc, wchar_t *argv[])
 					j = tmp_p[1] - '0';
 				if (j != -1)
 					switch_v |= j << 8;
+			} else if (wcsncmp(tmp_p, L"m", 1) == 0){
+				access_mode = 0;
+				j = 1;	// 8=HDD, 16=SSD, +32=NVMe SSD
+				while ((j < 1 + 2) && (tmp_p[j] >= '0') && (tmp_p[j] <= '9')){
+					access_mode = (access_mode * 10) + (tmp_p[j] - '0');
+					j++;
+				}
 
 			// オプション (文字列)
 			} else if (wcsncmp(tmp_p, L"vd", 2) == 0){
@@ -493,6 +493,28 @@ static int file_all_check(
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+static int crc_pool;	// 他のスレッドで CRC-32 を計算してるか
+
+// 基準ディレクトリからのファイル・パスを作る
+static void make_file_path(wchar_t *file_path, wchar_t *uni_name)
+{
+	int len, off;
+
+	wcscpy(file_path, base_dir);
+	// 先頭の「..\」を許可してるので、基準ディレクトリから上に遡る。
+	len = base_len - 1;
+	off = 0;
+	while ((uni_name[off] == '.') && (uni_name[off + 1] == '.') && (uni_name[off + 2] == '\\')){
+		off += 3;
+		file_path[len] = 0;
+		while (file_path[len] != '\\'){
+			file_path[len] = 0;
+			len--;
+		}
+	}
+	wcscat(file_path, uni_name + off);
+}
+
 // CRC-32 を比較する
 //  0 = ファイルが存在して完全である
 //  1 = エラー
@@ -507,76 +529,49 @@ static int file_crc32_check(
 	unsigned int crc2)
 {
 	unsigned char buf[IO_SIZE];
-	int len, off, bad_flag;
+	int len, bad_flag;
 	unsigned int crc, time_last, meta_data[7];
 	__int64 file_size = 0, file_left;
 	HANDLE hFile;
 
 	prog_last = -1;
 	time_last = GetTickCount() / UPDATE_TIME;	// 時刻の変化時に経過を表示する
-	wcscpy(file_path, base_dir);
-	// 先頭の「..\」を許可してるので、基準ディレクトリから上に遡る。
-	len = base_len - 1;
-	off = 0;
-	while ((uni_name[off] == '.') && (uni_name[off + 1] == '.') && (uni_name[off + 2] == '\\')){
-		off += 3;
-		file_path[len] = 0;
-		while (file_path[len] != '\\'){
-			file_path[len] = 0;
-			len--;
+	if (crc_pool != 0){	// 他のスレッドで計算した結果を回収する
+		while ((bad_flag = crc_pool_wait(num, UPDATE_TIME, &crc, &file_size, &file_left)) < 0){
+			// 経過表示
+			if ((file_size > 0) && (GetTickCount() / UPDATE_TIME != time_last)){
+				if (print_progress_file((int)((file_left * 1000) / file_size), uni_name))
+					return 2;
+				time_last = GetTickCount() / UPDATE_TIME;
+			}
 		}
-	}
-	wcscat(file_path, uni_name + off);
-
-	// 読み込むファイルを開く
-	hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-	if (hFile == INVALID_HANDLE_VALUE){
-		bad_flag = 1;	// 消失は記録しない
-	} else {
-		bad_flag = check_ini_state(num, meta_data, 4, (unsigned char *)&crc, hFile);
-		memcpy(&file_size, meta_data, 8);
-		if (bad_flag == 0){	// 記録がある時
-			if (crc2 != crc){
+		if (bad_flag == 0){
+			if (crc != crc2){
 				bad_flag = 2;	// ハッシュ値が異なる
 				if (switch_v & 2){	// 破損ファイルのハッシュ値を記録しておく
 					wsprintf((wchar_t *)buf, L"%08X", crc);
 					wsprintf((wchar_t *)buf + 64, L"%I64d", file_size);
 					if (add_hash(uni_name, (wchar_t *)buf, (wchar_t *)buf + 64) != 0){
 						printf("file%d: cannot add hash\n", num);
-						CloseHandle(hFile);
 						return 1;
 					}
 				}
-			} else {
-				bad_flag = 0;	// 完全
 			}
-		} else if (bad_flag == -2){	// 記録が無い場合 (属性取得エラーは不明にする)
-			file_left = file_size;
-			crc = 0xFFFFFFFF;	// 初期化
-			while (file_left > 0){
-				len = IO_SIZE;
-				if (file_left < IO_SIZE)
-					len = (int)file_left;
-				if (!ReadFile(hFile, buf, len, &bad_flag, NULL) || (len != bad_flag))
-					break;	// 読み取りエラーは必ず破損になる
-				file_left -= len;
-				// CRC-32 を更新する
-				crc = crc_update(crc, buf, len);
+		} else if (bad_flag == 3){
+			bad_flag = -1;	// 属性の読み取りエラー
+		}	// 開けないなら消失、読み取りエラーなら破損になる
+	} else {
+		make_file_path(file_path, uni_name);
 
-				// 経過表示
-				if (GetTickCount() / UPDATE_TIME != time_last){
-					if (print_progress_file((int)(((file_size - file_left) * 1000) / file_size), uni_name)){
-						CloseHandle(hFile);
-						return 2;
-					}
-					time_last = GetTickCount() / UPDATE_TIME;
-				}
-			}
-			if (file_left > 0){
-				bad_flag = 2;	// エラー等で中断した場合は破損として扱い、検査結果を記録しない
-			} else {
-				crc ^= 0xFFFFFFFF;	// 最終処理
-				if (crc != crc2){
+		// 読み込むファイルを開く
+		hFile = CreateFile(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE){
+			bad_flag = 1;	// 消失は記録しない
+		} else {
+			bad_flag = check_ini_state(num, meta_data, 4, (unsigned char *)&crc, hFile);
+			memcpy(&file_size, meta_data, 8);
+			if (bad_flag == 0){	// 記録がある時
+				if (crc2 != crc){
 					bad_flag = 2;	// ハッシュ値が異なる
 					if (switch_v & 2){	// 破損ファイルのハッシュ値を記録しておく
 						wsprintf((wchar_t *)buf, L"%08X", crc);
@@ -590,11 +585,52 @@ static int file_crc32_check(
 				} else {
 					bad_flag = 0;	// 完全
 				}
-				// 完全か破損なら、ハッシュ値を記録する
-				write_ini_state(num, meta_data, 4, &crc);
+			} else if (bad_flag == -2){	// 記録が無い場合 (属性取得エラーは不明にする)
+				file_left = file_size;
+				crc = 0xFFFFFFFF;	// 初期化
+				while (file_left > 0){
+					len = IO_SIZE;
+					if (file_left < IO_SIZE)
+						len = (int)file_left;
+					if (!ReadFile(hFile, buf, len, &bad_flag, NULL) || (len != bad_flag))
+						break;	// 読み取りエラーは必ず破損になる
+					file_left -= len;
+					// CRC-32 を更新する
+					crc = crc_update(crc, buf, len);
+
+					// 経過表示
+					if (GetTickCount() / UPDATE_TIME != time_last){
+						if (print_progress_file((int)(((file_size - file_left) * 1000) / file_size), uni_name)){
+							CloseHandle(hFile);
+							return 2;
+						}
+						time_last = GetTickCount() / UPDATE_TIME;
+					}
+				}
+				if (file_left > 0){
+					bad_flag = 2;	// エラー等で中断した場合は破損として扱い、検査結果を記録しない
+				} else {
+					crc ^= 0xFFFFFFFF;	// 最終処理
+					if (crc != crc2){
+						bad_flag = 2;	// ハッシュ値が異なる
+						if (switch_v & 2){	// 破損ファイルのハッシュ値を記録しておく
+							wsprintf((wchar_t *)buf, L"%08X", crc);
+							wsprintf((wchar_t *)buf + 64, L"%I64d", file_size);
+							if (add_hash(uni_name, (wchar_t *)buf, (wchar_t *)buf + 64) != 0){
+								printf("file%d: cannot add hash\n", num);
+								CloseHandle(hFile);
+								return 1;
+							}
+						}
+					} else {
+						bad_flag = 0;	// 完全
+					}
+					// 完全か破損なら、ハッシュ値を記録する
+					write_ini_state(num, meta_data, 4, &crc);
+				}
 			}
+			CloseHandle(hFile);
 		}
-		CloseHandle(hFile);
 	}
 
 	switch (bad_flag){
@@ -626,7 +662,7 @@ int verify_sfv(
 	char *ascii_buf,
 	wchar_t *file_path)
 {
-	wchar_t *line_off, uni_buf[MAX_LEN], tmp_buf[33];
+	wchar_t *line_off, *list_buf, uni_buf[MAX_LEN], tmp_buf[33];
 	int i, off, num, line_num, line_len, name_len;
 	int c_num, d_num, m_num, f_num;
 	unsigned int err = 0, rv, crc, comment;
@@ -794,6 +830,34 @@ int verify_sfv(
 		// 前回の検査結果が存在するか
 		check_ini_file(ctx.hash, text_len);
 	}
+	list_buf = NULL;
+	if ((recent_data == 0) && (file_num > 1)){	// 前回の検査結果を使わないなら
+		// 各ファイルのパスを並べて、他のスレッドで CRC-32 を計算する
+		list_buf = (wchar_t *)malloc((file_num * base_len + name_len) * 2);
+		if (list_buf != NULL){
+			num = 0;
+			line_len = 0;
+			off = 0;
+			while (off < name_len){
+				make_file_path(list_buf + line_len, hash_buf + off);
+				line_len += wcslen(list_buf + line_len) + 1;
+				while (hash_buf[off] != 0)	// ファイル名
+					off++;
+				off++;
+				while (hash_buf[off] != 0)	// ハッシュ値
+					off++;
+				off++;
+				off += 2;	// 状態
+				num++;
+			}
+			if (crc_pool_start(list_buf, num) == 0){
+				crc_pool = 1;
+			} else {
+				free(list_buf);
+				list_buf = NULL;
+			}
+		}
+	}
 	num = c_num = d_num = m_num = f_num = 0;
 	off = 0;
 	while (off < name_len){
@@ -813,7 +877,7 @@ int verify_sfv(
 		rv = file_crc32_check(num, ascii_buf, uni_buf, file_path, crc);
 		if (rv & 3){
 			err = rv;
-			return err;
+			break;
 		}
 		if (rv & 0xC){	// Missing or Damaged
 			err |= rv;
@@ -832,6 +896,13 @@ int verify_sfv(
 		off += 2;
 		num++;
 	}
+	if (crc_pool != 0){
+		crc_pool_stop();
+		crc_pool = 0;
+		free(list_buf);
+	}
+	if (err & 3)	// エラーやキャンセル
+		return err;
 	printf("\nComplete file count\t: %d\n", c_num);
 
 	// 消失か破損なら他のファイルと比較する